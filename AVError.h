@@ -0,0 +1,13 @@
+
+#ifndef HOMECAMRECORDER_AVERROR_H
+#define HOMECAMRECORDER_AVERROR_H
+
+extern "C" {
+#include <libavutil/error.h>
+}
+
+// FFmpeg's av_err2str uses a compound literal, which isn't C++. The same buffer, on the stack with alloca.
+#undef av_err2str
+#define av_err2str(errnum) av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), AV_ERROR_MAX_STRING_SIZE, errnum)
+
+#endif //HOMECAMRECORDER_AVERROR_H
@@ -0,0 +1,372 @@
+#include "AudioAnalyzer.h"
+#include "QosScheduler.h"
+
+#include <algorithm>
+#include <cmath>
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+}
+
+// Thumps and the low end of barking, voices and most of barking, and breaking glass, alarms and whistles.
+const AudioAnalyzer::Band AudioAnalyzer::BANDS[BAND_COUNT] = {
+    {"low", 100, 500},
+    {"mid", 500, 2000},
+    {"high", 2000, 8000}
+};
+
+static float to_db(float power) {
+    return 10 * log10f(max(power, 1e-10f));
+}
+
+AudioAnalyzer::AudioAnalyzer(string camera_name, string motion_file, RecordingCatalog *catalog,
+                             string catalog_camera) :
+    camera_name(std::move(camera_name)), motion_file_path(std::move(motion_file)), catalog(catalog),
+    catalog_camera(std::move(catalog_camera)) {}
+
+AudioAnalyzer::~AudioAnalyzer() {
+    stop();
+    if (fft) {
+        av_rdft_end(fft);
+    }
+    av_freep(&window_function);
+    av_freep(&fft_data);
+}
+
+void AudioAnalyzer::add_listener(MotionListener *listener) {
+    listeners.push_back(listener);
+}
+
+void AudioAnalyzer::send_packet(const AVPacket *packet, const shared_ptr<AVCodecParameters> &params,
+                                long timestamp_ms) {
+    if (stopping) return;
+    if (!worker.joinable()) {
+        worker = thread(&AudioAnalyzer::run_worker, this);
+    }
+    if (timestamp_ms < 0) {
+        timestamp_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    }
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if (queue.size() >= MAX_PENDING_PACKETS) {
+            // Only when the machine is too busy for a low priority thread. Sound events are worth less than video.
+            if (!dropping) {
+                Logger::warn(camera_name, "Audio analysis is behind. Dropping audio packets.");
+                dropping = true;
+            }
+            return;
+        }
+        dropping = false;
+        queue.push_back(Pending{av_packet_clone(packet), params, timestamp_ms});
+    }
+    wake_up.notify_one();
+}
+
+void AudioAnalyzer::stop() {
+    stopping = true;
+    wake_up.notify_all();
+    if (worker.joinable())
+        worker.join();
+    lock_guard<mutex> lock(queue_mutex);
+    for (Pending &pending : queue) {
+        av_packet_free(&pending.packet);
+    }
+    queue.clear();
+}
+
+void AudioAnalyzer::notify_listeners() {
+    if (!has_notifications.load(memory_order_acquire)) return;
+    vector<Notification> ready;
+    {
+        lock_guard<mutex> lock(notification_mutex);
+        ready.swap(notifications);
+        has_notifications = false;
+    }
+    for (const Notification &notification : ready) {
+        for (MotionListener *listener : listeners) {
+            if (notification.start) {
+                listener->on_motion_start(notification.event.start_ms);
+            } else {
+                listener->on_motion_end(notification.event);
+            }
+        }
+    }
+}
+
+void AudioAnalyzer::run_worker() {
+    // Decoding a camera's AAC takes about a percent of a core, and none of it may delay the camera threads. It never
+    // throttles though: a paused analyzer would only drop packets.
+    QosThread qos_thread(QosClass::BACKGROUND);
+    frame = av_frame_alloc();
+    while (true) {
+        Pending pending;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            wake_up.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping) break;
+            pending = queue.front();
+            queue.pop_front();
+        }
+        decode(pending);
+        av_packet_free(&pending.packet);
+    }
+    close_event();
+    close_decoder();
+    av_frame_free(&frame);
+}
+
+void AudioAnalyzer::decode(const Pending &pending) {
+    if (pending.params != decoder_params && !open_decoder(pending.params)) return;
+    if (!decoder) return;
+    // After a reconnect or dropped packets the buffered samples don't lead up to this packet.
+    if (samples_start_ms >= 0 && sample_rate > 0) {
+        double expected_ms = samples_start_ms + (double) samples.size() * 1000 / sample_rate;
+        if (fabs(pending.timestamp_ms - expected_ms) > RESYNC_MS) {
+            samples.clear();
+            samples_start_ms = -1;
+        }
+    }
+    int ret = avcodec_send_packet(decoder, pending.packet);
+    if (ret < 0) {
+        Logger::trace(camera_name, "Failed to decode an audio packet. Error = {}", ret);
+        return;
+    }
+    while (avcodec_receive_frame(decoder, frame) == 0) {
+        if (resample(frame, pending.timestamp_ms)) {
+            analyze_windows();
+        }
+        av_frame_unref(frame);
+    }
+}
+
+bool AudioAnalyzer::open_decoder(const shared_ptr<AVCodecParameters> &params) {
+    close_decoder();
+    // Set even if the decoder doesn't open, so it isn't retried for every packet.
+    decoder_params = params;
+    AVCodec *codec = avcodec_find_decoder(params->codec_id);
+    if (!codec) {
+        cerr << "(" << camera_name << ") No decoder for the audio stream. Sound events are disabled." << endl;
+        return false;
+    }
+    decoder = avcodec_alloc_context3(codec);
+    if (avcodec_parameters_to_context(decoder, params.get()) < 0) {
+        avcodec_free_context(&decoder);
+        return false;
+    }
+    decoder->thread_count = 1;
+    if (avcodec_open2(decoder, codec, nullptr) < 0) {
+        cerr << "(" << camera_name << ") Failed to open the audio decoder. Sound events are disabled." << endl;
+        avcodec_free_context(&decoder);
+        return false;
+    }
+    samples.clear();
+    samples_start_ms = -1;
+    return true;
+}
+
+void AudioAnalyzer::close_decoder() {
+    if (decoder) {
+        avcodec_free_context(&decoder);
+    }
+    swr_free(&resampler);
+    resampler_format = -1;
+}
+
+bool AudioAnalyzer::resample(const AVFrame *decoded, long timestamp_ms) {
+    int64_t layout = decoded->channel_layout ? (int64_t) decoded->channel_layout :
+                     av_get_default_channel_layout(decoded->channels);
+    if (decoded->format != resampler_format || decoded->sample_rate != resampler_rate || layout != resampler_layout) {
+        swr_free(&resampler);
+        resampler_format = decoded->format;
+        resampler_rate = decoded->sample_rate;
+        resampler_layout = layout;
+        // Only downmixes to mono floats. The windows are as long at any sample rate.
+        resampler = swr_alloc_set_opts(nullptr, AV_CH_LAYOUT_MONO, AV_SAMPLE_FMT_FLT, decoded->sample_rate, layout,
+                                       (AVSampleFormat) decoded->format, decoded->sample_rate, 0, nullptr);
+        if (resampler && swr_init(resampler) < 0) {
+            swr_free(&resampler);
+        }
+        if (!resampler) {
+            cerr << "(" << camera_name << ") Failed to convert the audio stream. Sound events are disabled." << endl;
+        } else if (decoded->sample_rate != sample_rate) {
+            set_window(decoded->sample_rate);
+        }
+    }
+    if (!resampler || !fft) return false;
+
+    converted.resize(decoded->nb_samples);
+    auto *output = (uint8_t *) converted.data();
+    int count = swr_convert(resampler, &output, (int) converted.size(), (const uint8_t **) decoded->extended_data,
+                            decoded->nb_samples);
+    if (count <= 0) return false;
+    if (samples.empty()) {
+        samples_start_ms = timestamp_ms;
+    }
+    samples.insert(samples.end(), converted.begin(), converted.begin() + count);
+    return true;
+}
+
+void AudioAnalyzer::set_window(int rate) {
+    sample_rate = rate;
+    // The FFT needs a power of two, so windows are a little shorter than WINDOW_MS: 85 ms at 48 kHz, 64 ms at 16 kHz.
+    window_bits = (int) floor(log2((double) rate * WINDOW_MS / 1000));
+    window_bits = min(13, max(8, window_bits));
+    window_size = 1 << window_bits;
+    if (fft) {
+        av_rdft_end(fft);
+    }
+    fft = av_rdft_init(window_bits, DFT_R2C);
+    // av_malloc aligns for the FFT's SIMD code.
+    av_freep(&window_function);
+    av_freep(&fft_data);
+    window_function = (float *) av_malloc(window_size * sizeof(float));
+    fft_data = (float *) av_malloc(window_size * sizeof(float));
+    for (int i = 0; i < window_size; i++) {
+        window_function[i] = (float) (0.5 - 0.5 * cos(2 * M_PI * i / window_size));
+    }
+    for (int band = 0; band < BAND_COUNT; band++) {
+        int from_bin = (int) ((long) BANDS[band].from_hz * window_size / rate);
+        int to_bin = (int) ((long) BANDS[band].to_hz * window_size / rate);
+        band_bins[band][0] = min(window_size / 2, max(1, from_bin));
+        band_bins[band][1] = min(window_size / 2, max(band_bins[band][0], to_bin));
+    }
+    samples.clear();
+    samples_start_ms = -1;
+    analyzed_ms = 0;
+}
+
+void AudioAnalyzer::analyze_windows() {
+    double window_ms = (double) window_size * 1000 / sample_rate;
+    size_t offset = 0;
+    while (samples.size() - offset >= (size_t) window_size) {
+        Levels levels = measure(samples.data() + offset);
+        detect(levels, (long) samples_start_ms);
+        samples_start_ms += window_ms;
+        offset += window_size;
+    }
+    samples.erase(samples.begin(), samples.begin() + (long) offset);
+}
+
+/**
+ * The loops are written for the vectorizer: no branches, restrict pointers and reductions it's allowed to reorder.
+ * With SSE or NEON a window costs a few thousand instructions on top of the FFT.
+ */
+AudioAnalyzer::Levels AudioAnalyzer::measure(const float *window) const {
+    const float *__restrict input = window;
+    const float *__restrict weights = window_function;
+    float *__restrict data = fft_data;
+    const int size = window_size;
+    float sum_squares = 0;
+    float peak = 0;
+#pragma omp simd reduction(+ : sum_squares) reduction(max : peak)
+    for (int i = 0; i < size; i++) {
+        float sample = input[i];
+        float magnitude = fabsf(sample);
+        sum_squares += sample * sample;
+        peak = magnitude > peak ? magnitude : peak;
+        data[i] = sample * weights[i];
+    }
+    av_rdft_calc(fft, data);
+
+    Levels levels{};
+    // Bin k is data[2k] and data[2k + 1], real and imaginary. Band levels are only ever compared with their floors,
+    // so the scale only keeps them near dBFS.
+    float scale = 1.0f / ((float) size * (float) size);
+    for (int band = 0; band < BAND_COUNT; band++) {
+        float energy = 0;
+        const int from = 2 * band_bins[band][0];
+        const int to = 2 * band_bins[band][1];
+#pragma omp simd reduction(+ : energy)
+        for (int i = from; i < to; i++) {
+            energy += data[i] * data[i];
+        }
+        levels.level_db[band] = to_db(energy * scale);
+    }
+    levels.level_db[BAND_COUNT] = to_db(sum_squares / size);
+    levels.peak_db = to_db(peak * peak);
+    return levels;
+}
+
+void AudioAnalyzer::detect(const Levels &levels, long window_start_ms) {
+    long window_end_ms = window_start_ms + (long) window_size * 1000 / sample_rate;
+    if (analyzed_ms == 0) {
+        copy(begin(levels.level_db), end(levels.level_db), begin(floor_db));
+    }
+    bool warm = analyzed_ms >= WARMUP_MS;
+    analyzed_ms += window_end_ms - window_start_ms;
+    if (event_open && window_start_ms - event.end_ms > MERGE_GAP_MS) {
+        close_event();
+    }
+
+    float excess_db[BAND_COUNT + 1];
+    float excess = -INFINITY;
+    for (int i = 0; i <= BAND_COUNT; i++) {
+        excess_db[i] = levels.level_db[i] - floor_db[i];
+        excess = max(excess, excess_db[i]);
+    }
+    bool audible = warm && levels.level_db[BAND_COUNT] >= MIN_EVENT_LEVEL_DB;
+    bool onset = audible && excess >= ONSET_DB;
+    bool sustained = audible && excess >= RELEASE_DB;
+    // Also while there's an event, so a sound that goes on for minutes becomes background.
+    update_floors(levels);
+    if (!event_open && onset) {
+        event_open = true;
+        event_confirmed = false;
+        event = MotionEvent{window_start_ms, window_end_ms, 0, 0};
+        event_peak_db = levels.peak_db;
+        fill(begin(loudest_excess_db), end(loudest_excess_db), -INFINITY);
+    }
+    if (!event_open || !sustained) return;
+
+    event.end_ms = window_end_ms;
+    event.frames++;
+    event.peak_score = max(event.peak_score, min(1.0, (double) excess / IMPULSE_DB));
+    event_peak_db = max(event_peak_db, levels.peak_db);
+    for (int band = 0; band < BAND_COUNT; band++) {
+        loudest_excess_db[band] = max(loudest_excess_db[band], excess_db[band]);
+    }
+    bool long_enough = event.frames >= 2 && event.end_ms - event.start_ms >= MIN_EVENT_MS;
+    if (!event_confirmed && (long_enough || excess >= IMPULSE_DB)) {
+        confirm_event();
+    }
+}
+
+void AudioAnalyzer::update_floors(const Levels &levels) {
+    double window_ms = (double) window_size * 1000 / sample_rate;
+    // Until they're warm the floors follow the levels both ways.
+    auto rise = (float) (window_ms / (analyzed_ms < WARMUP_MS ? FLOOR_FALL_TIME_MS : FLOOR_RISE_TIME_MS));
+    auto fall = (float) min(1.0, window_ms / FLOOR_FALL_TIME_MS);
+    for (int i = 0; i <= BAND_COUNT; i++) {
+        float difference = levels.level_db[i] - floor_db[i];
+        floor_db[i] += (difference > 0 ? rise : fall) * difference;
+    }
+}
+
+void AudioAnalyzer::confirm_event() {
+    event_confirmed = true;
+    if (catalog) {
+        catalog->motion_event(catalog_camera);
+    }
+    notify(true);
+    Logger::info(camera_name, "Sound started at {}", event.start_ms);
+}
+
+void AudioAnalyzer::close_event() {
+    if (!event_open) return;
+    event_open = false;
+    if (!event_confirmed) return;
+
+    int loudest_band = (int) (max_element(begin(loudest_excess_db), end(loudest_excess_db)) - begin(loudest_excess_db));
+    event.label = string("sound:") + BANDS[loudest_band].name;
+    notify(false);
+    Logger::info(camera_name, "Sound from {} to {}, {} windows, loudest in the {} band, peak {} dBFS", event.start_ms,
+                 event.end_ms, event.frames, BANDS[loudest_band].name, (int) event_peak_db);
+    ofstream motion_file(motion_file_path, std::ios_base::app);
+    motion_file << event.to_line() << endl;
+}
+
+void AudioAnalyzer::notify(bool start) {
+    lock_guard<mutex> lock(notification_mutex);
+    notifications.push_back(Notification{start, event});
+    has_notifications.store(true, memory_order_release);
+}
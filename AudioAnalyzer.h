@@ -0,0 +1,160 @@
+
+#ifndef HOMECAMRECORDER_AUDIOANALYZER_H
+#define HOMECAMRECORDER_AUDIOANALYZER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MotionDetector.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavcodec/avfft.h>
+#include <libswresample/swresample.h>
+}
+
+using namespace std;
+using namespace std::chrono;
+
+/**
+ * Detects sound events (glass breaking, a dog barking, a door slamming) in a camera's audio stream. The camera thread
+ * only references the packets. They are decoded on a low priority thread of the analyzer's own, downmixed to mono
+ * and cut into windows of about WINDOW_MS. Every window gets its RMS and peak level and the level of each of
+ * BAND_COUNT frequency bands, from a real FFT.
+ *
+ * Each level is compared with a noise floor of its own, which falls within about FLOOR_FALL_TIME_MS and rises over
+ * FLOOR_RISE_TIME_MS, so rain or a fan become background while a quiet night stays sensitive. A window ONSET_DB above
+ * its floor starts an event, which carries on while windows stay RELEASE_DB above it. Events are segmented like video
+ * motion, with MERGE_GAP_MS and MIN_EVENT_MS, except that a window IMPULSE_DB above the floor is an event on its own:
+ * breaking glass is over in a window or two.
+ *
+ * Events go where motion events go: a line in the camera's motion file labelled with the band that was loudest, a
+ * catalog motion event and the MotionListeners.
+ */
+class AudioAnalyzer {
+public:
+    static const long WINDOW_MS = 100;
+    static const int BAND_COUNT = 3;
+    static constexpr float ONSET_DB = 15;
+    static constexpr float RELEASE_DB = 9;
+    static constexpr float IMPULSE_DB = 30;
+    // Quieter windows are never an event, however quiet the floor.
+    static constexpr float MIN_EVENT_LEVEL_DB = -60;
+    static const long FLOOR_RISE_TIME_MS = 30000;
+    static const long FLOOR_FALL_TIME_MS = 1000;
+    // The floors settle before anything is reported.
+    static const long WARMUP_MS = 5000;
+    static const long MERGE_GAP_MS = 2000;
+    static const long MIN_EVENT_MS = 300;
+
+    AudioAnalyzer(string camera_name, string motion_file, RecordingCatalog *catalog = nullptr,
+                  string catalog_camera = "");
+    ~AudioAnalyzer();
+
+    // Queues an audio packet, which is referenced, not copied. The timestamp is the wall clock time of the packet, by
+    // default the time it's sent. A packet with other parameters than the last one reopens the decoder.
+    void send_packet(const AVPacket *packet, const shared_ptr<AVCodecParameters> &params, long timestamp_ms = -1);
+    // Ends the open event and stops the analyzer's thread.
+    void stop();
+
+    // Before the first packet.
+    void add_listener(MotionListener *listener);
+    // Tells the listeners about the events that started or ended since the last call. Called on the thread that
+    // analyzes the camera, which is the thread the listeners are told about video motion on.
+    void notify_listeners();
+
+private:
+    static const size_t MAX_PENDING_PACKETS = 256;
+    // Samples more than this far from where the stream's packets say they are start a new window.
+    static const long RESYNC_MS = 1000;
+
+    struct Pending {
+        AVPacket *packet{};
+        shared_ptr<AVCodecParameters> params;
+        long timestamp_ms{};
+    };
+
+    struct Notification {
+        bool start{};
+        MotionEvent event;
+    };
+
+    struct Band {
+        const char *name;
+        int from_hz;
+        int to_hz;
+    };
+    static const Band BANDS[BAND_COUNT];
+
+    // Levels of one window in dB. Levels 0 to BAND_COUNT - 1 are the bands, then the RMS.
+    struct Levels {
+        float level_db[BAND_COUNT + 1];
+        float peak_db;
+    };
+
+    const string camera_name;
+    const string motion_file_path;
+    RecordingCatalog *catalog;
+    const string catalog_camera;
+    vector<MotionListener *> listeners;
+
+    mutex queue_mutex;
+    condition_variable wake_up;
+    deque<Pending> queue;
+    bool dropping{false};
+    atomic<bool> stopping{false};
+    thread worker;
+
+    mutex notification_mutex;
+    vector<Notification> notifications;
+    atomic<bool> has_notifications{false};
+
+    // Only touched by the worker.
+    shared_ptr<AVCodecParameters> decoder_params;
+    AVCodecContext *decoder{};
+    SwrContext *resampler{};
+    int resampler_format{-1};
+    int resampler_rate{};
+    int64_t resampler_layout{};
+    AVFrame *frame{};
+    vector<float> converted;
+    RDFTContext *fft{};
+    int window_bits{};
+    int window_size{};
+    int sample_rate{};
+    float *window_function{};
+    float *fft_data{};
+    int band_bins[BAND_COUNT][2]{};
+    // Mono samples not yet analyzed, and the wall clock time of the first one.
+    vector<float> samples;
+    double samples_start_ms{-1};
+    float floor_db[BAND_COUNT + 1]{};
+    long analyzed_ms{};
+    bool event_open{false};
+    bool event_confirmed{false};
+    MotionEvent event;
+    float event_peak_db{};
+    float loudest_excess_db[BAND_COUNT]{};
+
+    void run_worker();
+    void decode(const Pending &pending);
+    bool open_decoder(const shared_ptr<AVCodecParameters> &params);
+    void close_decoder();
+    bool resample(const AVFrame *decoded, long timestamp_ms);
+    void set_window(int rate);
+    void analyze_windows();
+    Levels measure(const float *window) const;
+    void detect(const Levels &levels, long window_start_ms);
+    void update_floors(const Levels &levels);
+    void confirm_event();
+    void close_event();
+    void notify(bool start);
+};
+
+#endif //HOMECAMRECORDER_AUDIOANALYZER_H
@@ -0,0 +1,326 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <functional>
+#include <algorithm>
+#include <numeric>
+#include <cstring>
+#include <filesystem>
+
+#include "Muxer.h"
+#include "TeeMuxer.h"
+#include "MotionDetector.h"
+#include "SummaryGenerator.h"
+#include "BenchmarkFixtures.h"
+#include "SocketSink.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#ifndef HOMECAM_BUILD_TYPE
+#define HOMECAM_BUILD_TYPE "unknown"
+#endif
+
+/**
+ * Micro-benchmarks for the per-packet paths of the recorder. Every benchmark runs against the synthetic fixtures in
+ * BenchmarkFixtures, so two builds given the same --seed process exactly the same bytes. Results are written as JSON
+ * so they can be diffed between builds:
+ *
+ *   HomeCamRecorderBench --output before.json
+ *   HomeCamRecorderBench --filter muxer --repetitions 20
+ */
+using namespace std;
+using namespace std::chrono;
+
+struct BenchmarkResult {
+    string name;
+    long iterations{};
+    vector<double> ns_per_op;
+    double bytes_per_op{};
+};
+
+struct BenchmarkOptions {
+    uint32_t seed = 1;
+    int repetitions = 10;
+    string filter;
+    string output_file;
+    string tmpfs_dir = "/dev/shm";
+};
+
+/**
+ * Runs op(i) for i in [0, iterations) once as a warm up and then `repetitions` times, timing each repetition.
+ * op returns the number of input bytes it processed, which is used to report throughput.
+ */
+static BenchmarkResult measure(const string &name, long iterations, int repetitions,
+                               const function<size_t(long)> &op) {
+    BenchmarkResult result;
+    result.name = name;
+    result.iterations = iterations;
+
+    for (long i = 0; i < iterations; i++)
+        op(i);
+
+    size_t bytes = 0;
+    for (int repetition = 0; repetition < repetitions; repetition++) {
+        auto start = steady_clock::now();
+        for (long i = 0; i < iterations; i++)
+            bytes += op(i);
+        auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+        result.ns_per_op.push_back((double) elapsed / (double) iterations);
+    }
+    result.bytes_per_op = (double) bytes / (double) (iterations * (long) repetitions);
+    return result;
+}
+
+/**
+ * Exposes the timestamp path of Muxer without any container writing behind it.
+ */
+class TimestampOnlyMuxer : public Muxer {
+public:
+    TimestampOnlyMuxer(AVRational video_timebase, AVRational audio_timebase) {
+        input_timebase_per_stream[0] = video_timebase;
+        input_timebase_per_stream[1] = audio_timebase;
+        output_timebase_per_stream[0] = AVRational{1, 1000};
+        output_timebase_per_stream[1] = AVRational{1, 1000};
+        Muxer::release();
+        did_init = true;
+        should_add_streams = false;
+    }
+
+    void init() override {}
+
+    void send_packet(AVPacket *packet) override {
+        long prev_duration = packet->duration;
+        long prev_pts = packet->pts;
+        long prev_dts = packet->dts;
+        long prev_pos = packet->pos;
+        rescale_packet_timestamps(packet);
+        packet->duration = prev_duration;
+        packet->pts = prev_pts;
+        packet->dts = prev_dts;
+        packet->pos = prev_pos;
+    }
+};
+
+/**
+ * RotatingFileMuxer with the segment redirected to /dev/null, to separate muxing cost from file system cost.
+ */
+class DevNullRotatingFileMuxer : public RotatingFileMuxer {
+public:
+    DevNullRotatingFileMuxer() : RotatingFileMuxer("/dev/null", "flv") {}
+
+protected:
+    string get_output_file_name() override {
+        return "/dev/null";
+    }
+};
+
+static size_t send_to_muxer(Muxer *muxer, const vector<AVPacket *> &packets, long i) {
+    AVPacket *packet = packets[i % packets.size()];
+    muxer->send_packet(packet);
+    return (size_t) packet->size;
+}
+
+static void bench_nal_scanning(const BenchmarkOptions &options, BenchmarkFixtures &fixtures,
+                               vector<BenchmarkResult> &results) {
+    string motion_csv = options.tmpfs_dir + "/homecam_bench_motion.csv";
+    MotionDetector motion_detector("Bench", motion_csv, 30000);
+    const auto &packets = fixtures.video_packets();
+    results.push_back(measure("motion_detector.send_packet", (long) packets.size(), options.repetitions,
+                              [&](long i) {
+                                  AVPacket *packet = packets[i];
+                                  motion_detector.send_packet(packet);
+                                  return (size_t) packet->size;
+                              }));
+    motion_detector.release();
+    remove(motion_csv.c_str());
+}
+
+static void bench_timestamps(const BenchmarkOptions &options, BenchmarkFixtures &fixtures,
+                             vector<BenchmarkResult> &results) {
+    TimestampOnlyMuxer muxer(fixtures.video_stream()->time_base, fixtures.audio_stream()->time_base);
+    const auto &packets = fixtures.packets();
+    results.push_back(measure("muxer.rescale_packet_timestamps", (long) packets.size() * 100, options.repetitions,
+                              [&](long i) { return send_to_muxer(&muxer, packets, i); }));
+}
+
+static void bench_rotating_file_muxer(const BenchmarkOptions &options, BenchmarkFixtures &fixtures,
+                                      vector<BenchmarkResult> &results) {
+    const auto &packets = fixtures.packets();
+    long iterations = (long) packets.size() * 4;
+
+    string segment_dir = options.tmpfs_dir + "/homecam_bench";
+    create_directories(segment_dir);
+    RotatingFileMuxer tmpfs_muxer(segment_dir + "/segment", "flv");
+    fixtures.attach(&tmpfs_muxer);
+    results.push_back(measure("rotating_file_muxer.send_packet.tmpfs", iterations, options.repetitions,
+                              [&](long i) { return send_to_muxer(&tmpfs_muxer, packets, i); }));
+    tmpfs_muxer.release();
+    remove_all(segment_dir);
+
+    DevNullRotatingFileMuxer dev_null_muxer;
+    fixtures.attach(&dev_null_muxer);
+    results.push_back(measure("rotating_file_muxer.send_packet.dev_null", iterations, options.repetitions,
+                              [&](long i) { return send_to_muxer(&dev_null_muxer, packets, i); }));
+    dev_null_muxer.release();
+}
+
+static void bench_flv_muxer(const BenchmarkOptions &options, BenchmarkFixtures &fixtures,
+                            vector<BenchmarkResult> &results) {
+    SocketSink sink;
+    if (!sink.start()) {
+        cerr << "(Bench) Failed to start local socket sink. Skipping FLVMuxer benchmark." << endl;
+        return;
+    }
+    const auto &packets = fixtures.packets();
+    FLVMuxer muxer(sink.url());
+    fixtures.attach(&muxer);
+    results.push_back(measure("flv_muxer.send_packet.socket", (long) packets.size() * 4, options.repetitions,
+                              [&](long i) { return send_to_muxer(&muxer, packets, i); }));
+    muxer.release();
+    sink.stop();
+}
+
+// The same two outputs as rotating_file_muxer.send_packet.tmpfs and flv_muxer.send_packet.socket, muxed once.
+static void bench_tee_muxer(const BenchmarkOptions &options, BenchmarkFixtures &fixtures,
+                            vector<BenchmarkResult> &results) {
+    SocketSink sink;
+    if (!sink.start()) {
+        cerr << "(Bench) Failed to start local socket sink. Skipping TeeMuxer benchmark." << endl;
+        return;
+    }
+    const auto &packets = fixtures.packets();
+    string segment_dir = options.tmpfs_dir + "/homecam_bench_tee";
+    create_directories(segment_dir);
+    TeeMuxer muxer("flv", {new SegmentSink(segment_dir + "/segment", "flv"), new StreamSink(sink.url())});
+    fixtures.attach(&muxer);
+    results.push_back(measure("tee_muxer.send_packet.tmpfs_and_socket", (long) packets.size() * 4,
+                              options.repetitions, [&](long i) { return send_to_muxer(&muxer, packets, i); }));
+    muxer.release();
+    remove_all(segment_dir);
+    sink.stop();
+}
+
+static void bench_motion_windowing(const BenchmarkOptions &options, vector<BenchmarkResult> &results) {
+    // A day with 200 motion events of 5 seconds each, and a 30 minute segment in the middle of it.
+    const long day_start = 1600000000000L;
+    const long frame_interval_ms = 1000 / BenchmarkFixtures::FRAME_RATE;
+    mt19937 rng(options.seed);
+    uniform_int_distribution<long> burst_offset(0, 24L * 3600 * 1000);
+    vector<long> burst_starts(200);
+    for (long &start : burst_starts)
+        start = day_start + burst_offset(rng);
+    sort(burst_starts.begin(), burst_starts.end());
+    vector<MotionEvent> motion_events;
+    for (long start : burst_starts) {
+        if (!motion_events.empty() && start <= motion_events.back().end_ms) continue;
+        motion_events.push_back(MotionEvent{start, start + 5000, 0.5, (int) (5000 / frame_interval_ms)});
+    }
+
+    const long segment_start = day_start + 12L * 3600 * 1000;
+    const long segment_frames = 30L * 60 * BenchmarkFixtures::FRAME_RATE;
+    auto cursor = make_unique<MotionWindowCursor>(motion_events, segment_start);
+    results.push_back(measure("summary_generator.motion_window", segment_frames, options.repetitions,
+                              [&](long i) {
+                                  if (i == 0)
+                                      cursor = make_unique<MotionWindowCursor>(motion_events, segment_start);
+                                  cursor->should_include(segment_start + i * frame_interval_ms);
+                                  return (size_t) 0;
+                              }));
+}
+
+static void write_json(ostream &out, const BenchmarkOptions &options, const BenchmarkFixtures &fixtures,
+                       const vector<BenchmarkResult> &results) {
+    out << fixed << setprecision(3);
+    out << "{\n";
+    out << "  \"suite\": \"HomeCamRecorderBench\",\n";
+    out << "  \"schema_version\": 1,\n";
+    out << "  \"build_type\": \"" << HOMECAM_BUILD_TYPE << "\",\n";
+    out << "  \"compiler\": \"" << __VERSION__ << "\",\n";
+    out << "  \"seed\": " << options.seed << ",\n";
+    out << "  \"repetitions\": " << options.repetitions << ",\n";
+    out << "  \"fixture_packets\": " << fixtures.packets().size() << ",\n";
+    out << "  \"fixture_bytes\": " << fixtures.total_bytes() << ",\n";
+    out << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult &result = results[i];
+        vector<double> sorted = result.ns_per_op;
+        sort(sorted.begin(), sorted.end());
+        double median = sorted[sorted.size() / 2];
+        double mean = accumulate(sorted.begin(), sorted.end(), 0.0) / (double) sorted.size();
+        out << "    {\n";
+        out << "      \"name\": \"" << result.name << "\",\n";
+        out << "      \"iterations\": " << result.iterations << ",\n";
+        out << "      \"ns_per_op_min\": " << sorted.front() << ",\n";
+        out << "      \"ns_per_op_median\": " << median << ",\n";
+        out << "      \"ns_per_op_mean\": " << mean << ",\n";
+        out << "      \"ns_per_op_max\": " << sorted.back() << ",\n";
+        out << "      \"ops_per_sec\": " << 1e9 / median << ",\n";
+        out << "      \"mb_per_sec\": " << result.bytes_per_op * 1e3 / median << "\n";
+        out << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}" << endl;
+}
+
+static bool selected(const BenchmarkOptions &options, const string &name) {
+    return options.filter.empty() || name.find(options.filter) != string::npos;
+}
+
+int main(int argc, char *argv[]) {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            options.seed = (uint32_t) stoul(argv[++i]);
+        } else if (strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc) {
+            options.repetitions = max(1, stoi(argv[++i]));
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            options.output_file = argv[++i];
+        } else if (strcmp(argv[i], "--tmpfs") == 0 && i + 1 < argc) {
+            options.tmpfs_dir = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0]
+                 << " [--seed N] [--repetitions N] [--filter NAME] [--output FILE] [--tmpfs DIR]" << endl;
+            return 1;
+        }
+    }
+    if (!is_directory(options.tmpfs_dir)) {
+        options.tmpfs_dir = temp_directory_path().string();
+    }
+
+    av_log_set_level(AV_LOG_ERROR);
+
+    BenchmarkFixtures fixtures(options.seed);
+
+    // The hot paths log to stdout. Keep that cost in the measurement but out of the JSON.
+    ofstream dev_null("/dev/null");
+    streambuf *stdout_buffer = cout.rdbuf(dev_null.rdbuf());
+
+    vector<BenchmarkResult> results;
+    if (selected(options, "motion_detector"))
+        bench_nal_scanning(options, fixtures, results);
+    if (selected(options, "muxer.rescale_packet_timestamps"))
+        bench_timestamps(options, fixtures, results);
+    if (selected(options, "rotating_file_muxer"))
+        bench_rotating_file_muxer(options, fixtures, results);
+    if (selected(options, "flv_muxer"))
+        bench_flv_muxer(options, fixtures, results);
+    if (selected(options, "tee_muxer"))
+        bench_tee_muxer(options, fixtures, results);
+    if (selected(options, "summary_generator"))
+        bench_motion_windowing(options, results);
+
+    cout.rdbuf(stdout_buffer);
+
+    if (options.output_file.empty()) {
+        write_json(cout, options, fixtures, results);
+    } else {
+        ofstream output(options.output_file);
+        write_json(output, options, fixtures, results);
+    }
+    return 0;
+}
@@ -0,0 +1,142 @@
+#include "BenchmarkFixtures.h"
+
+#include <cstring>
+
+static const uint8_t START_CODE[] = {0, 0, 0, 1};
+// Baseline profile, level 3.1. Only the first bytes are read by the FLV muxer when it builds the avcC box.
+static const uint8_t SPS[] = {0x67, 0x42, 0xC0, 0x1F, 0xDA, 0x01, 0x40, 0x16, 0xE8, 0x06, 0xD0, 0xA1, 0x35};
+static const uint8_t PPS[] = {0x68, 0xCE, 0x3C, 0x80};
+// AudioSpecificConfig for AAC-LC, 44.1kHz, stereo.
+static const uint8_t AAC_CONFIG[] = {0x12, 0x10};
+
+static const uint8_t NAL_IDR = 0x65;
+static const uint8_t NAL_NON_IDR = 0x41;
+
+BenchmarkFixtures::BenchmarkFixtures(uint32_t seed, int gop_count) : rng(seed) {
+    create_streams();
+    create_packets(gop_count);
+}
+
+BenchmarkFixtures::~BenchmarkFixtures() {
+    for (AVPacket *packet : video)
+        av_packet_free(&packet);
+    for (AVPacket *packet : audio)
+        av_packet_free(&packet);
+    avformat_free_context(input_ctx);
+}
+
+void BenchmarkFixtures::attach(Muxer *muxer) {
+    if (!muxer->did_init) {
+        muxer->init();
+    }
+    if (muxer->should_add_streams) {
+        muxer->add_stream(video_stream(), avcodec_find_decoder(AV_CODEC_ID_H264), false);
+        muxer->add_stream(audio_stream(), avcodec_find_decoder(AV_CODEC_ID_AAC), true);
+    }
+}
+
+void BenchmarkFixtures::create_streams() {
+    input_ctx = avformat_alloc_context();
+
+    AVStream *video_stream = avformat_new_stream(input_ctx, nullptr);
+    video_stream->time_base = AVRational{1, 90000};
+    AVCodecParameters *video_params = video_stream->codecpar;
+    video_params->codec_type = AVMEDIA_TYPE_VIDEO;
+    video_params->codec_id = AV_CODEC_ID_H264;
+    video_params->width = 1920;
+    video_params->height = 1080;
+    video_params->format = AV_PIX_FMT_YUV420P;
+
+    vector<uint8_t> extradata;
+    extradata.insert(extradata.end(), START_CODE, START_CODE + sizeof(START_CODE));
+    extradata.insert(extradata.end(), SPS, SPS + sizeof(SPS));
+    extradata.insert(extradata.end(), START_CODE, START_CODE + sizeof(START_CODE));
+    extradata.insert(extradata.end(), PPS, PPS + sizeof(PPS));
+    video_params->extradata = (uint8_t *) av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+    memcpy(video_params->extradata, extradata.data(), extradata.size());
+    video_params->extradata_size = (int) extradata.size();
+
+    AVStream *audio_stream = avformat_new_stream(input_ctx, nullptr);
+    audio_stream->time_base = AVRational{1, AUDIO_SAMPLE_RATE};
+    AVCodecParameters *audio_params = audio_stream->codecpar;
+    audio_params->codec_type = AVMEDIA_TYPE_AUDIO;
+    audio_params->codec_id = AV_CODEC_ID_AAC;
+    audio_params->sample_rate = AUDIO_SAMPLE_RATE;
+    audio_params->channels = 2;
+    audio_params->channel_layout = AV_CH_LAYOUT_STEREO;
+    audio_params->frame_size = AUDIO_FRAME_SIZE;
+    audio_params->format = AV_SAMPLE_FMT_FLTP;
+    audio_params->extradata = (uint8_t *) av_mallocz(sizeof(AAC_CONFIG) + AV_INPUT_BUFFER_PADDING_SIZE);
+    memcpy(audio_params->extradata, AAC_CONFIG, sizeof(AAC_CONFIG));
+    audio_params->extradata_size = sizeof(AAC_CONFIG);
+}
+
+void BenchmarkFixtures::create_packets(int gop_count) {
+    // Sizes roughly match what a 1080p camera produces at 4 Mbit/s, with enough spread that the motion threshold
+    // used by the cameras (30000) is crossed in both directions.
+    normal_distribution<double> non_idr_size(30000, 8000);
+    normal_distribution<double> idr_size(90000, 10000);
+    uniform_int_distribution<int> audio_size(320, 420);
+
+    const int64_t video_frame_duration = 90000 / FRAME_RATE;
+    int video_frames = gop_count * GOP_SIZE;
+    for (int frame = 0; frame < video_frames; frame++) {
+        bool key = frame % GOP_SIZE == 0;
+        vector<uint8_t> buffer;
+        if (key) {
+            buffer.insert(buffer.end(), START_CODE, START_CODE + sizeof(START_CODE));
+            buffer.insert(buffer.end(), SPS, SPS + sizeof(SPS));
+            buffer.insert(buffer.end(), START_CODE, START_CODE + sizeof(START_CODE));
+            buffer.insert(buffer.end(), PPS, PPS + sizeof(PPS));
+            append_nal(buffer, NAL_IDR, max(1000, (int) idr_size(rng)));
+        } else {
+            append_nal(buffer, NAL_NON_IDR, max(500, (int) non_idr_size(rng)));
+        }
+        video.push_back(make_packet(buffer, VIDEO_STREAM_INDEX, frame * video_frame_duration,
+                                    video_frame_duration, key));
+    }
+
+    int64_t video_end_time = video_frames * video_frame_duration;
+    int64_t audio_end_time = av_rescale(video_end_time, AUDIO_SAMPLE_RATE, 90000);
+    for (int64_t timestamp = 0; timestamp < audio_end_time; timestamp += AUDIO_FRAME_SIZE) {
+        vector<uint8_t> buffer((size_t) audio_size(rng));
+        uniform_int_distribution<int> byte(1, 255);
+        for (uint8_t &b : buffer)
+            b = (uint8_t) byte(rng);
+        audio.push_back(make_packet(buffer, AUDIO_STREAM_INDEX, timestamp, AUDIO_FRAME_SIZE, true));
+    }
+
+    // Interleave by presentation time, which is how packets come out of av_read_frame for the cameras.
+    size_t v = 0, a = 0;
+    while (v < video.size() || a < audio.size()) {
+        bool take_video = a >= audio.size() ||
+                (v < video.size() && av_compare_ts(video[v]->dts, video_stream()->time_base,
+                                                   audio[a]->dts, audio_stream()->time_base) <= 0);
+        interleaved_packets.push_back(take_video ? video[v++] : audio[a++]);
+    }
+}
+
+void BenchmarkFixtures::append_nal(vector<uint8_t> &buffer, uint8_t header, int payload_size) {
+    // Payload bytes are never zero, so no start code can be emulated inside the NAL unit.
+    uniform_int_distribution<int> byte(1, 255);
+    buffer.insert(buffer.end(), START_CODE, START_CODE + sizeof(START_CODE));
+    buffer.push_back(header);
+    for (int i = 0; i < payload_size; i++)
+        buffer.push_back((uint8_t) byte(rng));
+}
+
+AVPacket *BenchmarkFixtures::make_packet(const vector<uint8_t> &buffer, int stream_index, int64_t timestamp,
+                                         int64_t duration, bool key) {
+    AVPacket *packet = av_packet_alloc();
+    av_new_packet(packet, (int) buffer.size());
+    memcpy(packet->data, buffer.data(), buffer.size());
+    packet->stream_index = stream_index;
+    packet->pts = timestamp;
+    packet->dts = timestamp;
+    packet->duration = duration;
+    packet->pos = -1;
+    if (key)
+        packet->flags |= AV_PKT_FLAG_KEY;
+    bytes += buffer.size();
+    return packet;
+}
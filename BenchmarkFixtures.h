@@ -0,0 +1,62 @@
+
+#ifndef HOMECAMRECORDER_BENCHMARKFIXTURES_H
+#define HOMECAMRECORDER_BENCHMARKFIXTURES_H
+
+#include <vector>
+#include <random>
+#include <cstdint>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+#include "Muxer.h"
+
+using namespace std;
+
+/**
+ * Synthetic camera input for the benchmarks. The video stream is an Annex B H.264 stream with the same layout our
+ * cameras send over RTSP (SPS + PPS + IDR slice on keyframes, a single non-IDR slice otherwise) and the audio stream
+ * is AAC-LC. The NAL payloads are random bytes that never contain a start code, so they exercise the parsers and
+ * muxers exactly like real data but are not decodable.
+ */
+class BenchmarkFixtures {
+public:
+    static const int VIDEO_STREAM_INDEX = 0;
+    static const int AUDIO_STREAM_INDEX = 1;
+
+    static const int FRAME_RATE = 30;
+    static const int GOP_SIZE = 60;
+    static const int AUDIO_SAMPLE_RATE = 44100;
+    static const int AUDIO_FRAME_SIZE = 1024;
+
+    explicit BenchmarkFixtures(uint32_t seed, int gop_count = 4);
+    ~BenchmarkFixtures();
+
+    // Packets in the interleaved order they arrive from the camera.
+    const vector<AVPacket *> &packets() const { return interleaved_packets; }
+    const vector<AVPacket *> &video_packets() const { return video; }
+    size_t total_bytes() const { return bytes; }
+
+    // Connects the muxer to the fixture streams the same way run() does for a live camera.
+    void attach(Muxer *muxer);
+
+    AVStream *video_stream() const { return input_ctx->streams[VIDEO_STREAM_INDEX]; }
+    AVStream *audio_stream() const { return input_ctx->streams[AUDIO_STREAM_INDEX]; }
+
+private:
+    mt19937 rng;
+    AVFormatContext *input_ctx{};
+    vector<AVPacket *> video;
+    vector<AVPacket *> audio;
+    vector<AVPacket *> interleaved_packets;
+    size_t bytes{0};
+
+    void create_streams();
+    void create_packets(int gop_count);
+    void append_nal(vector<uint8_t> &buffer, uint8_t header, int payload_size);
+    AVPacket *make_packet(const vector<uint8_t> &buffer, int stream_index, int64_t timestamp, int64_t duration, bool key);
+};
+
+#endif //HOMECAMRECORDER_BENCHMARKFIXTURES_H
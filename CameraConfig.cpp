@@ -0,0 +1,88 @@
+#include "CameraConfig.h"
+
+#include <fstream>
+#include <iostream>
+
+static string trim(const string &text) {
+    size_t start = text.find_first_not_of(" \t\r");
+    if (start == string::npos) return "";
+    size_t end = text.find_last_not_of(" \t\r");
+    return text.substr(start, end - start + 1);
+}
+
+static bool parse_int(const string &text, int &value) {
+    try {
+        size_t length;
+        value = stoi(text, &length);
+        return length == text.size();
+    } catch (...) {
+        return false;
+    }
+}
+
+bool CameraConfig::load(const string &path, vector<CameraConfig> &configs) {
+    ifstream file(path);
+    if (!file) {
+        cerr << "(CameraConfig) Failed to open " << path << endl;
+        return false;
+    }
+
+    vector<CameraConfig> loaded;
+    string line;
+    int line_number = 0;
+    while (getline(file, line)) {
+        line_number++;
+        line = trim(line);
+        if (line.empty() || line[0] == '#' || line[0] == ';') continue;
+
+        if (line.front() == '[' && line.back() == ']') {
+            CameraConfig config;
+            config.basename = trim(line.substr(1, line.size() - 2));
+            for (const CameraConfig &other : loaded) {
+                if (other.basename == config.basename) {
+                    cerr << "(CameraConfig) " << path << ":" << line_number << " Camera " << config.basename
+                         << " is listed twice." << endl;
+                    return false;
+                }
+            }
+            loaded.push_back(config);
+            continue;
+        }
+
+        size_t equals = line.find('=');
+        if (equals == string::npos || loaded.empty()) {
+            cerr << "(CameraConfig) " << path << ":" << line_number << " Expected [camera] or key = value." << endl;
+            return false;
+        }
+        CameraConfig &config = loaded.back();
+        string key = trim(line.substr(0, equals));
+        string value = trim(line.substr(equals + 1));
+        bool valid = true;
+        if (key == "name") config.name = value;
+        else if (key == "url") config.url = value;
+        else if (key == "relay_url") config.relay_url = value;
+        else if (key == "preview_url") config.preview_url = value;
+        else if (key == "analysis_url") config.analysis_url = value;
+        else if (key == "motion_threshold") valid = parse_int(value, config.motion_threshold);
+        else if (key == "retention_priority") valid = parse_int(value, config.retention_priority);
+        else if (key == "analysis_motion_threshold") valid = parse_int(value, config.analysis_motion_threshold);
+        else if (key == "cpu") valid = parse_int(value, config.cpu) && config.cpu >= -1;
+        else {
+            cerr << "(CameraConfig) " << path << ":" << line_number << " Unknown key " << key << endl;
+            return false;
+        }
+        if (!valid) {
+            cerr << "(CameraConfig) " << path << ":" << line_number << " " << key << " must be a number." << endl;
+            return false;
+        }
+    }
+
+    for (const CameraConfig &config : loaded) {
+        if (config.basename.empty() || config.name.empty() || config.url.empty()) {
+            cerr << "(CameraConfig) " << path << " Camera [" << config.basename << "] needs a name and a url." << endl;
+            return false;
+        }
+    }
+    configs = loaded;
+    return true;
+}
@@ -0,0 +1,104 @@
+
+#ifndef HOMECAMRECORDER_CAMERASOURCE_H
+#define HOMECAMRECORDER_CAMERASOURCE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include <chrono>
+
+#include "Muxer.h"
+#include "TransportMonitor.h"
+#include "StreamClock.h"
+#include "Watchdog.h"
+#include "StatusPage.h"
+#include "AudioAnalyzer.h"
+
+using namespace std;
+using namespace std::chrono;
+
+class CameraLoadStats;
+
+class CameraSource {
+public:
+    CameraSource(string name, string input_url, vector<Muxer *> muxers, string recordings_dir, string output_file_basename, int motion_threshold, int retention_priority = 1,
+                 vector<Muxer *> analysis_muxers = {}, string analysis_url = "", int analysis_motion_threshold = 0) :
+    name(std::move(name)),
+    muxers(std::move(muxers)),
+    url(std::move(input_url)),
+    recordings_dir(std::move(recordings_dir)),
+    output_file_basename(std::move(output_file_basename)),
+    motion_threshold(motion_threshold),
+    retention_priority(retention_priority),
+    analysis_muxers(std::move(analysis_muxers)),
+    analysis_url(std::move(analysis_url)),
+    analysis_motion_threshold(analysis_motion_threshold) {}
+    
+    // Muxers fed from the main stream. Without an analysis stream that includes the analysis muxers.
+    vector<Muxer *> main_stream_muxers() const {
+        vector<Muxer *> main_muxers = muxers;
+        if (analysis_url.empty()) {
+            main_muxers.insert(main_muxers.end(), analysis_muxers.begin(), analysis_muxers.end());
+        }
+        return main_muxers;
+    }
+    
+public:
+    const string name;
+    const string url;
+    const string recordings_dir;
+    const string output_file_basename;
+    atomic<int> motion_threshold;
+    // Footage of a camera with priority 2 is kept twice as long as that of a camera with priority 1.
+    atomic<int> retention_priority;
+    
+    vector<Muxer *> muxers;
+    // Low resolution substream of the same camera for motion detection, snapshots and previews, so they don't have
+    // to decode the main stream. Empty to analyze the main stream.
+    vector<Muxer *> analysis_muxers;
+    const string analysis_url;
+    atomic<int> analysis_motion_threshold;
+
+    // Outputs a reload can move while the camera records. The reload sets them under config_mutex (with the
+    // thresholds) and bumps config_generation, and the threads feeding the muxers pick them up at the next keyframe.
+    mutex config_mutex;
+    string relay_url;
+    string preview_url;
+    atomic<int> config_generation{0};
+    // Set when a reload removes or replaces the camera. Its threads finish, releasing the muxers.
+    atomic<bool> stopping{false};
+    // Maps main stream timestamps to wall clock time. The analysis stream aligns its motion times to it.
+    shared_ptr<StreamClock> main_clock = make_shared<StreamClock>();
+    // Stamped for every video packet. The watchdog cancels a stream's I/O when it stops.
+    shared_ptr<Heartbeat> heartbeat = make_shared<Heartbeat>();
+    shared_ptr<Heartbeat> analysis_heartbeat = make_shared<Heartbeat>();
+    bool needs_restart{false};
+    int video_frames_read{};
+    int audio_frames_read{};
+    
+    // Codec parameters (with the SPS/PPS) of the last connection, so reconnecting can skip probing the stream.
+    shared_ptr<AVCodecParameters> cached_video_params;
+    shared_ptr<AVCodecParameters> cached_audio_params;
+    // When the current outage started, or zero while the camera is up.
+    time_point<steady_clock> outage_start_time{};
+    bool outage_reported{false};
+
+    // Options passed to avformat_open_input for this camera. Changed under config_mutex once its threads run.
+    vector<pair<string, string>> input_options{{"rtsp_transport", "udp"}};
+    // Read the input no faster than its timestamps. Only useful for file inputs, network inputs are paced by the
+    // camera.
+    bool pace_realtime{false};
+    // Set for RTSP cameras whose transport is picked by measured loss.
+    shared_ptr<TransportMonitor> transport_monitor;
+    // Set when the camera is driven by the replay load generator.
+    shared_ptr<CameraLoadStats> load_stats;
+    // This worker's slot of the supervisor's status page, when running with --worker.
+    WorkerStatus *status{};
+    // Fed the audio packets of the main stream. Replayed cameras have none.
+    unique_ptr<AudioAnalyzer> audio_analyzer;
+};
+
+#endif //HOMECAMRECORDER_CAMERASOURCE_H
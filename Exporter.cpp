@@ -0,0 +1,175 @@
+#include "Exporter.h"
+
+#include <ctime>
+#include <cstring>
+#include <algorithm>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+#include "AVError.h"
+#include "SegmentTime.h"
+
+Exporter::Exporter(RecordingCatalog *catalog, string camera, long from_ms, long to_ms, string output_file) :
+    catalog(catalog), camera(std::move(camera)), from_ms(from_ms), to_ms(to_ms), output_file(std::move(output_file)) {}
+
+bool Exporter::run() {
+    vector<CatalogEntry> segments = catalog->find(camera, from_ms, to_ms);
+    if (segments.empty()) {
+        cerr << "(Exporter) No recordings of " << camera << " between " << from_ms << " and " << to_ms << "." << endl;
+        return false;
+    }
+
+    FileMuxer muxer(output_file);
+    muxer.init();
+    if (!muxer.did_init) {
+        return false;
+    }
+    for (size_t i = 0; i < segments.size(); i++) {
+        cout << "(Exporter) Copying " << segments[i].path << endl;
+        if (!add_segment(&muxer, segments[i], i == 0)) break;
+    }
+    muxer.release();
+
+    cout << "(Exporter) Wrote " << video_packets_written << " video frames to " << output_file << endl;
+    return video_packets_written > 0;
+}
+
+bool Exporter::add_segment(FileMuxer *muxer, const CatalogEntry &segment, bool seek_to_start) {
+    AVFormatContext *input_ctx = nullptr;
+    AVPacket *packet = av_packet_alloc();
+    bool reached_end = false;
+    int ret;
+
+    try {
+        ret = avformat_open_input(&input_ctx, segment.path.c_str(), nullptr, nullptr);
+        if (ret < 0) {
+            cerr << "(Exporter) Failed to open " << segment.path << ". Error = " << av_err2str(ret) << endl;
+            throw ret;
+        }
+        ret = avformat_find_stream_info(input_ctx, nullptr);
+        if (ret < 0) {
+            cerr << "(Exporter) Failed to find stream info in " << segment.path << ". Error = " << av_err2str(ret) << endl;
+            throw ret;
+        }
+
+        AVCodec *input_video_codec;
+        AVCodec *input_audio_codec;
+        int video_stream_idx = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &input_video_codec, 0);
+        if (video_stream_idx < 0) {
+            cerr << "(Exporter) No video stream in " << segment.path << "." << endl;
+            throw video_stream_idx;
+        }
+        int audio_stream_idx = av_find_best_stream(input_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &input_audio_codec, 0);
+
+        if (muxer->should_add_streams) {
+            muxer->add_stream(input_ctx->streams[video_stream_idx], input_video_codec, audio_stream_idx < 0);
+            time_base_per_stream[0] = input_ctx->streams[video_stream_idx]->time_base;
+            exports_audio = audio_stream_idx >= 0;
+            if (exports_audio) {
+                muxer->add_stream(input_ctx->streams[audio_stream_idx], input_audio_codec, true);
+                time_base_per_stream[1] = input_ctx->streams[audio_stream_idx]->time_base;
+            }
+        }
+
+        AVStream *video_stream = input_ctx->streams[video_stream_idx];
+        // Segments are only cut at a keyframe when they are the first of the export. Later segments continue the
+        // GOP of the previous one, which has already been written.
+        bool saw_key_frame = !seek_to_start;
+        if (seek_to_start && from_ms > segment.start_time_ms) {
+            int64_t target = segment_timestamp(segment.start_time_ms, input_ctx, video_stream, from_ms);
+            ret = av_seek_frame(input_ctx, video_stream_idx, target, AVSEEK_FLAG_BACKWARD);
+            if (ret < 0) {
+                // Reading from the start still works, it's just slower.
+                cerr << "(Exporter) Failed to seek in " << segment.path << ". Error = " << av_err2str(ret) << endl;
+            }
+        }
+
+        while (av_read_frame(input_ctx, packet) == 0) {
+            bool is_video = packet->stream_index == video_stream_idx;
+            if (!is_video && (packet->stream_index != audio_stream_idx || !exports_audio)) {
+                av_packet_unref(packet);
+                continue;
+            }
+            AVStream *input_stream = input_ctx->streams[packet->stream_index];
+            long epoch_time_ms = segment_time_ms(segment.start_time_ms, input_ctx, input_stream, packet);
+
+            if (epoch_time_ms > to_ms) {
+                av_packet_unref(packet);
+                if (is_video) {
+                    reached_end = true;
+                    break;
+                }
+                continue;
+            }
+            if (!saw_key_frame) {
+                // The seek lands on a keyframe at or before the start time, but without an index it may land earlier.
+                if (!is_video || !(packet->flags & AV_PKT_FLAG_KEY)) {
+                    av_packet_unref(packet);
+                    continue;
+                }
+                saw_key_frame = true;
+            }
+
+            // The muxer expects the recorder's stream layout: video is stream 0 and audio is stream 1.
+            packet->stream_index = is_video ? 0 : 1;
+            av_packet_rescale_ts(packet, input_stream->time_base, time_base_per_stream[packet->stream_index]);
+            fill_missing_duration(packet);
+            muxer->send_packet(packet);
+            if (is_video) video_packets_written++;
+            av_packet_unref(packet);
+        }
+    } catch (int e) {
+    }
+
+    av_packet_free(&packet);
+    avformat_close_input(&input_ctx);
+    // Each segment's timestamps start at 0 again.
+    last_dts_per_stream[0] = -1;
+    last_dts_per_stream[1] = -1;
+    return !reached_end;
+}
+
+void Exporter::fill_missing_duration(AVPacket *packet) {
+    int stream = packet->stream_index;
+    if (packet->dts != AV_NOPTS_VALUE) {
+        if (last_dts_per_stream[stream] != -1 && packet->dts > last_dts_per_stream[stream]) {
+            last_duration_per_stream[stream] = packet->dts - last_dts_per_stream[stream];
+        }
+        last_dts_per_stream[stream] = packet->dts;
+    }
+    // The timestamp repair in Muxer advances each packet by its duration, so a packet without one would be written
+    // with the same dts as the one before it.
+    if (packet->duration <= 0) {
+        packet->duration = last_duration_per_stream[stream];
+    }
+}
+
+long Exporter::parse_time(const string &value) {
+    if (!value.empty() && all_of(value.begin(), value.end(), [](char c) { return isdigit(c); })) {
+        long time = stol(value);
+        // Anything before 2001-09-09 in milliseconds is taken to be seconds.
+        return time < 1000000000000L ? time * 1000 : time;
+    }
+
+    time_t now = time(nullptr);
+    struct tm time_parts{};
+    localtime_r(&now, &time_parts);
+    time_parts.tm_sec = 0;
+    const char *end = nullptr;
+    for (const char *format : {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M",
+                               "%H:%M:%S", "%H:%M"}) {
+        struct tm parsed = time_parts;
+        end = strptime(value.c_str(), format, &parsed);
+        if (end && *end == '\0') {
+            time_parts = parsed;
+            break;
+        }
+        end = nullptr;
+    }
+    if (!end) return -1;
+    time_parts.tm_isdst = -1;
+    return (long) mktime(&time_parts) * 1000;
+}
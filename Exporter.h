@@ -0,0 +1,52 @@
+
+#ifndef HOMECAMRECORDER_EXPORTER_H
+#define HOMECAMRECORDER_EXPORTER_H
+
+#include <string>
+#include <vector>
+
+#include "Muxer.h"
+#include "RecordingCatalog.h"
+
+using namespace std;
+
+/**
+ * Copies the footage of one camera between two wall clock times into a single file, for handing a clip to someone
+ * without cutting segments by hand.
+ *
+ * The segments covering the range come from the catalog. The first one is seeked to the keyframe before the start
+ * time and the packets are stream copied (never decoded) through a FileMuxer until the end time, so the output
+ * timestamps stay continuous across segment boundaries, even between segments of different containers.
+ */
+class Exporter {
+public:
+    Exporter(RecordingCatalog *catalog, string camera, long from_ms, long to_ms, string output_file);
+
+    // Returns false if nothing was exported.
+    bool run();
+
+    // Accepts epoch seconds or milliseconds, "YYYY-MM-DD HH:MM[:SS]" (also with a T) or "HH:MM[:SS]" for today, in
+    // local time. Returns -1 if the time can't be parsed.
+    static long parse_time(const string &value);
+
+private:
+    RecordingCatalog *catalog;
+    const string camera;
+    const long from_ms;
+    const long to_ms;
+    const string output_file;
+
+    // The output streams are laid out from the first segment. Packets of every segment are rescaled to its time
+    // bases (FLV segments count in 1/1000, MPEG-TS in 1/90000), and audio is dropped if it had none.
+    AVRational time_base_per_stream[2]{};
+    bool exports_audio{false};
+    long last_dts_per_stream[2]{-1, -1};
+    long last_duration_per_stream[2]{};
+    long video_packets_written{};
+
+    // Returns false once the end time has been reached.
+    bool add_segment(FileMuxer *muxer, const CatalogEntry &segment, bool seek_to_start);
+    void fill_missing_duration(AVPacket *packet);
+};
+
+#endif //HOMECAMRECORDER_EXPORTER_H
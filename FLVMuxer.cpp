@@ -40,21 +40,13 @@ void FLVMuxer::send_packet(AVPacket *packet) {
     long prev_dts = packet->dts;
     long prev_pos = packet->pos;
 
-    auto input_timebase = input_timebase_per_stream[packet->stream_index];
-    auto output_timebase = output_timebase_per_stream[packet->stream_index];
-    packet->duration = av_rescale_q((int64_t) packet->duration, input_timebase, output_timebase);
-    packet->pts = av_rescale_q_rnd((int64_t) packet->pts, input_timebase, output_timebase,
-                                   AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-    packet->dts = av_rescale_q_rnd((int64_t) packet->dts, input_timebase, output_timebase,
-                                   AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-    packet->pos = -1;
-    fix_packet_timestamps(packet);
+    rescale_packet_timestamps(packet);
 
     int ret = av_write_frame(output_ctx, packet);
     if (ret < 0) {
         int total_frames_read = (video_frames_written + audio_frames_written);
-        cerr << "FLVMuxer failed to write to packet " << total_frames_read << " to file."
-             << " PTS: " << packet->pts << " DTS: " << packet->dts << endl;
+        Logger::warn("FLVMuxer", "Failed to write packet {} to file. PTS: {} DTS: {}", total_frames_read, packet->pts,
+                     packet->dts);
         if (ret == AVERROR_EOF) {
             cerr << "Re-starting FLV muxer." << endl;
             release();
@@ -62,13 +54,11 @@ void FLVMuxer::send_packet(AVPacket *packet) {
         return;
     }
     if (packet->stream_index == video_stream_index) {
-        if (TRACE_LOG)
-            cout << "FLVMuxer writing video frame " << video_frames_written << ". DTS: " << packet->dts << endl;
+        Logger::trace("FLVMuxer", "Writing video frame {}. DTS: {}", video_frames_written, packet->dts);
         video_frames_written++;
     }
     if (packet->stream_index == audio_stream_index) {
-        if (TRACE_LOG)
-            cout << "FLVMuxer writing audio frame " << audio_frames_written << ". DTS: " << packet->dts << endl;
+        Logger::trace("FLVMuxer", "Writing audio frame {}. DTS: {}", audio_frames_written, packet->dts);
         audio_frames_written++;
     }
     packet->duration = prev_duration;
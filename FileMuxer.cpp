@@ -0,0 +1,64 @@
+#include "Muxer.h"
+
+FileMuxer::FileMuxer(const string &output_file, const string &format) {
+    this->output_file = output_file;
+    this->format = format;
+}
+
+void FileMuxer::init() {
+    if (did_init) return;
+
+    output_format = format.empty() ? av_guess_format(nullptr, output_file.c_str(), nullptr)
+                                   : av_guess_format(format.c_str(), nullptr, nullptr);
+    if (avformat_alloc_output_context2(&output_ctx, output_format, nullptr, output_file.c_str()) < 0) {
+        cerr << "(FileMuxer) Failed to create output context for " << output_file << "." << endl;
+        return;
+    }
+
+    if (!(output_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&output_ctx->pb, output_file.c_str(), AVIO_FLAG_WRITE) < 0) {
+            cerr << "(FileMuxer) Failed to open output file " << output_file << "." << endl;
+            return;
+        }
+    }
+    did_init = true;
+}
+
+void FileMuxer::send_packet(AVPacket *packet) {
+    if (!did_init)
+        init();
+
+    long prev_duration = packet->duration;
+    long prev_pts = packet->pts;
+    long prev_dts = packet->dts;
+    long prev_pos = packet->pos;
+
+    rescale_packet_timestamps(packet);
+
+    if (av_write_frame(output_ctx, packet) < 0) {
+        int total_frames_read = (video_frames_written + audio_frames_written);
+        cerr << "(FileMuxer) Failed to write packet " << total_frames_read << " to " << output_file << "."
+             << " PTS: " << packet->pts << " DTS: " << packet->dts << endl;
+    } else if (packet->stream_index == video_stream_index) {
+        video_frames_written++;
+    } else if (packet->stream_index == audio_stream_index) {
+        audio_frames_written++;
+    }
+    packet->duration = prev_duration;
+    packet->pts = prev_pts;
+    packet->dts = prev_dts;
+    packet->pos = prev_pos;
+}
+
+void FileMuxer::release() {
+    if (!output_ctx) return;
+    if (did_init && !should_add_streams) {
+        av_write_trailer(output_ctx);
+    }
+    if (!(output_ctx->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&output_ctx->pb);
+    avformat_free_context(output_ctx);
+    output_ctx = nullptr;
+    Muxer::release();
+    did_init = false;
+}
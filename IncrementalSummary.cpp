@@ -0,0 +1,351 @@
+#include "IncrementalSummary.h"
+#include "SummaryGenerator.h"
+#include "QosScheduler.h"
+
+#include <fstream>
+#include <ctime>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+static const AVRational MILLISECONDS = {1, 1000};
+static const int AVIO_BUFFER_SIZE = 64 * 1024;
+
+static long now_ms() {
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+static int write_to_fd(void *opaque, uint8_t *buffer, int size) {
+    int fd = *(int *) opaque;
+    int written = 0;
+    while (written < size) {
+        ssize_t ret = write(fd, buffer + written, size - written);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return AVERROR(errno);
+        }
+        written += (int) ret;
+    }
+    return written;
+}
+
+SummaryWriter::~SummaryWriter() {
+    stop();
+}
+
+void SummaryWriter::start() {
+    stopping = false;
+    worker = thread(&SummaryWriter::run, this);
+}
+
+void SummaryWriter::stop() {
+    stopping = true;
+    wake_up.notify_all();
+    if (worker.joinable())
+        worker.join();
+    lock_guard<mutex> lock(queue_mutex);
+    for (SummaryWindow &window : queue) {
+        free_packets(window);
+    }
+    queue.clear();
+}
+
+void SummaryWriter::append(SummaryWindow window) {
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if (queue.size() < MAX_PENDING_WINDOWS) {
+            queue.push_back(std::move(window));
+            window.packets.clear();
+        }
+    }
+    if (!window.packets.empty()) {
+        cerr << "(SummaryWriter) Too many windows pending, dropping " << window.packets.size() << " packets of "
+             << window.basename << endl;
+        free_packets(window);
+        return;
+    }
+    wake_up.notify_one();
+}
+
+string SummaryWriter::summary_path(const string &basename, long timestamp_ms) {
+    time_t time = timestamp_ms / 1000;
+    struct tm local_time{};
+    localtime_r(&time, &local_time);
+    char date[16];
+    strftime(date, sizeof(date), "%Y-%m-%d", &local_time);
+    return basename + "_summary_" + date + ".ts";
+}
+
+void SummaryWriter::run() {
+    // Summaries are never urgent, recording is.
+    QosThread qos_thread(QosClass::BACKGROUND);
+
+    while (!stopping) {
+        SummaryWindow window;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            if (queue.empty()) {
+                wake_up.wait(lock, [this] { return stopping || !queue.empty(); });
+                continue;
+            }
+            window = std::move(queue.front());
+            queue.pop_front();
+        }
+        QosScheduler::throttle();
+        write(window);
+        free_packets(window);
+    }
+}
+
+void SummaryWriter::write(SummaryWindow &window) {
+    if (window.packets.empty() || !window.video_params) return;
+
+    string path = summary_path(window.basename, window.start_time_ms);
+    long offset_ms = summary_offset_ms(path);
+    AVFormatContext *output_ctx = nullptr;
+    AVIOContext *avio_ctx = nullptr;
+    int fd = -1;
+    long duration_ms = 0;
+
+    try {
+        fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd < 0) {
+            cerr << "(SummaryWriter) Failed to open " << path << ": " << strerror(errno) << endl;
+            throw errno;
+        }
+        if (avformat_alloc_output_context2(&output_ctx, nullptr, "mpegts", path.c_str()) < 0) {
+            cerr << "(SummaryWriter) Failed to create output context." << endl;
+            throw -1;
+        }
+        auto *buffer = (unsigned char *) av_malloc(AVIO_BUFFER_SIZE);
+        avio_ctx = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 1, &fd, nullptr, write_to_fd, nullptr);
+        avio_ctx->seekable = 0;
+        output_ctx->pb = avio_ctx;
+        output_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+        AVStream *output_stream = avformat_new_stream(output_ctx, nullptr);
+        avcodec_parameters_copy(output_stream->codecpar, window.video_params.get());
+        output_stream->codecpar->codec_tag = 0;
+        if (avformat_write_header(output_ctx, nullptr) < 0) {
+            cerr << "(SummaryWriter) Failed to write header to " << path << endl;
+            throw -1;
+        }
+
+        AVRational output_timebase = output_stream->time_base;
+        int64_t first_dts = window.packets.front()->dts;
+        int64_t output_offset = av_rescale_q(offset_ms, MILLISECONDS, output_timebase);
+        int64_t last_dts = AV_NOPTS_VALUE;
+        for (AVPacket *packet : window.packets) {
+            if (packet->dts == AV_NOPTS_VALUE) continue;
+            // Reconnects restart the camera's timestamps, keep the window monotonic anyway.
+            if (last_dts != AV_NOPTS_VALUE && packet->dts <= last_dts) continue;
+            last_dts = packet->dts;
+            int64_t cts = packet->pts != AV_NOPTS_VALUE ? packet->pts - packet->dts : 0;
+            packet->stream_index = 0;
+            packet->dts = output_offset + av_rescale_q(packet->dts - first_dts, window.time_base, output_timebase);
+            packet->pts = packet->dts + av_rescale_q(cts, window.time_base, output_timebase);
+            packet->duration = av_rescale_q(packet->duration, window.time_base, output_timebase);
+            packet->pos = -1;
+            if (av_write_frame(output_ctx, packet) < 0) {
+                cerr << "(SummaryWriter) Failed to write packet to " << path << endl;
+                break;
+            }
+            duration_ms = av_rescale_q(packet->dts + packet->duration - output_offset, output_timebase, MILLISECONDS);
+        }
+        av_write_trailer(output_ctx);
+        avio_flush(avio_ctx);
+        fdatasync(fd);
+    } catch (int e) {
+    }
+
+    if (avio_ctx) {
+        av_freep(&avio_ctx->buffer);
+        avio_context_free(&avio_ctx);
+    }
+    if (output_ctx) {
+        output_ctx->pb = nullptr;
+        avformat_free_context(output_ctx);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (duration_ms <= 0) return;
+
+    ofstream index_file(path.substr(0, path.size() - 3) + ".txt", ios_base::app);
+    index_file << window.start_time_ms << " " << offset_ms << " " << duration_ms << endl;
+    summary_offsets_ms[path] = offset_ms + duration_ms;
+    cout << "(SummaryWriter) Appended " << duration_ms << " ms of motion to " << path << endl;
+}
+
+long SummaryWriter::summary_offset_ms(const string &summary_path) {
+    auto offset = summary_offsets_ms.find(summary_path);
+    if (offset != summary_offsets_ms.end()) return offset->second;
+
+    // Continue after the last window written before a restart.
+    long end_ms = 0;
+    ifstream index_file(summary_path.substr(0, summary_path.size() - 3) + ".txt");
+    long start_time_ms, offset_ms, duration_ms;
+    while (index_file >> start_time_ms >> offset_ms >> duration_ms) {
+        end_ms = max(end_ms, offset_ms + duration_ms);
+    }
+    summary_offsets_ms[summary_path] = end_ms;
+    return end_ms;
+}
+
+void SummaryWriter::free_packets(SummaryWindow &window) {
+    for (AVPacket *packet : window.packets) {
+        av_packet_free(&packet);
+    }
+    window.packets.clear();
+}
+
+SummaryMuxer::SummaryMuxer(const string &basename, SummaryWriter *writer) : basename(basename), writer(writer) {}
+
+SummaryMuxer::~SummaryMuxer() {
+    clear();
+}
+
+void SummaryMuxer::init() {
+    did_init = true;
+}
+
+void SummaryMuxer::add_stream(AVStream *input_stream, AVCodec *input_codec, bool write_header) {
+    should_add_streams = false;
+    if (input_codec->type != AVMEDIA_TYPE_VIDEO) return;
+    video_input_index = input_stream->index;
+    video_time_base = input_stream->time_base;
+    video_params = shared_ptr<AVCodecParameters>(avcodec_parameters_alloc(), [](AVCodecParameters *params) {
+        avcodec_parameters_free(&params);
+    });
+    avcodec_parameters_copy(video_params.get(), input_stream->codecpar);
+}
+
+void SummaryMuxer::send_packet(AVPacket *packet) {
+    if (packet->stream_index != video_input_index) return;
+
+    // The camera reconnected without the muxers being released, and its timestamps started over.
+    if (packet->dts != AV_NOPTS_VALUE && last_dts != AV_NOPTS_VALUE && packet->dts < last_dts) {
+        close_window();
+        clear();
+    }
+    if (packet->dts != AV_NOPTS_VALUE) {
+        last_dts = packet->dts;
+    }
+
+    long now = now_ms();
+    long start_ms = motion_start_ms;
+    if (start_ms > handled_motion_ms) {
+        handled_motion_ms = start_ms;
+        if (window_end_ms == -1) {
+            open_window(start_ms);
+        }
+        window_end_ms = max(window_end_ms, start_ms + MotionWindowCursor::BUFFER_TIME_AFTER_MS);
+    }
+    // The window runs until BUFFER_TIME_AFTER_MS after the last packet of the event.
+    if (window_end_ms != -1 && motion_active) {
+        window_end_ms = max(window_end_ms, now + MotionWindowCursor::BUFFER_TIME_AFTER_MS);
+    }
+
+    bool is_key_frame = packet->flags & AV_PKT_FLAG_KEY;
+    if (window_end_ms != -1 && now > window_end_ms) {
+        close_window();
+    }
+
+    if (window_end_ms == -1) {
+        if (recent_packets.empty() && !is_key_frame) return;
+        if (is_key_frame) {
+            trim_recent_packets(now);
+        }
+        recent_packets.push_back({now, av_packet_clone(packet)});
+        return;
+    }
+
+    if (is_key_frame && !window_packets.empty() && now - window_packets.front().time_ms > MAX_WINDOW_MS) {
+        long end_ms = window_end_ms;
+        close_window();
+        window_end_ms = end_ms;
+    }
+    window_packets.push_back({now, av_packet_clone(packet)});
+}
+
+void SummaryMuxer::on_motion_start(long start_ms) {
+    motion_start_ms = start_ms;
+    motion_active = true;
+}
+
+void SummaryMuxer::on_motion_end(const MotionEvent &event) {
+    motion_active = false;
+}
+
+void SummaryMuxer::open_window(long timestamp_ms) {
+    // Start at the last keyframe before the buffer time, so the window can be decoded on its own.
+    long window_start_ms = timestamp_ms - MotionWindowCursor::BUFFER_TIME_BEFORE_MS;
+    size_t first = 0;
+    for (size_t i = 0; i < recent_packets.size(); i++) {
+        if (recent_packets[i].time_ms > window_start_ms) break;
+        if (recent_packets[i].packet->flags & AV_PKT_FLAG_KEY) first = i;
+    }
+    for (size_t i = 0; i < recent_packets.size(); i++) {
+        if (i < first) {
+            av_packet_free(&recent_packets[i].packet);
+        } else {
+            window_packets.push_back(recent_packets[i]);
+        }
+    }
+    recent_packets.clear();
+}
+
+void SummaryMuxer::close_window() {
+    window_end_ms = -1;
+    if (window_packets.empty()) return;
+    SummaryWindow window;
+    window.basename = basename;
+    window.video_params = video_params;
+    window.time_base = video_time_base;
+    window.start_time_ms = window_packets.front().time_ms;
+    for (TimedPacket &timed_packet : window_packets) {
+        window.packets.push_back(timed_packet.packet);
+    }
+    window_packets.clear();
+    writer->append(std::move(window));
+}
+
+void SummaryMuxer::trim_recent_packets(long now_ms) {
+    // Keep everything from the last keyframe that is older than the buffer time.
+    long cutoff_ms = now_ms - MotionWindowCursor::BUFFER_TIME_BEFORE_MS;
+    size_t first = 0;
+    for (size_t i = 1; i < recent_packets.size(); i++) {
+        if (recent_packets[i].time_ms > cutoff_ms) break;
+        if (recent_packets[i].packet->flags & AV_PKT_FLAG_KEY) first = i;
+    }
+    for (size_t i = 0; i < first; i++) {
+        av_packet_free(&recent_packets.front().packet);
+        recent_packets.pop_front();
+    }
+}
+
+void SummaryMuxer::clear() {
+    for (TimedPacket &timed_packet : recent_packets) {
+        av_packet_free(&timed_packet.packet);
+    }
+    recent_packets.clear();
+    for (TimedPacket &timed_packet : window_packets) {
+        av_packet_free(&timed_packet.packet);
+    }
+    window_packets.clear();
+    window_end_ms = -1;
+}
+
+void SummaryMuxer::release() {
+    // The camera is reconnecting or shutting down, the window so far is still worth keeping.
+    close_window();
+    clear();
+    video_input_index = -1;
+    last_dts = AV_NOPTS_VALUE;
+    Muxer::release();
+    did_init = false;
+}
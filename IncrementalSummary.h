@@ -0,0 +1,130 @@
+
+#ifndef HOMECAMRECORDER_INCREMENTALSUMMARY_H
+#define HOMECAMRECORDER_INCREMENTALSUMMARY_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Muxer.h"
+#include "MotionDetector.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+using namespace std;
+
+/**
+ * The video packets of one motion window, copied out of a camera's stream.
+ */
+struct SummaryWindow {
+    string basename;
+    shared_ptr<AVCodecParameters> video_params;
+    AVRational time_base{};
+    // Wall clock time of the first packet.
+    long start_time_ms{};
+    vector<AVPacket *> packets;
+};
+
+/**
+ * Appends motion windows to a daily summary per camera, <basename>_summary_<YYYY-MM-DD>.ts, on a low priority
+ * background thread. MPEG-TS can be appended to by writing another header and more packets, so a summary is
+ * complete after every window and never has to be rewritten.
+ *
+ * Next to each summary, <basename>_summary_<YYYY-MM-DD>.txt has one line per window:
+ *
+ *   <window start ms> <offset in summary ms> <duration ms>
+ *
+ * which maps the summary timeline back to wall clock time and gives the offset to continue from after a restart.
+ */
+class SummaryWriter {
+public:
+    SummaryWriter() = default;
+    ~SummaryWriter();
+
+    void start();
+    void stop();
+
+    // Takes ownership of the window's packets.
+    void append(SummaryWindow window);
+
+    static string summary_path(const string &basename, long timestamp_ms);
+
+private:
+    // Windows waiting to be written are dropped past this, the camera threads never wait for the writer.
+    static const size_t MAX_PENDING_WINDOWS = 32;
+
+    mutex queue_mutex;
+    condition_variable wake_up;
+    deque<SummaryWindow> queue;
+    // Summary path -> where the next window starts in the summary's timeline.
+    map<string, long> summary_offsets_ms;
+    atomic<bool> stopping{false};
+    thread worker;
+
+    void run();
+    void write(SummaryWindow &window);
+    long summary_offset_ms(const string &summary_path);
+    static void free_packets(SummaryWindow &window);
+};
+
+/**
+ * Keeps the last few seconds of a camera's video in memory and, when the motion detector reports motion, collects
+ * the packets from MotionWindowCursor::BUFFER_TIME_BEFORE_MS before the event starts until
+ * MotionWindowCursor::BUFFER_TIME_AFTER_MS after it ends. Closed windows are handed to the SummaryWriter. Packets are
+ * reference counted, so holding them costs no copies.
+ *
+ * The motion callbacks may be called from the thread of the camera's analysis stream. They only record the event,
+ * which the camera thread picks up with the next packet.
+ */
+class SummaryMuxer : public Muxer, public MotionListener {
+public:
+    SummaryMuxer(const string &basename, SummaryWriter *writer);
+    ~SummaryMuxer();
+
+    void send_packet(AVPacket *packet) override;
+    void release() override;
+    void init() override;
+    void add_stream(AVStream *input_stream, AVCodec *input_codec, bool write_header) override;
+    void on_motion_start(long start_ms) override;
+    void on_motion_end(const MotionEvent &event) override;
+
+private:
+    // Long motion is handed to the writer in pieces of about this length, at a keyframe, to bound memory.
+    const long MAX_WINDOW_MS = 60000;
+
+    struct TimedPacket {
+        long time_ms;
+        AVPacket *packet;
+    };
+
+    string basename;
+    SummaryWriter *writer;
+    int video_input_index{-1};
+    shared_ptr<AVCodecParameters> video_params;
+    AVRational video_time_base{};
+
+    // Recent packets, starting at a keyframe, while there's no motion.
+    deque<TimedPacket> recent_packets;
+    // Packets of the open motion window.
+    vector<TimedPacket> window_packets;
+    long window_end_ms{-1};
+    int64_t last_dts{AV_NOPTS_VALUE};
+    atomic<long> motion_start_ms{-1};
+    atomic<bool> motion_active{false};
+    long handled_motion_ms{-1};
+
+    void open_window(long timestamp_ms);
+    void close_window();
+    void trim_recent_packets(long now_ms);
+    void clear();
+};
+
+#endif //HOMECAMRECORDER_INCREMENTALSUMMARY_H
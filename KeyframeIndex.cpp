@@ -0,0 +1,60 @@
+#include "KeyframeIndex.h"
+#include "SegmentPaths.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+KeyframeIndex::~KeyframeIndex() {
+    close();
+}
+
+bool KeyframeIndex::create(const string &segment_path) {
+    close();
+    string index_path = path_for(segment_path);
+    fd = open(index_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        cerr << "(KeyframeIndex) Failed to create " << index_path << endl;
+        return false;
+    }
+    return true;
+}
+
+void KeyframeIndex::add(long offset, long time_ms) {
+    if (fd < 0) return;
+    char line[64];
+    int length = snprintf(line, sizeof(line), "%ld %ld\n", offset, time_ms);
+    // One line per GOP lands in the page cache. It goes to disk with the segment.
+    if (write(fd, line, length) != length) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+void KeyframeIndex::close() {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+vector<KeyframeIndexEntry> KeyframeIndex::read(const string &segment_path) {
+    vector<KeyframeIndexEntry> entries;
+    ifstream index_file(path_for(segment_path));
+    string line;
+    while (getline(index_file, line)) {
+        // A torn last line ends the index.
+        if (index_file.eof()) break;
+        stringstream fields(line);
+        KeyframeIndexEntry entry;
+        if (!(fields >> entry.offset >> entry.time_ms)) break;
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+string KeyframeIndex::path_for(const string &segment_path) {
+    return segment_sibling_path(segment_path, "_keyframes.txt");
+}
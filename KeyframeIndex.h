@@ -0,0 +1,46 @@
+
+#ifndef HOMECAMRECORDER_KEYFRAMEINDEX_H
+#define HOMECAMRECORDER_KEYFRAMEINDEX_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct KeyframeIndexEntry {
+    // Where the keyframe starts in the segment. Only container overhead (a PAT/PMT, an FLV tag header) can come
+    // between the offset and the frame.
+    long offset{};
+    // Wall clock time the keyframe was recorded.
+    long time_ms{};
+};
+
+/**
+ * Byte offset of every keyframe of a segment, so readers can jump from keyframe to keyframe without demuxing what's
+ * between them. RotatingFileMuxer writes it next to the segment as <basename>_<number>_keyframes.txt with one
+ * "<offset> <time ms>" line per keyframe.
+ *
+ * Only byte seekable formats (MPEG-TS, FLV) are indexed. Readers treat a missing index, or one cut short by a crash,
+ * as covering nothing past its last line.
+ */
+class KeyframeIndex {
+public:
+    KeyframeIndex() = default;
+    ~KeyframeIndex();
+
+    // Starts the index of a new segment, replacing an old index of the same name.
+    bool create(const string &segment_path);
+    void add(long offset, long time_ms);
+    void close();
+
+    // Entries in file order. Empty if the segment has no index.
+    static vector<KeyframeIndexEntry> read(const string &segment_path);
+
+    // <basename>_<number>.<extension> -> <basename>_<number>_keyframes.txt
+    static string path_for(const string &segment_path);
+
+private:
+    int fd{-1};
+};
+
+#endif //HOMECAMRECORDER_KEYFRAMEINDEX_H
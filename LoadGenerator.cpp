@@ -0,0 +1,300 @@
+#include "LoadGenerator.h"
+#include "TeeMuxer.h"
+
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+#include "AVError.h"
+
+void LatencyHistogram::record(long micros) {
+    counts[bucket_for(micros)].fetch_add(1, memory_order_relaxed);
+}
+
+long LatencyHistogram::count() const {
+    long total = 0;
+    for (const auto &bucket_count : counts)
+        total += bucket_count.load(memory_order_relaxed);
+    return total;
+}
+
+long LatencyHistogram::percentile(double fraction) const {
+    long total = count();
+    if (total == 0) return 0;
+    long target = (long) (fraction * (double) total);
+    long seen = 0;
+    for (int bucket = 0; bucket < BUCKETS; bucket++) {
+        seen += counts[bucket].load(memory_order_relaxed);
+        if (seen > target) return bucket_value(bucket);
+    }
+    return bucket_value(BUCKETS - 1);
+}
+
+int LatencyHistogram::bucket_for(long micros) {
+    if (micros < 8) return (int) max(0L, micros);
+    int exponent = 63 - __builtin_clzl((unsigned long) micros);
+    if (exponent > 33) return BUCKETS - 1;
+    int sub_bucket = (int) ((micros >> (exponent - 3)) - 8);
+    return exponent * 8 + sub_bucket;
+}
+
+long LatencyHistogram::bucket_value(int bucket) {
+    if (bucket < 8) return bucket;
+    int exponent = bucket / 8;
+    long sub_bucket = bucket % 8;
+    // Middle of the bucket.
+    return ((8 + sub_bucket) << (exponent - 3)) + ((1L << (exponent - 3)) / 2);
+}
+
+void CameraLoadStats::record_packet(int size, time_point<steady_clock> arrival_time) {
+    auto now = steady_clock::now();
+    long packet_count = ++packets;
+    bytes += size;
+    latency.record(duration_cast<microseconds>(now - arrival_time).count());
+    record_lateness(duration_cast<milliseconds>(now - arrival_time));
+    if ((packet_count & 0xFF) == 0) {
+        timespec cpu_time{};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time);
+        cpu_ns = cpu_time.tv_sec * 1000000000L + cpu_time.tv_nsec;
+    }
+}
+
+void CameraLoadStats::record_lateness(milliseconds lateness) {
+    if (lateness.count() <= BEHIND_THRESHOLD_MS) return;
+    late_packets++;
+    long expected = -1;
+    long since_start = duration_cast<milliseconds>(steady_clock::now() - test_start_time).count();
+    first_behind_ms.compare_exchange_strong(expected, since_start);
+}
+
+time_point<steady_clock> ReplayClock::wait(const AVPacket *packet, AVRational time_base) {
+    int64_t timestamp = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if (timestamp == AV_NOPTS_VALUE) return steady_clock::now();
+    int64_t timestamp_us = av_rescale_q(timestamp, time_base, AV_TIME_BASE_Q);
+    if (first_dts_us == AV_NOPTS_VALUE) {
+        first_dts_us = timestamp_us;
+        start_time = steady_clock::now();
+    }
+    auto due_time = start_time + microseconds(timestamp_us - first_dts_us);
+    this_thread::sleep_until(due_time);
+    return due_time;
+}
+
+RtspStandIn::RtspStandIn(string input_file, string url, shared_ptr<CameraLoadStats> stats) :
+    input_file(std::move(input_file)), url(std::move(url)), stats(std::move(stats)) {}
+
+void RtspStandIn::start() {
+    worker = thread(&RtspStandIn::run, this);
+}
+
+void RtspStandIn::stop() {
+    stopping = true;
+    if (worker.joinable())
+        worker.join();
+}
+
+int RtspStandIn::interrupt_callback(void *opaque) {
+    return ((RtspStandIn *) opaque)->stopping ? 1 : 0;
+}
+
+void RtspStandIn::run() {
+    while (!stopping) {
+        if (!publish_once()) {
+            // The camera side is not listening yet, or is restarting.
+            this_thread::sleep_for(milliseconds(200));
+        }
+    }
+}
+
+bool RtspStandIn::publish_once() {
+    AVFormatContext *input_ctx = nullptr;
+    AVFormatContext *output_ctx = nullptr;
+    AVPacket *packet = av_packet_alloc();
+    bool published = false;
+    int ret;
+
+    try {
+        ret = avformat_open_input(&input_ctx, input_file.c_str(), nullptr, nullptr);
+        if (ret < 0) {
+            cerr << "(RtspStandIn) Failed to open " << input_file << ". Error = " << av_err2str(ret) << endl;
+            throw ret;
+        }
+        ret = avformat_find_stream_info(input_ctx, nullptr);
+        if (ret < 0) throw ret;
+
+        ret = avformat_alloc_output_context2(&output_ctx, nullptr, "rtsp", url.c_str());
+        if (ret < 0) throw ret;
+        output_ctx->interrupt_callback = {interrupt_callback, this};
+        for (unsigned int i = 0; i < input_ctx->nb_streams; i++) {
+            AVStream *output_stream = avformat_new_stream(output_ctx, nullptr);
+            avcodec_parameters_copy(output_stream->codecpar, input_ctx->streams[i]->codecpar);
+            output_stream->codecpar->codec_tag = 0;
+            output_stream->time_base = input_ctx->streams[i]->time_base;
+        }
+
+        AVDictionary *options = nullptr;
+        av_dict_set(&options, "rtsp_transport", "tcp", 0);
+        ret = avformat_write_header(output_ctx, &options);
+        av_dict_free(&options);
+        if (ret < 0) throw ret;
+
+        ReplayClock clock;
+        while (!stopping && av_read_frame(input_ctx, packet) == 0) {
+            AVStream *input_stream = input_ctx->streams[packet->stream_index];
+            auto due_time = clock.wait(packet, input_stream->time_base);
+            // TCP backpressure from a camera that can't keep up shows up here as lateness.
+            stats->record_lateness(duration_cast<milliseconds>(steady_clock::now() - due_time));
+            av_packet_rescale_ts(packet, input_stream->time_base,
+                                 output_ctx->streams[packet->stream_index]->time_base);
+            packet->pos = -1;
+            ret = av_interleaved_write_frame(output_ctx, packet);
+            av_packet_unref(packet);
+            if (ret < 0) break;
+        }
+        av_write_trailer(output_ctx);
+        published = true;
+    } catch (int e) {
+    }
+
+    av_packet_free(&packet);
+    if (output_ctx)
+        avformat_free_context(output_ctx);
+    avformat_close_input(&input_ctx);
+    return published;
+}
+
+LoadGenerator::LoadGenerator(LoadGeneratorOptions options) : options(std::move(options)) {}
+
+LoadGenerator::~LoadGenerator() {
+    stop();
+}
+
+bool LoadGenerator::parse_args(int argc, char *argv[], int replay_arg_index, LoadGeneratorOptions &options) {
+    if (replay_arg_index + 1 >= argc) return false;
+    options.camera_count = atoi(argv[replay_arg_index + 1]);
+    if (options.camera_count <= 0) return false;
+
+    for (int i = replay_arg_index + 2; i < argc; i++) {
+        if (strcmp(argv[i], "--realtime") == 0) {
+            options.realtime = true;
+        } else if (strcmp(argv[i], "--rtsp") == 0) {
+            options.rtsp = true;
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            options.duration_sec = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ramp") == 0 && i + 1 < argc) {
+            options.ramp_interval_sec = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output-dir") == 0 && i + 1 < argc) {
+            options.output_dir = argv[++i];
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            return false;
+        } else {
+            options.input_files.emplace_back(argv[i]);
+        }
+    }
+    return !options.input_files.empty();
+}
+
+vector<shared_ptr<CameraSource>> LoadGenerator::create_cameras() {
+    test_start_time = steady_clock::now();
+    std::filesystem::create_directories(options.output_dir);
+    if (!relay_sink.start()) {
+        cerr << "(LoadGenerator) Failed to start the relay sink." << endl;
+    }
+
+    vector<shared_ptr<CameraSource>> cameras;
+    for (int i = 0; i < options.camera_count; i++) {
+        string basename = "replay_" + to_string(i);
+        const string &input_file = options.input_files[i % options.input_files.size()];
+        auto camera_stats = make_shared<CameraLoadStats>(test_start_time);
+        stats.push_back(camera_stats);
+
+        // The recording and the relay are both FLV, so they share one muxer.
+        vector<Muxer *> muxers;
+        muxers.push_back(new TeeMuxer("flv", {new SegmentSink(options.output_dir + "/" + basename, "flv"),
+                                              new StreamSink(relay_sink.url())}));
+
+        string url = input_file;
+        if (options.rtsp) {
+            url = "rtsp://127.0.0.1:" + to_string(18554 + i) + "/" + basename;
+            stand_ins.push_back(make_unique<RtspStandIn>(input_file, url, camera_stats));
+        }
+
+        auto camera = make_shared<CameraSource>("Replay " + to_string(i), url, muxers, options.output_dir, basename, 30000);
+        camera->load_stats = camera_stats;
+        if (options.rtsp) {
+            camera->input_options = {{"rtsp_flags", "listen"}, {"rtsp_transport", "tcp"}};
+        } else {
+            camera->input_options.clear();
+            camera->pace_realtime = options.realtime;
+        }
+        cameras.push_back(camera);
+    }
+    return cameras;
+}
+
+void LoadGenerator::start() {
+    for (auto &stand_in : stand_ins)
+        stand_in->start();
+}
+
+void LoadGenerator::stop() {
+    for (auto &stand_in : stand_ins)
+        stand_in->stop();
+    stand_ins.clear();
+    relay_sink.stop();
+}
+
+milliseconds LoadGenerator::start_delay(int camera_index) const {
+    return seconds((long) options.ramp_interval_sec * camera_index);
+}
+
+void LoadGenerator::report(const vector<shared_ptr<CameraSource>> &cameras) const {
+    double elapsed_sec = (double) duration_cast<milliseconds>(steady_clock::now() - test_start_time).count() / 1000.0;
+    long total_packets = 0;
+    double total_cpu_percent = 0;
+    long first_behind_ms = -1;
+
+    cout << fixed << setprecision(1);
+    cout << "(LoadGenerator) " << cameras.size() << " cameras, "
+         << (options.rtsp ? "rtsp" : (options.realtime ? "real time" : "as fast as possible"))
+         << ", " << elapsed_sec << " s" << endl;
+    for (size_t i = 0; i < cameras.size(); i++) {
+        const CameraLoadStats &camera_stats = *stats[i];
+        double running_sec = max(0.001, elapsed_sec - (double) start_delay((int) i).count() / 1000.0);
+        double cpu_percent = 100.0 * ((double) camera_stats.cpu_ns / 1e9) / running_sec;
+        total_packets += camera_stats.packets;
+        total_cpu_percent += cpu_percent;
+        if (camera_stats.first_behind_ms >= 0 &&
+            (first_behind_ms < 0 || camera_stats.first_behind_ms < first_behind_ms)) {
+            first_behind_ms = camera_stats.first_behind_ms;
+        }
+        cout << "(" << cameras[i]->name << ") packets/s: " << (double) camera_stats.packets / running_sec
+             << " Mbit/s: " << (double) camera_stats.bytes * 8 / 1e6 / running_sec
+             << " CPU: " << cpu_percent << "%"
+             << " latency us p50: " << camera_stats.latency.percentile(0.5)
+             << " p90: " << camera_stats.latency.percentile(0.9)
+             << " p99: " << camera_stats.latency.percentile(0.99)
+             << " p99.9: " << camera_stats.latency.percentile(0.999)
+             << " late packets: " << camera_stats.late_packets << endl;
+    }
+
+    cout << "(LoadGenerator) Sustained packets/s: " << (double) total_packets / elapsed_sec
+         << " CPU per camera: " << total_cpu_percent / (double) max<size_t>(1, cameras.size()) << "%" << endl;
+    if (first_behind_ms < 0) {
+        cout << "(LoadGenerator) No camera fell behind." << endl;
+    } else {
+        long cameras_running = (long) cameras.size();
+        if (options.ramp_interval_sec > 0) {
+            cameras_running = min(cameras_running, first_behind_ms / (options.ramp_interval_sec * 1000L) + 1);
+        }
+        cout << "(LoadGenerator) Packets started falling behind after " << (double) first_behind_ms / 1000.0
+             << " s with " << cameras_running << " cameras running." << endl;
+    }
+}
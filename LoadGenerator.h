@@ -0,0 +1,140 @@
+
+#ifndef HOMECAMRECORDER_LOADGENERATOR_H
+#define HOMECAMRECORDER_LOADGENERATOR_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "CameraSource.h"
+#include "SocketSink.h"
+
+using namespace std;
+using namespace std::chrono;
+
+/**
+ * Histogram of latencies in microseconds with 8 buckets per power of two, so percentiles are within ~12%.
+ */
+class LatencyHistogram {
+public:
+    void record(long micros);
+    long percentile(double fraction) const;
+    long count() const;
+
+private:
+    static const int BUCKETS = 8 * 34;
+    atomic<long> counts[BUCKETS]{};
+
+    static int bucket_for(long micros);
+    static long bucket_value(int bucket);
+};
+
+/**
+ * Counters for one replayed camera. Written by the camera thread and read by the report.
+ */
+class CameraLoadStats {
+public:
+    // A packet that is this late relative to its schedule means the pipeline is not keeping up.
+    static const long BEHIND_THRESHOLD_MS = 500;
+
+    explicit CameraLoadStats(time_point<steady_clock> test_start_time) : test_start_time(test_start_time) {}
+
+    void record_packet(int size, time_point<steady_clock> arrival_time);
+    void record_lateness(milliseconds lateness);
+
+    const time_point<steady_clock> test_start_time;
+    atomic<long> packets{0};
+    atomic<long> bytes{0};
+    atomic<long> late_packets{0};
+    atomic<long> cpu_ns{0};
+    // Milliseconds since the start of the test when this camera first fell behind, or -1.
+    atomic<long> first_behind_ms{-1};
+    LatencyHistogram latency;
+};
+
+/**
+ * Paces file input at real time: packets are released when the wallclock catches up with their timestamp.
+ */
+class ReplayClock {
+public:
+    // Sleeps until the packet is due and returns the time it was due.
+    time_point<steady_clock> wait(const AVPacket *packet, AVRational time_base);
+
+private:
+    int64_t first_dts_us{AV_NOPTS_VALUE};
+    time_point<steady_clock> start_time{};
+};
+
+/**
+ * Stands in for a camera's RTSP server. The camera input listens (rtsp_flags=listen) and this publishes a recorded
+ * file to it over RTSP/RTP at real-time pace, so the replay exercises the same network read path as a live camera.
+ */
+class RtspStandIn {
+public:
+    RtspStandIn(string input_file, string url, shared_ptr<CameraLoadStats> stats);
+    void start();
+    void stop();
+
+private:
+    const string input_file;
+    const string url;
+    shared_ptr<CameraLoadStats> stats;
+    atomic<bool> stopping{false};
+    thread worker;
+
+    void run();
+    bool publish_once();
+    static int interrupt_callback(void *opaque);
+};
+
+struct LoadGeneratorOptions {
+    int camera_count{1};
+    vector<string> input_files;
+    bool realtime{false};
+    bool rtsp{false};
+    int duration_sec{60};
+    int ramp_interval_sec{0};
+    string output_dir{"/tmp/homecam_replay"};
+};
+
+/**
+ * Replays recorded FLV files through the full CameraSource -> muxers -> MotionDetector pipeline as N emulated
+ * cameras, to find out how many cameras one box can handle:
+ *
+ *   HomeCamRecorder --replay 8 [--realtime] [--rtsp] [--duration 120] [--ramp 10] [--output-dir DIR] a.flv b.flv
+ *
+ * Files are assigned to cameras round robin. With --ramp, one more camera is started every N seconds so the report
+ * can tell at which camera count packets start falling behind.
+ */
+class LoadGenerator {
+public:
+    explicit LoadGenerator(LoadGeneratorOptions options);
+    ~LoadGenerator();
+
+    // Parses the arguments following --replay. Returns false on a usage error.
+    static bool parse_args(int argc, char *argv[], int replay_arg_index, LoadGeneratorOptions &options);
+
+    vector<shared_ptr<CameraSource>> create_cameras();
+    void start();
+    void stop();
+
+    const LoadGeneratorOptions &get_options() const { return options; }
+    milliseconds start_delay(int camera_index) const;
+    void report(const vector<shared_ptr<CameraSource>> &cameras) const;
+
+private:
+    const LoadGeneratorOptions options;
+    time_point<steady_clock> test_start_time;
+    SocketSink relay_sink;
+    vector<unique_ptr<RtspStandIn>> stand_ins;
+    vector<shared_ptr<CameraLoadStats>> stats;
+};
+
+#endif //HOMECAMRECORDER_LOADGENERATOR_H
@@ -0,0 +1,256 @@
+#include "Logger.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+using namespace std::chrono;
+
+static const int BUFFER_CAPACITY = 1024;
+static const int WRITE_INTERVAL_MS = 50;
+// Lines from one call site and tag allowed per second. The rest are counted and reported once the second is over.
+static const int MAX_LINES_PER_SECOND = 20;
+
+/**
+ * Single producer (the logging thread), single consumer (the writer thread) ring of records.
+ */
+struct LogBuffer {
+    LogRecord records[BUFFER_CAPACITY];
+    atomic<uint32_t> head{0};
+    atomic<uint32_t> tail{0};
+    atomic<bool> thread_exited{false};
+};
+
+// Flags the buffer when its thread exits, so the writer can free it once drained.
+struct LogBufferHandle {
+    shared_ptr<LogBuffer> buffer;
+
+    ~LogBufferHandle() {
+        if (buffer) buffer->thread_exited = true;
+    }
+};
+
+struct RateLimit {
+    long window_start_us{};
+    int lines{};
+    long suppressed{};
+    LogLevel level{};
+    string tag;
+};
+
+atomic<LogLevel> Logger::minimum_level{LogLevel::INFO};
+
+static thread_local LogBufferHandle thread_buffer;
+static mutex buffers_mutex;
+static vector<shared_ptr<LogBuffer>> buffers;
+static atomic<bool> running{false};
+static atomic<bool> stopping{false};
+static mutex writer_mutex;
+static condition_variable wake_up;
+static thread writer;
+// Held while draining: by the writer, or by a thread logging before start().
+static mutex output_mutex;
+static map<pair<const char *, string>, RateLimit> rate_limits;
+static atomic<long> dropped_lines{0};
+static long dropped_reported{};
+
+static const char *level_name(LogLevel level) {
+    switch (level) {
+        case LogLevel::TRACE: return "TRACE";
+        case LogLevel::DEBUG: return "DEBUG";
+        case LogLevel::INFO: return "INFO";
+        case LogLevel::WARN: return "WARN";
+        case LogLevel::ERROR: return "ERROR";
+    }
+    return "";
+}
+
+static void append_prefix(string &line, long timestamp_us, LogLevel level, const string &tag) {
+    time_t seconds_since_epoch = timestamp_us / 1000000;
+    struct tm local_time{};
+    localtime_r(&seconds_since_epoch, &local_time);
+    char prefix[64];
+    size_t length = strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S", &local_time);
+    snprintf(prefix + length, sizeof(prefix) - length, ".%03ld %s ", (timestamp_us / 1000) % 1000, level_name(level));
+    line += prefix;
+    if (!tag.empty()) {
+        line += "(" + tag + ") ";
+    }
+}
+
+static void append_record(string &line, const LogRecord &record) {
+    string tag(record.tag, record.tag_length);
+    append_prefix(line, record.timestamp_us, record.level, tag);
+    int next_argument = 0;
+    for (const char *c = record.format; *c; c++) {
+        if (c[0] != '{' || c[1] != '}' || next_argument >= record.argument_count) {
+            line += *c;
+            continue;
+        }
+        const LogArgument &argument = record.arguments[next_argument++];
+        if (argument.type == LogArgument::INTEGER) {
+            line += to_string(argument.integer);
+        } else if (argument.type == LogArgument::REAL) {
+            char number[32];
+            snprintf(number, sizeof(number), "%g", argument.real);
+            line += number;
+        } else {
+            line.append(record.text + argument.text.offset, argument.text.length);
+        }
+        c++;
+    }
+    line += '\n';
+}
+
+static void write_all(int fd, const string &text) {
+    size_t written = 0;
+    while (written < text.size()) {
+        ssize_t count = write(fd, text.data() + written, text.size() - written);
+        if (count <= 0) return;
+        written += count;
+    }
+}
+
+// Formats the records (in time order) and writes them with one write per stream.
+static void write_records(vector<LogRecord> &records, long now) {
+    string out;
+    string err;
+    for (auto &item : rate_limits) {
+        RateLimit &limit = item.second;
+        if (limit.suppressed > 0 && now - limit.window_start_us >= 1000000) {
+            string &stream = limit.level >= LogLevel::WARN ? err : out;
+            append_prefix(stream, now, limit.level, limit.tag);
+            stream += "Suppressed " + to_string(limit.suppressed) + " lines like: " + item.first.first + "\n";
+            limit.suppressed = 0;
+        }
+    }
+    for (const LogRecord &record : records) {
+        RateLimit &limit = rate_limits[{record.format, string(record.tag, record.tag_length)}];
+        if (record.timestamp_us - limit.window_start_us >= 1000000) {
+            limit.window_start_us = record.timestamp_us;
+            limit.lines = 0;
+        }
+        if (++limit.lines > MAX_LINES_PER_SECOND) {
+            limit.suppressed++;
+            limit.level = record.level;
+            limit.tag = string(record.tag, record.tag_length);
+            continue;
+        }
+        append_record(record.level >= LogLevel::WARN ? err : out, record);
+    }
+    write_all(STDOUT_FILENO, out);
+    write_all(STDERR_FILENO, err);
+}
+
+static void drain() {
+    // Also keeps two threads logging before start() from consuming the same ring.
+    lock_guard<mutex> lock(output_mutex);
+    vector<shared_ptr<LogBuffer>> snapshot;
+    {
+        lock_guard<mutex> lock(buffers_mutex);
+        snapshot = buffers;
+    }
+    vector<LogRecord> records;
+    for (const shared_ptr<LogBuffer> &buffer : snapshot) {
+        uint32_t tail = buffer->tail.load(memory_order_relaxed);
+        uint32_t head = buffer->head.load(memory_order_acquire);
+        for (; tail != head; tail++) {
+            records.push_back(buffer->records[tail % BUFFER_CAPACITY]);
+        }
+        buffer->tail.store(tail, memory_order_release);
+    }
+    stable_sort(records.begin(), records.end(), [](const LogRecord &a, const LogRecord &b) {
+        return a.timestamp_us < b.timestamp_us;
+    });
+
+    long now = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+    long dropped = dropped_lines.load(memory_order_relaxed);
+    if (dropped > dropped_reported) {
+        string line;
+        append_prefix(line, now, LogLevel::WARN, "Logger");
+        line += "Dropped " + to_string(dropped - dropped_reported) + " lines, the log buffers were full.\n";
+        write_all(STDERR_FILENO, line);
+        dropped_reported = dropped;
+    }
+    write_records(records, now);
+
+    // Buffers of threads that have exited are freed once they're empty.
+    lock_guard<mutex> buffers_lock(buffers_mutex);
+    buffers.erase(remove_if(buffers.begin(), buffers.end(), [](const shared_ptr<LogBuffer> &buffer) {
+        bool empty = buffer->head.load(memory_order_acquire) == buffer->tail.load(memory_order_relaxed);
+        return buffer->thread_exited && empty;
+    }), buffers.end());
+}
+
+static void run_writer() {
+    while (!stopping) {
+        drain();
+        unique_lock<mutex> lock(writer_mutex);
+        wake_up.wait_for(lock, milliseconds(WRITE_INTERVAL_MS), [] { return stopping.load(); });
+    }
+    drain();
+}
+
+void Logger::start() {
+    const char *level = getenv("LOG_LEVEL");
+    if (level) {
+        string name(level);
+        if (name == "trace") set_level(LogLevel::TRACE);
+        else if (name == "debug") set_level(LogLevel::DEBUG);
+        else if (name == "info") set_level(LogLevel::INFO);
+        else if (name == "warn") set_level(LogLevel::WARN);
+        else if (name == "error") set_level(LogLevel::ERROR);
+    }
+    stopping = false;
+    running = true;
+    writer = thread(run_writer);
+}
+
+void Logger::stop() {
+    // Before the writer's last drain, so a line committed from now on is written by its own thread instead.
+    running = false;
+    {
+        lock_guard<mutex> lock(writer_mutex);
+        stopping = true;
+    }
+    wake_up.notify_all();
+    if (writer.joinable())
+        writer.join();
+}
+
+LogRecord *Logger::begin_record() {
+    if (!thread_buffer.buffer) {
+        thread_buffer.buffer = make_shared<LogBuffer>();
+        lock_guard<mutex> lock(buffers_mutex);
+        buffers.push_back(thread_buffer.buffer);
+    }
+    LogBuffer &buffer = *thread_buffer.buffer;
+    uint32_t head = buffer.head.load(memory_order_relaxed);
+    if (head - buffer.tail.load(memory_order_acquire) >= BUFFER_CAPACITY) {
+        dropped_lines.fetch_add(1, memory_order_relaxed);
+        return nullptr;
+    }
+    return &buffer.records[head % BUFFER_CAPACITY];
+}
+
+void Logger::commit_record() {
+    LogBuffer &buffer = *thread_buffer.buffer;
+    buffer.head.store(buffer.head.load(memory_order_relaxed) + 1, memory_order_release);
+    if (!running) {
+        // Nobody is going to pick it up.
+        drain();
+    }
+}
+
+long Logger::now_us() {
+    timespec now{};
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
@@ -0,0 +1,145 @@
+
+#ifndef HOMECAMRECORDER_LOGGER_H
+#define HOMECAMRECORDER_LOGGER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+using namespace std;
+
+enum class LogLevel : uint8_t {
+    TRACE, DEBUG, INFO, WARN, ERROR
+};
+
+struct LogArgument {
+    enum Type : uint8_t { INTEGER, REAL, TEXT };
+    Type type;
+    union {
+        long integer;
+        double real;
+        // Offset and length of the text in LogRecord::text.
+        struct {
+            uint16_t offset;
+            uint16_t length;
+        } text;
+    };
+};
+
+/**
+ * A log line as the logging thread captured it: the format string (a literal, only the pointer is kept) and the
+ * arguments in binary form. It's turned into text on the writer thread.
+ */
+struct LogRecord {
+    static const int MAX_ARGUMENTS = 6;
+    static const int MAX_TAG_LENGTH = 31;
+    static const int TEXT_CAPACITY = 96;
+
+    long timestamp_us;
+    const char *format;
+    LogLevel level;
+    uint8_t argument_count;
+    uint8_t tag_length;
+    uint8_t text_used;
+    char tag[MAX_TAG_LENGTH];
+    LogArgument arguments[MAX_ARGUMENTS];
+    char text[TEXT_CAPACITY];
+};
+
+/**
+ * Logging that stays off the packet path. Each thread appends binary records to its own lock-free ring, and a
+ * background thread formats them, rate limits repeated lines and writes them to stdout (stderr for warnings and
+ * errors) with one write per batch. A log call below the level costs one atomic load, one above it tens of
+ * nanoseconds. When the ring is full, lines are dropped and counted rather than blocking the camera thread.
+ *
+ * Lines look like "2026-10-19 12:00:00.123 INFO (Front door) Motion started at 1760875200123".
+ * The format uses {} for each argument, and must be a string literal.
+ *
+ * Until start() (and in commands that never call it) lines are written synchronously instead.
+ */
+class Logger {
+public:
+    // The level is read from the LOG_LEVEL environment variable (trace, debug, info, warn or error).
+    static void start();
+    static void stop();
+    static void set_level(LogLevel level) { minimum_level.store(level, memory_order_relaxed); }
+    static bool enabled(LogLevel level) { return level >= minimum_level.load(memory_order_relaxed); }
+
+    template<typename... Arguments>
+    static void log(LogLevel level, string_view tag, const char *format, const Arguments &... arguments) {
+        static_assert(sizeof...(Arguments) <= LogRecord::MAX_ARGUMENTS, "Too many log arguments.");
+        if (!enabled(level)) return;
+        LogRecord *record = begin_record();
+        if (!record) return;
+        record->timestamp_us = now_us();
+        record->format = format;
+        record->level = level;
+        record->argument_count = 0;
+        record->text_used = 0;
+        record->tag_length = (uint8_t) min(tag.size(), (size_t) LogRecord::MAX_TAG_LENGTH);
+        memcpy(record->tag, tag.data(), record->tag_length);
+        (capture(*record, arguments), ...);
+        commit_record();
+    }
+
+    template<typename... Arguments>
+    static void trace(string_view tag, const char *format, const Arguments &... arguments) {
+        log(LogLevel::TRACE, tag, format, arguments...);
+    }
+
+    template<typename... Arguments>
+    static void debug(string_view tag, const char *format, const Arguments &... arguments) {
+        log(LogLevel::DEBUG, tag, format, arguments...);
+    }
+
+    template<typename... Arguments>
+    static void info(string_view tag, const char *format, const Arguments &... arguments) {
+        log(LogLevel::INFO, tag, format, arguments...);
+    }
+
+    template<typename... Arguments>
+    static void warn(string_view tag, const char *format, const Arguments &... arguments) {
+        log(LogLevel::WARN, tag, format, arguments...);
+    }
+
+    template<typename... Arguments>
+    static void error(string_view tag, const char *format, const Arguments &... arguments) {
+        log(LogLevel::ERROR, tag, format, arguments...);
+    }
+
+private:
+    static atomic<LogLevel> minimum_level;
+
+    static LogRecord *begin_record();
+    static void commit_record();
+    static long now_us();
+
+    template<typename T>
+    static void capture(LogRecord &record, const T &value) {
+        LogArgument &argument = record.arguments[record.argument_count++];
+        if constexpr (is_floating_point<T>::value) {
+            argument.type = LogArgument::REAL;
+            argument.real = value;
+        } else if constexpr (is_integral<T>::value || is_enum<T>::value) {
+            argument.type = LogArgument::INTEGER;
+            argument.integer = (long) value;
+        } else {
+            capture_text(record, argument, string_view(value));
+        }
+    }
+
+    static void capture_text(LogRecord &record, LogArgument &argument, string_view text) {
+        size_t length = min(text.size(), (size_t) (LogRecord::TEXT_CAPACITY - record.text_used));
+        argument.type = LogArgument::TEXT;
+        argument.text.offset = record.text_used;
+        argument.text.length = (uint16_t) length;
+        memcpy(record.text + record.text_used, text.data(), length);
+        record.text_used += length;
+    }
+};
+
+#endif //HOMECAMRECORDER_LOGGER_H
@@ -0,0 +1,473 @@
+#include "MosaicSummary.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "KeyframeIndex.h"
+#include "SummaryGenerator.h"
+
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+#include "AVError.h"
+#include "SegmentTime.h"
+
+MosaicSummary::MosaicSummary(RecordingCatalog *catalog, string recordings_dir, vector<string> cameras, long from_ms,
+                             long to_ms, string output_file, int fps) :
+    catalog(catalog), recordings_dir(std::move(recordings_dir)), cameras(std::move(cameras)), from_ms(from_ms),
+    to_ms(to_ms), output_file(std::move(output_file)), fps(fps), frame_interval_ms(max(1, 1000 / fps)),
+    scaled_frames(this->cameras.size()), next_sequence(this->cameras.size()),
+    frames_in_flight(this->cameras.size()) {}
+
+MosaicSummary::~MosaicSummary() {
+    close_output();
+    for (map<long, TileFrame> &frames : scaled_frames) {
+        for (auto &item : frames) {
+            av_frame_free(&item.second.frame);
+        }
+    }
+}
+
+bool MosaicSummary::run() {
+    find_scenes();
+    if (scenes.empty()) {
+        cerr << "(Mosaic) No motion between " << from_ms << " and " << to_ms << "." << endl;
+        return false;
+    }
+    if (!open_output()) {
+        return false;
+    }
+    auto start_time = steady_clock::now();
+    long scene_ms = 0;
+    for (const MosaicScene &scene : scenes) {
+        scene_ms += scene.end_ms - scene.start_ms;
+    }
+    cout << "(Mosaic) " << scenes.size() << " scenes, " << scene_ms / 1000 << " s of footage of " << cameras.size()
+         << " cameras." << endl;
+
+    vector<thread> decoders;
+    for (int camera = 0; camera < (int) cameras.size(); camera++) {
+        decoders.emplace_back(&MosaicSummary::run_decoder, this, camera);
+    }
+    vector<thread> scalers;
+    for (int i = 0; i < SCALE_THREAD_COUNT; i++) {
+        scalers.emplace_back(&MosaicSummary::run_scaler, this);
+    }
+    thread composer(&MosaicSummary::run_composer, this);
+    thread encoder(&MosaicSummary::run_encoder, this);
+
+    for (thread &decoder : decoders) {
+        decoder.join();
+    }
+    decoded_frames.close();
+    for (thread &scaler : scalers) {
+        scaler.join();
+    }
+    composer.join();
+    encoder.join();
+    close_output();
+
+    long elapsed_ms = duration_cast<milliseconds>(steady_clock::now() - start_time).count();
+    cout << "(Mosaic) Wrote " << frames_written << " frames (" << frames_written / fps << " s) to " << output_file
+         << " in " << elapsed_ms << " ms, " << (elapsed_ms > 0 ? scene_ms / elapsed_ms : 0) << "x real time. Decoded "
+         << frames_decoded << " frames." << endl;
+    return !failed && frames_written > 0;
+}
+
+void MosaicSummary::find_scenes() {
+    vector<MosaicScene> windows;
+    for (const string &camera : cameras) {
+        for (const MotionEvent &event : MotionEvent::read_file(recordings_dir + "/" + camera + ".csv")) {
+            if (!event.overlaps(from_ms, to_ms)) continue;
+            windows.push_back(MosaicScene{max(from_ms, event.start_ms - MotionWindowCursor::BUFFER_TIME_BEFORE_MS),
+                                          min(to_ms, event.end_ms + MotionWindowCursor::BUFFER_TIME_AFTER_MS)});
+        }
+    }
+    sort(windows.begin(), windows.end(), [](const MosaicScene &a, const MosaicScene &b) {
+        return a.start_ms < b.start_ms;
+    });
+    for (const MosaicScene &window : windows) {
+        if (!scenes.empty() && window.start_ms - scenes.back().end_ms <= SCENE_MERGE_GAP_MS) {
+            scenes.back().end_ms = max(scenes.back().end_ms, window.end_ms);
+        } else {
+            scenes.push_back(window);
+        }
+    }
+}
+
+bool MosaicSummary::open_output() {
+    AVCodec *encoder = avcodec_find_encoder_by_name("libx264");
+    if (!encoder) {
+        cerr << "(Mosaic) libx264 is not available." << endl;
+        return false;
+    }
+    try {
+        if (avformat_alloc_output_context2(&output_ctx, nullptr, nullptr, output_file.c_str()) < 0) {
+            cerr << "(Mosaic) Failed to create output context for " << output_file << endl;
+            throw -1;
+        }
+        encoder_ctx = avcodec_alloc_context3(encoder);
+        encoder_ctx->width = TILE_WIDTH * GRID_SIZE;
+        encoder_ctx->height = TILE_HEIGHT * GRID_SIZE;
+        encoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+        encoder_ctx->time_base = {1, fps};
+        encoder_ctx->framerate = {fps, 1};
+        encoder_ctx->gop_size = fps * 10;
+        // x264 picks its number of frame threads from the cores.
+        encoder_ctx->thread_count = 0;
+        if (output_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+            encoder_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        }
+        AVDictionary *options = nullptr;
+        av_dict_set(&options, "preset", "veryfast", 0);
+        av_dict_set(&options, "crf", "26", 0);
+        int ret = avcodec_open2(encoder_ctx, encoder, &options);
+        av_dict_free(&options);
+        if (ret < 0) {
+            cerr << "(Mosaic) Failed to open x264. Error = " << av_err2str(ret) << endl;
+            throw ret;
+        }
+
+        AVStream *output_stream = avformat_new_stream(output_ctx, nullptr);
+        avcodec_parameters_from_context(output_stream->codecpar, encoder_ctx);
+        output_stream->time_base = encoder_ctx->time_base;
+        ret = avio_open(&output_ctx->pb, output_file.c_str(), AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            cerr << "(Mosaic) Failed to open " << output_file << ". Error = " << av_err2str(ret) << endl;
+            throw ret;
+        }
+        ret = avformat_write_header(output_ctx, nullptr);
+        if (ret < 0) {
+            cerr << "(Mosaic) Failed to write header to " << output_file << endl;
+            avio_closep(&output_ctx->pb);
+            throw ret;
+        }
+    } catch (int e) {
+        avcodec_free_context(&encoder_ctx);
+        avformat_free_context(output_ctx);
+        output_ctx = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void MosaicSummary::close_output() {
+    if (output_ctx) {
+        av_write_trailer(output_ctx);
+        avio_closep(&output_ctx->pb);
+        avformat_free_context(output_ctx);
+        output_ctx = nullptr;
+    }
+    avcodec_free_context(&encoder_ctx);
+}
+
+long MosaicSummary::tick_of(const MosaicScene &scene, long time_ms) const {
+    long offset_ms = time_ms - scene.start_ms;
+    return offset_ms >= 0 ? offset_ms / frame_interval_ms : -1 - (-offset_ms - 1) / frame_interval_ms;
+}
+
+void MosaicSummary::run_decoder(int camera) {
+    long sequence = 0;
+    for (const MosaicScene &scene : scenes) {
+        // The last frame decoded, passed on once a frame of a later output frame shows it's the one to show.
+        AVFrame *held_frame = nullptr;
+        long held_time_ms = 0;
+        for (const CatalogEntry &segment : catalog->find(cameras[camera], scene.start_ms, scene.end_ms)) {
+            if (failed) break;
+            decode_segment(camera, segment, scene, sequence, held_frame, held_time_ms);
+        }
+        if (held_frame && tick_of(scene, held_time_ms) >= -1) {
+            pass_on(camera, sequence, held_time_ms, held_frame);
+        } else {
+            av_frame_free(&held_frame);
+        }
+        if (!pass_on(camera, sequence, scene.end_ms, nullptr)) return;
+    }
+}
+
+void MosaicSummary::decode_segment(int camera, const CatalogEntry &segment, const MosaicScene &scene, long &sequence,
+                                   AVFrame *&held_frame, long &held_time_ms) {
+    AVFormatContext *input_ctx = nullptr;
+    AVCodecContext *decoder_ctx = nullptr;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    int ret;
+
+    try {
+        ret = avformat_open_input(&input_ctx, segment.path.c_str(), nullptr, nullptr);
+        if (ret < 0) {
+            cerr << "(Mosaic) Failed to open " << segment.path << ". Error = " << av_err2str(ret) << endl;
+            throw ret;
+        }
+        ret = avformat_find_stream_info(input_ctx, nullptr);
+        if (ret < 0) throw ret;
+        AVCodec *codec;
+        int video_stream_idx = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+        if (video_stream_idx < 0) throw video_stream_idx;
+        AVStream *video_stream = input_ctx->streams[video_stream_idx];
+        decoder_ctx = avcodec_alloc_context3(codec);
+        if (avcodec_parameters_to_context(decoder_ctx, video_stream->codecpar) < 0) throw -1;
+        // The cameras are decoded in parallel, one thread each.
+        decoder_ctx->thread_count = 1;
+        ret = avcodec_open2(decoder_ctx, codec, nullptr);
+        if (ret < 0) throw ret;
+
+        if (scene.start_ms > segment.start_time_ms) {
+            vector<KeyframeIndexEntry> index = KeyframeIndex::read(segment.path);
+            auto keyframe = partition_point(index.begin(), index.end(), [&scene](const KeyframeIndexEntry &entry) {
+                return entry.time_ms <= scene.start_ms;
+            });
+            if (keyframe != index.begin()) {
+                av_seek_frame(input_ctx, -1, prev(keyframe)->offset, AVSEEK_FLAG_BYTE);
+            } else if (index.empty()) {
+                int64_t timestamp = segment_timestamp(segment.start_time_ms, input_ctx, video_stream, scene.start_ms);
+                av_seek_frame(input_ctx, video_stream_idx, timestamp, AVSEEK_FLAG_BACKWARD);
+            }
+        }
+
+        bool saw_key_frame = false;
+        bool past_scene = false;
+        while (!past_scene && !failed && av_read_frame(input_ctx, packet) == 0) {
+            if (packet->stream_index != video_stream_idx ||
+                (!saw_key_frame && !(packet->flags & AV_PKT_FLAG_KEY))) {
+                av_packet_unref(packet);
+                continue;
+            }
+            saw_key_frame = true;
+            avcodec_send_packet(decoder_ctx, packet);
+            av_packet_unref(packet);
+            while (!past_scene && avcodec_receive_frame(decoder_ctx, frame) == 0) {
+                frames_decoded++;
+                int64_t timestamp = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp :
+                                    frame->pts;
+                long time_ms = segment_time_ms(segment.start_time_ms, input_ctx, video_stream, timestamp);
+                if (time_ms > scene.end_ms) {
+                    past_scene = true;
+                } else if (held_frame && tick_of(scene, time_ms) == tick_of(scene, held_time_ms)) {
+                    // A later frame for the same output frame.
+                    av_frame_unref(held_frame);
+                    av_frame_move_ref(held_frame, frame);
+                    held_time_ms = time_ms;
+                } else {
+                    if (held_frame && tick_of(scene, held_time_ms) >= -1) {
+                        bool passed = pass_on(camera, sequence, held_time_ms, held_frame);
+                        held_frame = nullptr;
+                        if (!passed) throw -1;
+                    }
+                    if (!held_frame) {
+                        held_frame = av_frame_alloc();
+                    }
+                    av_frame_unref(held_frame);
+                    av_frame_move_ref(held_frame, frame);
+                    held_time_ms = time_ms;
+                }
+                av_frame_unref(frame);
+            }
+        }
+    } catch (int e) {
+    }
+
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&decoder_ctx);
+    avformat_close_input(&input_ctx);
+}
+
+bool MosaicSummary::pass_on(int camera, long &sequence, long time_ms, AVFrame *frame) {
+    {
+        unique_lock<mutex> lock(compose_mutex);
+        compose_changed.wait(lock, [this, camera] {
+            return failed || frames_in_flight[camera] < MAX_FRAMES_IN_FLIGHT;
+        });
+        if (!failed) {
+            frames_in_flight[camera]++;
+        }
+    }
+    if (failed || !decoded_frames.push(TileFrame{camera, sequence, time_ms, frame})) {
+        av_frame_free(&frame);
+        return false;
+    }
+    sequence++;
+    return true;
+}
+
+void MosaicSummary::run_scaler() {
+    // Each camera's frames can have a size of their own.
+    vector<SwsContext *> contexts(cameras.size(), nullptr);
+    TileFrame item;
+    while (decoded_frames.pop(item)) {
+        if (item.frame && !failed) {
+            AVFrame *source = item.frame;
+            AVFrame *tile = av_frame_alloc();
+            tile->format = AV_PIX_FMT_YUV420P;
+            tile->width = TILE_WIDTH;
+            tile->height = TILE_HEIGHT;
+            contexts[item.camera] = sws_getCachedContext(contexts[item.camera], source->width, source->height,
+                                                         (AVPixelFormat) source->format, TILE_WIDTH, TILE_HEIGHT,
+                                                         AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, nullptr, nullptr,
+                                                         nullptr);
+            if (contexts[item.camera] && av_frame_get_buffer(tile, 0) >= 0) {
+                sws_scale(contexts[item.camera], source->data, source->linesize, 0, source->height, tile->data,
+                          tile->linesize);
+            } else {
+                // Shown as a black tile.
+                av_frame_free(&tile);
+            }
+            av_frame_free(&item.frame);
+            item.frame = tile;
+            if (!tile) {
+                item.time_ms = -1;
+            }
+        } else if (item.frame) {
+            av_frame_free(&item.frame);
+        }
+        {
+            lock_guard<mutex> lock(compose_mutex);
+            scaled_frames[item.camera][item.sequence] = item;
+        }
+        compose_changed.notify_all();
+    }
+    for (SwsContext *context : contexts) {
+        sws_freeContext(context);
+    }
+}
+
+void MosaicSummary::run_composer() {
+    vector<AVFrame *> current(cameras.size(), nullptr);
+    int64_t pts = 0;
+    for (const MosaicScene &scene : scenes) {
+        // A camera without footage of the scene is black rather than showing what it saw earlier.
+        for (AVFrame *&frame : current) {
+            av_frame_free(&frame);
+        }
+        for (long time_ms = scene.start_ms; time_ms <= scene.end_ms && !failed; time_ms += frame_interval_ms) {
+            for (int camera = 0; camera < (int) cameras.size(); camera++) {
+                advance(camera, time_ms, current[camera], false);
+            }
+            AVFrame *canvas = compose(current);
+            if (!canvas) {
+                abort();
+                break;
+            }
+            canvas->pts = pts++;
+            if (!canvases.push(canvas)) {
+                av_frame_free(&canvas);
+                abort();
+            }
+        }
+        for (int camera = 0; camera < (int) cameras.size() && !failed; camera++) {
+            advance(camera, scene.end_ms, current[camera], true);
+        }
+        if (failed) break;
+    }
+    for (AVFrame *&frame : current) {
+        av_frame_free(&frame);
+    }
+    canvases.close();
+    compose_changed.notify_all();
+}
+
+bool MosaicSummary::advance(int camera, long until_ms, AVFrame *&current, bool to_end_of_scene) {
+    unique_lock<mutex> lock(compose_mutex);
+    map<long, TileFrame> &frames = scaled_frames[camera];
+    while (true) {
+        compose_changed.wait(lock, [this, &frames, camera] {
+            return failed || frames.count(next_sequence[camera]) > 0;
+        });
+        if (failed) return false;
+        auto next = frames.find(next_sequence[camera]);
+        TileFrame &item = next->second;
+        bool end_of_scene = !item.frame && item.time_ms >= 0;
+        if (!to_end_of_scene && (end_of_scene || item.time_ms > until_ms)) return true;
+
+        if (item.frame) {
+            av_frame_free(&current);
+            current = item.frame;
+        }
+        frames.erase(next);
+        next_sequence[camera]++;
+        frames_in_flight[camera]--;
+        compose_changed.notify_all();
+        if (end_of_scene) return true;
+    }
+}
+
+AVFrame *MosaicSummary::compose(const vector<AVFrame *> &current) const {
+    AVFrame *canvas = av_frame_alloc();
+    canvas->format = AV_PIX_FMT_YUV420P;
+    canvas->width = TILE_WIDTH * GRID_SIZE;
+    canvas->height = TILE_HEIGHT * GRID_SIZE;
+    if (av_frame_get_buffer(canvas, 0) < 0) {
+        av_frame_free(&canvas);
+        return nullptr;
+    }
+    for (int tile = 0; tile < MAX_CAMERAS; tile++) {
+        const AVFrame *frame = tile < (int) current.size() ? current[tile] : nullptr;
+        for (int plane = 0; plane < 3; plane++) {
+            // The chroma planes are half the size.
+            int shift = plane == 0 ? 0 : 1;
+            int width = TILE_WIDTH >> shift;
+            int height = TILE_HEIGHT >> shift;
+            int x = (tile % GRID_SIZE) * width;
+            int y = (tile / GRID_SIZE) * height;
+            for (int row = 0; row < height; row++) {
+                uint8_t *destination = canvas->data[plane] + (long) (y + row) * canvas->linesize[plane] + x;
+                if (frame) {
+                    memcpy(destination, frame->data[plane] + (long) row * frame->linesize[plane], width);
+                } else {
+                    memset(destination, plane == 0 ? 16 : 128, width);
+                }
+            }
+        }
+    }
+    return canvas;
+}
+
+void MosaicSummary::abort() {
+    {
+        // Under the lock, so no stage waiting for the compose stage misses it.
+        lock_guard<mutex> lock(compose_mutex);
+        failed = true;
+    }
+    compose_changed.notify_all();
+    // The composer may be waiting for room in the queue, and the encoder for a frame.
+    canvases.close();
+}
+
+void MosaicSummary::run_encoder() {
+    AVFrame *canvas;
+    while (canvases.pop(canvas)) {
+        if (!failed && avcodec_send_frame(encoder_ctx, canvas) < 0) {
+            cerr << "(Mosaic) Failed to encode frame " << canvas->pts << endl;
+        }
+        av_frame_free(&canvas);
+        if (!failed && !write_encoded_packets()) {
+            abort();
+        }
+    }
+    if (!failed) {
+        avcodec_send_frame(encoder_ctx, nullptr);
+        write_encoded_packets();
+    }
+}
+
+bool MosaicSummary::write_encoded_packets() {
+    AVPacket *packet = av_packet_alloc();
+    bool written = true;
+    while (avcodec_receive_packet(encoder_ctx, packet) == 0) {
+        AVStream *output_stream = output_ctx->streams[0];
+        packet->stream_index = 0;
+        av_packet_rescale_ts(packet, encoder_ctx->time_base, output_stream->time_base);
+        int ret = av_interleaved_write_frame(output_ctx, packet);
+        av_packet_unref(packet);
+        if (ret < 0) {
+            cerr << "(Mosaic) Failed to write to " << output_file << ". Error = " << av_err2str(ret) << endl;
+            written = false;
+            break;
+        }
+        frames_written++;
+    }
+    av_packet_free(&packet);
+    return written;
+}
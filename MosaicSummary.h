@@ -0,0 +1,172 @@
+
+#ifndef HOMECAMRECORDER_MOSAICSUMMARY_H
+#define HOMECAMRECORDER_MOSAICSUMMARY_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RecordingCatalog.h"
+#include "MotionEvent.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+struct SwsContext;
+
+using namespace std;
+using namespace std::chrono;
+
+/**
+ * Bounded queue between two stages of a pipeline. push blocks while it's full and pop while it's empty. Once closed,
+ * push fails and pop drains what's left.
+ */
+template<typename T>
+class StageQueue {
+public:
+    explicit StageQueue(size_t capacity) : capacity(capacity) {}
+
+    bool push(T item) {
+        unique_lock<mutex> lock(queue_mutex);
+        not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(T &item) {
+        unique_lock<mutex> lock(queue_mutex);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        lock_guard<mutex> lock(queue_mutex);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+private:
+    const size_t capacity;
+    mutex queue_mutex;
+    condition_variable not_full;
+    condition_variable not_empty;
+    deque<T> items;
+    bool closed{false};
+};
+
+/**
+ * A stretch of wall clock time with motion on at least one camera, including the buffer before and after it.
+ */
+struct MosaicScene {
+    long start_ms{};
+    long end_ms{};
+};
+
+/**
+ * Summarizes up to four cameras in one video, side by side in a 2x2 grid on a shared wall clock, so someone walking
+ * from the driveway to the front door is one scene instead of three files. The motion events of all the cameras are
+ * merged into scenes, and every camera is shown for every scene, whether it saw the motion or not.
+ *
+ * Only the footage of the scenes is decoded, starting at the keyframe before each scene (found with the KeyframeIndex
+ * when the segment has one). The work is a pipeline of stages with queues between them:
+ *
+ *   decode   one thread per camera. Only the last frame before every output frame time is passed on.
+ *   scale    SCALE_THREAD_COUNT threads scaling frames of any camera to TILE_WIDTH x TILE_HEIGHT.
+ *   compose  one thread putting the tiles of each output frame in order, together into the grid.
+ *   encode   one thread feeding x264, which runs its own frame threads.
+ *
+ * A camera can't get more than MAX_FRAMES_IN_FLIGHT frames ahead of the compose stage, so memory stays bounded
+ * however far apart the cameras' footage is in the files.
+ */
+class MosaicSummary {
+public:
+    MosaicSummary(RecordingCatalog *catalog, string recordings_dir, vector<string> cameras, long from_ms, long to_ms,
+                  string output_file, int fps);
+    ~MosaicSummary();
+
+    // Returns false if no frame was written.
+    bool run();
+
+    static const int GRID_SIZE = 2;
+    static const int MAX_CAMERAS = GRID_SIZE * GRID_SIZE;
+
+private:
+    static const int TILE_WIDTH = 640;
+    static const int TILE_HEIGHT = 360;
+    static const int SCALE_THREAD_COUNT = 2;
+    static const size_t DECODED_QUEUE_SIZE = 32;
+    static const size_t CANVAS_QUEUE_SIZE = 8;
+    static const long MAX_FRAMES_IN_FLIGHT = 48;
+    // Scenes closer together than this are one scene, so the summary doesn't cut away for a moment.
+    static const long SCENE_MERGE_GAP_MS = 5000;
+
+    // A frame of one camera on its way to the compose stage. A null frame ends the camera's footage of a scene.
+    struct TileFrame {
+        int camera{};
+        long sequence{};
+        long time_ms{};
+        AVFrame *frame{};
+    };
+
+    RecordingCatalog *catalog;
+    const string recordings_dir;
+    const vector<string> cameras;
+    const long from_ms;
+    const long to_ms;
+    const string output_file;
+    const int fps;
+    const long frame_interval_ms;
+
+    vector<MosaicScene> scenes;
+    atomic<bool> failed{false};
+    StageQueue<TileFrame> decoded_frames{DECODED_QUEUE_SIZE};
+    StageQueue<AVFrame *> canvases{CANVAS_QUEUE_SIZE};
+
+    // Scaled frames by camera and sequence number, since the scale threads finish them out of order.
+    mutex compose_mutex;
+    condition_variable compose_changed;
+    vector<map<long, TileFrame>> scaled_frames;
+    vector<long> next_sequence;
+    vector<long> frames_in_flight;
+
+    AVFormatContext *output_ctx{};
+    AVCodecContext *encoder_ctx{};
+    atomic<long> frames_decoded{};
+    long frames_written{};
+
+    void find_scenes();
+    bool open_output();
+    void close_output();
+
+    void run_decoder(int camera);
+    void decode_segment(int camera, const CatalogEntry &segment, const MosaicScene &scene, long &sequence,
+                        AVFrame *&held_frame, long &held_time_ms);
+    bool pass_on(int camera, long &sequence, long time_ms, AVFrame *frame);
+    long tick_of(const MosaicScene &scene, long time_ms) const;
+
+    void run_scaler();
+    void run_composer();
+    bool advance(int camera, long until_ms, AVFrame *&current, bool to_end_of_scene);
+    AVFrame *compose(const vector<AVFrame *> &current) const;
+
+    void run_encoder();
+    bool write_encoded_packets();
+    // Stops every stage. What was encoded so far is still written.
+    void abort();
+};
+
+#endif //HOMECAMRECORDER_MOSAICSUMMARY_H
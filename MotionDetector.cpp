@@ -3,22 +3,29 @@
 const string ADMIN_PHONE = "3393641604";
 const string FROM_PHONE = "8573550142";
 
-MotionDetector::MotionDetector(const string camera_name, const string &motion_file_path, const int motion_threshold) {
+MotionDetector::MotionDetector(const string camera_name, const string &motion_file_path, const int motion_threshold,
+                               RecordingCatalog *catalog, const string &catalog_camera) {
     this->camera_name = camera_name;
     this->motion_file_path = motion_file_path;
     this->motion_threshold = motion_threshold;
-    this->last_write_time = system_clock::now();
+    this->catalog = catalog;
+    this->catalog_camera = catalog_camera;
     init_twilio();
 }
 
-void MotionDetector::release() {
+void MotionDetector::add_listener(MotionListener *listener) {
+    listeners.push_back(listener);
+}
 
+void MotionDetector::release() {
+    close_event();
 }
 
 /**
   Extract multiple H264 NAL units from an AVPacket, find the IDR frame, and mark its size. If size > some threshold, mark the timestamp to a text file.
  */
-void MotionDetector::send_packet(AVPacket *packet) {
+void MotionDetector::send_packet(AVPacket *packet, long timestamp_ms) {
+    packet_time_ms = timestamp_ms;
     int last_IDR_index = -1;
     int last_non_IDR_index = -1;
     const int UNIT_TYPE_IDR = 5; // https://www.itu.int/rec/T-REC-H.264-200305-S Table 7-1.
@@ -67,14 +74,17 @@ void MotionDetector::init_twilio() {
     char* sid = getenv("TWILIO_SID");
     char* token = getenv("TWILIO_AUTH_TOKEN");
     if (!sid || !token) {
-        cerr << "Failed to retrieve twilio sid and auth token" << endl;
-        exit(1);
+        // Replayed cameras run without Twilio credentials.
+        cerr << "(" << camera_name << ") Failed to retrieve twilio sid and auth token. Alerts are disabled." << endl;
         return;
     }
     this->m_twilio = std::make_shared<twilio::Twilio>(sid, token);
 }
 
 void MotionDetector::send_sms(string message) {
+    if (!m_twilio) {
+        return;
+    }
     string twilio_response;
     auto t = std::time(nullptr);
     auto tm = *std::localtime(&t);
@@ -101,30 +111,56 @@ void MotionDetector::mark_idr_frame_size(int size) {
 }
 
 void MotionDetector::mark_non_idr_frame_size(int size) {
-    const int WRITE_INTERVAL_MSEC = 15000;
+    Logger::trace(camera_name, "Frame size {}", size);
+    long frame_time_ms = packet_time_ms >= 0 ? packet_time_ms :
+                         duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    if (event_open && frame_time_ms - event.end_ms > MERGE_GAP_MS) {
+        close_event();
+    }
+
+    bool onset = size < motion_threshold;
+    bool sustained = size < motion_threshold * RELEASE_FACTOR;
+    if (!event_open && onset) {
+        event_open = true;
+        event_confirmed = false;
+        event = MotionEvent{frame_time_ms, frame_time_ms, 0, 0};
+    }
+    if (!event_open || !sustained) return;
+
+    event.end_ms = frame_time_ms;
+    event.frames++;
+    event.peak_score = max(event.peak_score, 1.0 - (double) size / motion_threshold);
+    if (!event_confirmed && event.frames >= MIN_EVENT_FRAMES && event.end_ms - event.start_ms >= MIN_EVENT_MS) {
+        confirm_event();
+    }
+}
+
+void MotionDetector::confirm_event() {
     const int ALERT_INTERVAL_MSEC = 30000;
-    cout << this->camera_name << ": " << to_string(size) << endl;
-    if (size < this->motion_threshold) {
-        long ms_since_epoch = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
-        write_queue.push_back(ms_since_epoch);
-        cout << this->camera_name << ": Motion detected at " << ms_since_epoch << ". Size is " << size << endl;
-        if (duration_cast<milliseconds>(system_clock::now() - last_alert_time).count() > ALERT_INTERVAL_MSEC) {
-            //send_sms("Motion (" + to_string(size) + ") at " + this->camera_name);
-            last_alert_time = system_clock::now();
-        }
+    event_confirmed = true;
+    if (catalog) {
+        catalog->motion_event(catalog_camera);
+    }
+    for (MotionListener *listener : listeners) {
+        listener->on_motion_start(event.start_ms);
     }
-    if (duration_cast<milliseconds>(system_clock::now() - last_write_time).count() > WRITE_INTERVAL_MSEC) {
-        flush_write_queue();
+    Logger::info(camera_name, "Motion started at {}", event.start_ms);
+    if (duration_cast<milliseconds>(system_clock::now() - last_alert_time).count() > ALERT_INTERVAL_MSEC) {
+        //send_sms("Motion at " + this->camera_name);
+        last_alert_time = system_clock::now();
     }
 }
 
-void MotionDetector::flush_write_queue() {
-    ofstream motion_file;
-    motion_file.open(motion_file_path, std::ios_base::app);
-    for(long timestamp : this->write_queue)  {
-        motion_file << timestamp << endl;
+void MotionDetector::close_event() {
+    if (!event_open) return;
+    event_open = false;
+    if (!event_confirmed) return;
+
+    for (MotionListener *listener : listeners) {
+        listener->on_motion_end(event);
     }
-    motion_file.close();
-    write_queue.clear();
-    last_write_time = system_clock::now();
+    Logger::info(camera_name, "Motion from {} to {}, {} frames, peak score {}", event.start_ms, event.end_ms,
+                 event.frames, event.peak_score);
+    ofstream motion_file(motion_file_path, std::ios_base::app);
+    motion_file << event.to_line() << endl;
 }
@@ -11,7 +11,11 @@
 #include <sstream>
 #include <ctime>
 #include "twilio.h"
+#include "RecordingCatalog.h"
+#include "MotionEvent.h"
+#include "Logger.h"
 #include <iomanip>
+#include <memory>
 
 extern "C" {
 #include <libavcodec/packet.h>
@@ -20,28 +24,69 @@ extern "C" {
 using namespace std;
 using namespace std::chrono;
 
+/**
+ * Told when a motion event starts and ends, on the thread that analyzes the camera. That is the camera thread, unless
+ * the camera has an analysis stream.
+ */
+class MotionListener {
+public:
+    // Motion has lasted MotionDetector::MIN_EVENT_MS, so start_ms is a little in the past.
+    virtual void on_motion_start(long start_ms) = 0;
+    // Nothing for MotionDetector::MERGE_GAP_MS, or the detector was released.
+    virtual void on_motion_end(const MotionEvent &event) = 0;
+};
+
+/**
+ * Segments a camera's frame sizes into motion events. A frame smaller than the threshold starts motion, and motion
+ * carries on while frames stay below RELEASE_FACTOR times the threshold, so a size hovering around the threshold
+ * doesn't flap. Quiet gaps shorter than MERGE_GAP_MS are part of the event. Events shorter than MIN_EVENT_MS or
+ * MIN_EVENT_FRAMES (a glitch, a car's headlights) are dropped.
+ *
+ * Each event is one line in the motion file, one catalog motion event and one start and end for the listeners,
+ * however many frames it has.
+ */
 class MotionDetector {
 public:
-    void send_packet(AVPacket *packet);
+    static constexpr double RELEASE_FACTOR = 1.2;
+    static const long MERGE_GAP_MS = 3000;
+    static const long MIN_EVENT_MS = 400;
+    static const int MIN_EVENT_FRAMES = 4;
 
+    // The timestamp is the wall clock time of the packet, by default the time it's sent.
+    void send_packet(AVPacket *packet, long timestamp_ms = -1);
+
+    // Ends the open event.
     void release();
 
-    MotionDetector(const string camera_name, const string &motion_file, const int motion_threshold);
+    MotionDetector(const string camera_name, const string &motion_file, const int motion_threshold,
+                   RecordingCatalog *catalog = nullptr, const string &catalog_camera = "");
+
+    void add_listener(MotionListener *listener);
+
+    // On the thread sending the packets.
+    void set_motion_threshold(int threshold) { motion_threshold = threshold; }
 
 private:
     string camera_name;
     string motion_file_path;
     int motion_threshold;
-    time_point<system_clock> last_write_time{};
+    RecordingCatalog *catalog;
+    string catalog_camera;
+    vector<MotionListener *> listeners;
+    long packet_time_ms{-1};
     time_point<system_clock> last_alert_time{};
-    std::vector<long> write_queue{};
+    bool event_open{false};
+    // Set once the open event is long enough to be reported.
+    bool event_confirmed{false};
+    MotionEvent event;
     shared_ptr<twilio::Twilio> m_twilio;
 
     void init_twilio();
     void send_sms(string message);
     void mark_idr_frame_size(int size);
     void mark_non_idr_frame_size(int size);
-    void flush_write_queue();
+    void confirm_event();
+    void close_event();
 };
 
 
@@ -0,0 +1,58 @@
+#include "MotionEvent.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+string MotionEvent::to_line() const {
+    char line[96];
+    snprintf(line, sizeof(line), "%ld,%ld,%.3f,%d", start_ms, end_ms, peak_score, frames);
+    return label.empty() ? line : line + ("," + label);
+}
+
+bool MotionEvent::parse(const string &line, MotionEvent &event) {
+    MotionEvent parsed;
+    char label[32] = "";
+    int fields = sscanf(line.c_str(), "%ld,%ld,%lf,%d,%31s", &parsed.start_ms, &parsed.end_ms, &parsed.peak_score,
+                        &parsed.frames, label);
+    if (fields == 1) {
+        // A timestamp from before events.
+        parsed.end_ms = parsed.start_ms;
+        parsed.peak_score = 0;
+        parsed.frames = 1;
+    } else if (fields < 4 || parsed.end_ms < parsed.start_ms) {
+        return false;
+    }
+    parsed.label = label;
+    event = parsed;
+    return true;
+}
+
+vector<MotionEvent> MotionEvent::read_file(const string &path) {
+    vector<MotionEvent> events;
+    ifstream motion_file(path);
+    string line;
+    MotionEvent event;
+    while (getline(motion_file, line)) {
+        if (parse(line, event)) {
+            events.push_back(event);
+        }
+    }
+    stable_sort(events.begin(), events.end(), [](const MotionEvent &a, const MotionEvent &b) {
+        return a.start_ms < b.start_ms;
+    });
+    return events;
+}
+
+int MotionEvent::count_overlapping(const vector<MotionEvent> &events, long from_ms, long to_ms) {
+    // Sound events can overlap motion, so only the starts are in order. Everything starting after to_ms is skipped, the
+    // rest are checked.
+    auto last = partition_point(events.begin(), events.end(), [to_ms](const MotionEvent &event) {
+        return event.start_ms <= to_ms;
+    });
+    int count = 0;
+    for (auto it = events.begin(); it != last; ++it) {
+        if (it->end_ms >= from_ms) count++;
+    }
+    return count;
+}
@@ -0,0 +1,37 @@
+
+#ifndef HOMECAMRECORDER_MOTIONEVENT_H
+#define HOMECAMRECORDER_MOTIONEVENT_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * One stretch of motion on a camera, as the MotionDetector segments it. The camera's motion file (<camera>.csv) has
+ * one per line: "start ms,end ms,peak score,frames[,label]". Files written before events have a bare timestamp per
+ * line, which reads as an event of one frame.
+ *
+ * Sound events from the AudioAnalyzer share the file, labelled with the band they were loudest in. They can overlap
+ * video motion.
+ */
+struct MotionEvent {
+    long start_ms{};
+    long end_ms{};
+    // How far the most telling frame was below the threshold, 0 to 1.
+    double peak_score{};
+    int frames{};
+    // Empty for video motion, "sound:<band>" for audio events.
+    string label;
+
+    bool overlaps(long from_ms, long to_ms) const { return start_ms <= to_ms && end_ms >= from_ms; }
+
+    string to_line() const;
+    static bool parse(const string &line, MotionEvent &event);
+    // The events of a motion file, ordered by start time.
+    static vector<MotionEvent> read_file(const string &path);
+    // Events of an ordered list that overlap [from_ms, to_ms].
+    static int count_overlapping(const vector<MotionEvent> &events, long from_ms, long to_ms);
+};
+
+#endif //HOMECAMRECORDER_MOTIONEVENT_H
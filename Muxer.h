@@ -9,6 +9,13 @@
 #include <vector>
 #include <unistd.h>
 
+#include "RetentionManager.h"
+#include "RecordingCatalog.h"
+#include "SegmentUploader.h"
+#include "KeyframeIndex.h"
+#include "SegmentLifecycle.h"
+#include "Logger.h"
+
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
@@ -24,6 +31,7 @@ public:
     bool did_init = false;
 
     Muxer() = default;
+    virtual ~Muxer() = default;
     virtual void send_packet(AVPacket *packet) = 0;
     virtual void release() {
         last_frame_dts_per_stream[0] = -1;
@@ -32,9 +40,9 @@ public:
     }
     virtual void init() = 0;
     
-    void add_stream(AVStream *input_stream,
-                    AVCodec *input_codec,
-                    bool write_header) {
+    virtual void add_stream(AVStream *input_stream,
+                            AVCodec *input_codec,
+                            bool write_header) {
         should_add_streams = false;
         input_timebase_per_stream[output_ctx->nb_streams] = input_stream->time_base;
 
@@ -73,8 +81,6 @@ public:
     }
 
 protected:
-    const bool TRACE_LOG = false;
-
     AVFormatContext *output_ctx{};
     AVOutputFormat *output_format{};
     int audio_stream_index{-1};
@@ -85,6 +91,23 @@ protected:
     AVRational output_timebase_per_stream[2]{};
     long last_frame_dts_per_stream[2]{};
 
+    /**
+     * Rescale a packet's timestamps from the input stream timebase to the output stream timebase and make them
+     * continuous. Callers are expected to save and restore the packet fields, since the packet is shared between
+     * muxers.
+     */
+    void rescale_packet_timestamps(AVPacket *packet) {
+        auto input_timebase = input_timebase_per_stream[packet->stream_index];
+        auto output_timebase = output_timebase_per_stream[packet->stream_index];
+        packet->duration = av_rescale_q((int64_t) packet->duration, input_timebase, output_timebase);
+        packet->pts = av_rescale_q_rnd((int64_t) packet->pts, input_timebase, output_timebase,
+                                       AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+        packet->dts = av_rescale_q_rnd((int64_t) packet->dts, input_timebase, output_timebase,
+                                       AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+        packet->pos = -1;
+        fix_packet_timestamps(packet);
+    }
+
     void fix_packet_timestamps(AVPacket *packet) {
         auto cts = packet->pts - packet->dts;
         long last_frame_dts = last_frame_dts_per_stream[packet->stream_index];
@@ -98,9 +121,15 @@ protected:
     }
 };
 
+/**
+ * Records a camera into segments of MAX_FILE_DURATION_SEC. The output is flushed at every keyframe, so with MPEG-TS
+ * or fragmented MP4 (extension "ts" or "mp4") a segment cut off by a crash plays up to its last GOP. SegmentRecovery
+ * tidies up the torn end on the next start. MPEG-TS and FLV segments get a KeyframeIndex.
+ */
 class RotatingFileMuxer : public Muxer {
 public:
-    RotatingFileMuxer(const string &basename, const string &extension);
+    RotatingFileMuxer(const string &basename, const string &extension, RetentionManager *retention_manager = nullptr,
+                      RecordingCatalog *catalog = nullptr, SegmentUploader *uploader = nullptr);
 
     void send_packet(AVPacket *packet) override;
 
@@ -108,20 +137,37 @@ public:
 
     void init() override;
     
-    void add_stream(AVStream *input_stream, AVCodec *input_codec, bool write_header);
+    void add_stream(AVStream *input_stream, AVCodec *input_codec, bool write_header) override;
 
-private:
-    string get_output_file_name();
+protected:
+    virtual string get_output_file_name();
 
 private:
-    bool did_init;
-    string basename;
+    void flush();
+
     string extension;
     string output_file;
-    const int MAX_FILES = 32 /* 16 hours */;
-    const int MAX_FILE_DURATION_SEC = 30 * 60;/* 30 minutes */
-    int file_number{0};
-    time_point<system_clock> file_start_time{};
+    SegmentLifecycle segment;
+    // Second descriptor of the segment, only used to push it to disk.
+    int sync_fd{-1};
+};
+
+/**
+ * Writes a single output file, in the format given or guessed from the file name. Used by the commands that
+ * stitch recorded segments together, where the timestamp repair in Muxer keeps the output continuous across
+ * segment boundaries.
+ */
+class FileMuxer : public Muxer {
+public:
+    explicit FileMuxer(const string &output_file, const string &format = "");
+    void send_packet(AVPacket *packet) override;
+    void release() override;
+    void init() override;
+
+    int get_video_frames_written() const { return video_frames_written; }
+private:
+    string output_file;
+    string format;
 };
 
 class FLVMuxer : public Muxer {
@@ -130,6 +176,10 @@ public:
     void send_packet(AVPacket *packet) override;
     void release() override;
     void init() override;
+
+    const string &get_output_url() const { return output_url; }
+    // Takes effect at the next init(), so release first.
+    void set_output_url(const string &url) { output_url = url; }
 private:
     string output_url;
 };
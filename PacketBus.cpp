@@ -0,0 +1,296 @@
+#include "PacketBus.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// Records are padded to this, so record headers stay aligned.
+static const uint64_t RECORD_ALIGNMENT = 8;
+
+static uint64_t aligned(uint64_t size) {
+    return (size + RECORD_ALIGNMENT - 1) / RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+}
+
+string packet_bus_name(const string &camera) {
+    return "/homecam_" + camera;
+}
+
+PacketBusWriter::PacketBusWriter(string camera, uint64_t capacity) :
+    camera(std::move(camera)), capacity(aligned(capacity)) {}
+
+PacketBusWriter::~PacketBusWriter() {
+    close();
+}
+
+bool PacketBusWriter::open() {
+    if (header) return true;
+    string name = packet_bus_name(camera);
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        cerr << "(PacketBus) Failed to open " << name << ": " << strerror(errno) << endl;
+        return false;
+    }
+    long size = (long) (PACKET_BUS_HEADER_SIZE + capacity);
+    struct stat file_stat{};
+    bool resized = fstat(fd, &file_stat) != 0 || file_stat.st_size != size;
+    if (resized && ftruncate(fd, size) != 0) {
+        cerr << "(PacketBus) Failed to size " << name << ": " << strerror(errno) << endl;
+        ::close(fd);
+        return false;
+    }
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        cerr << "(PacketBus) Failed to map " << name << ": " << strerror(errno) << endl;
+        return false;
+    }
+    header = (PacketBusHeader *) memory;
+    ring = (uint8_t *) memory + PACKET_BUS_HEADER_SIZE;
+
+    if (!resized && header->magic == PACKET_BUS_MAGIC && header->version == PACKET_BUS_VERSION &&
+        header->capacity == capacity) {
+        // Positions carry on from the last run, so readers that stayed attached see new records as new.
+        write_position = header->write_position.load();
+        // A writer that died inside set_streams() left the sequence odd, and readers would wait for it forever.
+        // Its descriptors may be torn, so finish the update with no streams until set_streams() is called again.
+        if (header->streams_sequence.load() & 1) {
+            header->streams[0] = PacketBusStream();
+            header->streams[1] = PacketBusStream();
+            header->streams_sequence.fetch_add(1);
+        }
+        cout << "(PacketBus) Reopened " << name << " at position " << write_position << endl;
+    } else {
+        header->magic = 0;
+        atomic_thread_fence(memory_order_release);
+        header->version = PACKET_BUS_VERSION;
+        header->capacity = capacity;
+        header->write_position = 0;
+        header->keyframe_position = PACKET_BUS_NO_KEYFRAME;
+        header->streams_sequence = 0;
+        header->wake_sequence = 0;
+        header->waiting_readers = 0;
+        header->streams[0] = PacketBusStream();
+        header->streams[1] = PacketBusStream();
+        write_position = 0;
+        atomic_thread_fence(memory_order_release);
+        header->magic = PACKET_BUS_MAGIC;
+        cout << "(PacketBus) Created " << name << " with " << capacity / (1024 * 1024) << " MB." << endl;
+    }
+    header->writer_pid = getpid();
+    return true;
+}
+
+void PacketBusWriter::close() {
+    if (!header) return;
+    header->writer_pid = 0;
+    wake_readers();
+    // The ring is left in /dev/shm, so the next run can take it over.
+    munmap(header, PACKET_BUS_HEADER_SIZE + capacity);
+    header = nullptr;
+    ring = nullptr;
+}
+
+void PacketBusWriter::set_streams(const PacketBusStream &video, const PacketBusStream &audio) {
+    if (!header) return;
+    header->streams_sequence.fetch_add(1);
+    header->streams[0] = video;
+    header->streams[1] = audio;
+    header->streams_sequence.fetch_add(1);
+}
+
+bool PacketBusWriter::publish(PacketBusRecord record, const uint8_t *data) {
+    if (!header) return false;
+    uint64_t record_size = aligned(sizeof(PacketBusRecord) + record.size);
+    if (record_size > capacity / 4) return false;
+
+    uint64_t offset = write_position % capacity;
+    if (offset + record_size > capacity) {
+        // The record doesn't fit before the end of the ring. Readers skip the rest of it, so only write a padding
+        // record if there's room for one.
+        if (capacity - offset >= sizeof(PacketBusRecord)) {
+            PacketBusRecord padding{};
+            padding.position = write_position;
+            padding.flags = PACKET_BUS_PADDING;
+            memcpy(ring + offset, &padding, sizeof(padding));
+        }
+        write_position += capacity - offset;
+        offset = 0;
+    }
+
+    record.position = write_position;
+    memcpy(ring + offset, &record, sizeof(record));
+    memcpy(ring + offset + sizeof(record), data, record.size);
+    write_position += record_size;
+    header->write_position.store(write_position, memory_order_release);
+    if (record.stream_index == 0 && (record.flags & PACKET_BUS_KEYFRAME)) {
+        header->keyframe_position.store(record.position, memory_order_release);
+    }
+    wake_readers();
+    return true;
+}
+
+void PacketBusWriter::wake_readers() {
+    header->wake_sequence.fetch_add(1);
+    // Costs nothing while nobody is waiting.
+    if (header->waiting_readers.load() > 0) {
+#ifdef __linux__
+        syscall(SYS_futex, &header->wake_sequence, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+    }
+}
+
+PacketBusReader::PacketBusReader(string camera) : camera(std::move(camera)) {}
+
+PacketBusReader::~PacketBusReader() {
+    detach();
+}
+
+bool PacketBusReader::attach() {
+    if (header) return true;
+    string name = packet_bus_name(camera);
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) return false;
+
+    // Only the header is writable (to register as a waiting reader). The records are mapped read only.
+    void *header_memory = mmap(nullptr, PACKET_BUS_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header_memory == MAP_FAILED) {
+        ::close(fd);
+        return false;
+    }
+    auto *mapped_header = (PacketBusHeader *) header_memory;
+    struct stat file_stat{};
+    if (mapped_header->magic != PACKET_BUS_MAGIC || mapped_header->version != PACKET_BUS_VERSION ||
+        fstat(fd, &file_stat) != 0 || (uint64_t) file_stat.st_size != PACKET_BUS_HEADER_SIZE + mapped_header->capacity) {
+        munmap(header_memory, PACKET_BUS_HEADER_SIZE);
+        ::close(fd);
+        return false;
+    }
+    void *ring_memory = mmap(nullptr, mapped_header->capacity, PROT_READ, MAP_SHARED, fd, PACKET_BUS_HEADER_SIZE);
+    ::close(fd);
+    if (ring_memory == MAP_FAILED) {
+        munmap(header_memory, PACKET_BUS_HEADER_SIZE);
+        return false;
+    }
+    header = mapped_header;
+    ring = (const uint8_t *) ring_memory;
+    capacity = header->capacity;
+    skip_to_keyframe();
+    return true;
+}
+
+void PacketBusReader::detach() {
+    if (!header) return;
+    munmap((void *) ring, capacity);
+    munmap(header, PACKET_BUS_HEADER_SIZE);
+    header = nullptr;
+    ring = nullptr;
+}
+
+bool PacketBusReader::lapped(uint64_t position) const {
+    // The writer may be writing up to half a ring (a padding record and a record) past write_position.
+    return header->write_position.load(memory_order_acquire) - position > capacity / 2;
+}
+
+void PacketBusReader::skip_to_keyframe() {
+    uint64_t keyframe_position = header->keyframe_position.load(memory_order_acquire);
+    if (keyframe_position != PACKET_BUS_NO_KEYFRAME && !lapped(keyframe_position)) {
+        read_position = keyframe_position;
+    } else {
+        read_position = header->write_position.load(memory_order_acquire);
+    }
+}
+
+bool PacketBusReader::read(PacketBusPacket &packet, int timeout_ms) {
+    if (!header) return false;
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+    while (true) {
+        uint64_t write_position = header->write_position.load(memory_order_acquire);
+        if (write_position < read_position) {
+            // The writer started a new ring.
+            skip_to_keyframe();
+            continue;
+        }
+        if (read_position == write_position) {
+            long remaining_ms = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+            if (remaining_ms <= 0) return false;
+            wait((int) remaining_ms);
+            continue;
+        }
+        if (lapped(read_position)) {
+            overrun_count++;
+            skip_to_keyframe();
+            continue;
+        }
+
+        uint64_t offset = read_position % capacity;
+        if (capacity - offset < sizeof(PacketBusRecord)) {
+            read_position += capacity - offset;
+            continue;
+        }
+        memcpy(&packet.record, ring + offset, sizeof(PacketBusRecord));
+        bool valid = packet.record.position == read_position &&
+                     packet.record.size <= capacity - offset - sizeof(PacketBusRecord);
+        if (valid && !(packet.record.flags & PACKET_BUS_PADDING)) {
+            packet.data.assign(ring + offset + sizeof(PacketBusRecord),
+                               ring + offset + sizeof(PacketBusRecord) + packet.record.size);
+        }
+        // Whatever was copied is only good if the writer hasn't come round to it in the meantime.
+        atomic_thread_fence(memory_order_acquire);
+        if (!valid || lapped(read_position)) {
+            overrun_count++;
+            skip_to_keyframe();
+            continue;
+        }
+        if (packet.record.flags & PACKET_BUS_PADDING) {
+            read_position += capacity - offset;
+            continue;
+        }
+        read_position += aligned(sizeof(PacketBusRecord) + packet.record.size);
+        return true;
+    }
+}
+
+void PacketBusReader::wait(int timeout_ms) {
+#ifdef __linux__
+    uint32_t sequence = header->wake_sequence.load();
+    header->waiting_readers.fetch_add(1);
+    if (header->write_position.load() == read_position) {
+        timespec timeout{timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+        syscall(SYS_futex, &header->wake_sequence, FUTEX_WAIT, sequence, &timeout, nullptr, 0);
+    }
+    header->waiting_readers.fetch_sub(1);
+#else
+    this_thread::sleep_for(chrono::milliseconds(min(timeout_ms, 5)));
+#endif
+}
+
+uint32_t PacketBusReader::streams(PacketBusStream &video, PacketBusStream &audio) const {
+    while (true) {
+        uint32_t sequence = header->streams_sequence.load(memory_order_acquire);
+        if (sequence & 1) {
+            this_thread::yield();
+            continue;
+        }
+        video = header->streams[0];
+        audio = header->streams[1];
+        atomic_thread_fence(memory_order_acquire);
+        if (header->streams_sequence.load(memory_order_relaxed) == sequence) return sequence;
+    }
+}
+
+uint32_t PacketBusReader::streams_sequence() const {
+    return header->streams_sequence.load(memory_order_acquire);
+}
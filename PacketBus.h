@@ -0,0 +1,151 @@
+
+#ifndef HOMECAMRECORDER_PACKETBUS_H
+#define HOMECAMRECORDER_PACKETBUS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Shared memory ring of a camera's compressed packets, so local analyzers (a person detector, the prototype behind
+ * socket_server.py) can watch a camera without opening another RTSP session. The cameras only allow 2-3 clients.
+ *
+ * The ring lives in /dev/shm/homecam_<camera>. One writer (the recorder) appends records and never waits for
+ * anyone. Any number of readers attach and detach at will. A reader that falls more than half the ring behind has
+ * been overrun: it skips ahead to the newest keyframe and counts the overrun, and the writer never notices.
+ *
+ * This header has no FFmpeg dependency. Codec ids, media types and time bases are FFmpeg's values as plain ints.
+ *
+ * Layout: a PacketBusHeader in the first page, then capacity bytes of records. Record positions count bytes since
+ * the ring was created and only grow, so a position says both where a record is (position % capacity) and whether
+ * it has been overwritten.
+ */
+
+static const uint32_t PACKET_BUS_MAGIC = 0x48435042; // "HCPB"
+static const uint32_t PACKET_BUS_VERSION = 1;
+static const uint64_t PACKET_BUS_HEADER_SIZE = 4096;
+static const int PACKET_BUS_MAX_EXTRADATA = 1024;
+static const uint64_t PACKET_BUS_NO_KEYFRAME = UINT64_MAX;
+
+static const uint32_t PACKET_BUS_KEYFRAME = 1;
+static const uint32_t PACKET_BUS_CORRUPT = 2;
+// Fills the end of the ring when the next record doesn't fit. Readers skip to the start.
+static const uint32_t PACKET_BUS_PADDING = 4;
+
+// Streams are always 0 for video and 1 for audio.
+struct PacketBusStream {
+    int32_t codec_type{-1};
+    int32_t codec_id{};
+    int32_t width{};
+    int32_t height{};
+    int32_t sample_rate{};
+    int32_t channels{};
+    int32_t time_base_num{};
+    int32_t time_base_den{};
+    int32_t extradata_size{};
+    uint8_t extradata[PACKET_BUS_MAX_EXTRADATA]{};
+};
+
+struct PacketBusHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    atomic<uint64_t> write_position;
+    // Position of the newest video keyframe, where attaching and overrun readers start.
+    atomic<uint64_t> keyframe_position;
+    // Odd while the writer is changing the streams. Changes whenever the readers have to reopen their decoders.
+    atomic<uint32_t> streams_sequence;
+    // Futex word bumped for every record, and the readers waiting on it.
+    atomic<uint32_t> wake_sequence;
+    atomic<uint32_t> waiting_readers;
+    atomic<int32_t> writer_pid;
+    PacketBusStream streams[2];
+};
+
+struct PacketBusRecord {
+    uint64_t position;
+    uint32_t size;
+    uint32_t flags;
+    int32_t stream_index;
+    int32_t reserved;
+    // In the time base of the stream.
+    int64_t pts;
+    int64_t dts;
+    int64_t duration;
+    // When the recorder received the packet.
+    int64_t wall_time_ms;
+};
+
+struct PacketBusPacket {
+    PacketBusRecord record{};
+    vector<uint8_t> data;
+};
+
+static_assert(sizeof(PacketBusHeader) <= PACKET_BUS_HEADER_SIZE, "The header must fit in its page.");
+static_assert(atomic<uint64_t>::is_always_lock_free, "The ring needs address free atomics.");
+
+class PacketBusWriter {
+public:
+    // 8 MB is about 15 s of a 4 Mbit/s main stream.
+    static const uint64_t DEFAULT_CAPACITY = 8 * 1024 * 1024;
+
+    explicit PacketBusWriter(string camera, uint64_t capacity = DEFAULT_CAPACITY);
+    ~PacketBusWriter();
+
+    // Creates the ring, or takes over the one a previous run left, so attached readers carry on.
+    bool open();
+    void close();
+    bool is_open() const { return header != nullptr; }
+
+    void set_streams(const PacketBusStream &video, const PacketBusStream &audio);
+    // Records larger than a quarter of the ring are dropped.
+    bool publish(PacketBusRecord record, const uint8_t *data);
+
+private:
+    const string camera;
+    const uint64_t capacity;
+    PacketBusHeader *header{};
+    uint8_t *ring{};
+    uint64_t write_position{};
+
+    void wake_readers();
+};
+
+class PacketBusReader {
+public:
+    explicit PacketBusReader(string camera);
+    ~PacketBusReader();
+
+    // Maps the ring and starts at its newest keyframe. False if the camera isn't publishing.
+    bool attach();
+    void detach();
+
+    // Waits up to timeout_ms for the next packet. False on timeout.
+    bool read(PacketBusPacket &packet, int timeout_ms);
+
+    // Copies the streams. Returns the sequence they belong to, which changes when the decoders must be reopened.
+    uint32_t streams(PacketBusStream &video, PacketBusStream &audio) const;
+    uint32_t streams_sequence() const;
+
+    long overruns() const { return overrun_count; }
+
+private:
+    const string camera;
+    PacketBusHeader *header{};
+    const uint8_t *ring{};
+    uint64_t capacity{};
+    uint64_t read_position{};
+    long overrun_count{};
+
+    void skip_to_keyframe();
+    bool lapped(uint64_t position) const;
+    void wait(int timeout_ms);
+};
+
+// Name of the shared memory object, /homecam_<camera>.
+string packet_bus_name(const string &camera);
+
+#endif //HOMECAMRECORDER_PACKETBUS_H
@@ -0,0 +1,75 @@
+#include "PacketBus.h"
+
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <thread>
+
+using namespace std::chrono;
+
+/**
+ * Example PacketBus consumer. Follows a camera's packets and prints what it sees every 5 seconds:
+ *
+ *   HomeCamPacketBusExample front_door
+ *
+ * A real analyzer would open a decoder from the streams (codec id and extradata) and decode the keyframes or every
+ * packet, reopening it whenever the streams sequence changes.
+ */
+
+static volatile sig_atomic_t stopping = 0;
+
+static void print_stream(const char *kind, const PacketBusStream &stream) {
+    if (stream.codec_type < 0) return;
+    cout << "(PacketBusExample) " << kind << ": codec " << stream.codec_id;
+    if (stream.width > 0) cout << " " << stream.width << "x" << stream.height;
+    if (stream.sample_rate > 0) cout << " " << stream.sample_rate << " Hz, " << stream.channels << " channels";
+    cout << ", time base " << stream.time_base_num << "/" << stream.time_base_den << ", "
+         << stream.extradata_size << " bytes of extradata" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        cerr << "Usage: " << argv[0] << " <camera>" << endl;
+        return 1;
+    }
+    signal(SIGINT, [](int) { stopping = 1; });
+
+    PacketBusReader reader(argv[1]);
+    while (!stopping && !reader.attach()) {
+        cerr << "(PacketBusExample) " << argv[1] << " isn't publishing yet." << endl;
+        this_thread::sleep_for(seconds(1));
+    }
+
+    uint32_t streams_sequence = UINT32_MAX;
+    PacketBusPacket packet;
+    long packets = 0;
+    long keyframes = 0;
+    long bytes = 0;
+    long latency_ms = 0;
+    auto report_time = steady_clock::now();
+    while (!stopping) {
+        if (reader.read(packet, 1000)) {
+            if (reader.streams_sequence() != streams_sequence) {
+                PacketBusStream video;
+                PacketBusStream audio;
+                streams_sequence = reader.streams(video, audio);
+                print_stream("Video", video);
+                print_stream("Audio", audio);
+            }
+            packets++;
+            bytes += packet.record.size;
+            if (packet.record.stream_index == 0 && (packet.record.flags & PACKET_BUS_KEYFRAME)) keyframes++;
+            latency_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count() -
+                         packet.record.wall_time_ms;
+        }
+        if (steady_clock::now() - report_time >= seconds(5)) {
+            cout << "(PacketBusExample) " << packets << " packets, " << keyframes << " keyframes, "
+                 << (double) bytes * 8 / 5e6 << " Mbit/s, " << latency_ms << " ms behind, " << reader.overruns()
+                 << " overruns." << endl;
+            packets = keyframes = bytes = 0;
+            report_time = steady_clock::now();
+        }
+    }
+    reader.detach();
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "PacketBusMuxer.h"
+
+#include <algorithm>
+#include <cstring>
+
+PacketBusMuxer::PacketBusMuxer(const string &camera) : writer(camera) {}
+
+void PacketBusMuxer::init() {
+    if (!writer.is_open()) {
+        writer.open();
+    }
+    did_init = true;
+}
+
+void PacketBusMuxer::add_stream(AVStream *input_stream, AVCodec *input_codec, bool write_header) {
+    should_add_streams = false;
+    if (input_codec->type == AVMEDIA_TYPE_VIDEO) {
+        video_input_index = input_stream->index;
+        video_stream = describe(input_stream);
+    } else if (input_codec->type == AVMEDIA_TYPE_AUDIO) {
+        audio_input_index = input_stream->index;
+        audio_stream = describe(input_stream);
+    }
+    if (write_header) {
+        writer.set_streams(video_stream, audio_stream);
+    }
+}
+
+PacketBusStream PacketBusMuxer::describe(const AVStream *input_stream) {
+    const AVCodecParameters *params = input_stream->codecpar;
+    PacketBusStream stream;
+    stream.codec_type = params->codec_type;
+    stream.codec_id = params->codec_id;
+    stream.width = params->width;
+    stream.height = params->height;
+    stream.sample_rate = params->sample_rate;
+    stream.channels = params->channels;
+    stream.time_base_num = input_stream->time_base.num;
+    stream.time_base_den = input_stream->time_base.den;
+    stream.extradata_size = min(params->extradata_size, PACKET_BUS_MAX_EXTRADATA);
+    if (stream.extradata_size > 0) {
+        memcpy(stream.extradata, params->extradata, stream.extradata_size);
+    }
+    return stream;
+}
+
+void PacketBusMuxer::send_packet(AVPacket *packet) {
+    PacketBusRecord record{};
+    if (packet->stream_index == video_input_index) {
+        record.stream_index = 0;
+    } else if (packet->stream_index == audio_input_index) {
+        record.stream_index = 1;
+    } else {
+        return;
+    }
+    record.size = packet->size;
+    record.flags = ((packet->flags & AV_PKT_FLAG_KEY) ? PACKET_BUS_KEYFRAME : 0) |
+                   ((packet->flags & AV_PKT_FLAG_CORRUPT) ? PACKET_BUS_CORRUPT : 0);
+    record.pts = packet->pts;
+    record.dts = packet->dts;
+    record.duration = packet->duration;
+    record.wall_time_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    writer.publish(record, packet->data);
+}
+
+void PacketBusMuxer::release() {
+    // The writer stays open, so readers don't have to reattach after a reconnect.
+    video_input_index = -1;
+    audio_input_index = -1;
+    Muxer::release();
+    did_init = false;
+}
@@ -0,0 +1,36 @@
+
+#ifndef HOMECAMRECORDER_PACKETBUSMUXER_H
+#define HOMECAMRECORDER_PACKETBUSMUXER_H
+
+#include <string>
+
+#include "Muxer.h"
+#include "PacketBus.h"
+
+using namespace std;
+
+/**
+ * Publishes a camera's packets and stream parameters on its PacketBus. Writing a packet is two memcpys into shared
+ * memory, so it runs on the camera thread. The ring stays mapped across reconnects, so attached readers only see a
+ * new streams_sequence when the streams change.
+ */
+class PacketBusMuxer : public Muxer {
+public:
+    explicit PacketBusMuxer(const string &camera);
+
+    void send_packet(AVPacket *packet) override;
+    void release() override;
+    void init() override;
+    void add_stream(AVStream *input_stream, AVCodec *input_codec, bool write_header) override;
+
+private:
+    PacketBusWriter writer;
+    int video_input_index{-1};
+    int audio_input_index{-1};
+    PacketBusStream video_stream;
+    PacketBusStream audio_stream;
+
+    static PacketBusStream describe(const AVStream *input_stream);
+};
+
+#endif //HOMECAMRECORDER_PACKETBUSMUXER_H
@@ -0,0 +1,450 @@
+#include "PreviewTranscoder.h"
+
+#include <ctime>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+#include <libavutil/dict.h>
+#include <libswscale/swscale.h>
+}
+
+#include "AVError.h"
+
+TranscodePool::TranscodePool(int thread_count, double cpu_budget_cores) :
+    thread_count(thread_count), cpu_budget_cores(cpu_budget_cores) {}
+
+TranscodePool::~TranscodePool() {
+    stop();
+}
+
+void TranscodePool::start() {
+    stopping = false;
+    for (int i = 0; i < thread_count; i++) {
+        workers.emplace_back(&TranscodePool::run_worker, this);
+    }
+}
+
+void TranscodePool::stop() {
+    stopping = true;
+    wake_up.notify_all();
+    for (thread &worker : workers) {
+        if (worker.joinable())
+            worker.join();
+    }
+    workers.clear();
+}
+
+void TranscodePool::schedule(PreviewMuxer *muxer) {
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        ready_muxers.push_back(muxer);
+    }
+    wake_up.notify_one();
+}
+
+void TranscodePool::run_worker() {
+    while (!stopping) {
+        PreviewMuxer *muxer;
+        {
+            unique_lock<mutex> lock(pool_mutex);
+            if (ready_muxers.empty()) {
+                wake_up.wait(lock, [this] { return stopping || !ready_muxers.empty(); });
+                continue;
+            }
+            muxer = ready_muxers.front();
+            ready_muxers.pop_front();
+        }
+        long cpu_start_ns = thread_cpu_ns();
+        bool has_more = muxer->process_queue();
+        record_cpu_time(thread_cpu_ns() - cpu_start_ns);
+        if (has_more) {
+            // Back of the line, so every camera gets its turn.
+            schedule(muxer);
+        }
+    }
+}
+
+void TranscodePool::record_cpu_time(long cpu_ns) {
+    lock_guard<mutex> lock(budget_mutex);
+    auto now = steady_clock::now();
+    if (budget_window_start == time_point<steady_clock>{}) {
+        budget_window_start = now;
+    }
+    budget_window_cpu_ns += cpu_ns;
+    long elapsed_ns = duration_cast<nanoseconds>(now - budget_window_start).count();
+    if (elapsed_ns < 1000000000L) return;
+
+    double cores = (double) budget_window_cpu_ns / (double) elapsed_ns;
+    if (!over_budget && cores > cpu_budget_cores) {
+        cerr << "(TranscodePool) Using " << cores << " cores, over the budget of " << cpu_budget_cores
+             << ". Previews drop to keyframes only." << endl;
+        over_budget = true;
+    } else if (over_budget && cores < cpu_budget_cores * 0.8) {
+        cout << "(TranscodePool) Using " << cores << " cores, back under budget." << endl;
+        over_budget = false;
+    }
+    budget_window_start = now;
+    budget_window_cpu_ns = 0;
+}
+
+long TranscodePool::thread_cpu_ns() {
+    timespec cpu_time{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time);
+    return cpu_time.tv_sec * 1000000000L + cpu_time.tv_nsec;
+}
+
+PreviewMuxer::PreviewMuxer(vector<PreviewRung> preview_rungs, TranscodePool *pool) :
+    pool(pool), requested_rungs(preview_rungs) {
+    for (PreviewRung &rung : preview_rungs) {
+        RungState state;
+        state.rung = rung;
+        rungs.push_back(state);
+    }
+}
+
+PreviewMuxer::~PreviewMuxer() {
+    unique_lock<mutex> lock(queue_mutex);
+    for (QueuedPacket &item : queue) {
+        av_packet_free(&item.packet);
+    }
+    queue.clear();
+    // A worker may still be on the strand. With the queue empty it lets go at its next look.
+    strand_idle.wait(lock, [this] { return !scheduled; });
+    lock.unlock();
+    close_decoder();
+    for (RungState &state : rungs) {
+        close_rung(state);
+    }
+}
+
+void PreviewMuxer::set_rungs(vector<PreviewRung> preview_rungs) {
+    if (preview_rungs == requested_rungs) return;
+    requested_rungs = preview_rungs;
+    QueuedPacket item;
+    item.rungs = make_shared<vector<PreviewRung>>(std::move(preview_rungs));
+    enqueue(item);
+}
+
+void PreviewMuxer::init() {
+    did_init = true;
+}
+
+void PreviewMuxer::add_stream(AVStream *input_stream, AVCodec *input_codec, bool write_header) {
+    should_add_streams = false;
+    if (input_codec->type != AVMEDIA_TYPE_VIDEO) return;
+    video_input_index = input_stream->index;
+
+    QueuedPacket item;
+    item.params = shared_ptr<AVCodecParameters>(avcodec_parameters_alloc(), [](AVCodecParameters *params) {
+        avcodec_parameters_free(&params);
+    });
+    avcodec_parameters_copy(item.params.get(), input_stream->codecpar);
+    item.time_base = input_stream->time_base;
+    enqueue(item);
+}
+
+void PreviewMuxer::enqueue(QueuedPacket item) {
+    bool needs_schedule;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        queue.push_back(std::move(item));
+        needs_schedule = !scheduled;
+        scheduled = true;
+    }
+    if (needs_schedule) {
+        pool->schedule(this);
+    }
+}
+
+void PreviewMuxer::send_packet(AVPacket *packet) {
+    if (packet->stream_index != video_input_index) return;
+
+    bool needs_schedule;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if (queue.size() >= MAX_QUEUED_PACKETS) {
+            cerr << "(PreviewMuxer) Preview is falling behind, dropping " << queue.size() << " packets." << endl;
+            for (auto item = queue.begin(); item != queue.end();) {
+                if (!item->packet) {
+                    ++item;
+                    continue;
+                }
+                av_packet_free(&item->packet);
+                item = queue.erase(item);
+            }
+            // Packets after the gap can't be decoded until the next keyframe.
+            dropping = true;
+        }
+        if (dropping && !(packet->flags & AV_PKT_FLAG_KEY)) return;
+        dropping = false;
+        QueuedPacket item;
+        item.packet = av_packet_clone(packet);
+        queue.push_back(item);
+        needs_schedule = !scheduled;
+        scheduled = true;
+    }
+    if (needs_schedule) {
+        pool->schedule(this);
+    }
+}
+
+void PreviewMuxer::release() {
+    video_input_index = -1;
+    Muxer::release();
+    did_init = false;
+}
+
+bool PreviewMuxer::process_queue() {
+    for (int i = 0; i < PACKETS_PER_TURN; i++) {
+        QueuedPacket item;
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            if (queue.empty()) {
+                scheduled = false;
+                strand_idle.notify_all();
+                return false;
+            }
+            item = queue.front();
+            queue.pop_front();
+        }
+        if (item.params) {
+            open_decoder(item);
+        } else if (item.rungs) {
+            replace_rungs(*item.rungs);
+        } else {
+            process_packet(item.packet);
+            av_packet_free(&item.packet);
+        }
+    }
+    lock_guard<mutex> lock(queue_mutex);
+    if (queue.empty()) {
+        scheduled = false;
+        strand_idle.notify_all();
+        return false;
+    }
+    return true;
+}
+
+void PreviewMuxer::replace_rungs(const vector<PreviewRung> &preview_rungs) {
+    for (RungState &state : rungs) {
+        close_rung(state);
+    }
+    rungs.clear();
+    for (const PreviewRung &rung : preview_rungs) {
+        RungState state;
+        state.rung = rung;
+        rungs.push_back(state);
+    }
+}
+
+void PreviewMuxer::open_decoder(const QueuedPacket &item) {
+    close_decoder();
+    // The input restarted, so the outputs restart too rather than jumping back in time.
+    for (RungState &state : rungs) {
+        close_rung(state);
+    }
+
+    AVCodec *codec = avcodec_find_decoder(item.params->codec_id);
+    if (!codec) {
+        cerr << "(PreviewMuxer) No decoder for the input." << endl;
+        return;
+    }
+    decoder_ctx = avcodec_alloc_context3(codec);
+    decoder_ctx->thread_count = 1;
+    if (avcodec_parameters_to_context(decoder_ctx, item.params.get()) < 0 ||
+        avcodec_open2(decoder_ctx, codec, nullptr) < 0) {
+        cerr << "(PreviewMuxer) Failed to open the decoder." << endl;
+        close_decoder();
+        return;
+    }
+    if (keyframes_only) {
+        decoder_ctx->skip_frame = AVDISCARD_NONKEY;
+    }
+    if (transport_monitor) {
+        TransportMonitor::watch(decoder_ctx, transport_monitor.get(), true);
+    }
+    input_time_base = item.time_base;
+    decoded_frame = av_frame_alloc();
+    first_pts = AV_NOPTS_VALUE;
+    last_source_pts = AV_NOPTS_VALUE;
+    waiting_for_key_frame = true;
+}
+
+void PreviewMuxer::close_decoder() {
+    if (decoder_ctx) {
+        TransportMonitor::unwatch(decoder_ctx);
+    }
+    avcodec_free_context(&decoder_ctx);
+    av_frame_free(&decoded_frame);
+}
+
+void PreviewMuxer::process_packet(AVPacket *packet) {
+    if (!decoder_ctx) return;
+
+    bool over_budget = pool->is_over_budget();
+    if (over_budget != keyframes_only) {
+        keyframes_only = over_budget;
+        decoder_ctx->skip_frame = keyframes_only ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+        // Frames after the next keyframe may reference ones that were skipped.
+        waiting_for_key_frame = true;
+    }
+    bool is_key_frame = packet->flags & AV_PKT_FLAG_KEY;
+    if ((waiting_for_key_frame || keyframes_only) && !is_key_frame) return;
+    waiting_for_key_frame = false;
+
+    int ret = avcodec_send_packet(decoder_ctx, packet);
+    if (ret < 0) {
+        // A packet was dropped upstream, start again at the next keyframe.
+        waiting_for_key_frame = true;
+        return;
+    }
+    while (avcodec_receive_frame(decoder_ctx, decoded_frame) == 0) {
+        int64_t source_pts = decoded_frame->best_effort_timestamp != AV_NOPTS_VALUE ?
+                             decoded_frame->best_effort_timestamp : decoded_frame->pts;
+        if (source_pts != AV_NOPTS_VALUE) {
+            if (first_pts == AV_NOPTS_VALUE) {
+                first_pts = source_pts;
+            } else if (source_pts < last_source_pts) {
+                // The camera reconnected and its timestamps started over. Carry on from where the preview was.
+                first_pts = source_pts - (last_source_pts - first_pts) - 1;
+            }
+            last_source_pts = source_pts;
+            for (RungState &state : rungs) {
+                encode_frame(state, source_pts);
+            }
+        }
+        av_frame_unref(decoded_frame);
+    }
+}
+
+void PreviewMuxer::encode_frame(RungState &state, int64_t source_pts) {
+    if (!state.encoder_ctx) {
+        if (steady_clock::now() < state.retry_time) return;
+        if (!open_rung(state)) {
+            state.retry_time = steady_clock::now() + seconds(OUTPUT_RETRY_INTERVAL_SEC);
+            return;
+        }
+    }
+
+    // Frames closer together than the preview frame rate are skipped here.
+    int64_t pts = av_rescale_q(source_pts - first_pts, input_time_base, state.encoder_ctx->time_base);
+    if (pts <= state.last_pts) return;
+    state.last_pts = pts;
+
+    state.sws_ctx = sws_getCachedContext(state.sws_ctx, decoded_frame->width, decoded_frame->height,
+                                         (AVPixelFormat) decoded_frame->format, state.rung.width, state.height,
+                                         AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+    if (!state.sws_ctx || av_frame_make_writable(state.scaled_frame) < 0) return;
+    sws_scale(state.sws_ctx, decoded_frame->data, decoded_frame->linesize, 0, decoded_frame->height,
+              state.scaled_frame->data, state.scaled_frame->linesize);
+    state.scaled_frame->pts = pts;
+    if (avcodec_send_frame(state.encoder_ctx, state.scaled_frame) < 0) return;
+    write_encoded_packets(state);
+}
+
+void PreviewMuxer::write_encoded_packets(RungState &state) {
+    AVPacket *packet = av_packet_alloc();
+    while (state.encoder_ctx && avcodec_receive_packet(state.encoder_ctx, packet) == 0) {
+        AVStream *output_stream = state.output_ctx->streams[0];
+        packet->stream_index = 0;
+        av_packet_rescale_ts(packet, state.encoder_ctx->time_base, output_stream->time_base);
+        int ret = av_write_frame(state.output_ctx, packet);
+        av_packet_unref(packet);
+        if (ret < 0) {
+            cerr << "(PreviewMuxer) Failed to write to " << state.rung.output_url << ". Error = " << av_err2str(ret)
+                 << ". Retrying in " << OUTPUT_RETRY_INTERVAL_SEC << " seconds." << endl;
+            close_rung(state);
+            state.retry_time = steady_clock::now() + seconds(OUTPUT_RETRY_INTERVAL_SEC);
+        }
+    }
+    av_packet_free(&packet);
+}
+
+bool PreviewMuxer::open_rung(RungState &state) {
+    const PreviewRung &rung = state.rung;
+    AVCodec *encoder = avcodec_find_encoder_by_name("libx264");
+    if (!encoder) {
+        cerr << "(PreviewMuxer) libx264 is not available." << endl;
+        return false;
+    }
+    state.height = max(2, (rung.width * decoded_frame->height / max(1, decoded_frame->width)) & ~1);
+
+    try {
+        if (avformat_alloc_output_context2(&state.output_ctx, nullptr, "flv", rung.output_url.c_str()) < 0) {
+            cerr << "(PreviewMuxer) Failed to create output context for " << rung.output_url << endl;
+            throw -1;
+        }
+
+        state.encoder_ctx = avcodec_alloc_context3(encoder);
+        AVCodecContext *encoder_ctx = state.encoder_ctx;
+        encoder_ctx->width = rung.width;
+        encoder_ctx->height = state.height;
+        encoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+        encoder_ctx->time_base = {1, rung.fps};
+        encoder_ctx->framerate = {rung.fps, 1};
+        encoder_ctx->bit_rate = rung.bitrate_kbps * 1000L;
+        encoder_ctx->rc_max_rate = rung.bitrate_kbps * 1000;
+        encoder_ctx->rc_buffer_size = rung.bitrate_kbps * 1000;
+        encoder_ctx->gop_size = rung.fps * 2;
+        encoder_ctx->max_b_frames = 0;
+        encoder_ctx->thread_count = 1;
+        if (state.output_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+            encoder_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        }
+        AVDictionary *options = nullptr;
+        av_dict_set(&options, "preset", "veryfast", 0);
+        av_dict_set(&options, "tune", "zerolatency", 0);
+        av_dict_set(&options, "profile", "baseline", 0);
+        int ret = avcodec_open2(encoder_ctx, encoder, &options);
+        av_dict_free(&options);
+        if (ret < 0) {
+            cerr << "(PreviewMuxer) Failed to open x264. Error = " << av_err2str(ret) << endl;
+            throw ret;
+        }
+
+        AVStream *output_stream = avformat_new_stream(state.output_ctx, nullptr);
+        avcodec_parameters_from_context(output_stream->codecpar, encoder_ctx);
+        output_stream->time_base = {1, 1000};
+        ret = avio_open(&state.output_ctx->pb, rung.output_url.c_str(), AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            cerr << "(PreviewMuxer) Failed to open " << rung.output_url << ". Error = " << av_err2str(ret) << endl;
+            throw ret;
+        }
+        ret = avformat_write_header(state.output_ctx, nullptr);
+        if (ret < 0) {
+            cerr << "(PreviewMuxer) Failed to write header to " << rung.output_url << endl;
+            throw ret;
+        }
+        state.header_written = true;
+
+        state.scaled_frame = av_frame_alloc();
+        state.scaled_frame->format = AV_PIX_FMT_YUV420P;
+        state.scaled_frame->width = rung.width;
+        state.scaled_frame->height = state.height;
+        if (av_frame_get_buffer(state.scaled_frame, 0) < 0) throw -1;
+    } catch (int e) {
+        close_rung(state);
+        return false;
+    }
+    state.last_pts = -1;
+    cout << "(PreviewMuxer) Publishing " << rung.width << "x" << state.height << " at " << rung.fps << " fps, "
+         << rung.bitrate_kbps << " kbit/s to " << rung.output_url << endl;
+    return true;
+}
+
+void PreviewMuxer::close_rung(RungState &state) {
+    if (state.output_ctx) {
+        if (state.header_written) {
+            av_write_trailer(state.output_ctx);
+        }
+        avio_closep(&state.output_ctx->pb);
+        avformat_free_context(state.output_ctx);
+        state.output_ctx = nullptr;
+    }
+    state.header_written = false;
+    avcodec_free_context(&state.encoder_ctx);
+    av_frame_free(&state.scaled_frame);
+    sws_freeContext(state.sws_ctx);
+    state.sws_ctx = nullptr;
+}
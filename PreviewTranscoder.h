@@ -0,0 +1,171 @@
+
+#ifndef HOMECAMRECORDER_PREVIEWTRANSCODER_H
+#define HOMECAMRECORDER_PREVIEWTRANSCODER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Muxer.h"
+#include "TransportMonitor.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+struct SwsContext;
+
+using namespace std;
+using namespace std::chrono;
+
+/**
+ * One rendition of a camera's preview.
+ */
+struct PreviewRung {
+    string output_url;
+    int width;
+    int fps;
+    int bitrate_kbps;
+
+    bool operator==(const PreviewRung &other) const {
+        return output_url == other.output_url && width == other.width && fps == other.fps &&
+               bitrate_kbps == other.bitrate_kbps;
+    }
+};
+
+class PreviewMuxer;
+
+/**
+ * Worker threads shared by the preview transcodes of all cameras. Each PreviewMuxer is a strand: its packets are
+ * processed in order by one worker at a time, so a camera's decoder and encoders never need a lock.
+ *
+ * The CPU time the workers spend is measured every second against a budget in cores. Above the budget the
+ * previews drop to keyframes only, and go back to full frame rate below 80% of it.
+ */
+class TranscodePool {
+public:
+    TranscodePool(int thread_count, double cpu_budget_cores);
+    ~TranscodePool();
+
+    void start();
+    void stop();
+
+    void schedule(PreviewMuxer *muxer);
+    bool is_over_budget() const { return over_budget; }
+
+private:
+    const int thread_count;
+    const double cpu_budget_cores;
+
+    mutex pool_mutex;
+    condition_variable wake_up;
+    deque<PreviewMuxer *> ready_muxers;
+    atomic<bool> stopping{false};
+    atomic<bool> over_budget{false};
+    vector<thread> workers;
+
+    mutex budget_mutex;
+    long budget_window_cpu_ns{};
+    time_point<steady_clock> budget_window_start{};
+
+    void run_worker();
+    void record_cpu_time(long cpu_ns);
+    static long thread_cpu_ns();
+};
+
+/**
+ * Low resolution, low frame rate live preview of a camera for watching over a slow connection. The main stream is
+ * decoded, scaled and encoded with x264 for every rung, and each rung is published as FLV next to the passthrough
+ * stream. Only video is published.
+ *
+ * send_packet only queues a reference to the packet, the work happens on the TranscodePool. When the queue backs up
+ * past MAX_QUEUED_PACKETS the queued packets are dropped and the preview restarts at the next keyframe.
+ */
+class PreviewMuxer : public Muxer {
+public:
+    PreviewMuxer(vector<PreviewRung> rungs, TranscodePool *pool);
+    // Waits for the pool to finish with the muxer, so the pool must still be running.
+    ~PreviewMuxer() override;
+
+    // Changes the outputs on the thread feeding the muxer. Call it at a keyframe, so the new outputs start with a
+    // picture. The decoder keeps running.
+    void set_rungs(vector<PreviewRung> preview_rungs);
+
+    void send_packet(AVPacket *packet) override;
+    void release() override;
+    void init() override;
+    void add_stream(AVStream *input_stream, AVCodec *input_codec, bool write_header) override;
+
+    // Decode errors of the preview count as loss of the camera's stream.
+    shared_ptr<TransportMonitor> transport_monitor;
+
+private:
+    friend class TranscodePool;
+
+    static const size_t MAX_QUEUED_PACKETS = 90;
+    // Packets processed per turn of the strand, so one camera can't hold a worker forever.
+    static const int PACKETS_PER_TURN = 8;
+    const int OUTPUT_RETRY_INTERVAL_SEC = 5;
+
+    struct QueuedPacket {
+        AVPacket *packet{};
+        // Set when the input was (re)opened. The decoder is reopened with these parameters.
+        shared_ptr<AVCodecParameters> params;
+        AVRational time_base{};
+        // Set when the outputs changed.
+        shared_ptr<vector<PreviewRung>> rungs;
+    };
+
+    struct RungState {
+        PreviewRung rung;
+        int height{};
+        SwsContext *sws_ctx{};
+        AVCodecContext *encoder_ctx{};
+        AVFormatContext *output_ctx{};
+        AVFrame *scaled_frame{};
+        bool header_written{false};
+        int64_t last_pts{-1};
+        time_point<steady_clock> retry_time{};
+    };
+
+    TranscodePool *pool;
+    int video_input_index{-1};
+    // The rungs as last set, on the thread feeding the muxer.
+    vector<PreviewRung> requested_rungs;
+
+    // Guards the queue and the scheduled flag, everything below them belongs to the strand.
+    mutex queue_mutex;
+    deque<QueuedPacket> queue;
+    bool scheduled{false};
+    condition_variable strand_idle;
+    // Set after packets were dropped, until the next keyframe.
+    bool dropping{false};
+
+    vector<RungState> rungs;
+    AVCodecContext *decoder_ctx{};
+    AVRational input_time_base{};
+    AVFrame *decoded_frame{};
+    int64_t first_pts{AV_NOPTS_VALUE};
+    int64_t last_source_pts{AV_NOPTS_VALUE};
+    bool waiting_for_key_frame{true};
+    bool keyframes_only{false};
+
+    void enqueue(QueuedPacket item);
+    // Runs on a pool worker. Returns true if there are more packets.
+    bool process_queue();
+    void replace_rungs(const vector<PreviewRung> &preview_rungs);
+    void process_packet(AVPacket *packet);
+    void open_decoder(const QueuedPacket &item);
+    void close_decoder();
+    void encode_frame(RungState &state, int64_t source_pts);
+    bool open_rung(RungState &state);
+    void close_rung(RungState &state);
+    void write_encoded_packets(RungState &state);
+};
+
+#endif //HOMECAMRECORDER_PREVIEWTRANSCODER_H
@@ -0,0 +1,289 @@
+#include "QosScheduler.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Where the process may raise it (CAP_SYS_NICE or RLIMIT_NICE). Otherwise the camera threads stay at 0, which is
+// still above the background class.
+static const int REALTIME_NICE = -5;
+static const int CLASS_COUNT = 2;
+
+atomic<int> QosScheduler::pause_reasons{0};
+atomic<long> QosScheduler::ingest_latency_ms{0};
+atomic<long> QosScheduler::disk_write_latency_us{0};
+atomic<long> QosScheduler::last_ingest_ms{0};
+atomic<long> QosScheduler::last_disk_write_ms{0};
+
+static mutex scheduler_mutex;
+static condition_variable resumed;
+static condition_variable wake_up;
+static atomic<bool> stopping{false};
+static thread monitor;
+static QosPolicy active_policy;
+static cpu_set_t class_cpus[CLASS_COUNT];
+static bool has_class_cpus[CLASS_COUNT];
+static vector<QosThread *> members;
+// CPU time of the threads that left each class.
+static long retired_cpu_ns[CLASS_COUNT];
+static QosClassUsage last_usage[CLASS_COUNT];
+static long worst_ingest_ms;
+static long worst_disk_write_ms;
+
+static long cpu_ns(clockid_t clock) {
+    timespec cpu_time{};
+    if (clock_gettime(clock, &cpu_time) != 0) return 0;
+    return cpu_time.tv_sec * 1000000000L + cpu_time.tv_nsec;
+}
+
+// A list like "0-1,3".
+static bool parse_cpus(const string &list, cpu_set_t &cpus) {
+    CPU_ZERO(&cpus);
+    stringstream stream(list);
+    string range;
+    while (getline(stream, range, ',')) {
+        int first = -1;
+        int last = -1;
+        int fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (fields < 1) return false;
+        if (fields == 1) last = first;
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+        for (int cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+    return CPU_COUNT(&cpus) > 0;
+}
+
+void QosPolicy::from_environment(QosPolicy &policy) {
+    if (const char *cpus = getenv("HOMECAM_QOS_REALTIME_CPUS")) policy.realtime_cpus = cpus;
+    if (const char *cpus = getenv("HOMECAM_QOS_BACKGROUND_CPUS")) policy.background_cpus = cpus;
+    if (const char *cores = getenv("HOMECAM_QOS_BACKGROUND_CORES")) policy.background_cores = atof(cores);
+    if (const char *latency = getenv("HOMECAM_QOS_MAX_INGEST_LATENCY_MS")) {
+        policy.max_ingest_latency_ms = atol(latency);
+    }
+    if (const char *latency = getenv("HOMECAM_QOS_MAX_WRITE_LATENCY_MS")) {
+        policy.max_disk_write_latency_ms = atol(latency);
+    }
+}
+
+QosThread::QosThread(QosClass qos_class) : qos_class(qos_class) {
+#ifdef __linux__
+    pid_t tid = (pid_t) syscall(SYS_gettid);
+    const int IOPRIO_WHO_PROCESS = 1;
+    const int IOPRIO_CLASS_BE = 2;
+    if (qos_class == QosClass::REALTIME) {
+        setpriority(PRIO_PROCESS, tid, REALTIME_NICE);
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_BE << 13 | 0);
+    } else {
+        setpriority(PRIO_PROCESS, tid, 19);
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_BE << 13 | 7);
+    }
+#endif
+    if (pthread_getcpuclockid(pthread_self(), &cpu_clock) != 0) {
+        cpu_clock = CLOCK_THREAD_CPUTIME_ID;
+    }
+    start_cpu_ns = cpu_ns(cpu_clock);
+    QosScheduler::join(this);
+}
+
+QosThread::~QosThread() {
+    QosScheduler::leave(this);
+}
+
+void QosScheduler::join(QosThread *thread) {
+    lock_guard<mutex> lock(scheduler_mutex);
+    members.push_back(thread);
+    int index = (int) thread->qos_class;
+    if (!has_class_cpus[index]) return;
+    cpu_set_t current;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(current), &current) != 0) return;
+    cpu_set_t allowed;
+    CPU_AND(&allowed, &current, &class_cpus[index]);
+    if (CPU_COUNT(&allowed) > 0) {
+        pthread_setaffinity_np(pthread_self(), sizeof(allowed), &allowed);
+    }
+}
+
+void QosScheduler::leave(QosThread *thread) {
+    lock_guard<mutex> lock(scheduler_mutex);
+    retired_cpu_ns[(int) thread->qos_class] += cpu_ns(thread->cpu_clock) - thread->start_cpu_ns;
+    members.erase(remove(members.begin(), members.end(), thread), members.end());
+}
+
+// With scheduler_mutex held, so no member leaves while its clock is read.
+long QosScheduler::class_cpu_ns(QosClass qos_class) {
+    long total = retired_cpu_ns[(int) qos_class];
+    for (QosThread *member : members) {
+        if (member->qos_class == qos_class) {
+            total += cpu_ns(member->cpu_clock) - member->start_cpu_ns;
+        }
+    }
+    return total;
+}
+
+void QosScheduler::start(const QosPolicy &policy) {
+    {
+        lock_guard<mutex> lock(scheduler_mutex);
+        active_policy = policy;
+        const string *cpu_lists[CLASS_COUNT] = {&policy.realtime_cpus, &policy.background_cpus};
+        for (int i = 0; i < CLASS_COUNT; i++) {
+            has_class_cpus[i] = !cpu_lists[i]->empty() && parse_cpus(*cpu_lists[i], class_cpus[i]);
+            if (!cpu_lists[i]->empty() && !has_class_cpus[i]) {
+                cerr << "(QoS) Ignoring the CPU list \"" << *cpu_lists[i] << "\"." << endl;
+            }
+        }
+    }
+    stopping = false;
+    monitor = thread(&QosScheduler::run);
+}
+
+void QosScheduler::stop() {
+    stopping = true;
+    wake_up.notify_all();
+    if (monitor.joinable())
+        monitor.join();
+}
+
+void QosScheduler::throttle() {
+    if (!paused()) return;
+    unique_lock<mutex> lock(scheduler_mutex);
+    resumed.wait_for(lock, milliseconds(MAX_PAUSE_MS), [] { return !paused(); });
+}
+
+QosClassUsage QosScheduler::usage(QosClass qos_class) {
+    lock_guard<mutex> lock(scheduler_mutex);
+    return last_usage[(int) qos_class];
+}
+
+static string format_report() {
+    const QosClassUsage &realtime = last_usage[(int) QosClass::REALTIME];
+    const QosClassUsage &background = last_usage[(int) QosClass::BACKGROUND];
+    char report[256];
+    snprintf(report, sizeof(report),
+             "Realtime: %d threads, %.2f cores. Background: %d threads, %.2f cores, paused %.0f%% "
+             "(%ld over budget, %ld for latency). Ingest latency up to %ld ms, disk writes up to %ld ms.",
+             realtime.threads, realtime.cores, background.threads, background.cores, background.paused_fraction * 100,
+             background.budget_pauses, background.latency_pauses, worst_ingest_ms, worst_disk_write_ms);
+    return report;
+}
+
+string QosScheduler::report() {
+    lock_guard<mutex> lock(scheduler_mutex);
+    return format_report();
+}
+
+void QosScheduler::run() {
+    unique_lock<mutex> lock(scheduler_mutex);
+    const QosPolicy policy = active_policy;
+    const double quota_ns = policy.background_cores * PERIOD_MS * 1000000.0;
+    double quota_left_ns = quota_ns;
+    long last_cpu_ns[CLASS_COUNT];
+    long report_cpu_ns[CLASS_COUNT] = {};
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        last_cpu_ns[i] = class_cpu_ns((QosClass) i);
+    }
+    bool latency_paused = false;
+    auto last_over_latency = steady_clock::now();
+    auto last_check = steady_clock::now();
+    auto report_start = last_check;
+    long paused_ns = 0;
+    long budget_pauses = 0;
+    long latency_pauses = 0;
+    long report_ingest_ms = 0;
+    long report_disk_write_ms = 0;
+
+    while (!stopping) {
+        wake_up.wait_for(lock, milliseconds(PERIOD_MS), [] { return stopping.load(); });
+        if (stopping) break;
+        auto now = steady_clock::now();
+        long elapsed_ns = duration_cast<nanoseconds>(now - last_check).count();
+        last_check = now;
+
+        long used_ns[CLASS_COUNT];
+        for (int i = 0; i < CLASS_COUNT; i++) {
+            long total_ns = class_cpu_ns((QosClass) i);
+            used_ns[i] = max(0L, total_ns - last_cpu_ns[i]);
+            last_cpu_ns[i] = total_ns;
+            report_cpu_ns[i] += used_ns[i];
+        }
+        quota_left_ns = min(quota_left_ns + quota_ns - (double) used_ns[(int) QosClass::BACKGROUND],
+                            quota_ns * BURST_PERIODS);
+        bool over_budget = quota_left_ns < 0;
+
+        long ingest_ms = ingest_latency_ms.exchange(0, memory_order_relaxed);
+        long disk_write_ms = disk_write_latency_us.exchange(0, memory_order_relaxed) / 1000;
+        last_ingest_ms.store(ingest_ms, memory_order_relaxed);
+        last_disk_write_ms.store(disk_write_ms, memory_order_relaxed);
+        report_ingest_ms = max(report_ingest_ms, ingest_ms);
+        report_disk_write_ms = max(report_disk_write_ms, disk_write_ms);
+        if (ingest_ms > policy.max_ingest_latency_ms || disk_write_ms > policy.max_disk_write_latency_ms) {
+            last_over_latency = now;
+            if (!latency_paused) {
+                cerr << "(QoS) Pausing background work. Ingest latency " << ingest_ms << " ms, disk write "
+                     << disk_write_ms << " ms." << endl;
+                latency_paused = true;
+                latency_pauses++;
+            }
+        } else if (latency_paused &&
+                   duration_cast<milliseconds>(now - last_over_latency).count() >= RESUME_AFTER_MS) {
+            cout << "(QoS) Resuming background work." << endl;
+            latency_paused = false;
+        }
+
+        int previous = pause_reasons.load(memory_order_relaxed);
+        int reasons = (over_budget ? PAUSE_BUDGET : 0) | (latency_paused ? PAUSE_LATENCY : 0);
+        if (previous != 0) {
+            paused_ns += elapsed_ns;
+        }
+        if ((reasons & PAUSE_BUDGET) && !(previous & PAUSE_BUDGET)) {
+            budget_pauses++;
+        }
+        pause_reasons.store(reasons, memory_order_relaxed);
+        if (previous != 0 && reasons == 0) {
+            resumed.notify_all();
+        }
+
+        long report_ns = duration_cast<nanoseconds>(now - report_start).count();
+        if (report_ns >= REPORT_INTERVAL_SEC * 1000000000L) {
+            for (int i = 0; i < CLASS_COUNT; i++) {
+                QosClassUsage &usage = last_usage[i];
+                usage = QosClassUsage();
+                usage.threads = (int) count_if(members.begin(), members.end(), [i](const QosThread *member) {
+                    return (int) member->qos_class == i;
+                });
+                usage.cores = (double) report_cpu_ns[i] / (double) report_ns;
+                report_cpu_ns[i] = 0;
+            }
+            QosClassUsage &background = last_usage[(int) QosClass::BACKGROUND];
+            background.paused_fraction = (double) paused_ns / (double) report_ns;
+            background.budget_pauses = budget_pauses;
+            background.latency_pauses = latency_pauses;
+            worst_ingest_ms = report_ingest_ms;
+            worst_disk_write_ms = report_disk_write_ms;
+            cout << "(QoS) " << format_report() << endl;
+            report_start = now;
+            paused_ns = 0;
+            budget_pauses = 0;
+            latency_pauses = 0;
+            report_ingest_ms = 0;
+            report_disk_write_ms = 0;
+        }
+    }
+    pause_reasons.store(0, memory_order_relaxed);
+    resumed.notify_all();
+}
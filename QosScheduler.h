@@ -0,0 +1,144 @@
+
+#ifndef HOMECAMRECORDER_QOSSCHEDULER_H
+#define HOMECAMRECORDER_QOSSCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+using namespace std;
+using namespace std::chrono;
+
+enum class QosClass : uint8_t {
+    // Reading the cameras and writing their segments.
+    REALTIME,
+    // Anything that can wait: retention deletes, uploads, compaction, summaries, thumbnails, audio analysis.
+    BACKGROUND
+};
+
+struct QosPolicy {
+    // CPUs the threads of each class run on, like "0-1,3". Empty leaves them where they are. A thread already pinned
+    // elsewhere (a worker on its camera's CPU) keeps the CPUs both allow, or its own when they share none.
+    string realtime_cpus;
+    string background_cpus;
+    // CPU time the background class may use, in cores, enforced over each period like a cgroup's cpu.max.
+    double background_cores{1.0};
+    // Background work pauses while the cameras' packets are read this late, or a segment write takes this long.
+    long max_ingest_latency_ms{500};
+    long max_disk_write_latency_ms{250};
+
+    // Overrides the defaults with HOMECAM_QOS_REALTIME_CPUS, HOMECAM_QOS_BACKGROUND_CPUS, HOMECAM_QOS_BACKGROUND_CORES,
+    // HOMECAM_QOS_MAX_INGEST_LATENCY_MS and HOMECAM_QOS_MAX_WRITE_LATENCY_MS when they're set.
+    static void from_environment(QosPolicy &policy);
+};
+
+// What a class used over the last report interval.
+struct QosClassUsage {
+    int threads{};
+    double cores{};
+    // Background only.
+    double paused_fraction{};
+    long budget_pauses{};
+    long latency_pauses{};
+};
+
+/**
+ * Puts the calling thread in a QosClass for as long as the object lives. Create it first thing in the thread's
+ * function:
+ *
+ *   REALTIME    best effort I/O at its highest level, and a nicer CPU priority where the process may raise it.
+ *   BACKGROUND  nice 19, and best effort I/O at its lowest level rather than idle, so uploads still move while the
+ *               cameras keep the disk busy.
+ *
+ * Not SCHED_IDLE: every background component takes a lock the camera threads take too (RetentionManager's segments,
+ * the catalog, its own queue). A thread in the idle class can be kept off the CPU indefinitely while it holds one,
+ * and the camera threads would wait behind it. At nice 19 it still gets a slice, so a wait is short.
+ *
+ * The thread's CPU time counts towards its class's usage until the object is destroyed.
+ */
+class QosThread {
+public:
+    explicit QosThread(QosClass qos_class);
+    ~QosThread();
+    QosThread(const QosThread &) = delete;
+    QosThread &operator=(const QosThread &) = delete;
+
+private:
+    const QosClass qos_class;
+    clockid_t cpu_clock{};
+    long start_cpu_ns{};
+
+    friend class QosScheduler;
+};
+
+/**
+ * Keeps background work out of the way of recording. Threads join a class with a QosThread. The camera threads report
+ * how late they read packets and the segment writers how long their writes take. A monitor thread checks every
+ * PERIOD_MS:
+ *
+ *   - the background class's CPU time against its budget. Like a cgroup's cpu.max, a class that used up its quota is
+ *     paused for the rest of the period, and a quiet period banks at most BURST_PERIODS of quota.
+ *   - the worst ingest and disk write latency since the last check against the policy's limits. Once either is over,
+ *     background work pauses until both have stayed under for RESUME_AFTER_MS.
+ *
+ * Pausing is cooperative: background loops call throttle() between two units of work (a segment, a part, a
+ * thumbnail), which waits while the class is paused. A pause never holds a thread longer than MAX_PAUSE_MS, so
+ * deletes still make progress on a disk that stays slow.
+ *
+ * Usage per class is logged every REPORT_INTERVAL_SEC. Until start() (and in commands that never call it) classes are
+ * still applied and nothing is paused.
+ */
+class QosScheduler {
+public:
+    static const long PERIOD_MS = 250;
+    static const int BURST_PERIODS = 4;
+    static const long RESUME_AFTER_MS = 2000;
+    static const long MAX_PAUSE_MS = 10000;
+    static const long REPORT_INTERVAL_SEC = 60;
+
+    static void start(const QosPolicy &policy);
+    static void stop();
+
+    // Called by background work between two units of work.
+    static void throttle();
+    static bool paused() { return pause_reasons.load(memory_order_relaxed) != 0; }
+
+    // How late a packet was read, from the camera thread. Cheap enough for every packet.
+    static void record_ingest_latency(long latency_ms) { record_max(ingest_latency_ms, latency_ms); }
+    // How long a write of recorded data to disk took.
+    static void record_disk_write(long latency_us) { record_max(disk_write_latency_us, latency_us); }
+    // Worst latencies of the last period, for the status page.
+    static long last_ingest_latency_ms() { return last_ingest_ms.load(memory_order_relaxed); }
+    static long last_disk_write_latency_ms() { return last_disk_write_ms.load(memory_order_relaxed); }
+
+    static QosClassUsage usage(QosClass qos_class);
+    static string report();
+
+private:
+    enum PauseReason : int {
+        PAUSE_BUDGET = 1,
+        PAUSE_LATENCY = 2
+    };
+
+    static atomic<int> pause_reasons;
+    static atomic<long> ingest_latency_ms;
+    static atomic<long> disk_write_latency_us;
+    static atomic<long> last_ingest_ms;
+    static atomic<long> last_disk_write_ms;
+
+    static void record_max(atomic<long> &maximum, long value) {
+        long current = maximum.load(memory_order_relaxed);
+        while (value > current && !maximum.compare_exchange_weak(current, value, memory_order_relaxed)) {}
+    }
+
+    static void join(QosThread *thread);
+    static void leave(QosThread *thread);
+    static void run();
+    static long class_cpu_ns(QosClass qos_class);
+
+    friend class QosThread;
+};
+
+#endif //HOMECAMRECORDER_QOSSCHEDULER_H
@@ -0,0 +1,535 @@
+#include "RecordingCatalog.h"
+#include "SegmentRecovery.h"
+#include "MotionEvent.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std::chrono;
+
+#ifdef __APPLE__
+using namespace std::__fs::filesystem;
+#else
+using namespace std::filesystem;
+#endif
+
+static vector<string> split_fields(const string &line) {
+    vector<string> fields;
+    stringstream stream(line);
+    string field;
+    while (getline(stream, field, '\t')) {
+        fields.push_back(field);
+    }
+    return fields;
+}
+
+RecordingCatalog::RecordingCatalog(string recordings_dir) :
+    recordings_dir(recordings_dir), catalog_path(recordings_dir + "/catalog.log") {}
+
+RecordingCatalog::~RecordingCatalog() {
+    if (catalog_fd >= 0) {
+        close(catalog_fd);
+    }
+}
+
+string RecordingCatalog::camera_name(const string &basename) {
+    return path(basename).filename().string();
+}
+
+void RecordingCatalog::load(bool read_only) {
+    lock_guard<mutex> lock(catalog_mutex);
+    entries.clear();
+    entries_by_start_time.clear();
+
+    ifstream catalog_file(catalog_path);
+    replayed_bytes = 0;
+    if (catalog_file.is_open()) {
+        string line;
+        while (getline(catalog_file, line)) {
+            if (!catalog_file.eof()) {
+                replayed_bytes += (long) line.size() + 1;
+            }
+            // A torn last line after a crash fails to parse and is dropped.
+            try {
+                replay(split_fields(line));
+            } catch (const exception &e) {
+                cerr << "(RecordingCatalog) Ignoring bad record: " << line << endl;
+            }
+        }
+        catalog_file.close();
+        // A read only catalog runs next to the recorder, whose open segments are still being written.
+        repair_open_entries(!read_only);
+    } else {
+        cout << "(RecordingCatalog) No catalog at " << catalog_path << ". Rebuilding from recordings." << endl;
+        rebuild_from_files(!read_only);
+    }
+    if (!read_only) {
+        compact();
+    }
+    cout << "(RecordingCatalog) Loaded " << entries.size() << " segments." << endl;
+}
+
+void RecordingCatalog::replay(const vector<string> &fields) {
+    if (fields.empty()) return;
+    const string &type = fields[0];
+    if (type == "open" && fields.size() == 4) {
+        CatalogEntry entry;
+        entry.camera = fields[1];
+        entry.path = fields[2];
+        entry.start_time_ms = stol(fields[3]);
+        entry.end_time_ms = entry.start_time_ms;
+        entry.open = true;
+        if (entries.count(entry.path)) unindex(entries[entry.path]);
+        entries[entry.path] = entry;
+        index(entry);
+    } else if (type == "update" && fields.size() == 6) {
+        auto entry = entries.find(fields[1]);
+        if (entry == entries.end()) return;
+        entry->second.end_time_ms = stol(fields[2]);
+        entry->second.bytes = stol(fields[3]);
+        entry->second.keyframes = stoi(fields[4]);
+        entry->second.motion_events = stoi(fields[5]);
+    } else if (type == "close" && fields.size() == 8) {
+        CatalogEntry entry;
+        entry.camera = fields[1];
+        entry.path = fields[2];
+        entry.start_time_ms = stol(fields[3]);
+        entry.end_time_ms = stol(fields[4]);
+        entry.bytes = stol(fields[5]);
+        entry.keyframes = stoi(fields[6]);
+        entry.motion_events = stoi(fields[7]);
+        if (entries.count(entry.path)) unindex(entries[entry.path]);
+        entries[entry.path] = entry;
+        index(entry);
+    } else if (type == "upload" && fields.size() == 4) {
+        auto entry = entries.find(fields[1]);
+        if (entry == entries.end()) return;
+        entry->second.upload_id = fields[2];
+        entry->second.upload_part_size = stol(fields[3]);
+        entry->second.upload_parts.clear();
+    } else if (type == "part" && fields.size() == 4) {
+        auto entry = entries.find(fields[1]);
+        if (entry == entries.end()) return;
+        int part_number = stoi(fields[2]);
+        if (part_number < 1) throw invalid_argument("bad part number");
+        vector<string> &parts = entry->second.upload_parts;
+        if ((int) parts.size() < part_number) parts.resize(part_number);
+        parts[part_number - 1] = fields[3];
+    } else if (type == "uploaded" && fields.size() == 2) {
+        auto entry = entries.find(fields[1]);
+        if (entry == entries.end()) return;
+        entry->second.uploaded = true;
+        entry->second.upload_id.clear();
+        entry->second.upload_parts.clear();
+    } else if (type == "compacted" && fields.size() == 3) {
+        auto entry = entries.find(fields[1]);
+        if (entry == entries.end()) return;
+        entry->second.bytes = stol(fields[2]);
+        entry->second.compacted = true;
+    } else if (type == "remove" && fields.size() == 2) {
+        auto entry = entries.find(fields[1]);
+        if (entry == entries.end()) return;
+        unindex(entry->second);
+        entries.erase(entry);
+    } else {
+        throw invalid_argument("unknown record");
+    }
+}
+
+void RecordingCatalog::repair_open_entries(bool repair_files) {
+    vector<string> missing;
+    for (auto &item : entries) {
+        CatalogEntry &entry = item.second;
+        if (entry.open && repair_files) {
+            this->repair_files(entry);
+        }
+        struct stat file_stat{};
+        if (stat(entry.path.c_str(), &file_stat) != 0) {
+            missing.push_back(entry.path);
+            continue;
+        }
+        if (entry.open) {
+            // The process died while writing this segment.
+            entry.bytes = file_stat.st_size;
+            entry.end_time_ms = max(entry.start_time_ms, (long) file_stat.st_mtime * 1000L);
+            entry.open = false;
+        }
+    }
+    for (const string &path : missing) {
+        unindex(entries[path]);
+        entries.erase(path);
+    }
+}
+
+void RecordingCatalog::repair_files(const CatalogEntry &entry) {
+    SegmentRecovery::repair_segment(entry.path);
+    SegmentRecovery::repair_start_time(SegmentRecovery::start_time_path(entry.path), entry.start_time_ms);
+    SegmentRecovery::repair_text_file(recordings_dir + "/" + entry.camera + ".csv");
+}
+
+void RecordingCatalog::rebuild_from_files(bool repair_files) {
+    const string START_TIME_SUFFIX = "_start_time.txt";
+    map<string, vector<MotionEvent>> motion_events_per_camera;
+    // Without a catalog, the newest segment of each camera is the one that may have been cut off.
+    map<string, string> newest_segment_per_camera;
+
+    directory_iterator end_itr;
+    error_code error;
+    for (directory_iterator itr(recordings_dir, error); !error && itr != end_itr; itr.increment(error)) {
+        if (!is_regular_file(itr->status())) continue;
+        string filename = itr->path().filename().string();
+        size_t stem_length = filename.find('.');
+        if (stem_length == string::npos || filename.find(START_TIME_SUFFIX) != string::npos ||
+            filename.find("_summary") != string::npos) continue;
+        string stem = filename.substr(0, stem_length);
+        size_t number_start = stem.rfind('_');
+        if (number_start == string::npos || number_start + 1 == stem.size() ||
+            !all_of(stem.begin() + number_start + 1, stem.end(), [](char c) { return isdigit(c); })) continue;
+
+        ifstream start_time_file(recordings_dir + "/" + stem + START_TIME_SUFFIX);
+        long start_time_ms;
+        if (!(start_time_file >> start_time_ms)) continue;
+
+        struct stat file_stat{};
+        if (stat(itr->path().c_str(), &file_stat) != 0) continue;
+
+        CatalogEntry entry;
+        entry.camera = stem.substr(0, number_start);
+        entry.path = itr->path().string();
+        entry.start_time_ms = start_time_ms;
+        entry.end_time_ms = max(start_time_ms, (long) file_stat.st_mtime * 1000L);
+        entry.bytes = file_stat.st_size;
+
+        if (!motion_events_per_camera.count(entry.camera)) {
+            motion_events_per_camera[entry.camera] = MotionEvent::read_file(recordings_dir + "/" + entry.camera + ".csv");
+        }
+        entry.motion_events = MotionEvent::count_overlapping(motion_events_per_camera[entry.camera],
+                                                             entry.start_time_ms, entry.end_time_ms);
+
+        entries[entry.path] = entry;
+        index(entry);
+        auto newest = newest_segment_per_camera.find(entry.camera);
+        if (newest == newest_segment_per_camera.end() || entries[newest->second].start_time_ms < entry.start_time_ms) {
+            newest_segment_per_camera[entry.camera] = entry.path;
+        }
+    }
+
+    if (!repair_files) return;
+    for (const auto &newest : newest_segment_per_camera) {
+        CatalogEntry &entry = entries[newest.second];
+        this->repair_files(entry);
+        struct stat file_stat{};
+        if (stat(entry.path.c_str(), &file_stat) == 0) {
+            entry.bytes = file_stat.st_size;
+        }
+    }
+}
+
+void RecordingCatalog::compact() {
+    string compacted_path = catalog_path + ".tmp";
+    ofstream compacted(compacted_path, ios::trunc);
+    vector<const CatalogEntry *> ordered;
+    for (const auto &item : entries) {
+        ordered.push_back(&item.second);
+    }
+    sort(ordered.begin(), ordered.end(), [](const CatalogEntry *a, const CatalogEntry *b) {
+        return a->start_time_ms < b->start_time_ms;
+    });
+    for (const CatalogEntry *entry : ordered) {
+        compacted << close_record(*entry) << state_records(*entry);
+    }
+    compacted.close();
+
+    int fd = open(compacted_path.c_str(), O_WRONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    if (rename(compacted_path.c_str(), catalog_path.c_str()) != 0) {
+        cerr << "(RecordingCatalog) Failed to replace " << catalog_path << endl;
+    }
+
+    if (catalog_fd >= 0) {
+        close(catalog_fd);
+    }
+    catalog_fd = open(catalog_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (catalog_fd < 0) {
+        cerr << "(RecordingCatalog) Failed to open " << catalog_path << " for writing." << endl;
+    }
+    struct stat file_stat{};
+    replayed_bytes = catalog_fd >= 0 && fstat(catalog_fd, &file_stat) == 0 ? file_stat.st_size : 0;
+}
+
+void RecordingCatalog::open_for_append() {
+    lock_guard<mutex> lock(catalog_mutex);
+    if (catalog_fd >= 0) return;
+    catalog_fd = open(catalog_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (catalog_fd < 0) {
+        cerr << "(RecordingCatalog) Failed to open " << catalog_path << " for writing." << endl;
+    }
+}
+
+int RecordingCatalog::follow() {
+    // Under the lock, so this process's own appends are all in the file when it's read.
+    lock_guard<mutex> lock(catalog_mutex);
+    int fd = open(catalog_path.c_str(), O_RDONLY);
+    if (fd < 0) return 0;
+    string records;
+    char buffer[64 * 1024];
+    ssize_t length;
+    while ((length = pread(fd, buffer, sizeof(buffer), replayed_bytes + (long) records.size())) > 0) {
+        records.append(buffer, length);
+    }
+    close(fd);
+
+    int count = 0;
+    size_t line_start = 0;
+    size_t line_end;
+    // A record that's still being appended has no newline yet. It's replayed next time.
+    while ((line_end = records.find('\n', line_start)) != string::npos) {
+        string line = records.substr(line_start, line_end - line_start);
+        line_start = line_end + 1;
+        try {
+            replay(split_fields(line));
+            count++;
+        } catch (const exception &e) {
+            cerr << "(RecordingCatalog) Ignoring bad record: " << line << endl;
+        }
+    }
+    replayed_bytes += (long) line_start;
+    return count;
+}
+
+void RecordingCatalog::close_open_segments(const string &camera) {
+    lock_guard<mutex> lock(catalog_mutex);
+    vector<string> missing;
+    for (auto &item : entries) {
+        CatalogEntry &entry = item.second;
+        if (entry.camera != camera || !entry.open) continue;
+        repair_files(entry);
+        struct stat file_stat{};
+        if (stat(entry.path.c_str(), &file_stat) != 0) {
+            missing.push_back(entry.path);
+            continue;
+        }
+        entry.bytes = file_stat.st_size;
+        entry.end_time_ms = max(entry.end_time_ms, (long) file_stat.st_mtime * 1000L);
+        entry.open = false;
+        cout << "(RecordingCatalog) Closed " << entry.path << " after its worker exited." << endl;
+        append(close_record(entry), true);
+    }
+    for (const string &path : missing) {
+        unindex(entries[path]);
+        entries.erase(path);
+        append("remove\t" + path + "\n", false);
+    }
+}
+
+void RecordingCatalog::index(const CatalogEntry &entry) {
+    entries_by_start_time[entry.camera][entry.start_time_ms] = entry.path;
+}
+
+void RecordingCatalog::unindex(const CatalogEntry &entry) {
+    auto camera = entries_by_start_time.find(entry.camera);
+    if (camera == entries_by_start_time.end()) return;
+    auto indexed = camera->second.find(entry.start_time_ms);
+    if (indexed != camera->second.end() && indexed->second == entry.path) {
+        camera->second.erase(indexed);
+    }
+}
+
+void RecordingCatalog::append(const string &record, bool sync) {
+    if (catalog_fd < 0) return;
+    // Records are small, so an O_APPEND write lands in one piece.
+    if (write(catalog_fd, record.data(), record.size()) != (ssize_t) record.size()) {
+        cerr << "(RecordingCatalog) Failed to append to " << catalog_path << endl;
+        return;
+    }
+    if (sync) {
+        fdatasync(catalog_fd);
+    }
+}
+
+string RecordingCatalog::close_record(const CatalogEntry &entry) {
+    return "close\t" + entry.camera + "\t" + entry.path + "\t" + to_string(entry.start_time_ms) + "\t" +
+           to_string(entry.end_time_ms) + "\t" + to_string(entry.bytes) + "\t" + to_string(entry.keyframes) + "\t" +
+           to_string(entry.motion_events) + "\n";
+}
+
+string RecordingCatalog::state_records(const CatalogEntry &entry) {
+    string records;
+    if (entry.compacted) {
+        records += "compacted\t" + entry.path + "\t" + to_string(entry.bytes) + "\n";
+    }
+    if (entry.uploaded) {
+        records += "uploaded\t" + entry.path + "\n";
+    } else if (!entry.upload_id.empty()) {
+        records += "upload\t" + entry.path + "\t" + entry.upload_id + "\t" + to_string(entry.upload_part_size) + "\n";
+        for (size_t i = 0; i < entry.upload_parts.size(); i++) {
+            if (entry.upload_parts[i].empty()) continue;
+            records += "part\t" + entry.path + "\t" + to_string(i + 1) + "\t" + entry.upload_parts[i] + "\n";
+        }
+    }
+    return records;
+}
+
+void RecordingCatalog::segment_opened(const string &camera, const string &path, long start_time_ms) {
+    lock_guard<mutex> lock(catalog_mutex);
+    CatalogEntry entry;
+    entry.camera = camera;
+    entry.path = path;
+    entry.start_time_ms = start_time_ms;
+    entry.end_time_ms = start_time_ms;
+    entry.open = true;
+    if (entries.count(path)) unindex(entries[path]);
+    entries[path] = entry;
+    index(entry);
+    open_segment_per_camera[camera] = path;
+    append("open\t" + camera + "\t" + path + "\t" + to_string(start_time_ms) + "\n", true);
+}
+
+void RecordingCatalog::segment_progress(const string &path, long bytes, int keyframes) {
+    lock_guard<mutex> lock(catalog_mutex);
+    auto entry = entries.find(path);
+    if (entry == entries.end()) return;
+    entry->second.end_time_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    entry->second.bytes = bytes;
+    entry->second.keyframes = keyframes;
+    append("update\t" + path + "\t" + to_string(entry->second.end_time_ms) + "\t" + to_string(bytes) + "\t" +
+           to_string(keyframes) + "\t" + to_string(entry->second.motion_events) + "\n", false);
+}
+
+void RecordingCatalog::segment_closed(const string &path, long bytes, int keyframes) {
+    lock_guard<mutex> lock(catalog_mutex);
+    auto entry = entries.find(path);
+    if (entry == entries.end()) return;
+    entry->second.end_time_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    entry->second.bytes = bytes;
+    entry->second.keyframes = keyframes;
+    entry->second.open = false;
+    if (open_segment_per_camera[entry->second.camera] == path) {
+        open_segment_per_camera.erase(entry->second.camera);
+    }
+    append(close_record(entry->second), true);
+}
+
+void RecordingCatalog::segment_removed(const string &path) {
+    lock_guard<mutex> lock(catalog_mutex);
+    auto entry = entries.find(path);
+    if (entry == entries.end()) return;
+    unindex(entry->second);
+    entries.erase(entry);
+    append("remove\t" + path + "\n", false);
+}
+
+void RecordingCatalog::motion_event(const string &camera) {
+    lock_guard<mutex> lock(catalog_mutex);
+    auto open_segment = open_segment_per_camera.find(camera);
+    if (open_segment == open_segment_per_camera.end()) return;
+    auto entry = entries.find(open_segment->second);
+    if (entry != entries.end()) {
+        entry->second.motion_events++;
+    }
+}
+
+void RecordingCatalog::upload_started(const string &path, const string &upload_id, long part_size) {
+    lock_guard<mutex> lock(catalog_mutex);
+    auto entry = entries.find(path);
+    if (entry == entries.end()) return;
+    entry->second.upload_id = upload_id;
+    entry->second.upload_part_size = part_size;
+    entry->second.upload_parts.clear();
+    append("upload\t" + path + "\t" + upload_id + "\t" + to_string(part_size) + "\n", true);
+}
+
+void RecordingCatalog::part_uploaded(const string &path, int part_number, const string &etag) {
+    lock_guard<mutex> lock(catalog_mutex);
+    auto entry = entries.find(path);
+    if (entry == entries.end() || part_number < 1) return;
+    vector<string> &parts = entry->second.upload_parts;
+    if ((int) parts.size() < part_number) parts.resize(part_number);
+    parts[part_number - 1] = etag;
+    // A lost part record only costs uploading the part again.
+    append("part\t" + path + "\t" + to_string(part_number) + "\t" + etag + "\n", false);
+}
+
+void RecordingCatalog::segment_uploaded(const string &path) {
+    lock_guard<mutex> lock(catalog_mutex);
+    auto entry = entries.find(path);
+    if (entry == entries.end()) return;
+    entry->second.uploaded = true;
+    entry->second.upload_id.clear();
+    entry->second.upload_parts.clear();
+    append("uploaded\t" + path + "\n", true);
+}
+
+vector<CatalogEntry> RecordingCatalog::pending_uploads() const {
+    lock_guard<mutex> lock(catalog_mutex);
+    vector<CatalogEntry> pending;
+    for (const auto &item : entries) {
+        if (!item.second.open && !item.second.uploaded) {
+            pending.push_back(item.second);
+        }
+    }
+    sort(pending.begin(), pending.end(), [](const CatalogEntry &a, const CatalogEntry &b) {
+        return a.start_time_ms < b.start_time_ms;
+    });
+    return pending;
+}
+
+bool RecordingCatalog::get(const string &path, CatalogEntry &entry) const {
+    lock_guard<mutex> lock(catalog_mutex);
+    auto found = entries.find(path);
+    if (found == entries.end()) return false;
+    entry = found->second;
+    return true;
+}
+
+void RecordingCatalog::segment_compacted(const string &path, long bytes) {
+    lock_guard<mutex> lock(catalog_mutex);
+    auto entry = entries.find(path);
+    if (entry == entries.end()) return;
+    entry->second.bytes = bytes;
+    entry->second.compacted = true;
+    append("compacted\t" + path + "\t" + to_string(bytes) + "\n", true);
+}
+
+vector<CatalogEntry> RecordingCatalog::find(const string &camera, long from_ms, long to_ms) const {
+    lock_guard<mutex> lock(catalog_mutex);
+    vector<CatalogEntry> found;
+    auto camera_index = entries_by_start_time.find(camera);
+    if (camera_index == entries_by_start_time.end()) return found;
+    const map<long, string> &by_start_time = camera_index->second;
+
+    // The segment that covers from_ms starts at or before it.
+    auto it = by_start_time.upper_bound(from_ms);
+    if (it != by_start_time.begin()) --it;
+    for (; it != by_start_time.end() && it->first <= to_ms; ++it) {
+        const CatalogEntry &entry = entries.at(it->second);
+        if (entry.open || entry.end_time_ms >= from_ms) {
+            found.push_back(entry);
+        }
+    }
+    return found;
+}
+
+vector<CatalogEntry> RecordingCatalog::segments(const string &camera) const {
+    return find(camera, LONG_MIN, LONG_MAX);
+}
+
+vector<string> RecordingCatalog::camera_names() const {
+    lock_guard<mutex> lock(catalog_mutex);
+    vector<string> names;
+    for (const auto &camera : entries_by_start_time) {
+        names.push_back(camera.first);
+    }
+    return names;
+}
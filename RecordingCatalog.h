@@ -0,0 +1,120 @@
+
+#ifndef HOMECAMRECORDER_RECORDINGCATALOG_H
+#define HOMECAMRECORDER_RECORDINGCATALOG_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+struct CatalogEntry {
+    string camera;
+    string path;
+    long start_time_ms{};
+    long end_time_ms{};
+    long bytes{};
+    int keyframes{};
+    int motion_events{};
+    bool open{false};
+    // Multipart upload to the object store that's under way, and the ETags of its parts so far by part number - 1.
+    string upload_id;
+    long upload_part_size{};
+    vector<string> upload_parts;
+    // The segment is in the object store, so it's safe to evict locally.
+    bool uploaded{false};
+    // SegmentCompactor thinned the footage without motion to keyframes.
+    bool compacted{false};
+};
+
+/**
+ * Durable index of every recorded segment of every camera, so finding the segments that cover a time range doesn't
+ * need a directory listing and a pass over every _start_time.txt file.
+ *
+ * The catalog is an append-only text file (<recordings dir>/catalog.log) with one tab separated record per line:
+ *
+ *   open    <camera> <path> <start ms>
+ *   update  <path> <end ms> <bytes> <keyframes> <motion events>
+ *   close   <camera> <path> <start ms> <end ms> <bytes> <keyframes> <motion events>
+ *   remove  <path>
+ *   upload  <path> <upload id> <part size>
+ *   part    <path> <part number> <etag>
+ *   uploaded <path>
+ *   compacted <path> <bytes>
+ *
+ * On load the records are replayed, segments that were still open (the process crashed) are repaired with
+ * SegmentRecovery and closed using the file on disk, and the file is rewritten with one close record per segment.
+ * Only those segments are opened, so startup doesn't depend on how many recordings there are. If the catalog is missing it is rebuilt
+ * from the segments and their _start_time.txt files.
+ */
+class RecordingCatalog {
+public:
+    explicit RecordingCatalog(string recordings_dir);
+    ~RecordingCatalog();
+
+    // A read only catalog is used by commands like --export that run next to the recorder. It never writes to
+    // the catalog file.
+    void load(bool read_only = false);
+    // For a --worker process, whose supervisor owns the catalog: records are appended, but the file is never
+    // rewritten. Call after load(true).
+    void open_for_append();
+    // For the supervisor: replays the records its workers appended since load() or the last follow(). Records this
+    // process appended come around again, which leaves the entries as they were. Returns how many were replayed.
+    int follow();
+    // Closes the segments of a camera whose worker died, like load() does after a crash.
+    void close_open_segments(const string &camera);
+
+    void segment_opened(const string &camera, const string &path, long start_time_ms);
+    void segment_progress(const string &path, long bytes, int keyframes);
+    void segment_closed(const string &path, long bytes, int keyframes);
+    void segment_removed(const string &path);
+    // A motion event started. It counts for the camera's open segment.
+    void motion_event(const string &camera);
+
+    // Progress of SegmentUploader, so an upload carries on from its last part after a restart. An empty upload id
+    // forgets the upload.
+    void upload_started(const string &path, const string &upload_id, long part_size);
+    void part_uploaded(const string &path, int part_number, const string &etag);
+    void segment_uploaded(const string &path);
+    // Closed segments that aren't in the object store yet, ordered by start time.
+    vector<CatalogEntry> pending_uploads() const;
+    bool get(const string &path, CatalogEntry &entry) const;
+
+    // SegmentCompactor replaced the segment with a smaller one.
+    void segment_compacted(const string &path, long bytes);
+
+    // Segments of the camera that overlap [from_ms, to_ms], ordered by start time.
+    vector<CatalogEntry> find(const string &camera, long from_ms, long to_ms) const;
+    vector<CatalogEntry> segments(const string &camera) const;
+    vector<string> camera_names() const;
+
+    // Catalog name of a camera from its segment basename: /home/rohit/Recordings/front_door -> front_door
+    static string camera_name(const string &basename);
+
+private:
+    const string recordings_dir;
+    const string catalog_path;
+
+    mutable mutex catalog_mutex;
+    int catalog_fd{-1};
+    // How much of the catalog file has been replayed, for follow().
+    long replayed_bytes{};
+    unordered_map<string, CatalogEntry> entries;
+    map<string, map<long, string>> entries_by_start_time;
+    unordered_map<string, string> open_segment_per_camera;
+
+    void replay(const vector<string> &fields);
+    void rebuild_from_files(bool repair_files);
+    void repair_open_entries(bool repair_files);
+    void repair_files(const CatalogEntry &entry);
+    void compact();
+    void index(const CatalogEntry &entry);
+    void unindex(const CatalogEntry &entry);
+    void append(const string &record, bool sync);
+    static string close_record(const CatalogEntry &entry);
+    static string state_records(const CatalogEntry &entry);
+};
+
+#endif //HOMECAMRECORDER_RECORDINGCATALOG_H
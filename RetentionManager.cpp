@@ -0,0 +1,346 @@
+#include "RetentionManager.h"
+#include "KeyframeIndex.h"
+#include "QosScheduler.h"
+#include "SegmentRecovery.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#ifdef __APPLE__
+using namespace std::__fs::filesystem;
+#else
+using namespace std::filesystem;
+#endif
+
+static const int ENFORCE_INTERVAL_SEC = 10;
+
+RetentionManager::RetentionManager(string recordings_dir, RetentionPolicy policy, RecordingCatalog *catalog) :
+    recordings_dir(std::move(recordings_dir)), policy(policy), catalog(catalog) {}
+
+RetentionManager::~RetentionManager() {
+    stop();
+}
+
+void RetentionManager::register_camera(const string &basename, const string &motion_file, int priority) {
+    lock_guard<mutex> lock(segments_mutex);
+    // A camera registered again (a reload replaced it) already has its segments indexed.
+    bool indexed = cameras.count(basename) > 0;
+    Camera &camera = cameras[basename];
+    camera.motion_file = motion_file;
+    camera.priority = max(1, priority);
+    if (indexed) return;
+
+    if (catalog) {
+        for (const CatalogEntry &entry : catalog->segments(RecordingCatalog::camera_name(basename))) {
+            if (entry.open) continue;
+            add_existing_segment(camera, basename, entry.path, entry.bytes, entry.start_time_ms, entry.end_time_ms,
+                                 entry.uploaded);
+        }
+    } else {
+        directory_iterator end_itr;
+        error_code error;
+        for (directory_iterator itr(path(basename).parent_path(), error); !error && itr != end_itr; itr.increment(error)) {
+            struct stat file_stat{};
+            if (!is_regular_file(itr->status()) || stat(itr->path().c_str(), &file_stat) != 0) continue;
+            long start_time_ms = file_stat.st_mtime * 1000L;
+            ifstream start_time_file(SegmentRecovery::start_time_path(itr->path().string()));
+            start_time_file >> start_time_ms;
+            add_existing_segment(camera, basename, itr->path().string(), file_stat.st_size, start_time_ms,
+                                 file_stat.st_mtime * 1000L);
+        }
+    }
+    // Segment numbers aren't reused, so the next one says nothing about how many are left.
+    long segment_count = count_if(segments.begin(), segments.end(), [&basename](const auto &entry) {
+        return entry.second.basename == basename;
+    });
+    cout << "(RetentionManager) " << basename << " has " << segment_count << " segments. Priority " << camera.priority
+         << endl;
+}
+
+void RetentionManager::add_existing_segment(Camera &camera, const string &basename, const string &segment_path,
+                                            long size, long start_time_ms, long end_time_ms, bool uploaded) {
+    // Segments are named <basename>_<number>.<extension>
+    string prefix = path(basename).filename().string() + "_";
+    string filename = path(segment_path).filename().string();
+    if (filename.compare(0, prefix.size(), prefix) != 0) return;
+    size_t number_end = filename.find('.', prefix.size());
+    if (number_end == string::npos) return;
+    string number = filename.substr(prefix.size(), number_end - prefix.size());
+    if (number.empty() || !all_of(number.begin(), number.end(), [](char c) { return isdigit(c); })) return;
+
+    Segment segment;
+    segment.basename = basename;
+    segment.path = segment_path;
+    segment.start_time_path = SegmentRecovery::start_time_path(segment_path);
+    segment.size = size;
+    segment.start_time_ms = start_time_ms;
+    segment.end_time_ms = end_time_ms;
+    segment.uploaded = uploaded;
+    segments[segment.path] = segment;
+    camera.next_segment_number = max(camera.next_segment_number, stoi(number) + 1);
+}
+
+void RetentionManager::set_priority(const string &basename, int priority) {
+    lock_guard<mutex> lock(segments_mutex);
+    auto camera = cameras.find(basename);
+    if (camera == cameras.end()) return;
+    camera->second.priority = max(1, priority);
+    cout << "(RetentionManager) " << basename << " now has priority " << camera->second.priority << endl;
+}
+
+int RetentionManager::next_segment_number(const string &basename) {
+    bool registered;
+    {
+        lock_guard<mutex> lock(segments_mutex);
+        registered = cameras.count(basename) > 0;
+    }
+    if (!registered) {
+        register_camera(basename, basename + ".csv", 1);
+    }
+    lock_guard<mutex> lock(segments_mutex);
+    return cameras[basename].next_segment_number++;
+}
+
+void RetentionManager::segment_opened(const string &basename, const string &path, const string &start_time_path) {
+    lock_guard<mutex> lock(segments_mutex);
+    Segment segment;
+    segment.basename = basename;
+    segment.path = path;
+    segment.start_time_path = start_time_path;
+    segment.start_time_ms = now_ms();
+    segment.end_time_ms = segment.start_time_ms;
+    segment.open = true;
+    segments[path] = segment;
+}
+
+void RetentionManager::segment_closed(const string &basename, const string &path) {
+    {
+        lock_guard<mutex> lock(segments_mutex);
+        auto segment = segments.find(path);
+        if (segment == segments.end()) return;
+        struct stat file_stat{};
+        if (stat(path.c_str(), &file_stat) == 0) {
+            segment->second.size = file_stat.st_size;
+        }
+        segment->second.end_time_ms = now_ms();
+        segment->second.open = false;
+    }
+    wake_up.notify_one();
+}
+
+void RetentionManager::segment_uploaded(const string &path) {
+    lock_guard<mutex> lock(segments_mutex);
+    auto segment = segments.find(path);
+    if (segment != segments.end()) {
+        segment->second.uploaded = true;
+    }
+}
+
+bool RetentionManager::replace_segment(const string &path, long size, const function<bool()> &swap_in) {
+    lock_guard<mutex> lock(segments_mutex);
+    auto segment = segments.find(path);
+    if (segment == segments.end() || segment->second.pending_delete || !swap_in()) return false;
+    segment->second.size = size;
+    return true;
+}
+
+void RetentionManager::refresh_from_catalog() {
+    if (!catalog) return;
+    {
+        lock_guard<mutex> lock(segments_mutex);
+        for (auto &item : cameras) {
+            for (const CatalogEntry &entry : catalog->segments(RecordingCatalog::camera_name(item.first))) {
+                auto segment = segments.find(entry.path);
+                if (segment == segments.end()) {
+                    add_existing_segment(item.second, item.first, entry.path, entry.bytes, entry.start_time_ms,
+                                         entry.end_time_ms, entry.uploaded);
+                    segment = segments.find(entry.path);
+                    if (segment == segments.end()) continue;
+                } else if (segment->second.pending_delete) {
+                    continue;
+                }
+                segment->second.open = entry.open;
+                segment->second.size = entry.bytes;
+                segment->second.end_time_ms = entry.end_time_ms;
+                segment->second.uploaded = entry.uploaded;
+            }
+        }
+    }
+    wake_up.notify_one();
+}
+
+void RetentionManager::start() {
+    stopping = false;
+    worker = thread(&RetentionManager::run, this);
+}
+
+void RetentionManager::stop() {
+    stopping = true;
+    wake_up.notify_all();
+    if (worker.joinable())
+        worker.join();
+}
+
+void RetentionManager::run() {
+    QosThread qos_thread(QosClass::BACKGROUND);
+    while (!stopping) {
+        enforce();
+
+        Segment segment;
+        {
+            unique_lock<mutex> lock(segments_mutex);
+            if (delete_queue.empty()) {
+                wake_up.wait_for(lock, seconds(ENFORCE_INTERVAL_SEC));
+                continue;
+            }
+            segment = delete_queue.front();
+            delete_queue.erase(delete_queue.begin());
+        }
+
+        QosScheduler::throttle();
+        delete_segment(segment);
+
+        lock_guard<mutex> lock(segments_mutex);
+        segments.erase(segment.path);
+    }
+}
+
+void RetentionManager::enforce() {
+    // The camera threads take segments_mutex to rotate their segments, so it's only held to copy the segments and to
+    // queue what gets deleted. The file system is touched without it.
+    vector<Segment> snapshot;
+    map<string, Camera> camera_snapshot;
+    {
+        lock_guard<mutex> lock(segments_mutex);
+        snapshot.reserve(segments.size());
+        for (auto &entry : segments) {
+            snapshot.push_back(entry.second);
+        }
+        camera_snapshot = cameras;
+    }
+
+    long now = now_ms();
+    long total_bytes = 0;
+    long pending_bytes = 0;
+    for (Segment &segment : snapshot) {
+        if (segment.open) {
+            struct stat file_stat{};
+            if (stat(segment.path.c_str(), &file_stat) == 0) {
+                segment.size = file_stat.st_size;
+            }
+        }
+        if (segment.pending_delete) {
+            pending_bytes += segment.size;
+        } else {
+            total_bytes += segment.size;
+        }
+    }
+
+    // Bytes queued for deletion haven't been freed yet, but will be.
+    long floor_deficit = policy.min_free_bytes - free_bytes() - pending_bytes;
+    long needed_bytes = max(total_bytes - policy.max_total_bytes, floor_deficit);
+    if (needed_bytes <= 0) return;
+
+    vector<Segment *> candidates;
+    for (Segment &segment : snapshot) {
+        if (segment.open || segment.pending_delete) continue;
+        if (now - segment.end_time_ms < duration_cast<milliseconds>(policy.min_age).count()) continue;
+        candidates.push_back(&segment);
+    }
+    sort(candidates.begin(), candidates.end(), [&camera_snapshot, now](const Segment *a, const Segment *b) {
+        double a_age = (double) (now - a->end_time_ms) / camera_snapshot[a->basename].priority;
+        double b_age = (double) (now - b->end_time_ms) / camera_snapshot[b->basename].priority;
+        return a_age > b_age;
+    });
+
+    // Uploaded segments are safe to lose, motion or not. Segments with motion that only exist here are given up
+    // when the disk is about to fill up.
+    enum Pass { UPLOADED, NO_MOTION, ANY };
+    vector<Segment *> doomed;
+    for (Pass pass : {UPLOADED, NO_MOTION, ANY}) {
+        if (pass == ANY && floor_deficit <= 0) break;
+        for (Segment *segment : candidates) {
+            if (needed_bytes <= 0) break;
+            if (segment->pending_delete) continue;
+            if (pass == UPLOADED && !segment->uploaded) continue;
+            if (pass == NO_MOTION && contains_motion(camera_snapshot[segment->basename].motion_file, *segment)) {
+                continue;
+            }
+            segment->pending_delete = true;
+            doomed.push_back(segment);
+            needed_bytes -= segment->size;
+        }
+    }
+
+    vector<Segment> queued;
+    {
+        lock_guard<mutex> lock(segments_mutex);
+        for (const Segment *doomed_segment : doomed) {
+            // Deleted or rewritten while the lock wasn't held.
+            auto segment = segments.find(doomed_segment->path);
+            if (segment == segments.end() || segment->second.open || segment->second.pending_delete) continue;
+            segment->second.pending_delete = true;
+            delete_queue.push_back(segment->second);
+            queued.push_back(segment->second);
+        }
+    }
+    for (const Segment &segment : queued) {
+        cout << "(RetentionManager) Deleting " << segment.path << " (" << segment.size / (1024 * 1024) << " MB)"
+             << endl;
+    }
+    if (needed_bytes > 0) {
+        cerr << "(RetentionManager) Recordings are " << needed_bytes / (1024 * 1024)
+             << " MB over budget but no segment can be deleted yet." << endl;
+    }
+}
+
+long RetentionManager::free_bytes() const {
+    struct statvfs stats{};
+    if (statvfs(recordings_dir.c_str(), &stats) != 0) {
+        return policy.min_free_bytes;
+    }
+    return (long) stats.f_bavail * (long) stats.f_frsize;
+}
+
+bool RetentionManager::contains_motion(const string &motion_file, const Segment &segment) {
+    MotionLog &log = motion_logs[motion_file];
+    struct stat file_stat{};
+    long size = stat(motion_file.c_str(), &file_stat) == 0 ? file_stat.st_size : 0;
+    if (size != log.size) {
+        log.size = size;
+        log.events = MotionEvent::read_file(motion_file);
+    }
+    return MotionEvent::count_overlapping(log.events, segment.start_time_ms, segment.end_time_ms) > 0;
+}
+
+void RetentionManager::delete_segment(const Segment &segment) {
+    int fd = open(segment.path.c_str(), O_WRONLY);
+    if (fd >= 0) {
+        struct stat file_stat{};
+        long size = fstat(fd, &file_stat) == 0 ? file_stat.st_size : 0;
+        while (size > 0 && !stopping) {
+            size = max(0L, size - policy.truncate_step_bytes);
+            if (ftruncate(fd, size) != 0) break;
+            this_thread::sleep_for(policy.truncate_step_interval);
+        }
+        close(fd);
+    }
+    if (unlink(segment.path.c_str()) == 0) {
+        cout << "(RetentionManager) Deleted " << segment.path << endl;
+    }
+    if (catalog) {
+        catalog->segment_removed(segment.path);
+    }
+    unlink(segment.start_time_path.c_str());
+    unlink(KeyframeIndex::path_for(segment.path).c_str());
+}
+
+long RetentionManager::now_ms() {
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,119 @@
+
+#ifndef HOMECAMRECORDER_RETENTIONMANAGER_H
+#define HOMECAMRECORDER_RETENTIONMANAGER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+#include "RecordingCatalog.h"
+#include "MotionEvent.h"
+
+using namespace std;
+using namespace std::chrono;
+
+struct RetentionPolicy {
+    // Total bytes of recordings allowed across all cameras.
+    long max_total_bytes;
+    // Free space that must remain on the recordings file system. Motion segments are only deleted to honour this.
+    long min_free_bytes;
+    // Segments that finished less than this long ago are never deleted.
+    seconds min_age;
+    // Deleting a segment truncates it by this many bytes at a time before unlinking it, so the file system never
+    // has to free a whole 1 GB file in one go while the cameras are writing.
+    long truncate_step_bytes;
+    milliseconds truncate_step_interval;
+};
+
+/**
+ * Keeps the recordings of all cameras within a byte budget and above a free space floor. RotatingFileMuxer reports
+ * the segments it opens and closes, and a background thread picks the segments to delete and deletes them with a
+ * throttled truncate-then-unlink, so the camera threads never block on the file system.
+ *
+ * Segments are evicted by age weighted with the camera priority (a priority 2 camera keeps footage twice as long as
+ * a priority 1 camera). Segments already in the object store (see SegmentUploader) go first. Of the rest, segments
+ * that contain motion are kept unless the free space floor is breached.
+ */
+class RetentionManager {
+public:
+    RetentionManager(string recordings_dir, RetentionPolicy policy, RecordingCatalog *catalog = nullptr);
+    ~RetentionManager();
+
+    // Registers a camera by its segment basename and indexes the segments already on disk, from the catalog if
+    // there is one. Registering a camera again only updates it.
+    void register_camera(const string &basename, const string &motion_file, int priority);
+    // Changes the priority of a registered camera. Applies from the next eviction.
+    void set_priority(const string &basename, int priority);
+
+    // Segment numbers grow forever, so a number never refers to two different recordings.
+    int next_segment_number(const string &basename);
+    void segment_opened(const string &basename, const string &path, const string &start_time_path);
+    void segment_closed(const string &basename, const string &path);
+    // The segment has a copy in the object store, so it's the first to go when space is needed.
+    void segment_uploaded(const string &path);
+    // Runs swap_in, which renames a rewritten file over the segment (see SegmentCompactor), while the segment can't
+    // be queued for deletion, and records its new size. Returns false without running it if the segment is gone or
+    // already queued, so a deleted segment never comes back.
+    bool replace_segment(const string &path, long size, const function<bool()> &swap_in);
+    // For a supervisor whose workers record the segments: picks up the segments of the registered cameras that they
+    // opened and closed, from the catalog.
+    void refresh_from_catalog();
+
+    void start();
+    void stop();
+
+private:
+    struct Segment {
+        string basename;
+        string path;
+        string start_time_path;
+        long start_time_ms{};
+        long end_time_ms{};
+        long size{};
+        bool open{false};
+        bool uploaded{false};
+        bool pending_delete{false};
+    };
+
+    struct Camera {
+        string motion_file;
+        int priority{1};
+        int next_segment_number{0};
+    };
+
+    struct MotionLog {
+        long size{-1};
+        vector<MotionEvent> events;
+    };
+
+    const string recordings_dir;
+    const RetentionPolicy policy;
+    RecordingCatalog *catalog;
+
+    mutex segments_mutex;
+    condition_variable wake_up;
+    map<string, Camera> cameras;
+    map<string, Segment> segments;
+    vector<Segment> delete_queue;
+    atomic<bool> stopping{false};
+    thread worker;
+    // Motion file -> its events, reread when the file grows. Only touched by the worker.
+    map<string, MotionLog> motion_logs;
+
+    void add_existing_segment(Camera &camera, const string &basename, const string &path, long size,
+                              long start_time_ms, long end_time_ms, bool uploaded = false);
+    void run();
+    void enforce();
+    long free_bytes() const;
+    bool contains_motion(const string &motion_file, const Segment &segment);
+    void delete_segment(const Segment &segment);
+    static long now_ms();
+};
+
+#endif //HOMECAMRECORDER_RETENTIONMANAGER_H
@@ -1,9 +1,15 @@
 #include "Muxer.h"
-#include <fstream>
 #include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
 
-RotatingFileMuxer::RotatingFileMuxer(const string &basename, const string &extension) {
-    this->basename = basename;
+extern "C" {
+#include <libavutil/opt.h>
+}
+
+RotatingFileMuxer::RotatingFileMuxer(const string &basename, const string &extension, RetentionManager *retention_manager,
+                                     RecordingCatalog *catalog, SegmentUploader *uploader) :
+    segment(basename, extension, retention_manager, catalog, uploader) {
     this->extension = extension;
     this->did_init = false;
 }
@@ -12,8 +18,6 @@ void RotatingFileMuxer::init() {
     if (did_init) return;
     output_ctx = avformat_alloc_context();
     output_file = get_output_file_name();
-    file_number = (file_number + 1) % MAX_FILES;
-    file_start_time = system_clock::now();
 
     output_format = av_guess_format(extension.c_str(), nullptr, nullptr);
     if (avformat_alloc_output_context2(&output_ctx, output_format, nullptr, output_file.c_str()) < 0) {
@@ -21,12 +25,20 @@ void RotatingFileMuxer::init() {
         return;
     }
 
+    if (extension == "mp4" || extension == "mov") {
+        // A fragment per GOP with an empty moov up front, so the file plays up to the last fragment without the
+        // trailer.
+        av_opt_set(output_ctx->priv_data, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+
     if (!(output_ctx->oformat->flags & AVFMT_NOFILE)) {
         if (avio_open(&output_ctx->pb, output_file.c_str(), AVIO_FLAG_WRITE) < 0) {
             cerr << "RotatingFileMuxer failed to open output file." << endl;
             return;
         }
+        sync_fd = open(output_file.c_str(), O_WRONLY);
     }
+    segment.file_created(sync_fd);
     did_init = true;
 }
 
@@ -43,68 +55,72 @@ void RotatingFileMuxer::send_packet(AVPacket *packet) {
     long prev_dts = packet->dts;
     long prev_pos = packet->pos;
 
-    auto input_timebase = input_timebase_per_stream[packet->stream_index];
-    auto output_timebase = output_timebase_per_stream[packet->stream_index];
-    packet->duration = av_rescale_q((int64_t) packet->duration, input_timebase, output_timebase);
-    packet->pts = av_rescale_q_rnd((int64_t) packet->pts, input_timebase, output_timebase,
-                                   AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-    packet->dts = av_rescale_q_rnd((int64_t) packet->dts, input_timebase, output_timebase,
-                                   AVRounding(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
-    packet->pos = -1;
-    fix_packet_timestamps(packet);
+    rescale_packet_timestamps(packet);
 
+    bool keyframe = packet->stream_index == video_stream_index && (packet->flags & AV_PKT_FLAG_KEY);
+    if (output_ctx->pb && keyframe) {
+        // Frames are written straight through, so everything before this offset came before the keyframe.
+        segment.keyframe(avio_tell(output_ctx->pb));
+    }
     if (av_write_frame(output_ctx, packet) < 0) {
         int total_frames_read = (video_frames_written + audio_frames_written);
-        cerr << "RotatingFileMuxer failed to write to packet " << total_frames_read << " to file."
-             << " PTS: " << packet->pts << " DTS: " << packet->dts << endl;
+        Logger::warn("RotatingFileMuxer", "Failed to write packet {} to file. PTS: {} DTS: {}", total_frames_read,
+                     packet->pts, packet->dts);
         return;
     }
     if (video_frames_written == 0 && audio_frames_written == 0) {
         av_dump_format(output_ctx, 0, output_file.c_str(), 1);
     }
     if (packet->stream_index == video_stream_index) {
-        if (TRACE_LOG)
-            cout << "RotatingFileMuxer writing video frame " << video_frames_written << ". DTS: " << packet->dts << endl;
-
+        Logger::trace("RotatingFileMuxer", "Writing video frame {}. DTS: {}", video_frames_written, packet->dts);
         video_frames_written++;
     }
     if (packet->stream_index == audio_stream_index) {
-        if (TRACE_LOG)
-            cout << "RotatingFileMuxer writing audio frame " << audio_frames_written << ". DTS: " << packet->dts << endl;
+        Logger::trace("RotatingFileMuxer", "Writing audio frame {}. DTS: {}", audio_frames_written, packet->dts);
         audio_frames_written++;
     }
     packet->duration = prev_duration;
     packet->pts = prev_pts;
     packet->dts = prev_dts;
     packet->pos = prev_pos;
-    if (duration_cast<seconds>(system_clock::now() - file_start_time).count() > MAX_FILE_DURATION_SEC) {
-        cout << "RotatingFileMuxer rotating file " << file_number << endl;
+    if (keyframe || segment.should_flush()) {
+        flush();
+    }
+    if (output_ctx->pb) {
+        segment.progress(avio_tell(output_ctx->pb));
+    }
+    if (segment.should_rotate()) {
+        cout << "RotatingFileMuxer rotating file " << segment.file_number() << endl;
         RotatingFileMuxer::release();
     }
 }
 
 string RotatingFileMuxer::get_output_file_name() {
-    string output_file_full = basename + "_" + std::to_string(file_number) + "." + extension;
-    if (remove(output_file_full.c_str()) == 0) {
-        cout << "RotatingFileMuxer removed file " << output_file_full << endl;
-    }
-
-    // Write the system time of the start of this video to a separate file
-    long file_start_time_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
-    string timestamp_file_path = basename + "_" + std::to_string(file_number) + "_start_time.txt";
-    ofstream timestamp_file;
-    timestamp_file.open(timestamp_file_path);
-    timestamp_file << file_start_time_ms << endl;
-    timestamp_file.close();
+    return segment.open_segment();
+}
 
-    return output_file_full;
+void RotatingFileMuxer::flush() {
+    // Everything before a keyframe is a whole GOP (a whole fragment for MP4), so a crash loses at most the
+    // current one.
+    auto flush_start = steady_clock::now();
+    avio_flush(output_ctx->pb);
+    segment.flushed(flush_start);
 }
 
 void RotatingFileMuxer::release() {
     av_write_trailer(output_ctx);
     if (output_ctx && !(output_ctx->oformat->flags & AVFMT_NOFILE))
         avio_closep(&output_ctx->pb);
+    if (sync_fd >= 0) {
+        close(sync_fd);
+        sync_fd = -1;
+    }
     avformat_free_context(output_ctx);
+    if (did_init) {
+        struct stat file_stat{};
+        long bytes = stat(output_file.c_str(), &file_stat) == 0 ? file_stat.st_size : 0;
+        segment.close_segment(bytes);
+    }
     Muxer::release();
     did_init = false;
 }
@@ -0,0 +1,278 @@
+#include "SegmentCompactor.h"
+#include "KeyframeIndex.h"
+#include "QosScheduler.h"
+#include "SegmentPaths.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+}
+
+#include "AVError.h"
+#include "SegmentTime.h"
+
+SegmentCompactor::SegmentCompactor(string recordings_dir, CompactionPolicy policy, RecordingCatalog *catalog,
+                                   RetentionManager *retention_manager) :
+    recordings_dir(std::move(recordings_dir)), policy(policy), catalog(catalog), retention_manager(retention_manager) {}
+
+SegmentCompactor::~SegmentCompactor() {
+    stop();
+}
+
+void SegmentCompactor::start(bool wait_for_upload) {
+    this->wait_for_upload = wait_for_upload;
+    stopping = false;
+    worker = thread(&SegmentCompactor::run, this);
+}
+
+void SegmentCompactor::stop() {
+    stopping = true;
+    wake_up.notify_all();
+    if (worker.joinable())
+        worker.join();
+}
+
+void SegmentCompactor::run() {
+    // Compaction is never urgent, recording is.
+    QosThread qos_thread(QosClass::BACKGROUND);
+
+    while (!stopping) {
+        CatalogEntry segment;
+        if (next_segment(segment)) {
+            QosScheduler::throttle();
+            compact(segment);
+            continue;
+        }
+        unique_lock<mutex> lock(stop_mutex);
+        wake_up.wait_for(lock, seconds(SCAN_INTERVAL_SEC), [this] { return stopping.load(); });
+    }
+}
+
+bool SegmentCompactor::next_segment(CatalogEntry &segment) {
+    long newest_end_ms = now_ms() - duration_cast<milliseconds>(policy.min_age).count();
+    bool found = false;
+    for (const string &camera : catalog->camera_names()) {
+        for (const CatalogEntry &entry : catalog->segments(camera)) {
+            if (entry.open || entry.compacted || entry.end_time_ms > newest_end_ms || failed.count(entry.path)) continue;
+            if (wait_for_upload && !entry.uploaded) continue;
+            // Oldest first, they are the closest to being evicted.
+            if (!found || entry.start_time_ms < segment.start_time_ms) {
+                segment = entry;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+void SegmentCompactor::compact(const CatalogEntry &segment) {
+    auto start_time = steady_clock::now();
+    string output_path = compacting_path(segment.path);
+    long size = rewrite(segment, output_path, motion_events(segment.camera));
+    if (size < 0 || stopping) {
+        unlink(output_path.c_str());
+        unlink(KeyframeIndex::path_for(output_path).c_str());
+        if (!stopping) failed.insert(segment.path);
+        return;
+    }
+
+    if (size > (long) ((double) segment.bytes * (1 - MIN_SAVING))) {
+        // Mostly motion. Keep the original, it's just as good.
+        unlink(output_path.c_str());
+        unlink(KeyframeIndex::path_for(output_path).c_str());
+        catalog->segment_compacted(segment.path, segment.bytes);
+        return;
+    }
+
+    auto swap_in = [&output_path, &segment] {
+        if (rename(output_path.c_str(), segment.path.c_str()) != 0) return false;
+        // The old index points into the old file. Readers cope with a stale index for the moment in between.
+        if (rename(KeyframeIndex::path_for(output_path).c_str(), KeyframeIndex::path_for(segment.path).c_str()) != 0) {
+            unlink(KeyframeIndex::path_for(segment.path).c_str());
+        }
+        return true;
+    };
+    // The retention manager may have deleted or queued the segment in the meantime. It mustn't come back.
+    CatalogEntry current;
+    bool replaced = retention_manager ? retention_manager->replace_segment(segment.path, size, swap_in)
+                                      : catalog->get(segment.path, current) && swap_in();
+    if (!replaced) {
+        unlink(output_path.c_str());
+        unlink(KeyframeIndex::path_for(output_path).c_str());
+        // Not rewritten again on every scan.
+        failed.insert(segment.path);
+        return;
+    }
+    catalog->segment_compacted(segment.path, size);
+    cout << "(SegmentCompactor) Compacted " << segment.path << " from " << segment.bytes / (1024 * 1024) << " MB to "
+         << size / (1024 * 1024) << " MB in " << duration_cast<milliseconds>(steady_clock::now() - start_time).count()
+         << " ms" << endl;
+}
+
+long SegmentCompactor::rewrite(const CatalogEntry &segment, const string &output_path,
+                               const vector<MotionEvent> &events) {
+    AVFormatContext *input_ctx = nullptr;
+    AVFormatContext *output_ctx = nullptr;
+    AVPacket *packet = av_packet_alloc();
+    KeyframeIndex keyframe_index;
+    bool written = false;
+    int ret;
+
+    try {
+        ret = avformat_open_input(&input_ctx, segment.path.c_str(), nullptr, nullptr);
+        if (ret < 0) {
+            cerr << "(SegmentCompactor) Failed to open " << segment.path << ". Error = " << av_err2str(ret) << endl;
+            throw ret;
+        }
+        ret = avformat_find_stream_info(input_ctx, nullptr);
+        if (ret < 0) {
+            cerr << "(SegmentCompactor) Failed to find stream info in " << segment.path << ". Error = "
+                 << av_err2str(ret) << endl;
+            throw ret;
+        }
+        int video_stream_idx = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        if (video_stream_idx < 0) {
+            cerr << "(SegmentCompactor) No video stream in " << segment.path << "." << endl;
+            throw video_stream_idx;
+        }
+        int audio_stream_idx = av_find_best_stream(input_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+
+        if (avformat_alloc_output_context2(&output_ctx, nullptr, nullptr, output_path.c_str()) < 0) {
+            cerr << "(SegmentCompactor) Failed to create output context for " << output_path << endl;
+            throw -1;
+        }
+        // Input stream -> output stream. Video is 0 and audio 1, like the recordings.
+        vector<int> stream_map(input_ctx->nb_streams, -1);
+        for (int input_index : {video_stream_idx, audio_stream_idx}) {
+            if (input_index < 0) continue;
+            AVStream *output_stream = avformat_new_stream(output_ctx, nullptr);
+            if (!output_stream || avcodec_parameters_copy(output_stream->codecpar,
+                                                          input_ctx->streams[input_index]->codecpar) < 0) {
+                cerr << "(SegmentCompactor) Failed to copy the streams of " << segment.path << endl;
+                throw -1;
+            }
+            output_stream->codecpar->codec_tag = 0;
+            output_stream->time_base = input_ctx->streams[input_index]->time_base;
+            stream_map[input_index] = output_stream->index;
+        }
+        bool byte_seekable = strcmp(output_ctx->oformat->name, "mpegts") == 0 ||
+                             strcmp(output_ctx->oformat->name, "flv") == 0;
+        if (strcmp(output_ctx->oformat->name, "mpegts") == 0) {
+            // The input already has the mux delay in its timestamps. Adding it again would shift the segment.
+            ret = av_opt_set(output_ctx->priv_data, "mpegts_copyts", "1", 0);
+            if (ret < 0) {
+                cerr << "(SegmentCompactor) Failed to keep the timestamps of " << segment.path << ". Error = "
+                     << av_err2str(ret) << endl;
+                throw ret;
+            }
+        }
+        ret = avio_open(&output_ctx->pb, output_path.c_str(), AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            cerr << "(SegmentCompactor) Failed to open " << output_path << ". Error = " << av_err2str(ret) << endl;
+            throw ret;
+        }
+        ret = avformat_write_header(output_ctx, nullptr);
+        if (ret < 0) {
+            cerr << "(SegmentCompactor) Failed to write header to " << output_path << ". Error = " << av_err2str(ret)
+                 << endl;
+            throw ret;
+        }
+        if (byte_seekable) {
+            keyframe_index.create(output_path);
+        }
+
+        long padding_ms = policy.motion_padding.count();
+        // Decided at every keyframe, and at the first packet for a segment that starts mid GOP.
+        bool keep_gop = false;
+        bool decided = false;
+        while (av_read_frame(input_ctx, packet) == 0 && !stopping) {
+            int output_index = stream_map[packet->stream_index];
+            if (output_index < 0) {
+                av_packet_unref(packet);
+                continue;
+            }
+            AVStream *input_stream = input_ctx->streams[packet->stream_index];
+            long time_ms = segment_time_ms(segment.start_time_ms, input_ctx, input_stream, packet);
+            bool is_keyframe = packet->stream_index == video_stream_idx && (packet->flags & AV_PKT_FLAG_KEY);
+            if (is_keyframe || !decided) {
+                keep_gop = MotionEvent::count_overlapping(events, time_ms - padding_ms, time_ms + padding_ms) > 0;
+                decided = true;
+            }
+            if (!is_keyframe && !keep_gop) {
+                av_packet_unref(packet);
+                continue;
+            }
+            if (is_keyframe) {
+                keyframe_index.add(avio_tell(output_ctx->pb), time_ms);
+            }
+            av_packet_rescale_ts(packet, input_stream->time_base, output_ctx->streams[output_index]->time_base);
+            packet->stream_index = output_index;
+            packet->pos = -1;
+            ret = av_write_frame(output_ctx, packet);
+            av_packet_unref(packet);
+            if (ret < 0) {
+                cerr << "(SegmentCompactor) Failed to write to " << output_path << ". Error = " << av_err2str(ret)
+                     << endl;
+                throw ret;
+            }
+        }
+        av_write_trailer(output_ctx);
+        written = !stopping;
+    } catch (int e) {
+    }
+
+    av_packet_free(&packet);
+    avformat_close_input(&input_ctx);
+    if (output_ctx) {
+        if (output_ctx->pb) {
+            avio_closep(&output_ctx->pb);
+        }
+        avformat_free_context(output_ctx);
+    }
+    keyframe_index.close();
+    if (!written) return -1;
+
+    // On disk before it replaces the original.
+    int fd = open(output_path.c_str(), O_RDONLY);
+    struct stat file_stat{};
+    if (fd < 0 || fdatasync(fd) != 0 || fstat(fd, &file_stat) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+#ifdef __linux__
+    // Nobody is about to watch it. Leave the page cache to the cameras.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+    return file_stat.st_size;
+}
+
+const vector<MotionEvent> &SegmentCompactor::motion_events(const string &camera) {
+    MotionLog &log = motion_logs[camera];
+    string motion_file = recordings_dir + "/" + camera + ".csv";
+    struct stat file_stat{};
+    long size = stat(motion_file.c_str(), &file_stat) == 0 ? file_stat.st_size : 0;
+    if (size != log.size) {
+        log.size = size;
+        log.events = MotionEvent::read_file(motion_file);
+    }
+    return log.events;
+}
+
+string SegmentCompactor::compacting_path(const string &segment_path) {
+    // Keeps the extension, so the output format is the same. The name isn't a segment name, so a crash doesn't
+    // leave a segment behind for the catalog rebuild or the retention manager to pick up.
+    return segment_sibling_path(segment_path, "_compacting", true);
+}
+
+long SegmentCompactor::now_ms() {
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,84 @@
+
+#ifndef HOMECAMRECORDER_SEGMENTCOMPACTOR_H
+#define HOMECAMRECORDER_SEGMENTCOMPACTOR_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RecordingCatalog.h"
+#include "RetentionManager.h"
+#include "MotionEvent.h"
+
+using namespace std;
+using namespace std::chrono;
+
+struct CompactionPolicy {
+    // Segments are compacted once they finished this long ago.
+    seconds min_age;
+    // Whole GOPs are kept this far around motion. More than a GOP, so the GOP a motion event starts in is kept.
+    milliseconds motion_padding;
+};
+
+/**
+ * Thins old segments on a low priority background thread: every GOP within motion_padding of a motion event in the
+ * camera's motion file is kept whole, everywhere else only the keyframe of each GOP is kept. The packets are stream
+ * copied with their timestamps, so a compacted segment plays as a slideshow between motion and the catalog's times
+ * still hold. Most of a day has no motion, so this costs a fraction of the disk.
+ *
+ * The segment is rewritten to <basename>_<number>_compacting.<extension> with a fresh KeyframeIndex, synced, and
+ * renamed over the original, so a crash leaves either the old or the new segment. The catalog records which
+ * segments are compacted, so each is only compacted once.
+ */
+class SegmentCompactor {
+public:
+    SegmentCompactor(string recordings_dir, CompactionPolicy policy, RecordingCatalog *catalog,
+                     RetentionManager *retention_manager = nullptr);
+    ~SegmentCompactor();
+
+    // With wait_for_upload, segments are only compacted once SegmentUploader has the full footage in the object store.
+    void start(bool wait_for_upload = false);
+    void stop();
+
+private:
+    static const int SCAN_INTERVAL_SEC = 300;
+    // A rewrite that saves less than this isn't worth swapping in.
+    static constexpr double MIN_SAVING = 0.1;
+
+    struct MotionLog {
+        long size{-1};
+        vector<MotionEvent> events;
+    };
+
+    const string recordings_dir;
+    const CompactionPolicy policy;
+    RecordingCatalog *catalog;
+    RetentionManager *retention_manager;
+    bool wait_for_upload{false};
+
+    mutex stop_mutex;
+    condition_variable wake_up;
+    atomic<bool> stopping{false};
+    thread worker;
+    // Camera -> its motion events, reread when the file grows.
+    map<string, MotionLog> motion_logs;
+    // Segments that failed to compact this run. They are left as they are.
+    set<string> failed;
+
+    void run();
+    bool next_segment(CatalogEntry &segment);
+    void compact(const CatalogEntry &segment);
+    // Returns the size of the rewritten segment, or -1 if it failed.
+    long rewrite(const CatalogEntry &segment, const string &output_path, const vector<MotionEvent> &events);
+    const vector<MotionEvent> &motion_events(const string &camera);
+    static string compacting_path(const string &segment_path);
+    static long now_ms();
+};
+
+#endif //HOMECAMRECORDER_SEGMENTCOMPACTOR_H
@@ -0,0 +1,106 @@
+#include "SegmentLifecycle.h"
+#include "QosScheduler.h"
+#include "SegmentRecovery.h"
+
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+SegmentLifecycle::SegmentLifecycle(string basename, string extension, RetentionManager *retention_manager,
+                                   RecordingCatalog *catalog, SegmentUploader *uploader) :
+    basename(std::move(basename)), extension(std::move(extension)), retention_manager(retention_manager),
+    catalog(catalog), uploader(uploader) {}
+
+const string &SegmentLifecycle::open_segment() {
+    if (retention_manager) {
+        number = retention_manager->next_segment_number(basename);
+    }
+    path = basename + "_" + to_string(number) + "." + extension;
+    // With a retention manager old segments are deleted in the background instead.
+    if (!retention_manager) {
+        if (remove(path.c_str()) == 0) {
+            cout << "(SegmentLifecycle) Removed " << path << endl;
+        }
+        number = (number + 1) % MAX_FILES;
+    }
+
+    file_start_time = system_clock::now();
+    long file_start_time_ms = duration_cast<milliseconds>(file_start_time.time_since_epoch()).count();
+    string timestamp_file_path = SegmentRecovery::start_time_path(path);
+    ofstream timestamp_file(timestamp_file_path);
+    timestamp_file << file_start_time_ms << endl;
+    timestamp_file.close();
+    if (retention_manager) {
+        retention_manager->segment_opened(basename, path, timestamp_file_path);
+    }
+    if (catalog) {
+        catalog->segment_opened(RecordingCatalog::camera_name(basename), path, file_start_time_ms);
+    }
+
+    keyframes_written = 0;
+    open = true;
+    return path;
+}
+
+void SegmentLifecycle::file_created(int fd) {
+    sync_fd = fd;
+    last_catalog_update_time = system_clock::now();
+    last_flush_time = last_catalog_update_time;
+    last_sync_time = last_catalog_update_time;
+    // Fragmented MP4 can't be seeked by byte offset, and there's nothing to seek in a pipe or /dev/null.
+    struct stat file_stat{};
+    if (open && (extension == "ts" || extension == "flv") && fd >= 0 && fstat(fd, &file_stat) == 0 &&
+        S_ISREG(file_stat.st_mode)) {
+        keyframe_index.create(path);
+    }
+}
+
+void SegmentLifecycle::keyframe(long offset) {
+    keyframe_index.add(offset, duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count());
+    keyframes_written++;
+}
+
+void SegmentLifecycle::progress(long bytes) {
+    auto now = system_clock::now();
+    if (catalog && open && duration_cast<seconds>(now - last_catalog_update_time).count() > CATALOG_UPDATE_INTERVAL_SEC) {
+        catalog->segment_progress(path, bytes, keyframes_written);
+        last_catalog_update_time = now;
+    }
+}
+
+bool SegmentLifecycle::should_flush() const {
+    return duration_cast<milliseconds>(system_clock::now() - last_flush_time).count() > FLUSH_INTERVAL_MS;
+}
+
+void SegmentLifecycle::flushed(time_point<steady_clock> write_start) {
+    QosScheduler::record_disk_write(duration_cast<microseconds>(steady_clock::now() - write_start).count());
+    last_flush_time = system_clock::now();
+    if (sync_fd >= 0 && duration_cast<seconds>(last_flush_time - last_sync_time).count() >= SYNC_INTERVAL_SEC) {
+#ifdef __linux__
+        // Starts writeback without waiting for it, so a power loss costs seconds rather than the page cache.
+        sync_file_range(sync_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+        last_sync_time = last_flush_time;
+    }
+}
+
+bool SegmentLifecycle::should_rotate() const {
+    return open && duration_cast<seconds>(system_clock::now() - file_start_time).count() > MAX_FILE_DURATION_SEC;
+}
+
+void SegmentLifecycle::close_segment(long bytes) {
+    keyframe_index.close();
+    sync_fd = -1;
+    if (!open) return;
+    open = false;
+    if (catalog) {
+        catalog->segment_closed(path, bytes, keyframes_written);
+    }
+    if (retention_manager) {
+        retention_manager->segment_closed(basename, path);
+    }
+    if (uploader && catalog) {
+        uploader->segment_closed(path);
+    }
+}
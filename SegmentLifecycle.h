@@ -0,0 +1,74 @@
+
+#ifndef HOMECAMRECORDER_SEGMENTLIFECYCLE_H
+#define HOMECAMRECORDER_SEGMENTLIFECYCLE_H
+
+#include <chrono>
+#include <string>
+
+#include "RetentionManager.h"
+#include "RecordingCatalog.h"
+#include "SegmentUploader.h"
+#include "KeyframeIndex.h"
+
+using namespace std;
+using namespace std::chrono;
+
+/**
+ * The bookkeeping of a camera's recording segments, shared by RotatingFileMuxer and SegmentSink, which only write
+ * the bytes: the segment's number and name, its _start_time.txt, telling the catalog, the retention manager and the
+ * uploader about it, its KeyframeIndex, and when to flush, push to disk and rotate.
+ *
+ * Segments are named <basename>_<number>.<extension>. Without a retention manager they form a ring of MAX_FILES.
+ */
+class SegmentLifecycle {
+public:
+    static const int MAX_FILES = 32 /* 16 hours */;
+    static const int MAX_FILE_DURATION_SEC = 30 * 60; /* 30 minutes */
+    static const int CATALOG_UPDATE_INTERVAL_SEC = 60;
+    static const int FLUSH_INTERVAL_MS = 1000;
+    static const int SYNC_INTERVAL_SEC = 10;
+
+    SegmentLifecycle(string basename, string extension, RetentionManager *retention_manager = nullptr,
+                     RecordingCatalog *catalog = nullptr, SegmentUploader *uploader = nullptr);
+
+    // Numbers and announces the next segment and writes its start time. Returns its path, for the owner to create.
+    // Only a segment opened here is rotated and reported when it's closed.
+    const string &open_segment();
+    // The owner created the file, a segment or not. fd is only used to push it to disk, and stays the owner's.
+    void file_created(int fd);
+    // Before the keyframe at offset is written.
+    void keyframe(long offset);
+    // Every few packets, with the bytes written so far.
+    void progress(long bytes);
+    bool should_flush() const;
+    // After the owner wrote out its buffers, which it started doing at write_start.
+    void flushed(time_point<steady_clock> write_start);
+    bool should_rotate() const;
+    // After the owner closed the file.
+    void close_segment(long bytes);
+
+    bool is_open() const { return open; }
+    const string &output_file() const { return path; }
+    int file_number() const { return number; }
+
+private:
+    const string basename;
+    const string extension;
+    RetentionManager *retention_manager;
+    RecordingCatalog *catalog;
+    // Finished segments are copied to the object store when there is one.
+    SegmentUploader *uploader;
+
+    bool open{false};
+    string path;
+    int number{0};
+    int sync_fd{-1};
+    KeyframeIndex keyframe_index;
+    int keyframes_written{0};
+    time_point<system_clock> file_start_time{};
+    time_point<system_clock> last_catalog_update_time{};
+    time_point<system_clock> last_flush_time{};
+    time_point<system_clock> last_sync_time{};
+};
+
+#endif //HOMECAMRECORDER_SEGMENTLIFECYCLE_H
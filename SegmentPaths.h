@@ -0,0 +1,25 @@
+
+#ifndef HOMECAMRECORDER_SEGMENTPATHS_H
+#define HOMECAMRECORDER_SEGMENTPATHS_H
+
+#include <string>
+
+using namespace std;
+
+// The path of a file that goes with a segment: the segment's path with suffix in place of its extension, like
+// camera_3_keyframes.txt for camera_3.ts. With keep_extension the suffix goes before the extension instead. A dot in
+// a directory name isn't taken for the extension.
+inline string segment_sibling_path(const string &segment_path, const string &suffix, bool keep_extension = false) {
+    size_t extension_start = segment_path.rfind('.');
+    size_t name_start = segment_path.rfind('/');
+    if (extension_start == string::npos || (name_start != string::npos && extension_start < name_start)) {
+        return segment_path + suffix;
+    }
+    string sibling_path = segment_path.substr(0, extension_start) + suffix;
+    if (keep_extension) {
+        sibling_path += segment_path.substr(extension_start);
+    }
+    return sibling_path;
+}
+
+#endif //HOMECAMRECORDER_SEGMENTPATHS_H
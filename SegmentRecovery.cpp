@@ -0,0 +1,178 @@
+#include "SegmentRecovery.h"
+#include "SegmentPaths.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static uint32_t read_be32(const uint8_t *bytes) {
+    return ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | bytes[3];
+}
+
+static uint32_t read_be24(const uint8_t *bytes) {
+    return ((uint32_t) bytes[0] << 16) | ((uint32_t) bytes[1] << 8) | bytes[2];
+}
+
+static bool read_fully(int fd, uint8_t *buffer, long length, long offset) {
+    while (length > 0) {
+        ssize_t count = pread(fd, buffer, length, offset);
+        if (count <= 0) return false;
+        buffer += count;
+        length -= count;
+        offset += count;
+    }
+    return true;
+}
+
+long SegmentRecovery::repair_segment(const string &path) {
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0) return -1;
+    struct stat file_stat{};
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        return -1;
+    }
+    long size = file_stat.st_size;
+
+    string extension = path.substr(path.rfind('.') + 1);
+    transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    long repaired_size = size;
+    if (extension == "ts") {
+        repaired_size = repair_ts(fd, size);
+    } else if (extension == "flv") {
+        repaired_size = repair_flv(fd, size);
+    } else if (extension == "mp4" || extension == "mov" || extension == "m4v") {
+        repaired_size = repair_fragmented_mp4(fd, size);
+    }
+
+    if (repaired_size < size) {
+        if (ftruncate(fd, repaired_size) == 0) {
+            cout << "(SegmentRecovery) Cut " << path << " back from " << size << " to " << repaired_size
+                 << " bytes." << endl;
+        } else {
+            cerr << "(SegmentRecovery) Failed to truncate " << path << endl;
+            repaired_size = size;
+        }
+    }
+    close(fd);
+    return repaired_size;
+}
+
+long SegmentRecovery::repair_ts(int fd, long size) {
+    // Our segments start with a whole packet, so packets are aligned to the start of the file.
+    long end = size / TS_PACKET_SIZE * TS_PACKET_SIZE;
+    long start = max(0L, end - TS_TAIL_PACKETS * TS_PACKET_SIZE);
+    vector<uint8_t> tail(end - start);
+    if (!read_fully(fd, tail.data(), end - start, start)) return size;
+    while (end > start && tail[end - TS_PACKET_SIZE - start] != 0x47) {
+        end -= TS_PACKET_SIZE;
+    }
+    // A tail that is all garbage isn't a torn write. Leave it alone.
+    return end == start && start > 0 ? size : end;
+}
+
+long SegmentRecovery::repair_flv(int fd, long size) {
+    // 9 byte header and a zero PreviousTagSize.
+    const long HEADER_SIZE = 13;
+    const long TAG_HEADER_SIZE = 11;
+    if (size <= HEADER_SIZE) return size;
+
+    long start = max(HEADER_SIZE, size - FLV_TAIL_BYTES);
+    vector<uint8_t> tail(size - start);
+    if (!read_fully(fd, tail.data(), size - start, start)) return size;
+
+    // The file ends cleanly at end if the PreviousTagSize before it describes a whole tag: an audio, video or
+    // script tag whose data size matches and whose stream id is 0.
+    for (long end = size; end >= start + TAG_HEADER_SIZE + 4; end--) {
+        uint32_t tag_size = read_be32(&tail[end - 4 - start]);
+        if (tag_size < TAG_HEADER_SIZE || end - 4 - (long) tag_size < start) continue;
+        const uint8_t *tag = &tail[end - 4 - tag_size - start];
+        int tag_type = tag[0] & 0x1F;
+        if (tag_type != 8 && tag_type != 9 && tag_type != 18) continue;
+        if (read_be24(tag + 1) != tag_size - TAG_HEADER_SIZE) continue;
+        if (read_be24(tag + 8) != 0) continue;
+        return end;
+    }
+    // Nothing complete in the tail. Unless the tail is the whole file, leave it for the demuxer to resync.
+    return start == HEADER_SIZE ? HEADER_SIZE : size;
+}
+
+long SegmentRecovery::repair_fragmented_mp4(int fd, long size) {
+    // Boxes can't be found from the end, so this walks the top level box headers. That's one small read per
+    // fragment, not a read of the file.
+    long offset = 0;
+    long playable_end = 0;
+    uint8_t header[16];
+    while (offset + 8 <= size) {
+        if (!read_fully(fd, header, min(16L, size - offset), offset)) break;
+        long box_size = read_be32(header);
+        long header_size = 8;
+        if (box_size == 1) {
+            if (offset + 16 > size) break;
+            box_size = ((long) read_be32(header + 8) << 32) | read_be32(header + 12);
+            header_size = 16;
+        } else if (box_size == 0) {
+            // Runs to the end of the file, which is only whole if the trailer was written.
+            box_size = size - offset;
+        }
+        if (box_size < header_size || offset + box_size > size) break;
+        string type((const char *) header + 4, 4);
+        offset += box_size;
+        // The file plays up to the end of the moov and then up to the end of each moof + mdat pair.
+        if (type == "moov" || type == "mdat" || type == "mfra") {
+            playable_end = offset;
+        }
+    }
+    return playable_end > 0 ? playable_end : size;
+}
+
+void SegmentRecovery::repair_text_file(const string &path) {
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0) return;
+    struct stat file_stat{};
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(fd);
+        return;
+    }
+    long size = file_stat.st_size;
+    long start = max(0L, size - TEXT_TAIL_BYTES);
+    vector<uint8_t> tail(size - start);
+    if (read_fully(fd, tail.data(), size - start, start) && tail.back() != '\n') {
+        auto last_newline = find(tail.rbegin(), tail.rend(), '\n');
+        long repaired_size = -1;
+        if (last_newline != tail.rend()) {
+            repaired_size = start + (long) (tail.rend() - last_newline);
+        } else if (start == 0) {
+            repaired_size = 0;
+        }
+        if (repaired_size >= 0 && ftruncate(fd, repaired_size) == 0) {
+            cout << "(SegmentRecovery) Dropped a torn line from " << path << endl;
+        }
+    }
+    close(fd);
+}
+
+void SegmentRecovery::repair_start_time(const string &start_time_path, long start_time_ms) {
+    ifstream start_time_file(start_time_path);
+    long written_start_time_ms;
+    if (start_time_file >> written_start_time_ms) return;
+    start_time_file.close();
+
+    string temporary_path = start_time_path + ".tmp";
+    ofstream repaired(temporary_path, ios::trunc);
+    repaired << start_time_ms << endl;
+    repaired.close();
+    if (repaired && rename(temporary_path.c_str(), start_time_path.c_str()) == 0) {
+        cout << "(SegmentRecovery) Rewrote " << start_time_path << endl;
+    }
+}
+
+string SegmentRecovery::start_time_path(const string &segment_path) {
+    return segment_sibling_path(segment_path, "_start_time.txt");
+}
@@ -0,0 +1,43 @@
+
+#ifndef HOMECAMRECORDER_SEGMENTRECOVERY_H
+#define HOMECAMRECORDER_SEGMENTRECOVERY_H
+
+#include <string>
+
+using namespace std;
+
+/**
+ * Repairs the files a crash or power loss leaves behind, so they play and parse up to the last complete unit.
+ *
+ * Only the end of a file is looked at: a segment that was being written when the process died is cut back to its
+ * last complete MPEG-TS packet, FLV tag or fragmented MP4 fragment. Text files (the motion CSV, _start_time.txt)
+ * are cut back to their last complete line. Segment recovery only ever truncates, so running it on a segment that
+ * is fine leaves it as it is.
+ */
+class SegmentRecovery {
+public:
+    // Returns the size of the segment after the repair, or -1 if it can't be read.
+    static long repair_segment(const string &path);
+
+    // Drops a torn last line.
+    static void repair_text_file(const string &path);
+
+    // Rewrites the segment's start time file if it's missing or torn.
+    static void repair_start_time(const string &start_time_path, long start_time_ms);
+
+    // <basename>_<number>.<extension> -> <basename>_<number>_start_time.txt
+    static string start_time_path(const string &segment_path);
+
+private:
+    // How far back from the end of an FLV file a complete tag is looked for. More than a keyframe.
+    static const long FLV_TAIL_BYTES = 4 * 1024 * 1024;
+    static const long TS_PACKET_SIZE = 188;
+    static const long TS_TAIL_PACKETS = 1024;
+    static const long TEXT_TAIL_BYTES = 4096;
+
+    static long repair_ts(int fd, long size);
+    static long repair_flv(int fd, long size);
+    static long repair_fragmented_mp4(int fd, long size);
+};
+
+#endif //HOMECAMRECORDER_SEGMENTRECOVERY_H
@@ -0,0 +1,35 @@
+
+#ifndef HOMECAMRECORDER_SEGMENTTIME_H
+#define HOMECAMRECORDER_SEGMENTTIME_H
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// Maps the timestamps of a recorded segment's stream to epoch time in ms and back, given the time the segment started.
+// Segment timestamps start at 0, but MPEG-TS adds its mux delay to them, which the demuxer reports as the start time.
+
+inline int64_t segment_start_offset(const AVFormatContext *input_ctx) {
+    return input_ctx->start_time != AV_NOPTS_VALUE ? input_ctx->start_time : 0;
+}
+
+inline long segment_time_ms(long segment_start_ms, const AVFormatContext *input_ctx, const AVStream *stream,
+                            int64_t timestamp) {
+    return segment_start_ms + av_rescale_q(timestamp, stream->time_base, AVRational{1, 1000}) -
+           av_rescale_q(segment_start_offset(input_ctx), AV_TIME_BASE_Q, AVRational{1, 1000});
+}
+
+inline long segment_time_ms(long segment_start_ms, const AVFormatContext *input_ctx, const AVStream *stream,
+                            const AVPacket *packet) {
+    int64_t timestamp = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    return segment_time_ms(segment_start_ms, input_ctx, stream, timestamp);
+}
+
+// The stream's timestamp at time_ms, to seek to.
+inline int64_t segment_timestamp(long segment_start_ms, const AVFormatContext *input_ctx, const AVStream *stream,
+                                 long time_ms) {
+    return av_rescale_q(time_ms - segment_start_ms, AVRational{1, 1000}, stream->time_base) +
+           av_rescale_q(segment_start_offset(input_ctx), AV_TIME_BASE_Q, stream->time_base);
+}
+
+#endif //HOMECAMRECORDER_SEGMENTTIME_H
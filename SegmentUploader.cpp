@@ -0,0 +1,385 @@
+#include "SegmentUploader.h"
+#include "QosScheduler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <filesystem>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __APPLE__
+using namespace std::__fs::filesystem;
+#else
+using namespace std::filesystem;
+#endif
+
+// S3 allows up to 10000 parts per upload.
+static const long MAX_PARTS = 10000;
+// A stalled connection is given up after this long below a KB/s.
+static const long LOW_SPEED_TIME_SEC = 60;
+static const long CONNECT_TIMEOUT_SEC = 10;
+
+bool ObjectStoreConfig::from_environment(ObjectStoreConfig &config) {
+    const char *endpoint = getenv("HOMECAM_S3_ENDPOINT");
+    const char *bucket = getenv("HOMECAM_S3_BUCKET");
+    const char *access_key = getenv("HOMECAM_S3_ACCESS_KEY");
+    const char *secret_key = getenv("HOMECAM_S3_SECRET_KEY");
+    if (!endpoint) return false;
+    if (!bucket || !access_key || !secret_key) {
+        cerr << "(SegmentUploader) HOMECAM_S3_ENDPOINT needs HOMECAM_S3_BUCKET, HOMECAM_S3_ACCESS_KEY and "
+             << "HOMECAM_S3_SECRET_KEY. Not uploading." << endl;
+        return false;
+    }
+    config.endpoint = endpoint;
+    while (!config.endpoint.empty() && config.endpoint.back() == '/') {
+        config.endpoint.pop_back();
+    }
+    config.bucket = bucket;
+    config.access_key = access_key;
+    config.secret_key = secret_key;
+    if (const char *region = getenv("HOMECAM_S3_REGION")) config.region = region;
+    if (const char *prefix = getenv("HOMECAM_S3_PREFIX")) config.prefix = prefix;
+    if (const char *max_kbps = getenv("HOMECAM_S3_MAX_KBPS")) {
+        config.max_bytes_per_second = max(0L, atol(max_kbps)) * 1024;
+    }
+    return true;
+}
+
+SegmentUploader::SegmentUploader(ObjectStoreConfig config, RecordingCatalog *catalog,
+                                 RetentionManager *retention_manager) :
+    config(std::move(config)), catalog(catalog), retention_manager(retention_manager) {}
+
+SegmentUploader::~SegmentUploader() {
+    stop();
+}
+
+void SegmentUploader::start() {
+    curl_global_init(CURL_GLOBAL_ALL);
+    curl = curl_easy_init();
+    if (!curl) {
+        cerr << "(SegmentUploader) Failed to create a curl handle. Not uploading." << endl;
+        return;
+    }
+    vector<CatalogEntry> pending = catalog->pending_uploads();
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        for (const CatalogEntry &entry : pending) {
+            if (queued.insert(entry.path).second) {
+                queue.push_back(entry.path);
+            }
+        }
+    }
+    cout << "(SegmentUploader) Uploading to " << config.endpoint << "/" << config.bucket << ". " << pending.size()
+         << " segments to catch up on." << endl;
+    stopping = false;
+    worker = thread(&SegmentUploader::run, this);
+}
+
+void SegmentUploader::stop() {
+    stopping = true;
+    wake_up.notify_all();
+    if (worker.joinable())
+        worker.join();
+    if (curl) {
+        curl_easy_cleanup(curl);
+        curl = nullptr;
+    }
+}
+
+void SegmentUploader::segment_closed(const string &path) {
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if (!queued.insert(path).second) return;
+        queue.push_back(path);
+    }
+    wake_up.notify_one();
+}
+
+void SegmentUploader::run() {
+    // Uploads can always wait, the cameras can't.
+    QosThread qos_thread(QosClass::BACKGROUND);
+
+    int retry_sec = INITIAL_RETRY_SEC;
+    while (!stopping) {
+        string path;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            wake_up.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping) break;
+            path = queue.front();
+        }
+
+        bool done = upload(path);
+
+        unique_lock<mutex> lock(queue_mutex);
+        queue.pop_front();
+        if (done) {
+            queued.erase(path);
+            retry_sec = INITIAL_RETRY_SEC;
+            continue;
+        }
+        // A segment the store keeps refusing doesn't hold up the others.
+        queue.push_back(path);
+        if (stopping) break;
+        cerr << "(SegmentUploader) Retrying in " << retry_sec << " s." << endl;
+        wake_up.wait_for(lock, seconds(retry_sec), [this] { return stopping.load(); });
+        retry_sec = min(retry_sec * 2, MAX_RETRY_SEC);
+    }
+}
+
+bool SegmentUploader::upload(const string &path) {
+    CatalogEntry entry;
+    // Evicted before its turn came.
+    if (!catalog->get(path, entry) || entry.uploaded) return true;
+    string url = object_url(entry);
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "(SegmentUploader) " << path << " is gone. Not uploading it." << endl;
+        if (!entry.upload_id.empty()) {
+            abort_upload(entry, url);
+        }
+        return true;
+    }
+    struct stat file_stat{};
+    fstat(fd, &file_stat);
+    long size = file_stat.st_size;
+    // Parts may have to grow for very large segments. A resumed upload keeps the part size it started with.
+    long part_size = max(config.part_size, (size + MAX_PARTS - 1) / MAX_PARTS);
+    if (!entry.upload_id.empty() && entry.upload_part_size != part_size) {
+        abort_upload(entry, url);
+        entry.upload_id.clear();
+    }
+    if (entry.upload_id.empty()) {
+        entry.upload_part_size = part_size;
+        if (!create_upload(entry, url)) {
+            close(fd);
+            return false;
+        }
+    }
+#ifdef __linux__
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    long part_count = max(1L, (size + part_size - 1) / part_size);
+    entry.upload_parts.resize(part_count);
+    for (long part_number = 1; part_number <= part_count; part_number++) {
+        if (!entry.upload_parts[part_number - 1].empty()) continue;
+        QosScheduler::throttle();
+        FilePart part{fd, (part_number - 1) * part_size, min(part_size, size - (part_number - 1) * part_size)};
+        long part_offset = part.offset;
+        long part_length = part.remaining;
+        string response;
+        string etag;
+        long status = request("PUT", url + "?partNumber=" + to_string(part_number) + "&" + upload_query(entry.upload_id),
+                              "", &part, response, &etag);
+#ifdef __linux__
+        // What was read for the upload is never read again. Leave the page cache to the cameras.
+        posix_fadvise(fd, part_offset, part_length, POSIX_FADV_DONTNEED);
+#endif
+        if (status == 404) {
+            // The store dropped the upload. Start over on the next attempt.
+            cerr << "(SegmentUploader) Upload of " << path << " expired." << endl;
+            catalog->upload_started(path, "", 0);
+            close(fd);
+            return false;
+        }
+        if (status != 200 || etag.empty()) {
+            if (!stopping) {
+                cerr << "(SegmentUploader) Part " << part_number << " of " << path << " failed with status " << status
+                     << " " << xml_value(response, "Code") << endl;
+            }
+            close(fd);
+            return false;
+        }
+        entry.upload_parts[part_number - 1] = etag;
+        catalog->part_uploaded(path, (int) part_number, etag);
+    }
+    close(fd);
+
+    if (!complete_upload(entry, url)) return false;
+    catalog->segment_uploaded(path);
+    if (retention_manager) {
+        retention_manager->segment_uploaded(path);
+    }
+    cout << "(SegmentUploader) Uploaded " << path << " (" << size / (1024 * 1024) << " MB)" << endl;
+    return true;
+}
+
+bool SegmentUploader::create_upload(CatalogEntry &entry, const string &url) {
+    string response;
+    long status = request("POST", url + "?uploads=", "", nullptr, response);
+    string upload_id = xml_value(response, "UploadId");
+    if (status != 200 || upload_id.empty()) {
+        cerr << "(SegmentUploader) Failed to start uploading " << entry.path << ". Status " << status << " "
+             << xml_value(response, "Code") << endl;
+        return false;
+    }
+    entry.upload_id = upload_id;
+    entry.upload_parts.clear();
+    catalog->upload_started(entry.path, upload_id, entry.upload_part_size);
+    return true;
+}
+
+bool SegmentUploader::complete_upload(const CatalogEntry &entry, const string &url) {
+    string body = "<CompleteMultipartUpload>";
+    for (size_t i = 0; i < entry.upload_parts.size(); i++) {
+        body += "<Part><PartNumber>" + to_string(i + 1) + "</PartNumber><ETag>" + entry.upload_parts[i] +
+                "</ETag></Part>";
+    }
+    body += "</CompleteMultipartUpload>";
+
+    string response;
+    long status = request("POST", url + "?" + upload_query(entry.upload_id), body, nullptr, response);
+    if (status == 404) {
+        cerr << "(SegmentUploader) Upload of " << entry.path << " expired." << endl;
+        catalog->upload_started(entry.path, "", 0);
+        return false;
+    }
+    // Completing can fail after the 200 has been sent, with the error in the body.
+    if (status != 200 || response.find("<Error>") != string::npos) {
+        cerr << "(SegmentUploader) Failed to complete " << entry.path << ". Status " << status << " "
+             << xml_value(response, "Code") << endl;
+        return false;
+    }
+    return true;
+}
+
+void SegmentUploader::abort_upload(const CatalogEntry &entry, const string &url) {
+    // Otherwise the store keeps the parts, and bills for them, until a lifecycle rule cleans them up.
+    string response;
+    request("DELETE", url + "?" + upload_query(entry.upload_id), "", nullptr, response);
+    catalog->upload_started(entry.path, "", 0);
+}
+
+string SegmentUploader::object_url(const CatalogEntry &entry) const {
+    string key = config.prefix + entry.camera + "/" + path(entry.path).filename().string();
+    string url = config.endpoint + "/" + config.bucket;
+    size_t start = 0;
+    while (start <= key.size()) {
+        size_t end = key.find('/', start);
+        if (end == string::npos) end = key.size();
+        char *escaped = curl_easy_escape(curl, key.c_str() + start, (int) (end - start));
+        url += "/" + string(escaped ? escaped : "");
+        curl_free(escaped);
+        start = end + 1;
+    }
+    return url;
+}
+
+string SegmentUploader::upload_query(const string &upload_id) const {
+    char *escaped = curl_easy_escape(curl, upload_id.c_str(), (int) upload_id.size());
+    string query = "uploadId=" + string(escaped ? escaped : "");
+    curl_free(escaped);
+    return query;
+}
+
+long SegmentUploader::request(const string &method, const string &url, const string &body, FilePart *part,
+                              string &response, string *etag) {
+    curl_easy_reset(curl);
+    // Query strings are written sorted and with every value, the way SigV4 signs them.
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    string sigv4 = "aws:amz:" + config.region + ":s3";
+    curl_easy_setopt(curl, CURLOPT_AWS_SIGV4, sigv4.c_str());
+    curl_easy_setopt(curl, CURLOPT_USERNAME, config.access_key.c_str());
+    curl_easy_setopt(curl, CURLOPT_PASSWORD, config.secret_key.c_str());
+
+    // The parts aren't hashed, that would mean reading them twice. TCP and TLS look after their integrity.
+    struct curl_slist *headers = curl_slist_append(nullptr, "x-amz-content-sha256: UNSIGNED-PAYLOAD");
+    if (part) {
+        curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_part);
+        curl_easy_setopt(curl, CURLOPT_READDATA, part);
+        curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t) part->remaining);
+        if (config.max_bytes_per_second > 0) {
+            curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, (curl_off_t) config.max_bytes_per_second);
+        }
+    } else if (method == "POST") {
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) body.size());
+        headers = curl_slist_append(headers, "Content-Type: application/xml");
+    } else {
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method.c_str());
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_response);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    if (etag) {
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, read_etag);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, etag);
+    }
+    // Stopping the recorder cuts an upload short. The part is sent again on the next start.
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, check_stopping);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT_SEC);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, LOW_SPEED_TIME_SEC);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+    CURLcode result = curl_easy_perform(curl);
+    curl_slist_free_all(headers);
+    if (result != CURLE_OK) {
+        if (!stopping) {
+            cerr << "(SegmentUploader) " << method << " " << url << " failed: " << curl_easy_strerror(result) << endl;
+        }
+        return -1;
+    }
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    return status;
+}
+
+size_t SegmentUploader::read_part(char *buffer, size_t size, size_t count, void *user_data) {
+    auto *part = (FilePart *) user_data;
+    size_t wanted = min(size * count, (size_t) part->remaining);
+    if (wanted == 0) return 0;
+    ssize_t ret;
+    do {
+        ret = pread(part->fd, buffer, wanted, part->offset);
+    } while (ret < 0 && errno == EINTR);
+    // The retention manager truncates segments it deletes. A short file fails the part instead of sending less.
+    if (ret <= 0) return CURL_READFUNC_ABORT;
+    part->offset += ret;
+    part->remaining -= ret;
+    return (size_t) ret;
+}
+
+size_t SegmentUploader::write_response(char *data, size_t size, size_t count, void *user_data) {
+    auto *response = (string *) user_data;
+    // Responses are small XML documents, anything past this is of no interest.
+    if (response->size() < 64 * 1024) {
+        response->append(data, size * count);
+    }
+    return size * count;
+}
+
+size_t SegmentUploader::read_etag(char *data, size_t size, size_t count, void *user_data) {
+    size_t length = size * count;
+    const char *name = "etag:";
+    if (length > strlen(name) && strncasecmp(data, name, strlen(name)) == 0) {
+        string value(data + strlen(name), length - strlen(name));
+        size_t start = value.find_first_not_of(" \t");
+        size_t end = value.find_last_not_of(" \t\r\n");
+        *(string *) user_data = start == string::npos ? "" : value.substr(start, end - start + 1);
+    }
+    return length;
+}
+
+int SegmentUploader::check_stopping(void *user_data, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+    return ((SegmentUploader *) user_data)->stopping ? 1 : 0;
+}
+
+string SegmentUploader::xml_value(const string &xml, const string &tag) {
+    string open_tag = "<" + tag + ">";
+    size_t start = xml.find(open_tag);
+    if (start == string::npos) return "";
+    start += open_tag.size();
+    size_t end = xml.find("</" + tag + ">", start);
+    if (end == string::npos) return "";
+    return xml.substr(start, end - start);
+}
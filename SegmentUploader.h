@@ -0,0 +1,102 @@
+
+#ifndef HOMECAMRECORDER_SEGMENTUPLOADER_H
+#define HOMECAMRECORDER_SEGMENTUPLOADER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <curl/curl.h>
+
+#include "RecordingCatalog.h"
+#include "RetentionManager.h"
+
+using namespace std;
+
+struct ObjectStoreConfig {
+    // http://minio.local:9000. Buckets are addressed by path, which both S3 and MinIO take.
+    string endpoint;
+    string bucket;
+    string region{"us-east-1"};
+    string access_key;
+    string secret_key;
+    // Objects are named <prefix><camera>/<segment file name>.
+    string prefix;
+    // Upload bandwidth, 0 for unlimited. The default is well above what three cameras record.
+    long max_bytes_per_second{4 * 1024 * 1024};
+    // S3 needs at least 5 MB in every part but the last.
+    long part_size{16 * 1024 * 1024};
+
+    /**
+     * Reads HOMECAM_S3_ENDPOINT, HOMECAM_S3_BUCKET, HOMECAM_S3_ACCESS_KEY and HOMECAM_S3_SECRET_KEY, and optionally
+     * HOMECAM_S3_REGION, HOMECAM_S3_PREFIX and HOMECAM_S3_MAX_KBPS. Returns false if uploads aren't configured.
+     */
+    static bool from_environment(ObjectStoreConfig &config);
+};
+
+/**
+ * Copies finished segments to an S3 compatible object store on a low priority background thread, so recordings
+ * outlive the local disk.
+ *
+ * Segments are sent with multipart uploads streamed from the file a part at a time and never held in memory. The
+ * upload is capped at max_bytes_per_second, runs at the lowest CPU and I/O priority, and drops what it read from the
+ * page cache, so it can't get in the way of the cameras. Every part is recorded in the catalog, so after a restart
+ * an upload carries on from its last part, and an uploaded segment is marked in the catalog and with the retention
+ * manager as safe to evict.
+ */
+class SegmentUploader {
+public:
+    SegmentUploader(ObjectStoreConfig config, RecordingCatalog *catalog, RetentionManager *retention_manager = nullptr);
+    ~SegmentUploader();
+
+    // Queues the segments in the catalog that aren't uploaded yet, including uploads a restart interrupted.
+    void start();
+    void stop();
+
+    void segment_closed(const string &path);
+
+private:
+    static const int INITIAL_RETRY_SEC = 30;
+    static const int MAX_RETRY_SEC = 600;
+
+    struct FilePart {
+        int fd;
+        long offset;
+        long remaining;
+    };
+
+    const ObjectStoreConfig config;
+    RecordingCatalog *catalog;
+    RetentionManager *retention_manager;
+    CURL *curl{};
+
+    mutex queue_mutex;
+    condition_variable wake_up;
+    deque<string> queue;
+    set<string> queued;
+    atomic<bool> stopping{false};
+    thread worker;
+
+    void run();
+    // True when the segment is uploaded or can't be anymore, false to try again later.
+    bool upload(const string &path);
+    bool create_upload(CatalogEntry &entry, const string &url);
+    bool complete_upload(const CatalogEntry &entry, const string &url);
+    void abort_upload(const CatalogEntry &entry, const string &url);
+    string object_url(const CatalogEntry &entry) const;
+    string upload_query(const string &upload_id) const;
+    // Returns the HTTP status, or -1 if the request failed.
+    long request(const string &method, const string &url, const string &body, FilePart *part, string &response,
+                 string *etag = nullptr);
+
+    static size_t read_part(char *buffer, size_t size, size_t count, void *user_data);
+    static size_t write_response(char *data, size_t size, size_t count, void *user_data);
+    static size_t read_etag(char *data, size_t size, size_t count, void *user_data);
+    static int check_stopping(void *user_data, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
+    static string xml_value(const string &xml, const string &tag);
+};
+
+#endif //HOMECAMRECORDER_SEGMENTUPLOADER_H
@@ -0,0 +1,434 @@
+#include "SnapshotService.h"
+#include "QosScheduler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+}
+
+#ifdef __APPLE__
+using namespace std::__fs::filesystem;
+#else
+using namespace std::filesystem;
+#endif
+
+static const long PRUNE_INTERVAL_MS = 60L * 60 * 1000;
+
+static long now_ms() {
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+static bool send_all(int fd, const string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t ret = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        sent += ret;
+    }
+    return true;
+}
+
+static void send_response(int fd, const string &status, const string &content_type, const string &body) {
+    ostringstream response;
+    response << "HTTP/1.1 " << status << "\r\n"
+             << "Content-Type: " << content_type << "\r\n"
+             << "Content-Length: " << body.size() << "\r\n"
+             << "Connection: close\r\n\r\n"
+             << body;
+    send_all(fd, response.str());
+}
+
+// Camera names come from URLs, so only the characters basenames use are allowed.
+static bool is_valid_camera(const string &camera) {
+    return !camera.empty() && all_of(camera.begin(), camera.end(), [](char c) { return isalnum(c) || c == '_'; });
+}
+
+SnapshotService::SnapshotService(string thumbs_dir, int port) : thumbs_dir(std::move(thumbs_dir)), port(port) {}
+
+SnapshotService::~SnapshotService() {
+    stop();
+}
+
+void SnapshotService::start(bool serve) {
+    const char *base_url = getenv("SNAPSHOT_BASE_URL");
+    public_base_url = base_url ? base_url : "";
+    while (!public_base_url.empty() && public_base_url.back() == '/') {
+        public_base_url.pop_back();
+    }
+    stopping = false;
+    for (int i = 0; i < WORKER_COUNT; i++) {
+        workers.emplace_back(&SnapshotService::run_worker, this);
+    }
+    if (serve) {
+        server = thread(&SnapshotService::run_server, this);
+    }
+}
+
+void SnapshotService::stop() {
+    stopping = true;
+    wake_up.notify_all();
+    for (thread &worker : workers) {
+        if (worker.joinable())
+            worker.join();
+    }
+    workers.clear();
+    if (server.joinable())
+        server.join();
+    lock_guard<mutex> lock(queue_mutex);
+    for (Snapshot &snapshot : queue) {
+        av_packet_free(&snapshot.keyframe);
+    }
+    queue.clear();
+}
+
+void SnapshotService::submit(const string &camera, long timestamp_ms, const AVPacket *keyframe,
+                             const shared_ptr<AVCodecParameters> &params, bool motion) {
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if (queue.size() >= MAX_PENDING_SNAPSHOTS) {
+            cerr << "(SnapshotService) Too many snapshots pending, skipping " << camera << " at " << timestamp_ms << endl;
+            return;
+        }
+        Snapshot snapshot;
+        snapshot.camera = camera;
+        snapshot.timestamp_ms = timestamp_ms;
+        snapshot.keyframe = av_packet_clone(keyframe);
+        snapshot.params = params;
+        snapshot.motion = motion;
+        queue.push_back(snapshot);
+    }
+    wake_up.notify_one();
+}
+
+void SnapshotService::set_motion_snapshot_callback(function<void(const string &, const string &)> callback) {
+    motion_snapshot_callback = std::move(callback);
+}
+
+string SnapshotService::thumbnail_path(const string &camera, long timestamp_ms) const {
+    return thumbs_dir + "/" + camera + "/" + to_string(timestamp_ms) + ".jpg";
+}
+
+string SnapshotService::picture_url(const string &camera, long timestamp_ms) const {
+    if (public_base_url.empty()) return "";
+    return public_base_url + "/thumbs/" + camera + "/" + to_string(timestamp_ms) + ".jpg";
+}
+
+void SnapshotService::run_worker() {
+    QosThread qos_thread(QosClass::BACKGROUND);
+    while (!stopping) {
+        Snapshot snapshot;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            if (queue.empty()) {
+                wake_up.wait(lock, [this] { return stopping || !queue.empty(); });
+                continue;
+            }
+            snapshot = queue.front();
+            queue.pop_front();
+        }
+        QosScheduler::throttle();
+        bool written = write_thumbnail(snapshot);
+        av_packet_free(&snapshot.keyframe);
+        if (written && snapshot.motion && motion_snapshot_callback) {
+            string url = picture_url(snapshot.camera, snapshot.timestamp_ms);
+            if (!url.empty()) {
+                motion_snapshot_callback(snapshot.camera, url);
+            }
+        }
+    }
+}
+
+bool SnapshotService::write_thumbnail(const Snapshot &snapshot) {
+    AVFrame *frame = decode_keyframe(snapshot);
+    if (!frame) return false;
+    AVFrame *thumbnail = scale_frame(frame);
+    av_frame_free(&frame);
+    if (!thumbnail) return false;
+    string jpeg;
+    bool encoded = encode_jpeg(thumbnail, jpeg);
+    av_frame_free(&thumbnail);
+    if (!encoded) return false;
+
+    string path = thumbnail_path(snapshot.camera, snapshot.timestamp_ms);
+    error_code error;
+    create_directories(thumbs_dir + "/" + snapshot.camera, error);
+    // Written under a temporary name, so the server never sends half a file.
+    string temp_path = path + ".tmp";
+    ofstream file(temp_path, ios::binary);
+    file.write(jpeg.data(), (streamsize) jpeg.size());
+    file.close();
+    if (!file || rename(temp_path.c_str(), path.c_str()) != 0) {
+        cerr << "(SnapshotService) Failed to write " << path << endl;
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+AVFrame *SnapshotService::decode_keyframe(const Snapshot &snapshot) {
+    AVCodec *codec = avcodec_find_decoder(snapshot.params->codec_id);
+    if (!codec) {
+        cerr << "(SnapshotService) No decoder for " << snapshot.camera << endl;
+        return nullptr;
+    }
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    AVFrame *frame = av_frame_alloc();
+    bool decoded = false;
+    if (avcodec_parameters_to_context(codec_ctx, snapshot.params.get()) >= 0) {
+        codec_ctx->thread_count = 1;
+        if (avcodec_open2(codec_ctx, codec, nullptr) >= 0) {
+            // A keyframe decodes on its own. Flushing gets the frame out without waiting for more packets.
+            avcodec_send_packet(codec_ctx, snapshot.keyframe);
+            avcodec_send_packet(codec_ctx, nullptr);
+            decoded = avcodec_receive_frame(codec_ctx, frame) == 0;
+        }
+    }
+    avcodec_free_context(&codec_ctx);
+    if (!decoded) {
+        cerr << "(SnapshotService) Failed to decode keyframe of " << snapshot.camera << endl;
+        av_frame_free(&frame);
+    }
+    return frame;
+}
+
+AVFrame *SnapshotService::scale_frame(const AVFrame *frame) {
+    AVFrame *thumbnail = av_frame_alloc();
+    thumbnail->format = AV_PIX_FMT_YUVJ420P;
+    thumbnail->width = THUMBNAIL_WIDTH;
+    thumbnail->height = max(2, (THUMBNAIL_WIDTH * frame->height / max(1, frame->width)) & ~1);
+    SwsContext *sws_ctx = sws_getContext(frame->width, frame->height, (AVPixelFormat) frame->format,
+                                         thumbnail->width, thumbnail->height, AV_PIX_FMT_YUVJ420P,
+                                         SWS_AREA, nullptr, nullptr, nullptr);
+    if (!sws_ctx || av_frame_get_buffer(thumbnail, 0) < 0) {
+        cerr << "(SnapshotService) Failed to scale " << frame->width << "x" << frame->height << " frame." << endl;
+        sws_freeContext(sws_ctx);
+        av_frame_free(&thumbnail);
+        return nullptr;
+    }
+    sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, thumbnail->data, thumbnail->linesize);
+    sws_freeContext(sws_ctx);
+    return thumbnail;
+}
+
+bool SnapshotService::encode_jpeg(AVFrame *frame, string &jpeg) {
+    AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (!codec) return false;
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    codec_ctx->width = frame->width;
+    codec_ctx->height = frame->height;
+    codec_ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    codec_ctx->time_base = {1, 1};
+    codec_ctx->flags |= AV_CODEC_FLAG_QSCALE;
+    codec_ctx->global_quality = FF_QP2LAMBDA * JPEG_QSCALE;
+    frame->quality = codec_ctx->global_quality;
+    frame->pts = 0;
+
+    bool encoded = false;
+    AVPacket *packet = av_packet_alloc();
+    if (avcodec_open2(codec_ctx, codec, nullptr) >= 0 && avcodec_send_frame(codec_ctx, frame) >= 0 &&
+        avcodec_receive_packet(codec_ctx, packet) == 0) {
+        jpeg.assign((const char *) packet->data, packet->size);
+        encoded = true;
+    }
+    av_packet_free(&packet);
+    avcodec_free_context(&codec_ctx);
+    return encoded;
+}
+
+void SnapshotService::run_server() {
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int enable = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (server_fd < 0 || ::bind(server_fd, (sockaddr *) &address, sizeof(address)) != 0 || listen(server_fd, 8) != 0) {
+        cerr << "(SnapshotService) Failed to listen on port " << port << ": " << strerror(errno) << endl;
+        if (server_fd >= 0) close(server_fd);
+        return;
+    }
+    cout << "(SnapshotService) Serving thumbnails on http://127.0.0.1:" << port << "/thumbs" << endl;
+
+    long last_prune_ms = 0;
+    while (!stopping) {
+        if (now_ms() - last_prune_ms > PRUNE_INTERVAL_MS) {
+            prune();
+            last_prune_ms = now_ms();
+        }
+        pollfd poll_fd{server_fd, POLLIN, 0};
+        if (poll(&poll_fd, 1, 500) <= 0) continue;
+        int client_fd = accept(server_fd, nullptr, nullptr);
+        if (client_fd < 0) continue;
+        handle_connection(client_fd);
+        close(client_fd);
+    }
+    close(server_fd);
+}
+
+void SnapshotService::handle_connection(int client_fd) {
+    timeval timeout{2, 0};
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == string::npos && request.size() < 8192) {
+        ssize_t received = recv(client_fd, buffer, sizeof(buffer), 0);
+        if (received <= 0) break;
+        request.append(buffer, received);
+    }
+
+    istringstream request_line(request.substr(0, request.find("\r\n")));
+    string method, target;
+    request_line >> method >> target;
+    const string PREFIX = "/thumbs/";
+    if (method != "GET" || target.compare(0, PREFIX.size(), PREFIX) != 0) {
+        send_response(client_fd, "404 Not Found", "text/plain", "Not found\n");
+        return;
+    }
+
+    string query;
+    size_t query_start = target.find('?');
+    if (query_start != string::npos) {
+        query = target.substr(query_start + 1);
+        target = target.substr(0, query_start);
+    }
+    string camera = target.substr(PREFIX.size());
+    string file_name;
+    size_t slash = camera.find('/');
+    if (slash != string::npos) {
+        file_name = camera.substr(slash + 1);
+        camera = camera.substr(0, slash);
+    }
+    if (!is_valid_camera(camera)) {
+        send_response(client_fd, "404 Not Found", "text/plain", "Not found\n");
+        return;
+    }
+
+    long timestamp_ms = -1;
+    if (!file_name.empty()) {
+        size_t extension = file_name.find(".jpg");
+        string number = file_name.substr(0, extension);
+        if (extension != string::npos && extension + 4 == file_name.size() && !number.empty() &&
+            all_of(number.begin(), number.end(), [](char c) { return isdigit(c); })) {
+            timestamp_ms = stol(number);
+        }
+    } else if (query.compare(0, 3, "at=") == 0) {
+        timestamp_ms = find_thumbnail(camera, atol(query.c_str() + 3));
+    } else {
+        ostringstream json;
+        json << "[";
+        vector<long> timestamps = thumbnail_timestamps(camera);
+        for (size_t i = 0; i < timestamps.size(); i++) {
+            json << (i ? "," : "") << timestamps[i];
+        }
+        json << "]\n";
+        send_response(client_fd, "200 OK", "application/json", json.str());
+        return;
+    }
+
+    ifstream file(thumbnail_path(camera, timestamp_ms), ios::binary);
+    if (timestamp_ms < 0 || !file) {
+        send_response(client_fd, "404 Not Found", "text/plain", "Not found\n");
+        return;
+    }
+    ostringstream jpeg;
+    jpeg << file.rdbuf();
+    send_response(client_fd, "200 OK", "image/jpeg", jpeg.str());
+}
+
+long SnapshotService::find_thumbnail(const string &camera, long at_ms) const {
+    vector<long> timestamps = thumbnail_timestamps(camera);
+    auto after = upper_bound(timestamps.begin(), timestamps.end(), at_ms);
+    if (after == timestamps.begin()) return -1;
+    return *(after - 1);
+}
+
+vector<long> SnapshotService::thumbnail_timestamps(const string &camera) const {
+    vector<long> timestamps;
+    error_code error;
+    directory_iterator end_itr;
+    for (directory_iterator itr(thumbs_dir + "/" + camera, error); !error && itr != end_itr; itr.increment(error)) {
+        if (itr->path().extension() != ".jpg") continue;
+        string stem = itr->path().stem().string();
+        if (stem.empty() || !all_of(stem.begin(), stem.end(), [](char c) { return isdigit(c); })) continue;
+        timestamps.push_back(stol(stem));
+    }
+    sort(timestamps.begin(), timestamps.end());
+    return timestamps;
+}
+
+void SnapshotService::prune() {
+    long cutoff_ms = now_ms() - MAX_THUMBNAIL_AGE_MS;
+    error_code error;
+    directory_iterator end_itr;
+    for (directory_iterator itr(thumbs_dir, error); !error && itr != end_itr; itr.increment(error)) {
+        if (!itr->is_directory()) continue;
+        string camera = itr->path().filename().string();
+        for (long timestamp_ms : thumbnail_timestamps(camera)) {
+            if (timestamp_ms >= cutoff_ms) break;
+            unlink(thumbnail_path(camera, timestamp_ms).c_str());
+        }
+    }
+}
+
+SnapshotMuxer::SnapshotMuxer(const string &camera, SnapshotService *service) : camera(camera), service(service) {}
+
+void SnapshotMuxer::init() {
+    did_init = true;
+}
+
+void SnapshotMuxer::add_stream(AVStream *input_stream, AVCodec *input_codec, bool write_header) {
+    should_add_streams = false;
+    if (input_codec->type != AVMEDIA_TYPE_VIDEO) return;
+    video_input_index = input_stream->index;
+    video_params = shared_ptr<AVCodecParameters>(avcodec_parameters_alloc(), [](AVCodecParameters *params) {
+        avcodec_parameters_free(&params);
+    });
+    avcodec_parameters_copy(video_params.get(), input_stream->codecpar);
+}
+
+void SnapshotMuxer::send_packet(AVPacket *packet) {
+    if (packet->stream_index != video_input_index || !(packet->flags & AV_PKT_FLAG_KEY)) return;
+
+    long now = now_ms();
+    if (motion_pending && now - last_motion_snapshot_ms >= MOTION_SNAPSHOT_INTERVAL_MS) {
+        service->submit(camera, now, packet, video_params, true);
+        last_motion_snapshot_ms = now;
+        last_snapshot_ms = now;
+    } else if (now - last_snapshot_ms >= SNAPSHOT_INTERVAL_MS) {
+        service->submit(camera, now, packet, video_params, false);
+        last_snapshot_ms = now;
+    }
+    // Long motion gets another snapshot every MOTION_SNAPSHOT_INTERVAL_MS.
+    motion_pending = motion_active;
+}
+
+void SnapshotMuxer::on_motion_start(long start_ms) {
+    motion_pending = true;
+    motion_active = true;
+}
+
+void SnapshotMuxer::on_motion_end(const MotionEvent &event) {
+    motion_active = false;
+}
+
+void SnapshotMuxer::release() {
+    video_input_index = -1;
+    motion_pending = false;
+    Muxer::release();
+    did_init = false;
+}
@@ -0,0 +1,127 @@
+
+#ifndef HOMECAMRECORDER_SNAPSHOTSERVICE_H
+#define HOMECAMRECORDER_SNAPSHOTSERVICE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Muxer.h"
+#include "MotionDetector.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+using namespace std;
+
+/**
+ * Turns keyframes into JPEG thumbnails and serves them. Only keyframes are ever decoded, one packet at a time on a
+ * small pool of low priority threads, so the camera threads never decode anything.
+ *
+ * Thumbnails are cached in <thumbs dir>/<camera>/<timestamp ms>.jpg and served on 127.0.0.1:<port>:
+ *
+ *   GET /thumbs/<camera>                    JSON array of the cached timestamps, oldest first
+ *   GET /thumbs/<camera>?at=<ms>            the last thumbnail taken at or before <ms>
+ *   GET /thumbs/<camera>/<ms>.jpg           a thumbnail
+ *
+ * Twilio fetches alert pictures from the internet, so picture URLs use SNAPSHOT_BASE_URL (the public address that
+ * proxies to this endpoint) and are only produced when it is set.
+ */
+class SnapshotService {
+public:
+    SnapshotService(string thumbs_dir, int port);
+    ~SnapshotService();
+
+    // Without serve only thumbnails are taken. A --worker process leaves serving them to its supervisor.
+    void start(bool serve = true);
+    void stop();
+
+    // Queues a keyframe for a thumbnail. The packet is referenced, not copied.
+    void submit(const string &camera, long timestamp_ms, const AVPacket *keyframe,
+                const shared_ptr<AVCodecParameters> &params, bool motion);
+
+    // Called on a worker thread with the picture URL of every motion thumbnail.
+    void set_motion_snapshot_callback(function<void(const string &camera, const string &picture_url)> callback);
+
+    string thumbnail_path(const string &camera, long timestamp_ms) const;
+    // Empty without SNAPSHOT_BASE_URL.
+    string picture_url(const string &camera, long timestamp_ms) const;
+
+private:
+    static const int WORKER_COUNT = 2;
+    static const size_t MAX_PENDING_SNAPSHOTS = 16;
+    static const int THUMBNAIL_WIDTH = 320;
+    // MJPEG qscale, 2 (best) to 31.
+    static const int JPEG_QSCALE = 5;
+    static const long MAX_THUMBNAIL_AGE_MS = 7L * 24 * 60 * 60 * 1000;
+
+    struct Snapshot {
+        string camera;
+        long timestamp_ms{};
+        AVPacket *keyframe{};
+        shared_ptr<AVCodecParameters> params;
+        bool motion{};
+    };
+
+    const string thumbs_dir;
+    const int port;
+    string public_base_url;
+
+    mutex queue_mutex;
+    condition_variable wake_up;
+    deque<Snapshot> queue;
+    function<void(const string &, const string &)> motion_snapshot_callback;
+    atomic<bool> stopping{false};
+    vector<thread> workers;
+    thread server;
+
+    void run_worker();
+    bool write_thumbnail(const Snapshot &snapshot);
+    static AVFrame *decode_keyframe(const Snapshot &snapshot);
+    static AVFrame *scale_frame(const AVFrame *frame);
+    static bool encode_jpeg(AVFrame *frame, string &jpeg);
+
+    void run_server();
+    void handle_connection(int client_fd);
+    long find_thumbnail(const string &camera, long at_ms) const;
+    vector<long> thumbnail_timestamps(const string &camera) const;
+    void prune();
+};
+
+/**
+ * Sends a camera's keyframes to the SnapshotService: one every SNAPSHOT_INTERVAL_MS for browsing the timeline, and
+ * the first one after motion is reported, at most every MOTION_SNAPSHOT_INTERVAL_MS.
+ */
+class SnapshotMuxer : public Muxer, public MotionListener {
+public:
+    SnapshotMuxer(const string &camera, SnapshotService *service);
+
+    void send_packet(AVPacket *packet) override;
+    void release() override;
+    void init() override;
+    void add_stream(AVStream *input_stream, AVCodec *input_codec, bool write_header) override;
+    void on_motion_start(long start_ms) override;
+    void on_motion_end(const MotionEvent &event) override;
+
+private:
+    const long SNAPSHOT_INTERVAL_MS = 60000;
+    const long MOTION_SNAPSHOT_INTERVAL_MS = 30000;
+
+    string camera;
+    SnapshotService *service;
+    int video_input_index{-1};
+    shared_ptr<AVCodecParameters> video_params;
+    long last_snapshot_ms{};
+    long last_motion_snapshot_ms{};
+    bool motion_pending{false};
+    bool motion_active{false};
+};
+
+#endif //HOMECAMRECORDER_SNAPSHOTSERVICE_H
@@ -0,0 +1,84 @@
+
+#ifndef HOMECAMRECORDER_SOCKETSINK_H
+#define HOMECAMRECORDER_SOCKETSINK_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/**
+ * A TCP server on localhost that accepts any number of connections and discards everything written to it. Used as
+ * the remote end of FLVMuxer when there is no RTMP server to talk to (benchmarks and replay load tests).
+ */
+class SocketSink {
+public:
+    ~SocketSink() {
+        stop();
+    }
+
+    bool start() {
+        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd < 0) return false;
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+        socklen_t address_length = sizeof(address);
+        if (::bind(listen_fd, (sockaddr *) &address, sizeof(address)) < 0 ||
+            getsockname(listen_fd, (sockaddr *) &address, &address_length) < 0 ||
+            listen(listen_fd, 16) < 0) {
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+        port = ntohs(address.sin_port);
+        acceptor = std::thread([this] {
+            int fd;
+            while ((fd = accept(listen_fd, nullptr, nullptr)) >= 0) {
+                std::lock_guard<std::mutex> lock(readers_mutex);
+                readers.emplace_back([this, fd] {
+                    char buffer[64 * 1024];
+                    ssize_t count;
+                    while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+                        bytes_received += count;
+                    close(fd);
+                });
+            }
+        });
+        return true;
+    }
+
+    // Waits for every client to disconnect, then closes the listening socket.
+    void stop() {
+        if (listen_fd < 0) return;
+        shutdown(listen_fd, SHUT_RDWR);
+        if (acceptor.joinable())
+            acceptor.join();
+        for (std::thread &reader : readers)
+            reader.join();
+        readers.clear();
+        close(listen_fd);
+        listen_fd = -1;
+    }
+
+    std::string url() const {
+        return "tcp://127.0.0.1:" + std::to_string(port);
+    }
+
+    std::atomic<size_t> bytes_received{0};
+
+private:
+    int listen_fd{-1};
+    int port{0};
+    std::thread acceptor;
+    std::mutex readers_mutex;
+    std::vector<std::thread> readers;
+};
+
+#endif //HOMECAMRECORDER_SOCKETSINK_H
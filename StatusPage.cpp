@@ -0,0 +1,145 @@
+#include "StatusPage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std::chrono;
+
+static const char *STATUS_PAGE_NAME = "/homecam.status";
+
+StatusPage::~StatusPage() {
+    close();
+}
+
+bool StatusPage::create() {
+    close();
+    int fd = shm_open(STATUS_PAGE_NAME, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        cerr << "(StatusPage) Failed to open " << STATUS_PAGE_NAME << ": " << strerror(errno) << endl;
+        return false;
+    }
+    if (ftruncate(fd, sizeof(StatusPageHeader)) != 0) {
+        cerr << "(StatusPage) Failed to size " << STATUS_PAGE_NAME << ": " << strerror(errno) << endl;
+        ::close(fd);
+        return false;
+    }
+    void *memory = mmap(nullptr, sizeof(StatusPageHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        cerr << "(StatusPage) Failed to map " << STATUS_PAGE_NAME << ": " << strerror(errno) << endl;
+        return false;
+    }
+    page = (StatusPageHeader *) memory;
+    // Readers check the magic last, so they never trust a page that's being cleared.
+    page->magic = 0;
+    atomic_thread_fence(memory_order_release);
+    memset((void *) page->slots, 0, sizeof(page->slots));
+    page->version = STATUS_PAGE_VERSION;
+    page->slot_count = STATUS_PAGE_SLOTS;
+    page->supervisor_pid = getpid();
+    page->started_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    atomic_thread_fence(memory_order_release);
+    page->magic = STATUS_PAGE_MAGIC;
+    return true;
+}
+
+bool StatusPage::attach() {
+    close();
+    int fd = shm_open(STATUS_PAGE_NAME, O_RDWR, 0);
+    if (fd < 0) return false;
+    struct stat file_stat{};
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < (long) sizeof(StatusPageHeader)) {
+        ::close(fd);
+        return false;
+    }
+    void *memory = mmap(nullptr, sizeof(StatusPageHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) return false;
+    page = (StatusPageHeader *) memory;
+    atomic_thread_fence(memory_order_acquire);
+    if (page->magic != STATUS_PAGE_MAGIC || page->version != STATUS_PAGE_VERSION) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void StatusPage::close() {
+    if (page) {
+        munmap(page, sizeof(StatusPageHeader));
+        page = nullptr;
+    }
+}
+
+WorkerStatus *StatusPage::slot(int index) const {
+    if (!page || index < 0 || index >= page->slot_count) return nullptr;
+    return &page->slots[index];
+}
+
+void StatusPage::print(ostream &out) const {
+    if (!page) return;
+    int32_t supervisor_pid = page->supervisor_pid.load();
+    bool supervisor_alive = supervisor_pid > 0 && kill(supervisor_pid, 0) == 0;
+    out << "Supervisor " << supervisor_pid << (supervisor_alive ? "" : " (not running)") << endl;
+    out << left << setw(20) << "camera" << setw(12) << "state" << setw(8) << "pid" << setw(5) << "cpu" << setw(10)
+        << "restarts" << setw(8) << "exit" << setw(10) << "up (s)" << setw(12) << "packet (ms)" << setw(12) << "video"
+        << setw(12) << "audio" << setw(10) << "MB" << setw(10) << "connects" << setw(10) << "lag (ms)" << "write (ms)"
+        << endl;
+    int64_t now = now_ms();
+    int64_t wall_now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    for (int i = 0; i < page->slot_count; i++) {
+        const WorkerStatus &status = page->slots[i];
+        int32_t state = status.state.load(memory_order_relaxed);
+        if (state == WORKER_EMPTY) continue;
+        int64_t last_packet_ms = status.last_packet_ms.load(memory_order_relaxed);
+        string camera(status.camera, strnlen(status.camera, sizeof(status.camera)));
+        out << left << setw(20) << camera << setw(12) << state_name(state) << setw(8) << status.pid.load()
+            << setw(5) << status.cpu.load() << setw(10) << status.restarts.load() << setw(8)
+            << status.last_exit_status.load() << setw(10) << (wall_now - status.started_ms.load()) / 1000
+            << setw(12) << (last_packet_ms > 0 ? to_string(now - last_packet_ms) : "-") << setw(12)
+            << status.video_packets.load(memory_order_relaxed) << setw(12)
+            << status.audio_packets.load(memory_order_relaxed) << setw(10)
+            << status.bytes.load(memory_order_relaxed) / (1024 * 1024) << setw(10)
+            << status.connects.load(memory_order_relaxed) << setw(10)
+            << status.ingest_latency_ms.load(memory_order_relaxed)
+            << status.disk_write_latency_ms.load(memory_order_relaxed) << endl;
+    }
+}
+
+void StatusPage::worst_latencies(int64_t &ingest_ms, int64_t &disk_write_ms) const {
+    ingest_ms = 0;
+    disk_write_ms = 0;
+    if (!page) return;
+    for (int i = 0; i < page->slot_count; i++) {
+        const WorkerStatus &status = page->slots[i];
+        if (status.state.load(memory_order_relaxed) == WORKER_EMPTY) continue;
+        ingest_ms = max(ingest_ms, status.ingest_latency_ms.load(memory_order_relaxed));
+        disk_write_ms = max(disk_write_ms, status.disk_write_latency_ms.load(memory_order_relaxed));
+    }
+}
+
+const char *StatusPage::state_name(int32_t state) {
+    switch (state) {
+        case WORKER_EMPTY: return "empty";
+        case WORKER_STARTING: return "starting";
+        case WORKER_CONNECTING: return "connecting";
+        case WORKER_RECORDING: return "recording";
+        case WORKER_STALLED: return "stalled";
+        case WORKER_EXITED: return "exited";
+        case WORKER_BACKING_OFF: return "backoff";
+        case WORKER_STOPPING: return "stopping";
+        default: return "unknown";
+    }
+}
+
+int64_t StatusPage::now_ms() {
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
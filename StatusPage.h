@@ -0,0 +1,102 @@
+
+#ifndef HOMECAMRECORDER_STATUSPAGE_H
+#define HOMECAMRECORDER_STATUSPAGE_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+using namespace std;
+
+/**
+ * Shared memory page where camera worker processes report their health and counters to the supervisor (see
+ * WorkerSupervisor), and where --status reads them. It lives in /dev/shm/homecam.status, which can't clash with a
+ * PacketBus ring (/homecam_<camera>).
+ *
+ * The supervisor creates the page and owns the slots: it assigns one to every camera and fills in the process
+ * fields. A worker only touches its own slot, and only with relaxed atomic stores, so the camera thread never waits
+ * on the page and a worker that dies mid update leaves nothing half locked.
+ *
+ * Times are milliseconds on the monotonic clock (steady_clock), which all processes share, except started_ms which is
+ * wall clock time.
+ */
+
+static const uint32_t STATUS_PAGE_MAGIC = 0x48435354; // "HCST"
+static const uint32_t STATUS_PAGE_VERSION = 2;
+static const int STATUS_PAGE_SLOTS = 32;
+static const int STATUS_PAGE_CAMERA_LENGTH = 64;
+
+enum WorkerState : int32_t {
+    WORKER_EMPTY = 0,
+    WORKER_STARTING,
+    WORKER_CONNECTING,
+    WORKER_RECORDING,
+    // The watchdog cancelled the camera's input and it hasn't recovered.
+    WORKER_STALLED,
+    WORKER_EXITED,
+    // Crashed right after starting. It is restarted once its backoff ends.
+    WORKER_BACKING_OFF,
+    WORKER_STOPPING
+};
+
+struct WorkerStatus {
+    // Segment basename. Written by the supervisor while the slot is empty.
+    char camera[STATUS_PAGE_CAMERA_LENGTH];
+    // Written by the supervisor.
+    atomic<int32_t> pid;
+    atomic<int32_t> state;
+    atomic<int32_t> cpu;
+    atomic<int32_t> last_exit_status;
+    atomic<int64_t> restarts;
+    atomic<int64_t> started_ms;
+    // Written by the worker. alive_ms is stamped by its main thread, last_packet_ms for every video packet.
+    atomic<int64_t> alive_ms;
+    atomic<int64_t> last_packet_ms;
+    atomic<int64_t> video_packets;
+    atomic<int64_t> audio_packets;
+    atomic<int64_t> bytes;
+    atomic<int64_t> connects;
+    // Written by the worker: its worst latencies of the last QosScheduler period, so the supervisor's background work
+    // pauses for them too.
+    atomic<int64_t> ingest_latency_ms;
+    atomic<int64_t> disk_write_latency_ms;
+};
+
+struct StatusPageHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t slot_count;
+    atomic<int32_t> supervisor_pid;
+    int64_t started_ms;
+    WorkerStatus slots[STATUS_PAGE_SLOTS];
+};
+
+static_assert(atomic<int64_t>::is_always_lock_free, "The status page needs address free atomics.");
+
+class StatusPage {
+public:
+    StatusPage() = default;
+    ~StatusPage();
+
+    // Creates a fresh page, for the supervisor. Anything a previous supervisor left is cleared.
+    bool create();
+    // Maps the page a supervisor created, for workers and --status. False if there's no supervisor's page.
+    bool attach();
+    void close();
+
+    StatusPageHeader *header() const { return page; }
+    WorkerStatus *slot(int index) const;
+    // One line per camera, for --status.
+    void print(ostream &out) const;
+    // The worst latencies any worker reports.
+    void worst_latencies(int64_t &ingest_ms, int64_t &disk_write_ms) const;
+
+    static const char *state_name(int32_t state);
+    static int64_t now_ms();
+
+private:
+    StatusPageHeader *page{};
+};
+
+#endif //HOMECAMRECORDER_STATUSPAGE_H
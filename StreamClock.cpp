@@ -0,0 +1,42 @@
+#include "StreamClock.h"
+
+#include <chrono>
+
+using namespace std::chrono;
+
+void StreamClock::reset(AVFormatContext *input_ctx, int stream_index) {
+    this->input_ctx = input_ctx;
+    time_base = input_ctx->streams[stream_index]->time_base;
+    arrival_offset_us = UNSET;
+    capture_offset_us = UNSET;
+}
+
+long StreamClock::wall_time_ms(const AVPacket *packet, const StreamClock *timeline) {
+    long now_us = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+    int64_t timestamp = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    if (!input_ctx || timestamp == AV_NOPTS_VALUE) return now_us / 1000;
+
+    long timestamp_us = av_rescale_q(timestamp, time_base, AV_TIME_BASE_Q);
+    track_offset(now_us - timestamp_us, arrival_offset_us);
+
+    // RTSP timestamps count from the first RTCP sender report, whose NTP time is start_time_realtime.
+    if (input_ctx->start_time_realtime != AV_NOPTS_VALUE && input_ctx->start_time_realtime > 0) {
+        long capture_time_us = input_ctx->start_time_realtime + timestamp_us;
+        long offset_us = capture_offset_us;
+        track_offset(now_us - capture_time_us, offset_us);
+        capture_offset_us = offset_us;
+        long timeline_offset_us = timeline ? timeline->capture_offset_us.load() : UNSET;
+        if (timeline_offset_us != UNSET) {
+            return (capture_time_us + timeline_offset_us) / 1000;
+        }
+    }
+    return (timestamp_us + arrival_offset_us) / 1000;
+}
+
+void StreamClock::track_offset(long sample_us, long &offset_us) {
+    if (offset_us == UNSET || sample_us < offset_us || sample_us - offset_us > RESYNC_US) {
+        offset_us = sample_us;
+    } else {
+        offset_us += (sample_us - offset_us) / 256;
+    }
+}
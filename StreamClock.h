@@ -0,0 +1,43 @@
+
+#ifndef HOMECAMRECORDER_STREAMCLOCK_H
+#define HOMECAMRECORDER_STREAMCLOCK_H
+
+#include <atomic>
+#include <climits>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+using namespace std;
+
+/**
+ * Maps a stream's timestamps to wall clock time, so events found in one of a camera's streams line up with the
+ * recording of another.
+ *
+ * The offset between arrival time and timestamp is tracked with a minimum filter (the least delayed packet is the
+ * best estimate) that creeps up slowly to follow clock drift and resyncs when the timestamps jump. When the RTSP
+ * session knows the camera's capture time from RTCP (start_time_realtime), that offset is learnt against capture
+ * time as well, and a stream can be placed on another stream's timeline through the capture time they share.
+ */
+class StreamClock {
+public:
+    // Called for every new input.
+    void reset(AVFormatContext *input_ctx, int stream_index);
+
+    // Wall clock time of the packet in ms. With a timeline, the time the packet would have on that stream.
+    long wall_time_ms(const AVPacket *packet, const StreamClock *timeline = nullptr);
+
+private:
+    static const long RESYNC_US = 2000000;
+    static constexpr long UNSET = LONG_MIN;
+
+    AVFormatContext *input_ctx{};
+    AVRational time_base{1, 1000};
+    long arrival_offset_us{UNSET};
+    atomic<long> capture_offset_us{UNSET};
+
+    static void track_offset(long sample_us, long &offset_us);
+};
+
+#endif //HOMECAMRECORDER_STREAMCLOCK_H
@@ -6,26 +6,43 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 }
 
+#include "SegmentTime.h"
+
+MotionWindowCursor::MotionWindowCursor(const vector<MotionEvent> &motion_events, long start_timestamp) :
+    motion_events(motion_events) {
+    next_event = partition_point(motion_events.begin(), motion_events.end(), [start_timestamp](const MotionEvent &event) {
+        return event.end_ms <= start_timestamp;
+    });
+}
+
+bool MotionWindowCursor::should_include(long epoch_time_ms) {
+    while (next_event != motion_events.end() && epoch_time_ms >= next_event->end_ms + BUFFER_TIME_AFTER_MS) {
+        ++next_event;
+    }
+    return next_event != motion_events.end() && epoch_time_ms > next_event->start_ms - BUFFER_TIME_BEFORE_MS;
+}
+
 SummaryGenerator::SummaryGenerator(
     const string &recordings_dir, 
     const string &basename, 
-    const string &output_file) : recordings_dir(std::move(recordings_dir)), basename(std::move(basename)), output_file(std::move(output_file)) {}
+    const string &output_file,
+    RecordingCatalog *catalog) : recordings_dir(std::move(recordings_dir)), basename(std::move(basename)), output_file(std::move(output_file)), catalog(catalog) {}
 
 void SummaryGenerator::run() {
     cout << "Running summary for " << basename << endl;
 //     Get list of video files ordered by timestamp
-//     Get list of motion timestamps
+//     Get list of motion events
 //     Add each video file's frames with motion into the output file
-//         Get list of motion timestamps > time start of video and < time end of video
-//             Add motion time - 5s until motion time + 5s into output file
+//         Get list of motion events that end after the start of the video
+//             Add event start - 3s until event end + 3s into output file
     auto video_files = get_video_files();
-    auto motion_timestamps = get_motion_timestamps();
-    RotatingFileMuxer muxer = RotatingFileMuxer(recordings_dir + "/" + basename + "_summary", "flv");
+    auto motion_events = get_motion_events();
+    FileMuxer muxer(recordings_dir + "/" + basename + "_summary.flv");
     muxer.init();
     
     for (pair<string, long> video_file : video_files) {
         cout << video_file.first << " " << video_file.second << endl;
-        add_video(&muxer, recordings_dir + "/" + video_file.first, video_file.second, motion_timestamps);
+        add_video(&muxer, video_file.first, video_file.second, motion_events);
     }
     muxer.release();
 }
@@ -35,14 +52,24 @@ void SummaryGenerator::release() {
 
 vector<pair<string, long>> SummaryGenerator::get_video_files() {
     vector<pair<string, long>> video_files;
+    if (catalog) {
+        for (const CatalogEntry &entry : catalog->segments(basename)) {
+            if (entry.bytes > 0 || entry.open) {
+                video_files.emplace_back(entry.path, entry.start_time_ms);
+            }
+        }
+        return video_files;
+    }
+    
     directory_iterator end_itr;
     for (directory_iterator itr(this->recordings_dir); itr != end_itr; ++itr ) {
         if (is_regular_file(itr->status())) {
             auto is_relevant = itr->path().filename().string().find(this->basename) == 0;
             auto is_not_summary = itr->path().filename().string().find("_summary") == -1;
-            auto is_flv_file = itr->path().extension().string().compare(".flv") == 0;
-            if (is_not_summary && is_relevant && is_flv_file && file_size(itr->path()) > 0) {
-                auto path = itr->path().filename().string();
+            auto extension = itr->path().extension().string();
+            auto is_segment_file = extension == ".flv" || extension == ".ts" || extension == ".mp4";
+            if (is_not_summary && is_relevant && is_segment_file && file_size(itr->path()) > 0) {
+                auto path = this->recordings_dir + "/" + itr->path().filename().string();
                 ifstream input_file(this->recordings_dir + "/" + itr->path().stem().string() + "_start_time.txt");
                 long start_timestamp;
                 input_file >> start_timestamp;
@@ -58,22 +85,15 @@ vector<pair<string, long>> SummaryGenerator::get_video_files() {
     return video_files;
 }
 
-vector<long> SummaryGenerator::get_motion_timestamps() {
-    vector<long> motion_timestamps;
-    ifstream motion_file(this->recordings_dir + "/" + this->basename + ".csv");
+vector<MotionEvent> SummaryGenerator::get_motion_events() {
     cout << this->recordings_dir + "/" + this->basename + ".csv" << endl;
-    long timestamp;
-    while(motion_file >> timestamp) {
-        motion_timestamps.push_back(timestamp);
-    }
-    motion_file.close();
-    return motion_timestamps;
+    return MotionEvent::read_file(this->recordings_dir + "/" + this->basename + ".csv");
 }
 
-void SummaryGenerator::add_video(RotatingFileMuxer *muxer,
+void SummaryGenerator::add_video(FileMuxer *muxer,
                                  const string video_file_path,
                                  const long start_timestamp,
-                                 vector<long> motion_timestamps) {
+                                 const vector<MotionEvent> &motion_events) {
     
     cout << "Reading " << video_file_path.c_str() << endl;
     AVFormatContext *input_ctx = avformat_alloc_context();
@@ -102,22 +122,11 @@ void SummaryGenerator::add_video(RotatingFileMuxer *muxer,
         input_timebase_per_stream[1] = input_audio_stream->time_base;
     }
     
-    const long BUFFER_TIME_BEFORE_MS = 3000;
-    const long BUFFER_TIME_AFTER_MS = 3000;
-    
-    long next_motion_timestamp_video = -1;
-    long next_motion_timestamp_audio = -1;
-    for (long timestamp : motion_timestamps) {
-        if (timestamp > start_timestamp) {
-            next_motion_timestamp_video = timestamp;
-            next_motion_timestamp_audio = timestamp;
-            break;
-        }
-    }
+    MotionWindowCursor motion_window(motion_events, start_timestamp);
     
     bool has_more_frames = true;
     bool saw_key_frame = false;
-    while (has_more_frames && next_motion_timestamp_video != -1) {
+    while (has_more_frames && motion_window.has_motion()) {
         AVPacket *packet = av_packet_alloc();
         ret = av_read_frame(input_ctx, packet);
         if (ret != 0) {
@@ -126,9 +135,8 @@ void SummaryGenerator::add_video(RotatingFileMuxer *muxer,
         }
         
         if (packet->stream_index == video_stream_idx) {
-            long epoch_time_ms = packet->pts + start_timestamp;
-            long motion_start = next_motion_timestamp_video - BUFFER_TIME_BEFORE_MS;
-            long motion_end = next_motion_timestamp_video + BUFFER_TIME_AFTER_MS;
+            long epoch_time_ms = segment_time_ms(start_timestamp, input_ctx, input_ctx->streams[video_stream_idx],
+                                                 packet);
             
             if (!saw_key_frame && !(packet->flags & AV_PKT_FLAG_KEY)) {
                 av_packet_free(&packet);
@@ -136,17 +144,9 @@ void SummaryGenerator::add_video(RotatingFileMuxer *muxer,
             }
             saw_key_frame = true;
             
-            if (epoch_time_ms > motion_start && epoch_time_ms < motion_end) {
+            if (motion_window.should_include(epoch_time_ms)) {
                 muxer->send_packet(packet);
             }
-            if (epoch_time_ms > motion_end) {
-                for (long timestamp : motion_timestamps) {
-                    if (timestamp > motion_end) {
-                        next_motion_timestamp_video = timestamp;
-                        break;
-                    }
-                }
-            }
         } else {
 //            long epoch_time_ms = packet->pts + start_timestamp;
 //            long motion_start = next_motion_timestamp_audio - BUFFER_TIME_BEFORE_MS;
@@ -16,6 +16,8 @@ extern "C" {
 };
 
 #include "Muxer.h"
+#include "RecordingCatalog.h"
+#include "MotionEvent.h"
 
 using namespace std;
 using namespace std::chrono;
@@ -26,12 +28,32 @@ using namespace std::__fs::filesystem;
 using namespace std::filesystem;
 #endif
 
+/**
+ * Walks the motion events alongside a video's packets and decides which packets fall inside a motion window
+ * (event start - BUFFER_TIME_BEFORE_MS until event end + BUFFER_TIME_AFTER_MS).
+ */
+class MotionWindowCursor {
+public:
+    static const long BUFFER_TIME_BEFORE_MS = 3000;
+    static const long BUFFER_TIME_AFTER_MS = 3000;
+
+    MotionWindowCursor(const vector<MotionEvent> &motion_events, long start_timestamp);
+
+    bool has_motion() const { return next_event != motion_events.end(); }
+    bool should_include(long epoch_time_ms);
+
+private:
+    const vector<MotionEvent> &motion_events;
+    vector<MotionEvent>::const_iterator next_event;
+};
+
 class SummaryGenerator {
 public:
     SummaryGenerator(
         const string &recordings_dir, 
         const string &basename, 
-        const string &output_file);
+        const string &output_file,
+        RecordingCatalog *catalog = nullptr);
 
     void run();
     void release();
@@ -40,10 +62,13 @@ private:
     const string recordings_dir;
     const string basename;
     const string output_file;
+    RecordingCatalog *catalog;
 
+    // Full paths of the camera's segments with their start time, oldest first.
     vector<pair<string, long>> get_video_files();
-    vector<long> get_motion_timestamps();
-    void add_video(RotatingFileMuxer *muxer, const string video_file_path, const long start_timestamp, vector<long> motion_timestamps);
+    vector<MotionEvent> get_motion_events();
+    void add_video(FileMuxer *muxer, const string video_file_path, const long start_timestamp,
+                   const vector<MotionEvent> &motion_events);
 };
 
 
@@ -0,0 +1,218 @@
+#include "TeeMuxer.h"
+
+#include <cstring>
+#include <fcntl.h>
+
+#include "AVError.h"
+
+TeeMuxer::TeeMuxer(string format, vector<TeeSink *> sinks) : format(std::move(format)) {
+    for (TeeSink *sink : sinks) {
+        this->sinks.emplace_back(sink);
+    }
+}
+
+TeeMuxer::~TeeMuxer() {
+    if (did_init) {
+        release();
+    }
+}
+
+void TeeMuxer::init() {
+    if (did_init) return;
+    if (avformat_alloc_output_context2(&output_ctx, nullptr, format.c_str(), nullptr) < 0) {
+        cerr << "(TeeMuxer) Failed to create " << format << " output context." << endl;
+        return;
+    }
+    auto *io_buffer = (uint8_t *) av_malloc(IO_BUFFER_SIZE);
+    io = avio_alloc_context(io_buffer, IO_BUFFER_SIZE, 1, this, nullptr, collect, nullptr);
+    // Nothing written is ever patched, e.g. the FLV duration, so every byte can go out right away.
+    io->seekable = 0;
+    output_ctx->pb = io;
+    output_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    pending.clear();
+    header.clear();
+    did_init = true;
+}
+
+void TeeMuxer::add_stream(AVStream *input_stream, AVCodec *input_codec, bool write_header) {
+    Muxer::add_stream(input_stream, input_codec, write_header);
+    if (write_header) {
+        avio_flush(io);
+        header.swap(pending);
+        pending.clear();
+    }
+}
+
+void TeeMuxer::send_packet(AVPacket *packet) {
+    if (!did_init) {
+        init();
+    }
+    long prev_duration = packet->duration;
+    long prev_pts = packet->pts;
+    long prev_dts = packet->dts;
+    long prev_pos = packet->pos;
+
+    rescale_packet_timestamps(packet);
+
+    bool keyframe = packet->stream_index == video_stream_index && (packet->flags & AV_PKT_FLAG_KEY);
+    int ret = av_write_frame(output_ctx, packet);
+    if (ret < 0) {
+        Logger::warn("TeeMuxer", "Failed to write packet {}. PTS: {} DTS: {}",
+                     video_frames_written + audio_frames_written, packet->pts, packet->dts);
+    } else if (packet->stream_index == video_stream_index) {
+        video_frames_written++;
+    } else if (packet->stream_index == audio_stream_index) {
+        audio_frames_written++;
+    }
+    packet->duration = prev_duration;
+    packet->pts = prev_pts;
+    packet->dts = prev_dts;
+    packet->pos = prev_pos;
+    if (ret >= 0) {
+        hand_off(keyframe);
+    }
+}
+
+void TeeMuxer::hand_off(bool keyframe) {
+    avio_flush(io);
+    if (pending.empty()) return;
+    // Every sink gets the same bytes. Only the sinks that start a file or a connection copy the header.
+    for (unique_ptr<TeeSink> &sink : sinks) {
+        sink->write(header, pending.data(), pending.size(), keyframe);
+    }
+    pending.clear();
+}
+
+void TeeMuxer::release() {
+    if (did_init && !should_add_streams) {
+        av_write_trailer(output_ctx);
+        hand_off(false);
+    }
+    for (unique_ptr<TeeSink> &sink : sinks) {
+        sink->close();
+    }
+    if (io) {
+        av_freep(&io->buffer);
+        avio_context_free(&io);
+    }
+    if (output_ctx) {
+        output_ctx->pb = nullptr;
+        avformat_free_context(output_ctx);
+        output_ctx = nullptr;
+    }
+    Muxer::release();
+    did_init = false;
+}
+
+int TeeMuxer::collect(void *opaque, uint8_t *data, int size) {
+    auto *muxer = (TeeMuxer *) opaque;
+    muxer->pending.insert(muxer->pending.end(), data, data + size);
+    return size;
+}
+
+SegmentSink::SegmentSink(string basename, string extension, RetentionManager *retention_manager,
+                         RecordingCatalog *catalog, SegmentUploader *uploader) :
+    segment(std::move(basename), std::move(extension), retention_manager, catalog, uploader) {}
+
+SegmentSink::~SegmentSink() {
+    close();
+}
+
+void SegmentSink::write(const vector<uint8_t> &header, const uint8_t *data, size_t size, bool keyframe) {
+    if (fd >= 0 && keyframe && segment.should_rotate()) {
+        cout << "(SegmentSink) Rotating file " << segment.file_number() << endl;
+        close();
+    }
+    if (fd < 0 && (!keyframe || !open_segment(header))) return;
+
+    if (keyframe) {
+        // A flushed segment always ends with a whole GOP.
+        flush();
+        segment.keyframe(bytes_written);
+    }
+    append(data, size);
+    if (segment.should_flush()) {
+        flush();
+    }
+    segment.progress(bytes_written);
+}
+
+bool SegmentSink::open_segment(const vector<uint8_t> &header) {
+    const string &output_file = segment.open_segment();
+    fd = open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cerr << "(SegmentSink) Failed to open " << output_file << ": " << strerror(errno) << endl;
+        segment.close_segment(0);
+        return false;
+    }
+    segment.file_created(fd);
+    bytes_written = 0;
+    append(header.data(), header.size());
+    return true;
+}
+
+void SegmentSink::append(const uint8_t *data, size_t size) {
+    buffer.insert(buffer.end(), data, data + size);
+    bytes_written += (long) size;
+}
+
+void SegmentSink::flush() {
+    auto write_start = steady_clock::now();
+    size_t offset = 0;
+    while (offset < buffer.size()) {
+        ssize_t written = ::write(fd, buffer.data() + offset, buffer.size() - offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            Logger::warn("SegmentSink", "Failed to write to {}: {}", segment.output_file(), strerror(errno));
+            break;
+        }
+        offset += written;
+    }
+    buffer.clear();
+    segment.flushed(write_start);
+}
+
+void SegmentSink::close() {
+    if (fd < 0) return;
+    flush();
+    ::close(fd);
+    fd = -1;
+    segment.close_segment(bytes_written);
+}
+
+StreamSink::StreamSink(string url) : url(std::move(url)) {}
+
+StreamSink::~StreamSink() {
+    close();
+}
+
+void StreamSink::write(const vector<uint8_t> &header, const uint8_t *data, size_t size, bool keyframe) {
+    if (!io) {
+        auto now = steady_clock::now();
+        if (!keyframe || (last_attempt_time != time_point<steady_clock>{} &&
+                          duration_cast<milliseconds>(now - last_attempt_time).count() < RETRY_INTERVAL_MS)) {
+            return;
+        }
+        last_attempt_time = now;
+        int ret = avio_open(&io, url.c_str(), AVIO_FLAG_WRITE);
+        if (ret < 0) {
+            cerr << "(StreamSink) Failed to open " << url << ". Error = " << av_err2str(ret) << endl;
+            return;
+        }
+        cout << "(StreamSink) Sending to " << url << endl;
+        avio_write(io, header.data(), (int) header.size());
+    }
+    avio_write(io, data, (int) size);
+    // Live outputs shouldn't sit in the buffer. Muxing straight to the network flushes every packet too.
+    avio_flush(io);
+    if (io->error < 0) {
+        Logger::warn("StreamSink", "Failed to write to {}. Error = {}", url, av_err2str(io->error));
+        close();
+    }
+}
+
+void StreamSink::close() {
+    if (io) {
+        avio_closep(&io);
+    }
+}
@@ -0,0 +1,110 @@
+
+#ifndef HOMECAMRECORDER_TEEMUXER_H
+#define HOMECAMRECORDER_TEEMUXER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Muxer.h"
+
+using namespace std;
+using namespace std::chrono;
+
+/**
+ * Somewhere the bytes serialized by a TeeMuxer go. Sinks only deal in bytes: where a segment starts and what it
+ * starts with is all the state they keep.
+ */
+class TeeSink {
+public:
+    virtual ~TeeSink() = default;
+    // The bytes of one packet. header is what every output of the stream starts with (e.g. the FLV header, metadata
+    // and sequence headers), for a sink to replay when it starts a new file or connection at a keyframe.
+    virtual void write(const vector<uint8_t> &header, const uint8_t *data, size_t size, bool keyframe) = 0;
+    // The stream ended. Trailer bytes have already been written.
+    virtual void close() = 0;
+};
+
+/**
+ * Muxes a camera once and hands the bytes of every packet to several sinks, instead of one Muxer per output running
+ * its own timestamp rescaling and container writer over the same packets. Outputs in the same container format (an
+ * FLV recording and an FLV relay) cost one muxer between them.
+ *
+ * The container is written to a non-seekable in-memory AVIOContext, so the muxer never goes back to patch what it
+ * wrote and the bytes can go out as they come.
+ */
+class TeeMuxer : public Muxer {
+public:
+    // Takes ownership of the sinks.
+    TeeMuxer(string format, vector<TeeSink *> sinks);
+    ~TeeMuxer() override;
+
+    void send_packet(AVPacket *packet) override;
+    void release() override;
+    void init() override;
+    void add_stream(AVStream *input_stream, AVCodec *input_codec, bool write_header) override;
+
+private:
+    static const int IO_BUFFER_SIZE = 64 * 1024;
+
+    const string format;
+    vector<unique_ptr<TeeSink>> sinks;
+    AVIOContext *io{};
+    // What the muxer wrote since the bytes were last handed to the sinks.
+    vector<uint8_t> pending;
+    vector<uint8_t> header;
+
+    void hand_off(bool keyframe);
+    static int collect(void *opaque, uint8_t *data, int size);
+};
+
+/**
+ * Writes the stream into segments like RotatingFileMuxer, numbered through the retention manager and recorded in the
+ * catalog. A segment is cut at the first keyframe after
+ * SegmentLifecycle::MAX_FILE_DURATION_SEC and starts with the stream's header,
+ * so every segment plays on its own. Bytes are buffered and written at every keyframe, or every
+ * SegmentLifecycle::FLUSH_INTERVAL_MS.
+ */
+class SegmentSink : public TeeSink {
+public:
+    SegmentSink(string basename, string extension, RetentionManager *retention_manager = nullptr,
+                RecordingCatalog *catalog = nullptr, SegmentUploader *uploader = nullptr);
+    ~SegmentSink() override;
+
+    void write(const vector<uint8_t> &header, const uint8_t *data, size_t size, bool keyframe) override;
+    void close() override;
+
+private:
+    SegmentLifecycle segment;
+    int fd{-1};
+    // Bytes in the segment, including the ones still in buffer.
+    long bytes_written{};
+    vector<uint8_t> buffer;
+
+    bool open_segment(const vector<uint8_t> &header);
+    void append(const uint8_t *data, size_t size);
+    void flush();
+};
+
+/**
+ * Sends the stream to a URL FFmpeg can write to: rtmp:// (which takes FLV), tcp://, a file or a pipe. A connection
+ * starts at a keyframe with the stream's header. One that fails is dropped and retried at a keyframe at most every
+ * RETRY_INTERVAL_MS, so a relay that's down doesn't stall the camera thread at every keyframe.
+ */
+class StreamSink : public TeeSink {
+public:
+    explicit StreamSink(string url);
+    ~StreamSink() override;
+
+    void write(const vector<uint8_t> &header, const uint8_t *data, size_t size, bool keyframe) override;
+    void close() override;
+
+private:
+    const long RETRY_INTERVAL_MS = 5000;
+
+    const string url;
+    AVIOContext *io{};
+    time_point<steady_clock> last_attempt_time{};
+};
+
+#endif //HOMECAMRECORDER_TEEMUXER_H
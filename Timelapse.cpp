@@ -0,0 +1,143 @@
+#include "Timelapse.h"
+
+#include <chrono>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+#include "AVError.h"
+#include "SegmentTime.h"
+
+Timelapse::Timelapse(RecordingCatalog *catalog, string camera, long from_ms, long to_ms, string output_file, int fps,
+                     long interval_ms) :
+    catalog(catalog), camera(std::move(camera)), from_ms(from_ms), to_ms(to_ms), output_file(std::move(output_file)),
+    fps(fps), interval_ms(interval_ms), next_frame_time_ms(from_ms) {}
+
+bool Timelapse::run() {
+    vector<CatalogEntry> segments = catalog->find(camera, from_ms, to_ms);
+    if (segments.empty()) {
+        cerr << "(Timelapse) No recordings of " << camera << " between " << from_ms << " and " << to_ms << "." << endl;
+        return false;
+    }
+    auto start_time = steady_clock::now();
+
+    FileMuxer muxer(output_file);
+    muxer.init();
+    if (!muxer.did_init) {
+        return false;
+    }
+    for (const CatalogEntry &segment : segments) {
+        if (!add_segment(&muxer, segment)) break;
+    }
+    muxer.release();
+
+    cout << "(Timelapse) Wrote " << frames_written << " frames (" << frames_written / fps << " s) from "
+         << segments.size() << " segments to " << output_file << " in "
+         << duration_cast<milliseconds>(steady_clock::now() - start_time).count() << " ms. " << frames_seeked
+         << " frames were found with a keyframe index." << endl;
+    return frames_written > 0;
+}
+
+bool Timelapse::add_segment(FileMuxer *muxer, const CatalogEntry &segment) {
+    AVFormatContext *input_ctx = nullptr;
+    AVPacket *packet = av_packet_alloc();
+    bool keep_going = true;
+    int ret;
+
+    try {
+        ret = avformat_open_input(&input_ctx, segment.path.c_str(), nullptr, nullptr);
+        if (ret < 0) {
+            cerr << "(Timelapse) Failed to open " << segment.path << ". Error = " << av_err2str(ret) << endl;
+            throw ret;
+        }
+        ret = avformat_find_stream_info(input_ctx, nullptr);
+        if (ret < 0) {
+            cerr << "(Timelapse) Failed to find stream info in " << segment.path << ". Error = " << av_err2str(ret) << endl;
+            throw ret;
+        }
+
+        AVCodec *input_video_codec;
+        int video_stream_idx = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &input_video_codec, 0);
+        if (video_stream_idx < 0) {
+            cerr << "(Timelapse) No video stream in " << segment.path << "." << endl;
+            throw video_stream_idx;
+        }
+        // Video only. The muxer expects it as stream 0.
+        if (muxer->should_add_streams) {
+            AVStream *video_stream = input_ctx->streams[video_stream_idx];
+            muxer->add_stream(video_stream, input_video_codec, true);
+            frame_duration = max((int64_t) 1, av_rescale_q(1, AVRational{1, fps}, video_stream->time_base));
+        }
+
+        vector<KeyframeIndexEntry> index = KeyframeIndex::read(segment.path);
+        if (!index.empty()) {
+            keep_going = add_indexed_frames(muxer, input_ctx, packet, video_stream_idx, index);
+        } else {
+            cout << "(Timelapse) " << segment.path << " has no keyframe index. Reading all of it." << endl;
+            keep_going = add_demuxed_frames(muxer, input_ctx, packet, video_stream_idx, segment);
+        }
+    } catch (int e) {
+    }
+
+    av_packet_free(&packet);
+    avformat_close_input(&input_ctx);
+    return keep_going;
+}
+
+bool Timelapse::add_indexed_frames(FileMuxer *muxer, AVFormatContext *input_ctx, AVPacket *packet,
+                                   int video_stream_idx, const vector<KeyframeIndexEntry> &index) {
+    for (const KeyframeIndexEntry &entry : index) {
+        if (entry.time_ms > to_ms) return false;
+        if (entry.time_ms < next_frame_time_ms) continue;
+
+        int ret = av_seek_frame(input_ctx, -1, entry.offset, AVSEEK_FLAG_BYTE);
+        if (ret < 0) {
+            cerr << "(Timelapse) Failed to seek to " << entry.offset << ". Error = " << av_err2str(ret) << endl;
+            continue;
+        }
+        for (int i = 0; i < MAX_PACKETS_AFTER_SEEK && av_read_frame(input_ctx, packet) == 0; i++) {
+            bool is_keyframe = packet->stream_index == video_stream_idx && (packet->flags & AV_PKT_FLAG_KEY);
+            if (is_keyframe) {
+                write_frame(muxer, packet, entry.time_ms);
+                frames_seeked++;
+            }
+            av_packet_unref(packet);
+            if (is_keyframe) break;
+        }
+    }
+    return true;
+}
+
+bool Timelapse::add_demuxed_frames(FileMuxer *muxer, AVFormatContext *input_ctx, AVPacket *packet,
+                                   int video_stream_idx, const CatalogEntry &segment) {
+    AVStream *video_stream = input_ctx->streams[video_stream_idx];
+    while (av_read_frame(input_ctx, packet) == 0) {
+        if (packet->stream_index != video_stream_idx || !(packet->flags & AV_PKT_FLAG_KEY)) {
+            av_packet_unref(packet);
+            continue;
+        }
+        long time_ms = segment_time_ms(segment.start_time_ms, input_ctx, video_stream, packet);
+        if (time_ms > to_ms) {
+            av_packet_unref(packet);
+            return false;
+        }
+        if (time_ms >= next_frame_time_ms) {
+            write_frame(muxer, packet, time_ms);
+        }
+        av_packet_unref(packet);
+    }
+    return true;
+}
+
+void Timelapse::write_frame(FileMuxer *muxer, AVPacket *packet, long time_ms) {
+    // Every keyframe is shown for one frame of the output. Muxer makes the timestamps continuous from the durations.
+    packet->stream_index = 0;
+    packet->pts = frames_written * frame_duration;
+    packet->dts = packet->pts;
+    packet->duration = frame_duration;
+    muxer->send_packet(packet);
+    frames_written++;
+    next_frame_time_ms = time_ms + interval_ms;
+}
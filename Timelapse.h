@@ -0,0 +1,56 @@
+
+#ifndef HOMECAMRECORDER_TIMELAPSE_H
+#define HOMECAMRECORDER_TIMELAPSE_H
+
+#include <string>
+
+#include "Muxer.h"
+#include "KeyframeIndex.h"
+#include "RecordingCatalog.h"
+
+using namespace std;
+
+/**
+ * Builds a timelapse of one camera by stream copying one keyframe every interval_ms of recording into a file that
+ * plays at fps frames per second. Nothing is decoded or encoded.
+ *
+ * Keyframes are found with each segment's KeyframeIndex: the input is seeked straight to the offset of every keyframe
+ * that's used, so only those frames are read. Segments without an index are demuxed from start to end.
+ */
+class Timelapse {
+public:
+    Timelapse(RecordingCatalog *catalog, string camera, long from_ms, long to_ms, string output_file, int fps,
+              long interval_ms);
+
+    // Returns false if no frame was written.
+    bool run();
+
+private:
+    // How far past an indexed offset the keyframe is looked for. Only container overhead should be in the way.
+    static const int MAX_PACKETS_AFTER_SEEK = 16;
+
+    RecordingCatalog *catalog;
+    const string camera;
+    const long from_ms;
+    const long to_ms;
+    const string output_file;
+    const int fps;
+    const long interval_ms;
+
+    // Recording time of the next keyframe wanted.
+    long next_frame_time_ms;
+    long frames_written{};
+    long frames_seeked{};
+    // In the time base of the first segment's video stream, which the muxer converts from.
+    int64_t frame_duration{};
+
+    // Each returns false once the end time has been reached.
+    bool add_segment(FileMuxer *muxer, const CatalogEntry &segment);
+    bool add_indexed_frames(FileMuxer *muxer, AVFormatContext *input_ctx, AVPacket *packet, int video_stream_idx,
+                            const vector<KeyframeIndexEntry> &index);
+    bool add_demuxed_frames(FileMuxer *muxer, AVFormatContext *input_ctx, AVPacket *packet, int video_stream_idx,
+                            const CatalogEntry &segment);
+    void write_frame(FileMuxer *muxer, AVPacket *packet, long time_ms);
+};
+
+#endif //HOMECAMRECORDER_TIMELAPSE_H
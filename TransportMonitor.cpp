@@ -0,0 +1,154 @@
+#include "TransportMonitor.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <mutex>
+#include <unordered_map>
+#include <cstring>
+#include <cmath>
+#include <cstdio>
+#include <cstdarg>
+
+static mutex watched_contexts_mutex;
+static unordered_map<void *, pair<TransportMonitor *, bool>> watched_contexts;
+
+TransportMonitor::TransportMonitor(string camera_name, string transport) :
+    camera_name(std::move(camera_name)), current_transport(std::move(transport)) {
+    window_start_time = steady_clock::now();
+    udp_since = window_start_time;
+}
+
+void TransportMonitor::record_packet(const AVPacket *packet, AVRational time_base) {
+    frames++;
+    bytes += packet->size;
+    if (packet->flags & AV_PKT_FLAG_CORRUPT) {
+        corrupt_frames++;
+    }
+
+    int64_t timestamp = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if (timestamp == AV_NOPTS_VALUE) return;
+    int64_t timestamp_us = av_rescale_q(timestamp, time_base, AV_TIME_BASE_Q);
+    auto now = steady_clock::now();
+    if (last_timestamp_us != AV_NOPTS_VALUE && timestamp_us > last_timestamp_us) {
+        long arrival_delta_us = duration_cast<microseconds>(now - last_arrival_time).count();
+        double difference = (double) (arrival_delta_us - (timestamp_us - last_timestamp_us));
+        jitter += (fabs(difference) - jitter) / 16.0;
+        jitter_us = (long) jitter;
+    }
+    last_timestamp_us = timestamp_us;
+    last_arrival_time = now;
+}
+
+bool TransportMonitor::should_switch() {
+    auto now = steady_clock::now();
+    if (now - window_start_time < seconds(WINDOW_SEC)) return false;
+
+    long window_frames = frames - window_start_frames;
+    long window_bytes = bytes - window_start_bytes;
+    long window_lost = lost_rtp_packets - window_start_lost;
+    // A corrupt frame or decode error stands for at least one lost packet.
+    long window_damaged = (corrupt_frames - window_start_corrupt) + (decode_errors - window_start_decode_errors);
+    long estimated_rtp_packets = window_bytes / RTP_PAYLOAD_BYTES + window_frames;
+    long window_loss = max(window_lost, window_damaged);
+    loss_basis_points = estimated_rtp_packets + window_loss > 0 ?
+                        window_loss * 10000 / (estimated_rtp_packets + window_loss) : 0;
+
+    window_start_time = now;
+    window_start_frames = frames;
+    window_start_bytes = bytes;
+    window_start_corrupt = corrupt_frames;
+    window_start_lost = lost_rtp_packets;
+    window_start_decode_errors = decode_errors;
+
+    if (transport() == "tcp") {
+        if (now < tcp_until) return false;
+        cout << "(" << camera_name << ") Trying UDP again after " << tcp_hold.count() << " minutes on TCP." << endl;
+        set_transport("udp");
+        udp_since = now;
+        bad_windows = 0;
+        return true;
+    }
+
+    if (now - udp_since > UDP_GOOD_RESET) {
+        tcp_hold = INITIAL_TCP_HOLD;
+    }
+    bad_windows = loss_basis_points > BAD_LOSS_BASIS_POINTS ? bad_windows + 1 : 0;
+    if (bad_windows < BAD_WINDOWS_TO_SWITCH) return false;
+
+    cout << "(" << camera_name << ") " << setprecision(2) << fixed << (double) loss_basis_points / 100.0
+         << "% loss over UDP. Switching to TCP for " << tcp_hold.count() << " minutes." << endl;
+    set_transport("tcp");
+    tcp_until = now + tcp_hold;
+    tcp_hold = min(duration_cast<minutes>(MAX_TCP_HOLD), tcp_hold * 2);
+    bad_windows = 0;
+    return true;
+}
+
+string TransportMonitor::transport() const {
+    lock_guard<mutex> lock(transport_mutex);
+    return current_transport;
+}
+
+void TransportMonitor::set_transport(const string &transport) {
+    lock_guard<mutex> lock(transport_mutex);
+    current_transport = transport;
+}
+
+string TransportMonitor::report() const {
+    ostringstream line;
+    line << "Transport: " << transport()
+         << " Loss: " << setprecision(2) << fixed << (double) loss_basis_points / 100.0 << "%"
+         << " Lost RTP packets: " << lost_rtp_packets
+         << " Corrupt frames: " << corrupt_frames
+         << " Decode errors: " << decode_errors
+         << " Jitter: " << jitter_us / 1000 << " ms";
+    return line.str();
+}
+
+void TransportMonitor::install_log_callback() {
+    av_log_set_callback(log_callback);
+}
+
+void TransportMonitor::watch(void *context, TransportMonitor *monitor, bool is_decoder) {
+    lock_guard<mutex> lock(watched_contexts_mutex);
+    watched_contexts[context] = {monitor, is_decoder};
+}
+
+void TransportMonitor::unwatch(void *context) {
+    lock_guard<mutex> lock(watched_contexts_mutex);
+    watched_contexts.erase(context);
+}
+
+void TransportMonitor::log_callback(void *context, int level, const char *format, va_list arguments) {
+    if (context && level <= AV_LOG_WARNING) {
+        lock_guard<mutex> lock(watched_contexts_mutex);
+        auto watched = watched_contexts.find(context);
+        if (watched != watched_contexts.end()) {
+            char line[256];
+            va_list arguments_copy;
+            va_copy(arguments_copy, arguments);
+            vsnprintf(line, sizeof(line), format, arguments_copy);
+            va_end(arguments_copy);
+            watched->second.first->parse_log_line(line, level, watched->second.second);
+        }
+    }
+    av_log_default_callback(context, level, format, arguments);
+}
+
+void TransportMonitor::parse_log_line(const char *line, int level, bool is_decoder) {
+    if (is_decoder) {
+        if (level <= AV_LOG_ERROR) {
+            decode_errors++;
+        }
+        return;
+    }
+    int missed;
+    const char *rtp_missed = strstr(line, "RTP: missed ");
+    if (rtp_missed && sscanf(rtp_missed, "RTP: missed %d packets", &missed) == 1) {
+        lost_rtp_packets += missed;
+    } else if (strstr(line, "max delay reached")) {
+        // The reorder buffer gave up waiting for a packet.
+        lost_rtp_packets++;
+    }
+}
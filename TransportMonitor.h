@@ -0,0 +1,94 @@
+
+#ifndef HOMECAMRECORDER_TRANSPORTMONITOR_H
+#define HOMECAMRECORDER_TRANSPORTMONITOR_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+extern "C" {
+#include <libavcodec/packet.h>
+#include <libavutil/avutil.h>
+}
+
+using namespace std;
+using namespace std::chrono;
+
+/**
+ * Measures how well a camera's RTSP stream arrives and picks the transport for it. UDP has the lowest latency and
+ * overhead, but on a lossy link (Wi-Fi) lost RTP packets smear frames and throw off the size based motion
+ * heuristic, and interleaved TCP is better.
+ *
+ * Loss comes from the RTP demuxer's "RTP: missed N packets" and reorder buffer warnings, packets flagged
+ * AV_PKT_FLAG_CORRUPT and decoder errors, all attributed to the camera through the av_log callback. Jitter is the
+ * RFC 3550 interarrival jitter of the video frames.
+ *
+ * Every WINDOW_SEC the loss of the window is checked. Two bad windows in a row on UDP switch the camera to TCP for a
+ * hold time, which doubles every time UDP turns out to be bad again and resets after a good hour on UDP.
+ */
+class TransportMonitor {
+public:
+    TransportMonitor(string camera_name, string transport);
+
+    // Called for every video packet on the camera thread.
+    void record_packet(const AVPacket *packet, AVRational time_base);
+
+    // Checked on the camera thread. True when the camera should reconnect with transport().
+    bool should_switch();
+    string transport() const;
+
+    // One line summary, safe to call from any thread.
+    string report() const;
+
+    static void install_log_callback();
+    // Attributes log lines of a demuxer or decoder context to the monitor.
+    static void watch(void *context, TransportMonitor *monitor, bool is_decoder);
+    static void unwatch(void *context);
+
+    atomic<long> frames{0};
+    atomic<long> bytes{0};
+    atomic<long> corrupt_frames{0};
+    atomic<long> lost_rtp_packets{0};
+    atomic<long> decode_errors{0};
+    atomic<long> jitter_us{0};
+    // Loss of the last window in hundredths of a percent.
+    atomic<long> loss_basis_points{0};
+
+private:
+    static const int WINDOW_SEC = 30;
+    // Above this the window is bad, in hundredths of a percent.
+    static const long BAD_LOSS_BASIS_POINTS = 100;
+    static const int BAD_WINDOWS_TO_SWITCH = 2;
+    // RTP payloads are about this big, to estimate the number of RTP packets from the bytes received.
+    static const long RTP_PAYLOAD_BYTES = 1400;
+    const minutes INITIAL_TCP_HOLD{15};
+    const hours MAX_TCP_HOLD{4};
+    const hours UDP_GOOD_RESET{1};
+
+    const string camera_name;
+    // Changed on the camera thread, read by report() on any thread.
+    mutable mutex transport_mutex;
+    string current_transport;
+
+    time_point<steady_clock> window_start_time{};
+    long window_start_frames{};
+    long window_start_bytes{};
+    long window_start_corrupt{};
+    long window_start_lost{};
+    long window_start_decode_errors{};
+    int bad_windows{};
+    minutes tcp_hold{INITIAL_TCP_HOLD};
+    time_point<steady_clock> tcp_until{};
+    time_point<steady_clock> udp_since{};
+
+    int64_t last_timestamp_us{AV_NOPTS_VALUE};
+    time_point<steady_clock> last_arrival_time{};
+    double jitter{};
+
+    void set_transport(const string &transport);
+    void parse_log_line(const char *line, int level, bool is_decoder);
+    static void log_callback(void *context, int level, const char *format, va_list arguments);
+};
+
+#endif //HOMECAMRECORDER_TRANSPORTMONITOR_H
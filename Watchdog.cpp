@@ -0,0 +1,132 @@
+#include "Watchdog.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <iterator>
+
+// Gaps longer than this (a reconnect, a paused file) aren't frame intervals.
+static const long MAX_INTERVAL_US = 2000000;
+
+long Heartbeat::now_us() {
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void Heartbeat::connecting() {
+    previous_beat_us = 0;
+    last_beat_us.store(now_us(), memory_order_relaxed);
+    stalled_flag.store(false, memory_order_relaxed);
+    phase.store(CONNECTING, memory_order_release);
+}
+
+void Heartbeat::beat() {
+    long now = now_us();
+    if (previous_beat_us > 0 && now - previous_beat_us < MAX_INTERVAL_US) {
+        long interval = now - previous_beat_us;
+        long average = average_interval_us.load(memory_order_relaxed);
+        average_interval_us.store(average == 0 ? interval : average + (interval - average) / 16, memory_order_relaxed);
+    }
+    previous_beat_us = now;
+    last_beat_us.store(now, memory_order_relaxed);
+    if (phase.load(memory_order_relaxed) != STREAMING) {
+        phase.store(STREAMING, memory_order_release);
+    }
+}
+
+void Heartbeat::pause() {
+    phase.store(PAUSED, memory_order_release);
+}
+
+Watchdog::~Watchdog() {
+    stop();
+}
+
+void Watchdog::watch(const string &name, shared_ptr<Heartbeat> heartbeat) {
+    lock_guard<mutex> lock(wheel_mutex);
+    schedule(Timer{name, std::move(heartbeat), 0}, Heartbeat::now_us() + IDLE_RECHECK_MS * 1000);
+}
+
+void Watchdog::unwatch(const shared_ptr<Heartbeat> &heartbeat) {
+    lock_guard<mutex> lock(wheel_mutex);
+    for (vector<Timer> &slot : wheel) {
+        slot.erase(remove_if(slot.begin(), slot.end(), [&heartbeat](const Timer &timer) {
+            return timer.heartbeat == heartbeat;
+        }), slot.end());
+    }
+}
+
+void Watchdog::start() {
+    stopping = false;
+    worker = thread(&Watchdog::run, this);
+}
+
+void Watchdog::stop() {
+    {
+        lock_guard<mutex> lock(wheel_mutex);
+        stopping = true;
+    }
+    wake_up.notify_all();
+    if (worker.joinable())
+        worker.join();
+}
+
+long Watchdog::tick_of(long time_us) const {
+    return (time_us - start_us + TICK_MS * 1000 - 1) / (TICK_MS * 1000);
+}
+
+void Watchdog::schedule(Timer timer, long deadline_us) {
+    // Never in the slot being processed, or it would be seen again in the same pass.
+    timer.deadline_tick = max(tick_of(deadline_us), current_tick + 1);
+    wheel[timer.deadline_tick % WHEEL_SLOTS].push_back(std::move(timer));
+}
+
+void Watchdog::run() {
+    unique_lock<mutex> lock(wheel_mutex);
+    while (!stopping) {
+        auto next_tick = steady_clock::time_point(microseconds(start_us + (current_tick + 1) * TICK_MS * 1000));
+        if (wake_up.wait_until(lock, next_tick, [this] { return stopping.load(); })) break;
+        current_tick++;
+
+        vector<Timer> &slot = wheel[current_tick % WHEEL_SLOTS];
+        vector<Timer> due;
+        // Timers further out than one turn of the wheel stay where they are.
+        auto first_later = partition(slot.begin(), slot.end(), [this](const Timer &timer) {
+            return timer.deadline_tick > current_tick;
+        });
+        move(first_later, slot.end(), back_inserter(due));
+        slot.erase(first_later, slot.end());
+
+        long now = Heartbeat::now_us();
+        for (Timer &timer : due) {
+            check(std::move(timer), now);
+        }
+    }
+}
+
+void Watchdog::check(Timer timer, long now) {
+    Heartbeat &heartbeat = *timer.heartbeat;
+    int phase = heartbeat.phase.load(memory_order_acquire);
+    if (phase == Heartbeat::PAUSED || heartbeat.stalled()) {
+        schedule(std::move(timer), now + IDLE_RECHECK_MS * 1000);
+        return;
+    }
+
+    long timeout_us = CONNECT_TIMEOUT_MS * 1000;
+    if (phase == Heartbeat::STREAMING) {
+        timeout_us = max(MIN_STALL_MS * 1000, MISSED_FRAMES * heartbeat.frame_interval_us());
+    }
+    long last_beat = heartbeat.last_beat_us.load(memory_order_relaxed);
+    long deadline = last_beat + timeout_us;
+    if (now < deadline) {
+        schedule(std::move(timer), deadline);
+        return;
+    }
+
+    heartbeat.stalled_flag.store(true, memory_order_relaxed);
+    if (phase == Heartbeat::STREAMING) {
+        Logger::warn(timer.name, "Stalled. No video for {} ms, frames were {} ms apart.", (now - last_beat) / 1000,
+                     heartbeat.frame_interval_us() / 1000);
+    } else {
+        Logger::warn(timer.name, "Stalled. Connecting took longer than {} ms.", CONNECT_TIMEOUT_MS);
+    }
+    schedule(std::move(timer), now + IDLE_RECHECK_MS * 1000);
+}
@@ -0,0 +1,101 @@
+
+#ifndef HOMECAMRECORDER_WATCHDOG_H
+#define HOMECAMRECORDER_WATCHDOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+/**
+ * Liveness of one input (a camera's main or analysis stream). The camera thread stamps it for every video packet,
+ * which costs a clock read and two relaxed stores, and checks stalled() from its interrupt callback, which costs
+ * one relaxed load. The Watchdog decides when the input has stalled.
+ */
+class Heartbeat {
+public:
+    // A connection attempt starts. Clears a stall, and the connect timeout applies until the first packet.
+    void connecting();
+    // A video packet arrived.
+    void beat();
+    // Nothing is expected, e.g. while waiting to reconnect.
+    void pause();
+    // The input is being shut down for good. Unlike a stall, connecting() doesn't clear it.
+    void cancel() { cancelled_flag.store(true, memory_order_relaxed); }
+
+    bool stalled() const { return stalled_flag.load(memory_order_relaxed); }
+    bool cancelled() const { return cancelled_flag.load(memory_order_relaxed); }
+    bool paused() const { return phase.load(memory_order_relaxed) == PAUSED; }
+    // Average time between video packets, 0 until measured.
+    long frame_interval_us() const { return average_interval_us.load(memory_order_relaxed); }
+
+private:
+    friend class Watchdog;
+    enum Phase : int { PAUSED, CONNECTING, STREAMING };
+
+    atomic<int> phase{PAUSED};
+    atomic<long> last_beat_us{0};
+    atomic<long> average_interval_us{0};
+    atomic<bool> stalled_flag{false};
+    atomic<bool> cancelled_flag{false};
+    // Only touched by the camera thread.
+    long previous_beat_us{0};
+
+    static long now_us();
+};
+
+/**
+ * Declares an input stalled after it has missed MISSED_FRAMES of its own frame interval (never less than
+ * MIN_STALL_MS), or CONNECT_TIMEOUT_MS while connecting. A stalled heartbeat makes that input's interrupt callback
+ * abort its blocking I/O, and nothing else.
+ *
+ * Deadlines are kept in a hashed timer wheel of TICK_MS slots. The watchdog thread sleeps until the next tick and
+ * only looks at the timers in that slot. A timer that fires for an input that has beaten since is moved to the
+ * input's new deadline.
+ */
+class Watchdog {
+public:
+    ~Watchdog();
+
+    void watch(const string &name, shared_ptr<Heartbeat> heartbeat);
+    void unwatch(const shared_ptr<Heartbeat> &heartbeat);
+    void start();
+    void stop();
+
+private:
+    static const long TICK_MS = 50;
+    static const int WHEEL_SLOTS = 256;
+    static const long MISSED_FRAMES = 10;
+    static const long MIN_STALL_MS = 750;
+    static const long CONNECT_TIMEOUT_MS = 10000;
+    // How often a paused or stalled input is looked at again.
+    static const long IDLE_RECHECK_MS = 1000;
+
+    struct Timer {
+        string name;
+        shared_ptr<Heartbeat> heartbeat;
+        long deadline_tick;
+    };
+
+    mutex wheel_mutex;
+    condition_variable wake_up;
+    atomic<bool> stopping{false};
+    vector<vector<Timer>> wheel{WHEEL_SLOTS};
+    long current_tick{0};
+    long start_us{Heartbeat::now_us()};
+    thread worker;
+
+    void run();
+    void schedule(Timer timer, long deadline_us);
+    void check(Timer timer, long now);
+    long tick_of(long time_us) const;
+};
+
+#endif //HOMECAMRECORDER_WATCHDOG_H
@@ -0,0 +1,282 @@
+#include "WorkerSupervisor.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
+
+WorkerSupervisor::WorkerSupervisor(string executable, StatusPage *status_page,
+                                   function<void(const string &)> on_exit) :
+    executable(std::move(executable)), status_page(status_page), on_exit(std::move(on_exit)) {}
+
+void WorkerSupervisor::apply(const vector<CameraConfig> &configs) {
+    for (auto &item : workers) {
+        Worker &worker = item.second;
+        bool configured = any_of(configs.begin(), configs.end(), [&item](const CameraConfig &config) {
+            return config.basename == item.first;
+        });
+        if (!configured && !worker.removed) {
+            worker.removed = true;
+            stop_worker(worker, false);
+        }
+    }
+
+    for (const CameraConfig &config : configs) {
+        auto existing = workers.find(config.basename);
+        if (existing == workers.end()) {
+            int slot = free_slot();
+            if (slot < 0) {
+                cerr << "(Supervisor) No status slot left for " << config.basename << ". Only " << STATUS_PAGE_SLOTS
+                     << " cameras can be supervised." << endl;
+                continue;
+            }
+            Worker &worker = workers[config.basename];
+            worker.config = config;
+            worker.slot = slot;
+            WorkerStatus *status = status_page->slot(slot);
+            strncpy(status->camera, config.basename.c_str(), sizeof(status->camera) - 1);
+            // The slot may have belonged to a camera that was removed.
+            status->restarts = 0;
+            status->last_exit_status = 0;
+            status->last_packet_ms = 0;
+            status->video_packets = 0;
+            status->audio_packets = 0;
+            status->bytes = 0;
+            status->connects = 0;
+            spawn(worker);
+            continue;
+        }
+
+        Worker &worker = existing->second;
+        CameraConfig previous = worker.config;
+        worker.config = config;
+        // Added back before its worker exited. It's restarted when it does.
+        worker.removed = false;
+        if (worker.pid < 0 || worker.restart_now) continue;
+        if (config.cpu != previous.cpu) {
+            cout << "(Supervisor) Moving " << config.basename << " to cpu " << config.cpu << endl;
+            stop_worker(worker, true);
+        } else if (config != previous) {
+            kill(worker.pid, SIGHUP);
+        }
+    }
+}
+
+void WorkerSupervisor::check() {
+    int wait_status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &wait_status, WNOHANG)) > 0) {
+        for (auto &item : workers) {
+            if (item.second.pid == pid) {
+                reaped(item.second, wait_status);
+                break;
+            }
+        }
+    }
+
+    auto now = steady_clock::now();
+    int64_t now_ms = StatusPage::now_ms();
+    for (auto item = workers.begin(); item != workers.end();) {
+        Worker &worker = item->second;
+        WorkerStatus *status = status_page->slot(worker.slot);
+        if (worker.pid < 0) {
+            if (worker.removed) {
+                status->state = WORKER_EMPTY;
+                memset(status->camera, 0, sizeof(status->camera));
+                item = workers.erase(item);
+                continue;
+            }
+            if (now >= worker.restart_time) {
+                spawn(worker);
+            }
+        } else if (worker.stop_time != time_point<steady_clock>{}) {
+            if (duration_cast<milliseconds>(now - worker.stop_time).count() > STOP_TIMEOUT_MS) {
+                cerr << "(Supervisor) " << worker.config.basename << " didn't stop. Killing " << worker.pid << endl;
+                kill(worker.pid, SIGKILL);
+            }
+        } else if (duration_cast<milliseconds>(now - worker.started_time).count() > HUNG_WORKER_MS &&
+                   now_ms - status->alive_ms.load(memory_order_relaxed) > HUNG_WORKER_MS) {
+            cerr << "(Supervisor) " << worker.config.basename << " stopped responding. Killing " << worker.pid << endl;
+            kill(worker.pid, SIGKILL);
+            worker.stop_time = now;
+        } else if (status->state.load(memory_order_relaxed) == WORKER_STALLED) {
+            if (worker.stalled_time == time_point<steady_clock>{}) {
+                worker.stalled_time = now;
+            } else if (duration_cast<milliseconds>(now - worker.stalled_time).count() > STALLED_WORKER_MS) {
+                cerr << "(Supervisor) " << worker.config.basename << " is stuck on a stalled input. Killing "
+                     << worker.pid << endl;
+                kill(worker.pid, SIGKILL);
+                worker.stop_time = now;
+                worker.restart_now = true;
+            }
+        } else {
+            worker.stalled_time = {};
+        }
+        ++item;
+    }
+}
+
+void WorkerSupervisor::stop_all(milliseconds timeout) {
+    stopping = true;
+    for (auto &item : workers) {
+        if (item.second.pid > 0) {
+            stop_worker(item.second, false);
+        }
+    }
+    auto end_time = steady_clock::now() + timeout;
+    while (true) {
+        bool running = false;
+        for (auto &item : workers) {
+            Worker &worker = item.second;
+            if (worker.pid < 0) continue;
+            int wait_status = 0;
+            pid_t pid = waitpid(worker.pid, &wait_status, steady_clock::now() < end_time ? WNOHANG : 0);
+            if (pid == 0 && steady_clock::now() >= end_time) {
+                kill(worker.pid, SIGKILL);
+                pid = waitpid(worker.pid, &wait_status, 0);
+            }
+            if (pid == worker.pid || (pid < 0 && errno == ECHILD)) {
+                reaped(worker, wait_status);
+            } else {
+                running = true;
+            }
+        }
+        if (!running) break;
+        this_thread::sleep_for(milliseconds(50));
+    }
+}
+
+bool WorkerSupervisor::spawn(Worker &worker) {
+    WorkerStatus *status = status_page->slot(worker.slot);
+    int cpu = worker.config.cpu;
+    // Everything the child needs is built before the fork. The child of a threaded process may only make async signal
+    // safe calls until it execs.
+    string slot = to_string(worker.slot);
+    vector<char *> arguments = {(char *) executable.c_str(), (char *) "--worker",
+                                (char *) worker.config.basename.c_str(), (char *) slot.c_str(), nullptr};
+    pid_t supervisor_pid = getpid();
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &cpus);
+    }
+#endif
+
+    status->state = WORKER_STARTING;
+    status->alive_ms = StatusPage::now_ms();
+    pid_t pid = fork();
+    if (pid < 0) {
+        cerr << "(Supervisor) Failed to start a worker for " << worker.config.basename << ": " << strerror(errno)
+             << endl;
+        worker.restart_time = steady_clock::now() + milliseconds(MAX_RESTART_BACKOFF_MS);
+        status->state = WORKER_BACKING_OFF;
+        return false;
+    }
+    if (pid == 0) {
+        // Out of the terminal's process group, so Ctrl-C reaches the supervisor, which stops the workers in order.
+        setpgid(0, 0);
+#ifdef __linux__
+        // A worker outliving the supervisor would record alongside the next one.
+        prctl(PR_SET_PDEATHSIG, SIGINT);
+        if (getppid() != supervisor_pid) _exit(1);
+        if (cpu >= 0 && sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            const char message[] = "(Supervisor) Failed to pin the worker to its cpu.\n";
+            ssize_t ignored = write(STDERR_FILENO, message, sizeof(message) - 1);
+            (void) ignored;
+        }
+#endif
+        // The catalog, the thumbnail server's socket and the supervisor's pipes stay with the supervisor.
+#if defined(__linux__) && defined(SYS_close_range)
+        if (syscall(SYS_close_range, 3, ~0U, 0) != 0)
+#endif
+        {
+            for (int fd = 3; fd < 1024; fd++) close(fd);
+        }
+        execv(arguments[0], arguments.data());
+        _exit(127);
+    }
+
+    worker.pid = pid;
+    worker.started_time = steady_clock::now();
+    worker.stop_time = {};
+    worker.stalled_time = {};
+    worker.restart_now = false;
+    status->pid = pid;
+    status->cpu = cpu;
+    status->started_ms = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    cout << "(Supervisor) Started " << worker.config.basename << " as " << pid
+         << (cpu >= 0 ? " on cpu " + to_string(cpu) : "") << endl;
+    return true;
+}
+
+void WorkerSupervisor::stop_worker(Worker &worker, bool restart) {
+    if (worker.pid < 0) return;
+    status_page->slot(worker.slot)->state = WORKER_STOPPING;
+    worker.restart_now = restart;
+    worker.stop_time = steady_clock::now();
+    kill(worker.pid, SIGINT);
+}
+
+void WorkerSupervisor::reaped(Worker &worker, int wait_status) {
+    WorkerStatus *status = status_page->slot(worker.slot);
+    auto now = steady_clock::now();
+    long ran_ms = duration_cast<milliseconds>(now - worker.started_time).count();
+    string how;
+    if (WIFSIGNALED(wait_status)) {
+        how = "was killed by signal " + to_string(WTERMSIG(wait_status));
+        status->last_exit_status = -WTERMSIG(wait_status);
+    } else {
+        how = "exited with status " + to_string(WEXITSTATUS(wait_status));
+        status->last_exit_status = WEXITSTATUS(wait_status);
+    }
+    pid_t pid = worker.pid;
+    worker.pid = -1;
+    worker.stop_time = {};
+    status->pid = 0;
+    status->state = WORKER_EXITED;
+    // Its last latencies would keep the background work paused.
+    status->ingest_latency_ms = 0;
+    status->disk_write_latency_ms = 0;
+    if (on_exit) {
+        on_exit(worker.config.basename);
+    }
+    if (worker.removed || stopping) {
+        cout << "(Supervisor) " << worker.config.basename << " worker " << pid << " " << how << endl;
+        return;
+    }
+
+    status->restarts.fetch_add(1, memory_order_relaxed);
+    if (worker.restart_now || ran_ms >= MIN_HEALTHY_RUN_MS) {
+        worker.backoff_ms = 0;
+    } else {
+        worker.backoff_ms = min(MAX_RESTART_BACKOFF_MS, max(INITIAL_RESTART_BACKOFF_MS, worker.backoff_ms * 2));
+    }
+    cerr << "(Supervisor) " << worker.config.basename << " worker " << pid << " " << how << " after " << ran_ms
+         << " ms. Restarting in " << worker.backoff_ms << " ms." << endl;
+    worker.restart_time = now + milliseconds(worker.backoff_ms);
+    if (worker.backoff_ms == 0) {
+        spawn(worker);
+    } else {
+        status->state = WORKER_BACKING_OFF;
+    }
+}
+
+int WorkerSupervisor::free_slot() const {
+    for (int slot = 0; slot < STATUS_PAGE_SLOTS; slot++) {
+        bool used = any_of(workers.begin(), workers.end(), [slot](const pair<const string, Worker> &item) {
+            return item.second.slot == slot;
+        });
+        if (!used) return slot;
+    }
+    return -1;
+}
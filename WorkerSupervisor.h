@@ -0,0 +1,85 @@
+
+#ifndef HOMECAMRECORDER_WORKERSUPERVISOR_H
+#define HOMECAMRECORDER_WORKERSUPERVISOR_H
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "CameraConfig.h"
+#include "StatusPage.h"
+
+using namespace std;
+using namespace std::chrono;
+
+/**
+ * Records every camera in a worker process of its own (the recorder started with --worker <camera> <slot>), so a
+ * crash or a hang in one camera's FFmpeg code only takes that camera down while the others keep recording. Workers
+ * report through their slot of the StatusPage.
+ *
+ * A worker that exits is restarted as soon as it's reaped, which takes milliseconds. One that dies within
+ * MIN_HEALTHY_RUN_MS of starting is restarted after a backoff that doubles up to MAX_RESTART_BACKOFF_MS, so a camera
+ * that crashes while connecting doesn't spin. A worker that stops stamping its slot, or whose camera stays stalled
+ * after the watchdog cancelled its input, is killed and restarted.
+ *
+ * A camera with a cpu in the cameras file has its worker pinned to that core before it execs.
+ */
+class WorkerSupervisor {
+public:
+    // on_exit is called with the basename of every worker that's reaped, before it's restarted.
+    WorkerSupervisor(string executable, StatusPage *status_page, function<void(const string &basename)> on_exit);
+
+    // Starts workers for new cameras and stops the ones of removed cameras. A worker whose cpu changed is restarted,
+    // the others are sent SIGHUP and reload their camera in place.
+    void apply(const vector<CameraConfig> &configs);
+    // Reaps and restarts workers, and kills the ones that hang. Called after SIGCHLD and at least every CHECK_INTERVAL_MS.
+    void check();
+    // SIGINT to every worker, so they close their segments, and SIGKILL to those still running after the timeout.
+    void stop_all(milliseconds timeout);
+
+    static const long CHECK_INTERVAL_MS = 250;
+
+private:
+    static const long MIN_HEALTHY_RUN_MS = 10000;
+    static const long INITIAL_RESTART_BACKOFF_MS = 100;
+    static const long MAX_RESTART_BACKOFF_MS = 30000;
+    // A worker stamps alive_ms every few hundred ms. One that misses it this long is stuck.
+    static const long HUNG_WORKER_MS = 10000;
+    // The watchdog makes a stalled input's I/O fail within a second. A camera thread that stays stalled this long is
+    // stuck somewhere the interrupt callback doesn't reach.
+    static const long STALLED_WORKER_MS = 30000;
+    static const long STOP_TIMEOUT_MS = 10000;
+
+    struct Worker {
+        CameraConfig config;
+        int slot{-1};
+        pid_t pid{-1};
+        time_point<steady_clock> started_time{};
+        time_point<steady_clock> restart_time{};
+        // When the worker was asked to stop, or when its camera was first seen stalled.
+        time_point<steady_clock> stop_time{};
+        time_point<steady_clock> stalled_time{};
+        long backoff_ms{};
+        // The camera was removed. The worker is forgotten once it exits.
+        bool removed{false};
+        // The worker was stopped to be started again right away, e.g. on another core.
+        bool restart_now{false};
+    };
+
+    const string executable;
+    StatusPage *status_page;
+    function<void(const string &)> on_exit;
+    // By camera basename.
+    map<string, Worker> workers;
+    bool stopping{false};
+
+    bool spawn(Worker &worker);
+    void stop_worker(Worker &worker, bool restart);
+    void reaped(Worker &worker, int wait_status);
+    int free_slot() const;
+};
+
+#endif //HOMECAMRECORDER_WORKERSUPERVISOR_H